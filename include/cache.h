@@ -5,6 +5,15 @@
 #include <stdint.h>
 #include <stddef.h> // for size_t
 
+#define CACHE_SWEEP_INTERVAL_MS (10 * 1000)
+#define CACHE_SWEEP_BATCH 32
+
+#define CACHE_PREFETCH_WORKERS 4
+#define CACHE_FETCH_RETRIES 5
+#define CACHE_FETCH_BACKOFF_MS (2 * 1000)
+#define CACHE_FETCH_BACKOFF_MAX_MS (5 * 60 * 1000)
+#define CACHE_FETCH_WAIT_MS (30 * 1000)
+
 typedef struct
 {
     size_t total_entries;  /**< Total number of cache entries. */
@@ -12,6 +21,11 @@ typedef struct
     size_t total_files;    /**< Number of files in the cache. */
     size_t total_size;     /**< Total size of all files in the cache (in bytes). */
     size_t memory_used;    /**< Total memory used for cache infos (in bytes). */
+    size_t max_size;       /**< Size above which files get evicted (in bytes), 0 for no limit. */
+    size_t evicted_files;  /**< Number of files deleted to stay within max_size since startup. */
+    size_t prefetch_pending; /**< Number of entries waiting to be prefetched, including failed ones waiting for a retry. */
+    size_t prefetch_done;    /**< Number of entries prefetched successfully since startup. */
+    size_t prefetch_failed;  /**< Number of entries that could not be prefetched after all retries since startup. */
 } cache_stats_t;
 
 /**
@@ -20,11 +34,24 @@ typedef struct
 typedef struct cache_entry_s cache_entry_t;
 struct cache_entry_s
 {
-    cache_entry_t *next;      /**< Pointer to the next cache entry in the list. */
-    uint32_t hash;            /**< Uppermost 32 bits of the hash for fast searching and inserting. */
+    cache_entry_t *next;         /**< Pointer to the next cache entry in the list, in the order they were added. */
+    cache_entry_t *next_by_hash; /**< Next entry in the same bucket of the hash table. */
+    cache_entry_t *next_by_url;  /**< Next entry in the same bucket of the original URL table. */
+    uint32_t hash;               /**< Uppermost 32 bits of the hash, selects the bucket in the hash table. */
+    uint32_t url_hash;           /**< Hash of the original URL, selects the bucket in the original URL table. */
+    uint8_t sha256[32];          /**< SHA-256 of the original URL, which names the cached file. */
+    cache_entry_t *lru_prev;     /**< More recently used entry with an existing file. */
+    cache_entry_t *lru_next;     /**< Less recently used entry with an existing file. */
+    uint32_t size;               /**< Size of the local cached file, accounted while it exists. */
+    uint32_t last_access;        /**< System time in ms the local cached file was last added or fetched. */
+    bool fetching;               /**< A download is running, other fetches wait for it instead of downloading again. */
+    bool queued;                 /**< Waiting in the prefetch queue or for a prefetch retry. */
+    uint8_t failures;            /**< Failed downloads in a row. */
+    uint32_t retry_at;           /**< System time in ms before which a failed download is not tried again. */
+    cache_entry_t *prefetch_next; /**< Next entry in the prefetch queue or retry list. */
     uint32_t statusCode;      /**< Status code when fetching the file. */
     bool exists;              /**< Flag indicating if the local cached file exists. */
-    const char *original_url; /**< URL from which the file is to be downloaded. */
+    const char *original_url; /**< URL from which the file is to be downloaded, NULL for files found at startup that no URL was added for yet. */
     const char *cached_url;   /**< URL generated and used when adding to index. */
     const char *file_path;    /**< Path of the local cached file. */
 };
@@ -47,10 +74,20 @@ uint32_t cache_flush();
 /**
  * @brief Gathers statistics about the current cache.
  *
+ * The counters are maintained when files are added, fetched or deleted, so this does not access the file system.
+ *
  * @param stats Pointer to a structure where the statistics will be stored.
  */
 void cache_stats(cache_stats_t *stats);
 
+/**
+ * @brief Enforces the size limit of the cache.
+ *
+ * Called periodically from the main loop, deletes the least recently used files while the cached files
+ * exceed core.cachedir_max_mb, at most CACHE_SWEEP_BATCH per call.
+ */
+void cache_loop();
+
 /**
  * @brief Adds a new cache entry for the given URL.
  *
@@ -59,14 +96,44 @@ void cache_stats(cache_stats_t *stats);
  */
 cache_entry_t *cache_add(const char *url);
 
+/**
+ * @brief Adds a cache entry for a URL whose cached URL is already known, without hashing the URL again.
+ *
+ * @param url The URL to add to the cache.
+ * @param cached_url The cached URL previously returned by cache_add() for the same URL.
+ * @return Pointer to the newly created cache entry, or NULL if the cached URL is invalid or the addition fails.
+ */
+cache_entry_t *cache_add_cached(const char *url, const char *cached_url);
+
 /**
  * @brief Fetches the file for the given cache entry.
  *
+ * Only one download per entry runs at a time, concurrent calls wait for it up to CACHE_FETCH_WAIT_MS.
+ * After a failed download the entry is not tried again before its backoff time has passed.
+ *
  * @param entry Pointer to the cache entry.
  * @return true if the file was successfully fetched and exists locally, false otherwise.
  */
 bool cache_fetch_entry(cache_entry_t *entry);
 
+/**
+ * @brief Queues the file of the given cache entry for download in the background.
+ *
+ * Downloads run on CACHE_PREFETCH_WORKERS tasks once cache_init() was called. Transient failures
+ * are retried with exponential backoff up to CACHE_FETCH_RETRIES times.
+ *
+ * @param entry Pointer to the cache entry.
+ */
+void cache_prefetch(cache_entry_t *entry);
+
+/**
+ * @brief Accounts the files in the cache directory and starts the prefetch tasks, called once startup is done.
+ *
+ * Files named like cache_add() names them, but whose URL was not added, count towards core.cachedir_max_mb
+ * and are evicted first. Other files in the directory are not accounted.
+ */
+void cache_init();
+
 /**
  * @brief Searches for a cache entry by the original URL.
  *
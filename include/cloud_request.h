@@ -14,6 +14,7 @@ struct req_cbr_t
     void (*header)(void *ctx, HttpClientContext *cloud_ctx, const char *header, const char *value);
     void (*body)(void *ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error);
     void (*disconnect)(void *ctx, HttpClientContext *cloud_ctx);
+    void (*request)(void *ctx, HttpClientContext *cloud_ctx); /* called before the request header is sent, to add header fields */
 };
 
 int_t cloud_request_get(const char *server, int port, const char *uri, const char *queryString, const uint8_t *hash, req_cbr_t *cbr);
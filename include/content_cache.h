@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "error.h"
+#include "fs_port.h"
+#include "taf_index.h"
+#include "http/http_server.h"
+
+#define CONTENT_CACHE_SEGMENT_SIZE (256 * 1024)
+#define CONTENT_CACHE_BUCKETS 256
+
+/**
+ * @brief A cached, reference counted segment of a content file.
+ */
+typedef struct content_cache_segment_s content_cache_segment_t;
+struct content_cache_segment_s
+{
+    content_cache_segment_t *next;     /**< Next segment in the same hash bucket. */
+    content_cache_segment_t *lru_prev; /**< More recently used segment. */
+    content_cache_segment_t *lru_next; /**< Less recently used segment. */
+    taf_index_key_t key;               /**< Identity of the file the segment belongs to. */
+    uint32_t index;                    /**< Segment number within the file. */
+    uint32_t refs;                     /**< Number of senders currently using the data. */
+    bool detached;                     /**< Evicted while in use, freed with the last reference. */
+    size_t length;                     /**< Number of valid bytes in data. */
+    uint8_t *data;                     /**< Segment content. */
+};
+
+void content_cache_init();
+void content_cache_deinit();
+
+/**
+ * @brief Checks whether the cache is enabled by core.content_cache_mb.
+ */
+bool content_cache_enabled();
+
+/**
+ * @brief Returns a referenced segment of a file, reading it on a miss.
+ *
+ * @param key Identity of the file, the file must not grow while being cached.
+ * @param file Opened file used to fill the segment on a miss.
+ * @param index Segment number, i.e. offset / CONTENT_CACHE_SEGMENT_SIZE.
+ * @return The segment, to be released with content_cache_release(), or NULL on read errors.
+ */
+content_cache_segment_t *content_cache_get(const taf_index_key_t *key, FsFile *file, uint32_t index);
+
+/**
+ * @brief Drops a reference obtained by content_cache_get().
+ */
+void content_cache_release(content_cache_segment_t *segment);
+
+/**
+ * @brief Sends a region of a complete file through the cache.
+ *
+ * @param connection Connection to write to, using httpWriteStream().
+ * @param key Identity of the file.
+ * @param file Opened file.
+ * @param offset Absolute offset of the first byte to send.
+ * @param length Number of bytes to send.
+ * @return ERROR_NOT_IMPLEMENTED if the cache is disabled and nothing was sent, otherwise the send result.
+ */
+error_t content_cache_send(HttpConnection *connection, const taf_index_key_t *key, FsFile *file, size_t offset, size_t length);
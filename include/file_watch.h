@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define FILE_WATCH_POLL_MS 1000       /* stat interval of subscriptions without change notifications */
+#define FILE_WATCH_MAX_PENDING 64     /* changed paths collected per subscription before reporting "everything" */
+#define FILE_WATCH_MAX_DELAY_FACTOR 4 /* under constant changes report after this many debounce intervals */
+
+/**
+ * @brief Called with a changed path after the changes settled.
+ *
+ * path is the file or directory that was created, changed or removed. NULL means that the changes
+ * are unknown, e.g. after lost notifications, and everything below the watched directory has to
+ * be checked again. Runs on the file watch task, so it should only do short work or hand it off.
+ */
+typedef void (*file_watch_cb_t)(const char *path, void *ctx);
+
+/**
+ * @brief Subscribes to changes in a directory.
+ *
+ * Changes are reported by the platform's change notifications where available. Otherwise, or once
+ * the system limit of watched directories is reached, the directory (or the file) itself is checked
+ * with stat every FILE_WATCH_POLL_MS, which does not see changes further down.
+ *
+ * @param name Name for log messages.
+ * @param dir Directory to watch.
+ * @param file Only report this file inside dir, NULL for all entries.
+ * @param recursive Watch the subdirectories too.
+ * @param debounceMs Time without further changes before they are reported.
+ * @param callback Receives the changed paths.
+ * @param ctx Passed to the callback.
+ * @return Id of the subscription, -1 on error.
+ */
+int32_t file_watch_subscribe(const char *name, const char *dir, const char *file, bool recursive, uint32_t debounceMs, file_watch_cb_t callback, void *ctx);
+
+/**
+ * @brief Ends a subscription. A callback already running may still complete.
+ */
+void file_watch_unsubscribe(int32_t id);
+
+/**
+ * @brief Returns if changes of the subscription are reported by notifications, false if only polled.
+ */
+bool file_watch_notified(int32_t id);
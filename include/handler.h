@@ -89,6 +89,7 @@ void getContentPathFromCharRUID(char ruid[17], char **pcontentPath, settings_t *
 void getContentPathFromUID(uint64_t uid, char **pcontentPath, settings_t *settings);
 void setTonieboxSettings(TonieFreshnessCheckResponse *freshResp, settings_t *settings);
 bool_t isValidTaf(const char *contentPath, bool checkHashAndSize);
+bool_t isValidTafCached(const char *contentPath, bool checkHashAndSize);
 tonie_info_t *getTonieInfoFromUid(uint64_t uid, bool lock, settings_t *settings);
 tonie_info_t *getTonieInfoFromRuid(char ruid[17], bool lock, settings_t *settings);
 tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *settings);
@@ -100,6 +101,7 @@ error_t httpWriteResponseString(HttpConnection *connection, char_t *data, bool_t
 error_t httpWriteResponse(HttpConnection *connection, void *data, size_t size, bool_t freeMemory);
 error_t httpWriteString(HttpConnection *connection, const char_t *content);
 error_t httpFlushStream(HttpConnection *connection);
+void httpSetTafEntityTag(HttpConnection *connection, const tonie_info_t *tonieInfo, bool skipHeader);
 error_t httpOkResponse(HttpConnection *connection);
 
 void setLastUid(uint64_t uid, settings_t *settings);
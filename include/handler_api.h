@@ -11,6 +11,7 @@
 #include "http/http_server_misc.h"
 
 #include "handler.h"
+#include "tag_registry.h"
 
 typedef struct
 {
@@ -57,6 +58,8 @@ error_t handleApiContentJson(HttpConnection *connection, const char_t *uri, cons
 error_t handleApiContentJsonGet(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
 error_t handleApiContentJsonSet(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
 error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
+/* builds the info of a tag directory in the content directory of the settings, NULL if there is no valid tag */
+cJSON *getTagRegistryInfo(const char *name, client_ctx_t *client_ctx, tag_registry_attr_t *attr);
 error_t handleApiTagInfo(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
 
 error_t handleApiAuthLogin(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
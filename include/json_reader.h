@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fs_port.h"
+
+#define JSON_READER_BUFFER_SIZE 4096
+#define JSON_READER_TEXT_SIZE 1024
+#define JSON_READER_TEXT_MAX_SIZE (1024 * 1024)
+#define JSON_READER_MAX_DEPTH 32
+
+/**
+ * @brief Pull parser reading a JSON file in small blocks instead of building a DOM.
+ *
+ * Containers are walked with json_reader_enter() and json_reader_more(), values are read
+ * one at a time into the text buffer. Any syntax or read error sets the failed flag,
+ * which makes all further calls fail. Values longer than JSON_READER_TEXT_SIZE move the
+ * text to the heap, values longer than JSON_READER_TEXT_MAX_SIZE fail the parse.
+ */
+typedef struct
+{
+    FsFile *file;
+    char buffer[JSON_READER_BUFFER_SIZE];
+    size_t pos;
+    size_t length;
+    bool failed;
+    char *text; /**< Last string or scalar read, always complete and terminated. */
+    size_t textLength;
+    size_t textSize;
+    char textBuffer[JSON_READER_TEXT_SIZE];
+} json_reader_t;
+
+/**
+ * @brief Starts reading the file at its current position.
+ */
+void json_reader_init(json_reader_t *reader, FsFile *file);
+
+/**
+ * @brief Frees the text grown for long values, the file is left open.
+ */
+void json_reader_deinit(json_reader_t *reader);
+
+/**
+ * @brief Returns the next character that is not whitespace without consuming it, -1 at the end of the file.
+ */
+int json_reader_peek(json_reader_t *reader);
+
+/**
+ * @brief Consumes the opening bracket of an object ('{') or array ('[').
+ *
+ * @return false and sets the failed flag if the next value is not of that type.
+ */
+bool json_reader_enter(json_reader_t *reader, char open);
+
+/**
+ * @brief Advances to the next member of the current object or array.
+ *
+ * For objects the caller reads the key with json_reader_key() afterwards.
+ *
+ * @param reader The reader.
+ * @param close The closing bracket, '}' or ']'.
+ * @return true if there is another member, false at the end of the container or on errors.
+ */
+bool json_reader_more(json_reader_t *reader, char close);
+
+/**
+ * @brief Reads an object key and the following colon into the text buffer.
+ */
+bool json_reader_key(json_reader_t *reader);
+
+/**
+ * @brief Reads a string into the text buffer.
+ */
+bool json_reader_string(json_reader_t *reader);
+
+/**
+ * @brief Reads a string, number or literal as text, null as empty text. Objects and arrays are skipped and read as empty text.
+ */
+bool json_reader_scalar(json_reader_t *reader);
+
+/**
+ * @brief Skips the next value including everything it contains.
+ */
+bool json_reader_skip(json_reader_t *reader);
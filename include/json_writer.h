@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "error.h"
+#include "cJSON.h"
+#include "http/http_server.h"
+
+#define JSON_WRITER_BUFFER_SIZE 2048
+#define JSON_WRITER_MAX_DEPTH 32
+
+/**
+ * @brief Streaming JSON emitter writing a response body as it is generated.
+ *
+ * Values are appended to a small buffer that is sent with httpWriteStream() whenever it is full,
+ * using chunked encoding for HTTP/1.1 clients. Inside objects every value takes a key, inside
+ * arrays and at the top level the key is NULL. The first error is kept and makes all further
+ * calls no-ops, so callers only check the result of json_writer_end().
+ */
+typedef struct
+{
+    HttpConnection *connection;
+    char buffer[JSON_WRITER_BUFFER_SIZE];
+    size_t length;
+    size_t depth;
+    bool hasElements[JSON_WRITER_MAX_DEPTH]; /**< Per open container, if a separator is needed before the next value. */
+    error_t error;
+} json_writer_t;
+
+/**
+ * @brief Sends the response header and starts the body.
+ *
+ * @param writer The writer to initialize.
+ * @param connection The connection to respond on.
+ * @param contentType Content type of the response.
+ * @return Error code of sending the header.
+ */
+error_t json_writer_begin(json_writer_t *writer, HttpConnection *connection, const char *contentType);
+
+/**
+ * @brief Sends the rest of the buffer and terminates the body.
+ *
+ * @return The first error that occurred while writing.
+ */
+error_t json_writer_end(json_writer_t *writer);
+
+void json_writer_object_begin(json_writer_t *writer, const char *key);
+void json_writer_object_end(json_writer_t *writer);
+void json_writer_array_begin(json_writer_t *writer, const char *key);
+void json_writer_array_end(json_writer_t *writer);
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value);
+void json_writer_number(json_writer_t *writer, const char *key, double value);
+void json_writer_bool(json_writer_t *writer, const char *key, bool value);
+void json_writer_null(json_writer_t *writer, const char *key);
+
+/**
+ * @brief Writes a cJSON item including everything it contains, for values that are already built as DOM.
+ */
+void json_writer_cjson(json_writer_t *writer, const char *key, const cJSON *item);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MEM_ARENA_CHUNK_SIZE (64 * 1024)
+#define MEM_ARENA_ALIGNMENT 8
+
+/**
+ * @brief Bump allocator for data that is built once and released as a whole.
+ *
+ * Allocations are served from MEM_ARENA_CHUNK_SIZE chunks, larger ones get a chunk of their own.
+ * Strings can be interned, so repeated values are stored only once.
+ */
+typedef struct mem_arena_s mem_arena_t;
+
+/**
+ * @brief Creates an empty arena.
+ *
+ * @return The arena or NULL on allocation errors.
+ */
+mem_arena_t *mem_arena_create();
+
+/**
+ * @brief Allocates memory that lives until the arena is freed.
+ *
+ * @return Memory aligned to MEM_ARENA_ALIGNMENT bytes or NULL on allocation errors.
+ */
+void *mem_arena_alloc(mem_arena_t *arena, size_t size);
+
+/**
+ * @brief Copies a string into the arena.
+ */
+char *mem_arena_strdup(mem_arena_t *arena, const char *str);
+
+/**
+ * @brief Returns a copy of the string in the arena, equal strings share one copy.
+ */
+char *mem_arena_intern(mem_arena_t *arena, const char *str);
+
+/**
+ * @brief Returns the number of bytes allocated from the system for the arena.
+ */
+size_t mem_arena_size(const mem_arena_t *arena);
+
+/**
+ * @brief Releases the arena and everything allocated from it.
+ */
+void mem_arena_free(mem_arena_t *arena);
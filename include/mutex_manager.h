@@ -13,6 +13,15 @@ typedef enum
     MUTEX_MQTT_BOX,
     MUTEX_TONIES_JSON_CACHE,
     MUTEX_PCAPLOG_FILE,
+    MUTEX_TAF_INDEX,
+    MUTEX_CONTENT_CACHE,
+    MUTEX_STREAM_BUFFERS,
+    MUTEX_STREAM_REGISTRY,
+    MUTEX_CACHE,
+    MUTEX_WORKER_POOL,
+    MUTEX_TAG_REGISTRY,
+    MUTEX_FILE_WATCH,
+    MUTEX_CONTENT_JSON,
     MUTEX_ID,
     MUTEX_ID_START,
     MUTEX_LAST = MUTEX_ID_START + 16
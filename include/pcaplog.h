@@ -7,5 +7,6 @@
 
 void pcaplog_open();
 void pcaplog_close();
+bool pcaplog_enabled();
 void pcaplog_write(pcaplog_ctx_t *ctx, bool is_tx, const uint8_t *payload, size_t payload_len);
 void pcaplog_reset(pcaplog_ctx_t *ctx);
@@ -3,9 +3,37 @@
 
 #include <stdbool.h>
 #include "core/net.h"
+#include "fs_port.h"
 
 void *resolve_host(const char *hostname);
 bool resolve_get_ip(void *res, int pos, IpAddr *ipAddr);
 void resolve_free(void *res);
 
+/* sends a file region directly from the kernel, ERROR_NOT_IMPLEMENTED if unsupported */
+error_t socketSendFile(Socket *socket, FsFile *file, size_t offset, size_t length, size_t *written);
+
+#define FS_WATCH_CREATED (1 << 0)   /* entry created or moved into the directory */
+#define FS_WATCH_DELETED (1 << 1)   /* entry deleted or moved out of the directory */
+#define FS_WATCH_MODIFIED (1 << 2)  /* content or attributes of an entry changed */
+#define FS_WATCH_DIRECTORY (1 << 3) /* the entry is a directory */
+#define FS_WATCH_GONE (1 << 4)      /* the watched directory itself is gone, the id is invalid now */
+#define FS_WATCH_OVERFLOW (1 << 5)  /* events were lost, everything has to be checked again */
+
+typedef struct FsWatch FsWatch;
+
+typedef struct
+{
+    int32_t id;
+    uint32_t flags;
+    char name[FS_MAX_NAME_LEN + 1];
+} FsWatchEvent;
+
+/* directory change notifications (not recursive), ERROR_NOT_IMPLEMENTED if unsupported */
+error_t fsWatchOpen(FsWatch **watch);
+error_t fsWatchAdd(FsWatch *watch, const char *path, int32_t *id);
+void fsWatchRemove(FsWatch *watch, int32_t id);
+/* returns the next event, ERROR_TIMEOUT if there was none within the timeout */
+error_t fsWatchRead(FsWatch *watch, FsWatchEvent *event, systime_t timeout);
+void fsWatchClose(FsWatch *watch);
+
 #endif
\ No newline at end of file
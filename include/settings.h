@@ -21,11 +21,13 @@
 #define TONIESV2_JSON_FILE "toniesV2.json"
 #define TONIES_JSON_TMP_FILE TONIES_JSON_FILE ".tmp"
 #define TONIES_CUSTOM_JSON_FILE "tonies.custom.json"
-#define TONIESV2_CUSTOM_JSON_FILE "tonies.custom.json"
+#define TONIESV2_CUSTOM_JSON_FILE "toniesV2.custom.json"
 #define TONIEBOX_JSON_FILE "tonieboxes.json"
 #define TONIEBOX_CUSTOM_JSON_FILE "tonieboxes.custom.json"
+#define TAF_INDEX_FILE "taf.index"
 #define CONFIG_FILE "config.ini"
 #define CONFIG_OVERLAY_FILE "config.overlay.ini"
+#define SETTINGS_WATCH_DEBOUNCE_MS 250
 #define CONFIG_VERSION 13
 #define MAX_OVERLAYS 16 + 1
 
@@ -90,10 +92,13 @@ typedef struct
 {
     uint32_t bitrate;
     uint32_t ffmpeg_stream_buffer_ms;
+    uint32_t stream_ready_blocks;
     bool ffmpeg_stream_restart;
     bool ffmpeg_sweep_startup_buffer;
     uint32_t ffmpeg_sweep_delay_ms;
     uint32_t stream_max_size;
+    uint32_t stream_join_backlog;
+    uint32_t workers;
 
 } settings_encode_t;
 
@@ -293,6 +298,9 @@ typedef struct
 
     bool tonies_json_auto_update;
     bool full_taf_validation;
+    uint32_t content_cache_mb;
+    uint32_t cachedir_max_mb;
+    uint32_t index_workers;
 } settings_core_t;
 
 typedef struct
@@ -483,6 +491,13 @@ void settings_resolve_dir(char **resolvedPath, char *path, char *basePath);
 void settings_changed_id(uint8_t settingsId);
 void settings_loop();
 
+/**
+ * @brief Reloads the settings when the config or overlay file changes on disk.
+ *
+ * Replaces polling the files with settings_loop(), the check runs once the file watch reports a change.
+ */
+void settings_watch();
+
 /**
  * @brief Initializes the settings subsystem.
  *
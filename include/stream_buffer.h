@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "error.h"
+#include "os_port.h"
+#include "fs_port.h"
+
+#define STREAM_BUFFER_BLOCK_SIZE 4096
+#define STREAM_BUFFER_BLOCKS 256
+#define STREAM_BUFFER_MAX_READERS 8
+#define STREAM_BUFFER_WAIT_MS 1000
+#define STREAM_BUFFER_RATE_WINDOW_MS 500
+#define STREAM_BUFFER_RATE_STEADY_MIN 900  /* permille of real time, below the source cannot keep up */
+#define STREAM_BUFFER_RATE_STEADY_MAX 1500 /* permille of real time, above the source still sends its startup burst */
+
+typedef struct stream_buffer_s stream_buffer_t;
+
+/**
+ * @brief A consumer of a stream buffer with its own position and wakeup event.
+ */
+typedef struct
+{
+    stream_buffer_t *buffer; /**< Buffer the reader is attached to. */
+    OsEvent event;           /**< Signalled by the producer on new data or close. */
+    uint64_t pos;            /**< Offset of the next byte in the reader's view of the file. */
+    uint64_t split;          /**< Offset in the reader's view from which on delta applies. */
+    int64_t delta;           /**< Difference between file offset and reader offset after a late join. */
+} stream_buffer_reader_t;
+
+/**
+ * @brief Creates a ring buffer for a TAF that is being encoded and registers it under its file path.
+ *
+ * The buffer keeps the TAF header and the last STREAM_BUFFER_BLOCKS finished 4 KB blocks in memory,
+ * so senders get woken up on every finished block instead of polling the file on disk.
+ *
+ * @param path Full path of the TAF file written in parallel.
+ * @return The buffer with one reference held by the caller or NULL on allocation errors.
+ */
+stream_buffer_t *stream_buffer_create(const char *path);
+
+/**
+ * @brief Looks up the buffer of a file that is currently being encoded.
+ *
+ * @param path Full path of the TAF file.
+ * @return A new reference to the buffer or NULL if the file is not being encoded.
+ */
+stream_buffer_t *stream_buffer_open(const char *path);
+
+/**
+ * @brief Drops a reference obtained by stream_buffer_create() or stream_buffer_open().
+ */
+void stream_buffer_release(stream_buffer_t *buffer);
+
+/**
+ * @brief Stores the TAF header block, i.e. the first STREAM_BUFFER_BLOCK_SIZE bytes of the file.
+ */
+void stream_buffer_write_header(stream_buffer_t *buffer, const uint8_t *data, size_t length);
+
+/**
+ * @brief Appends encoded data and wakes up all readers.
+ *
+ * @param buffer The buffer.
+ * @param offset Absolute file offset of the data, must directly follow the previously written data.
+ * @param data Data to append.
+ * @param length Number of bytes.
+ */
+void stream_buffer_write(stream_buffer_t *buffer, uint64_t offset, const uint8_t *data, size_t length);
+
+/**
+ * @brief Marks the end of the stream and unregisters the buffer, readers drain the remaining data.
+ *
+ * @param buffer The buffer.
+ * @param error Result of the encoder, reported to readers waiting for data that will never come.
+ */
+void stream_buffer_close(stream_buffer_t *buffer, error_t error);
+
+/**
+ * @brief Waits until the header and at least @p bytes of audio data are buffered or the stream was closed.
+ *
+ * @return NO_ERROR if the data is available, ERROR_TIMEOUT, or the close result (ERROR_END_OF_STREAM if closed without error).
+ */
+error_t stream_buffer_wait(stream_buffer_t *buffer, size_t bytes, systime_t timeout);
+
+/**
+ * @brief Waits like stream_buffer_wait() and additionally for a measured input rate in the given range.
+ *
+ * @param buffer The buffer.
+ * @param bytes Audio data that has to be buffered.
+ * @param min_rate Minimum input rate in permille of real time.
+ * @param max_rate Maximum input rate in permille of real time, UINT32_MAX for no limit.
+ * @param timeout Maximum time to wait.
+ * @return NO_ERROR if ready, ERROR_TIMEOUT, or the close result (ERROR_END_OF_STREAM if closed without error).
+ */
+error_t stream_buffer_wait_input(stream_buffer_t *buffer, size_t bytes, uint32_t min_rate, uint32_t max_rate, systime_t timeout);
+
+/**
+ * @brief Reports decoded input samples, used to measure how fast the source delivers compared to real time.
+ */
+void stream_buffer_report_input(stream_buffer_t *buffer, size_t samples, uint32_t sample_rate);
+
+/**
+ * @brief Returns the encoder telemetry.
+ *
+ * @param buffer The buffer.
+ * @param encoded Receives the number of bytes written since the encoder started.
+ * @param input_rate Receives the last measured input rate in permille of real time, 0 if not measured yet.
+ */
+void stream_buffer_get_telemetry(stream_buffer_t *buffer, uint64_t *encoded, uint32_t *input_rate);
+
+/**
+ * @brief Sets how many already encoded blocks a late joining reader gets.
+ *
+ * A reader attaching further behind the newest data (or beyond it) than this keeps
+ * the TAF header and the opus header block, and then continues at the newest blocks.
+ */
+void stream_buffer_set_join_backlog(stream_buffer_t *buffer, size_t blocks);
+
+/**
+ * @brief Attaches a reader at the given file offset, applying the late join policy.
+ *
+ * @return ERROR_OUT_OF_RESOURCES if too many readers are attached.
+ */
+error_t stream_buffer_reader_attach(stream_buffer_reader_t *reader, stream_buffer_t *buffer, uint64_t pos);
+
+/**
+ * @brief Detaches a reader, the buffer reference stays with the caller.
+ */
+void stream_buffer_reader_detach(stream_buffer_reader_t *reader);
+
+/**
+ * @brief Returns the file offset the reader position maps to.
+ */
+uint64_t stream_buffer_reader_offset(const stream_buffer_reader_t *reader);
+
+/**
+ * @brief Reads data at the reader position, waiting for the producer if nothing is available.
+ *
+ * @param reader The reader.
+ * @param data Destination buffer.
+ * @param size Maximum number of bytes to read.
+ * @param read Receives the number of bytes read and added to the reader position.
+ * @param timeout Maximum time to wait for new data.
+ * @return NO_ERROR, ERROR_TIMEOUT, ERROR_END_OF_STREAM once closed and drained, or ERROR_OUT_OF_RANGE
+ *         if the position is not held in memory (anymore) and has to be read from the file.
+ */
+error_t stream_buffer_read(stream_buffer_reader_t *reader, uint8_t *data, size_t size, size_t *read, systime_t timeout);
+
+/**
+ * @brief Like stream_buffer_read(), but reads ranges not held in memory from the file written in parallel.
+ *
+ * @param file The TAF file opened for reading, its position is changed.
+ * @return NO_ERROR, ERROR_TIMEOUT, ERROR_END_OF_STREAM once closed and drained, or a file error.
+ */
+error_t stream_buffer_read_file(stream_buffer_reader_t *reader, FsFile *file, uint8_t *data, size_t size, size_t *read, systime_t timeout);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "error.h"
+#include "settings.h"
+#include "toniefile.h"
+#include "stream_buffer.h"
+
+/**
+ * @brief A running decode/encode pipeline shared by all boxes playing the same source.
+ */
+typedef struct stream_pipeline_s stream_pipeline_t;
+struct stream_pipeline_s
+{
+    stream_pipeline_t *next; /**< Next registered pipeline. */
+    char *source;            /**< Resolved source, part of the key. */
+    size_t skip_seconds;     /**< Seconds skipped at the start, part of the key. */
+    char *targetFile;        /**< The .stream file of the first subscriber, written as spill. */
+    uint32_t subscribers;    /**< Number of boxes currently listening. */
+    bool registered;         /**< Still in the list, until the encoder task exited. */
+    bool stopping;           /**< The last subscriber left and waits for the encoder to quit. */
+    stream_ctx_t stream_ctx; /**< Context of the encoder task. */
+    ffmpeg_stream_ctx_t ffmpeg_ctx;
+    stream_buffer_t *stream_buffer; /**< Encoded blocks fanned out to all subscribers. */
+};
+
+/**
+ * @brief Joins a running pipeline for the source or starts a new one.
+ *
+ * Waits while a stopping pipeline still writes the same target file.
+ *
+ * @param source Resolved source URL or path.
+ * @param skip_seconds Seconds to skip at the start of the source.
+ * @param targetFile .stream file used if a new pipeline has to be started.
+ * @param append Continue an existing .stream file if a new pipeline has to be started.
+ * @param settings Settings of the subscribing box.
+ * @param created Receives whether a new pipeline was started.
+ * @return The pipeline to be left with stream_registry_unsubscribe() or NULL on errors.
+ */
+stream_pipeline_t *stream_registry_subscribe(const char *source, size_t skip_seconds, const char *targetFile, bool append, settings_t *settings, bool *created);
+
+/**
+ * @brief Leaves a pipeline, the last subscriber stops the encoder and frees it.
+ */
+void stream_registry_unsubscribe(stream_pipeline_t *pipeline);
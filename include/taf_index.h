@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "error.h"
+#include "contentJson.h"
+#include "proto/toniebox.pb.taf-header.pb-c.h"
+
+#define TAF_INDEX_MAGIC 0x58444954 /* "TIDX" */
+#define TAF_INDEX_VERSION 2
+#define TAF_INDEX_BUCKETS 1024
+#define TAF_INDEX_SAVE_INTERVAL_MS (60 * 1000)
+#define TAF_INDEX_WATCH_DEBOUNCE_MS 1000
+
+/**
+ * @brief Result of a full SHA1 and size validation of a TAF.
+ */
+typedef enum
+{
+    TAF_VERDICT_UNKNOWN = 0, /**< File was not fully validated yet. */
+    TAF_VERDICT_VALID,       /**< SHA1 and size match the header. */
+    TAF_VERDICT_INVALID      /**< SHA1 or size mismatch, or no TAF at all. */
+} taf_verdict_t;
+
+/**
+ * @brief Identity of a file on disk, used to detect if an index entry is stale.
+ */
+typedef struct taf_index_key_s
+{
+    uint64_t device; /**< Device the file resides on. */
+    uint64_t inode;  /**< Inode number, 0 on platforms not providing one. */
+    uint64_t size;   /**< File size in bytes. */
+    uint64_t mtime;  /**< Modification time in nanoseconds (seconds resolution on some platforms). */
+} taf_index_key_t;
+
+/**
+ * @brief Structure representing a single indexed file.
+ */
+typedef struct taf_index_entry_s taf_index_entry_t;
+struct taf_index_entry_s
+{
+    taf_index_entry_t *next; /**< Next entry in the same bucket. */
+    uint32_t hash;           /**< Hash of the path, used for bucket selection and fast comparison. */
+    char *path;              /**< Absolute path of the file. */
+    taf_index_key_t key;     /**< File identity at the time the header was read. */
+    bool has_header;         /**< Header and track positions are known, otherwise only the verdict is cached. */
+    uint8_t verdict;         /**< Cached taf_verdict_t of the full validation. */
+    uint8_t *header;         /**< Raw protobuf TAF header, NULL if the file is no valid TAF. */
+    uint32_t header_size;    /**< Size of the raw protobuf header. */
+    uint32_t track_count;    /**< Number of decoded track positions. */
+    uint32_t *track_pos;     /**< Decoded track start positions in seconds. */
+};
+
+/**
+ * @brief Loads the persisted TAF index from the config directory.
+ *
+ * Entries whose file vanished or changed since they were written are dropped while loading.
+ */
+void taf_index_init();
+
+/**
+ * @brief Drops the entries of files changed or removed in the content and library directories as they are reported.
+ */
+void taf_index_watch();
+
+/**
+ * @brief Saves the index if it was modified and frees all entries.
+ */
+void taf_index_deinit();
+
+/**
+ * @brief Periodically persists the index, to be called from the main loop.
+ */
+void taf_index_loop();
+
+/**
+ * @brief Writes the index to disk if it was modified since the last save.
+ *
+ * @return NO_ERROR on success or if nothing had to be written.
+ */
+error_t taf_index_save();
+
+/**
+ * @brief Reads the identity (inode, size, mtime) of a file.
+ *
+ * @param path Path of the file.
+ * @param key Pointer receiving the identity.
+ * @return true if the file exists and could be stat'ed.
+ */
+bool taf_index_stat(const char *path, taf_index_key_t *key);
+
+/**
+ * @brief Looks up the cached TAF metadata of a file.
+ *
+ * The file is stat'ed and the result written to @p key, so a caller can pass it on to
+ * taf_index_put() after a miss. An entry only matches if inode, size and mtime are unchanged.
+ *
+ * @param path Path of the file.
+ * @param key Pointer receiving the current identity of the file.
+ * @param isTaf Optional, receives whether the file has a valid TAF header.
+ * @param tafHeader Optional, receives a newly unpacked header to be freed by the caller, NULL if no TAF.
+ * @param trackPos Optional, receives a newly allocated copy of the track positions.
+ * @return true on a hit, false if the file has to be read.
+ */
+bool taf_index_get(const char *path, taf_index_key_t *key, bool *isTaf, TonieboxAudioFileHeader **tafHeader, track_positions_t *trackPos);
+
+/**
+ * @brief Adds or replaces the cached TAF metadata of a file.
+ *
+ * @param path Path of the file.
+ * @param key Identity of the file as returned by taf_index_get() before reading it.
+ * @param header Raw protobuf header or NULL if the file is no valid TAF.
+ * @param headerSize Size of the raw protobuf header.
+ * @param trackPos Decoded track positions, may be NULL.
+ */
+void taf_index_put(const char *path, const taf_index_key_t *key, const uint8_t *header, size_t headerSize, const track_positions_t *trackPos);
+
+/**
+ * @brief Looks up the cached full validation verdict of a file.
+ *
+ * @param path Path of the file.
+ * @param key Pointer receiving the current identity of the file, zeroed if it does not exist.
+ * @return The verdict or TAF_VERDICT_UNKNOWN if the file changed or was never validated.
+ */
+taf_verdict_t taf_index_get_verdict(const char *path, taf_index_key_t *key);
+
+/**
+ * @brief Stores the full validation verdict of a file.
+ *
+ * @param path Path of the file.
+ * @param key Identity of the file as stat'ed before validating it.
+ * @param valid Result of the validation.
+ */
+void taf_index_set_verdict(const char *path, const taf_index_key_t *key, bool valid);
+
+/**
+ * @brief Queues a file for full validation by the background validator.
+ *
+ * @param path Path of the file.
+ */
+void taf_index_queue_validation(const char *path);
+
+/**
+ * @brief Removes the entry of a file, e.g. after it was deleted or moved.
+ *
+ * @param path Path of the file.
+ */
+void taf_index_remove(const char *path);
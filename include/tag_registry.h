@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cJSON.h"
+
+#define TAG_REGISTRY_BUCKETS 1024
+#define TAG_REGISTRY_MODEL_LEN 32
+#define TAG_REGISTRY_DEBOUNCE_MS 500                /* of the file watch subscriptions */
+#define TAG_REGISTRY_RESCAN_MS (15 * 60 * 1000)     /* safety net while changes are watched */
+#define TAG_REGISTRY_POLL_RESCAN_MS (60 * 1000)     /* without change notifications */
+
+/**
+ * @brief Values of a tag the listings filter by, so they need not be looked up in the JSON.
+ */
+typedef struct
+{
+    bool valid;
+    bool hide;
+    bool hasCloudAuth;
+    bool hasAudioId;
+    uint32_t audioId;
+    char model[TAG_REGISTRY_MODEL_LEN];
+} tag_registry_attr_t;
+
+/**
+ * @brief A content directory of the registry as copied out by tag_registry_list().
+ */
+typedef struct
+{
+    char name[9];
+    char ruid[17]; /* tag found in the directory, kept for removed directories */
+    uint64_t date;
+    uint64_t generation;
+    bool deleted;
+} tag_registry_item_t;
+
+/**
+ * @brief Builds the registry in the background and keeps it current.
+ *
+ * The content directory is read once, afterwards only the directories reported by the file watch
+ * are read again. Changes in the library mark the tags that refer to a source. A full rescan runs every
+ * TAG_REGISTRY_RESCAN_MS, or TAG_REGISTRY_POLL_RESCAN_MS while the file watch only polls.
+ */
+void tag_registry_init();
+
+/**
+ * @brief Returns the content directories changed after the given generation.
+ *
+ * With since set to 0 all current tags are returned, otherwise also the directories removed in the meantime.
+ *
+ * @param contentDir Content directory of the request, the registry only serves its own one.
+ * @param since Generation the client has seen.
+ * @param items Receives the directories, to be freed with osFreeMem().
+ * @param count Receives the number of directories.
+ * @param generation Receives the current generation.
+ * @return false if the registry is not built yet or for another content directory.
+ */
+bool tag_registry_list(const char *contentDir, uint64_t since, tag_registry_item_t **items, size_t *count, uint64_t *generation);
+
+/**
+ * @brief Returns a copy of the tag info of a content directory.
+ *
+ * @return The tag info to be freed with cJSON_Delete() or NULL if the directory holds no tag.
+ */
+cJSON *tag_registry_get(const char *name, tag_registry_attr_t *attr);
@@ -33,5 +33,7 @@ bool_t is_valid_tap(char *filename);
 error_t tap_load(char *filename, tonie_audio_playlist_t *tap);
 error_t tap_save(char *filename, tonie_audio_playlist_t *tap);
 void tap_free(tonie_audio_playlist_t *tap);
+/* true if the background validation found the generated TAF of the playlist broken */
+bool_t tap_cache_invalid(tonie_audio_playlist_t *tap);
 error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force);
 void tap_generate_task(void *param);
\ No newline at end of file
@@ -2,11 +2,12 @@
 #pragma once
 #include <stdint.h>
 #include "fs_ext.h"
+#include "stream_buffer.h"
 
 #define OPUS_FRAME_SIZE_MS OPUS_FRAMESIZE_60_MS
 #define OPUS_SAMPLING_RATE 48000
 // #define OPUS_BIT_RATE 96000
-#define OPUS_FRAME_SIZE OPUS_SAMPLING_RATE * 60 / 1000 /* samples: 60ms at 48kHz */
+#define OPUS_FRAME_SIZE (OPUS_SAMPLING_RATE * 60 / 1000) /* samples: 60ms at 48kHz */
 #define OPUS_CHANNELS 2
 #define OPUS_PACKET_PAD 64
 #define OPUS_PACKET_MINSIZE 64
@@ -40,6 +41,7 @@ typedef struct
     OsTaskId taskId;
     bool_t quit;
     bool_t stop_on_playback_stop;
+    systime_t ttfb_start; /* request time of a live stream until its first byte was sent, 0 otherwise */
 
     void *ctx;
 } stream_ctx_t;
@@ -51,13 +53,20 @@ typedef struct
     char *targetFile;
     bool_t append;
     bool_t sweep;
+    stream_buffer_t *stream_buffer;
 } ffmpeg_stream_ctx_t;
 
 toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool append, int32_t size);
+toniefile_t *toniefile_create_stream(const char *fullPath, uint32_t audio_id, bool append, int32_t size, stream_buffer_t *stream_buffer);
+/* audio pages only, laid out for the TAF position offset and added by toniefile_append_segment(). the first preroll packets prime the encoder and are dropped */
+toniefile_t *toniefile_create_segment(const char *fullPath, uint32_t audio_id, size_t offset, size_t preroll);
 error_t toniefile_close(toniefile_t *ctx);
 error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available);
 error_t toniefile_write_header(toniefile_t *ctx);
+/* the chapter starts in the block of the next encoded packet */
 error_t toniefile_new_chapter(toniefile_t *ctx);
+/* adds the packets of a closed segment to the TAF as if they were encoded into it */
+error_t toniefile_append_segment(toniefile_t *ctx, const char *segmentPath);
 
 bool toniefile_is_valid(const char *file_path);
 
@@ -65,6 +74,8 @@ FILE *ffmpeg_decode_audio_start(const char *input_source);
 FILE *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds, size_t skip_bytes);
 error_t ffmpeg_decode_audio_end(FILE *ffmpeg_pipe, error_t error);
 error_t ffmpeg_decode_audio(FILE *ffmpeg_pipe, int16_t *buffer, size_t size, size_t *blocks_read);
-error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, bool_t isStream);
+error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, bool_t isStream, stream_buffer_t *stream_buffer);
 error_t ffmpeg_convert(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds);
+/* encodes the sources serially to <target_taf>.serial and in parallel to target_taf and compares the results */
+error_t ffmpeg_convert_check(char source[99][PATH_LEN], size_t source_len, const char *target_taf, size_t skip_seconds);
 void ffmpeg_stream_task(void *param);
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "error.h"
+#include "mem_arena.h"
 
 typedef struct
 {
@@ -58,15 +59,56 @@ typedef struct
     uint8_t ids_count;
 } toniesV2Json_item_t;
 
+#define TONIES_SEARCH_FIELD_MODEL (1 << 0)
+#define TONIES_SEARCH_FIELD_SERIES (1 << 1)
+#define TONIES_SEARCH_FIELD_EPISODES (1 << 2)
+#define TONIES_SEARCH_FIELD_TITLE (1 << 3)
+#define TONIES_SEARCH_FIELD_ALL 0x0F
+#define TONIES_SEARCH_FIELDS 4
+
+#define TONIES_SEARCH_QUERY_LEN 256
+#define TONIES_SEARCH_DEFAULT_LIMIT 18
+#define TONIES_SEARCH_MAX_LIMIT 200
+
+typedef struct
+{
+    const char *text;
+    uint32_t fields;
+} tonies_search_term_t;
+
+/* replaced tonies.json versions are kept at least this long, even when no reader holds them anymore */
+#define TONIES_JSON_GRACE_PERIOD_MS (10 * 1000)
+#define TONIES_JSON_WATCH_DEBOUNCE_MS 1000
+
+/* ETag and Last-Modified of a downloaded file are kept in a file with this suffix */
+#define TONIES_VALIDATORS_EXT ".validators"
+
+/* one version of the parsed tonies json files */
+typedef struct tonies_db_s tonies_db_t;
+
 void tonies_init();
+void tonies_reload();
+/* reloads the tonies json files when they are changed on disk */
+void tonies_watch();
+void tonies_loop();
+/* changes with every published reload, for caches that hold data derived from the tonies json files */
+uint32_t tonies_version();
+/* holds the current version, everything the lookups return from it stays valid until it is released, NULL if none is loaded */
+tonies_db_t *tonies_dbAcquire();
+void tonies_dbRelease(tonies_db_t *db);
 error_t tonies_update();
 error_t toniesV2_update();
 error_t tonieboxes_update();
-void tonies_readJson(char *source, toniesJson_item_t **retCache, size_t *retCount);
-void toniesV2_readJson(char *source, toniesV2Json_item_t **toniesCache, size_t *toniesCount);
-toniesJson_item_t *tonies_byAudioId(uint32_t audio_id);
-toniesJson_item_t *tonies_byAudioIdHash(uint32_t audio_id, uint8_t *hash);
-toniesJson_item_t *tonies_byModel(char *model);
-toniesJson_item_t *tonies_byAudioIdHashModel(uint32_t audio_id, uint8_t *hash, char *model);
-bool tonies_byModelSeriesEpisode(char *model, char *series, char *episode, toniesJson_item_t *result[18], size_t *result_size);
+void tonies_readJson(char *source, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena);
+void toniesV2_readJson(char *source, toniesV2Json_item_t **retCache, size_t *retCount, mem_arena_t **retArena);
+toniesJson_item_t *tonies_byAudioId(const tonies_db_t *db, uint32_t audio_id);
+toniesJson_item_t *tonies_byAudioIdHash(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash);
+toniesJson_item_t *tonies_byModel(const tonies_db_t *db, char *model);
+toniesJson_item_t *tonies_byAudioIdHashModel(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash, char *model);
+toniesV2Json_item_t *toniesV2_byAudioIdHash(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash);
+/* returns a copy of the model, which the caller frees */
+char *tonies_modelByAudioIdHash(uint32_t audio_id, uint8_t *hash);
+/* compares the tonies.json and toniesV2.json lookups for the given time each, for --tonies-benchmark */
+void tonies_benchmark(uint32_t duration_ms);
+size_t tonies_search(const tonies_db_t *db, const tonies_search_term_t *terms, size_t termCount, size_t offset, size_t limit, toniesJson_item_t **results, size_t *total);
 void tonies_deinit();
\ No newline at end of file
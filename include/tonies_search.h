@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "toniesJson.h"
+
+/**
+ * @brief Prebuilt trigram index over model, series, episodes and title of all tonies.json entries.
+ */
+typedef struct tonies_search_s tonies_search_t;
+
+/**
+ * @brief Case folds a text, replaces latin diacritics by their base letters and collapses everything else to single spaces.
+ *
+ * @param text UTF-8 text.
+ * @param out Destination buffer.
+ * @param size Size of the destination buffer, at least 4 bytes.
+ * @return Length of the normalized text.
+ */
+size_t tonies_search_normalize(const char *text, char *out, size_t size);
+
+/**
+ * @brief Builds the index, custom entries shadow official entries with the same model.
+ *
+ * The index refers to the items, so it has to be freed before them.
+ *
+ * @return The index or NULL on allocation errors.
+ */
+tonies_search_t *tonies_search_build(toniesJson_item_t *custom, size_t customCount, toniesJson_item_t *official, size_t officialCount);
+
+/**
+ * @brief Frees an index built by tonies_search_build().
+ */
+void tonies_search_free(tonies_search_t *search);
+
+/**
+ * @brief Searches the index.
+ *
+ * Entries matching any of the terms are ranked by the best match: a word prefix scores higher than a
+ * substring, which scores higher than an entry sharing only some trigrams with the term (fuzzy).
+ * Model matches rank before title, series and episodes matches, ties keep the tonies.json order.
+ *
+ * @param search The index.
+ * @param terms Search terms, empty texts are ignored.
+ * @param termCount Number of terms.
+ * @param offset Number of ranked results to skip.
+ * @param limit Maximum number of results to return.
+ * @param results Receives up to @p limit items.
+ * @param total Receives the number of all matching entries.
+ * @return Number of items written to @p results.
+ */
+size_t tonies_search_query(const tonies_search_t *search, const tonies_search_term_t *terms, size_t termCount, size_t offset, size_t limit, toniesJson_item_t **results, size_t *total);
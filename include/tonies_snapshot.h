@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "toniesJson.h"
+#include "mem_arena.h"
+
+#define TONIES_SNAPSHOT_MAGIC 0x4E534A54 /* "TJSN" */
+#define TONIES_SNAPSHOT_VERSION 1
+#define TONIES_SNAPSHOT_EXT ".bin"
+
+#define TONIES_SNAPSHOT_FLAG_CACHE_IMAGES (1 << 0)
+
+/**
+ * @brief Identifies the content of a tonies.json file a snapshot was built from.
+ */
+typedef struct
+{
+    uint32_t size;
+    int64_t mtime;
+    uint8_t sha256[32];
+} tonies_snapshot_source_t;
+
+/**
+ * @brief Reads size and modification time of a source file and hashes its content.
+ *
+ * @return false if the file cannot be read.
+ */
+bool tonies_snapshot_source(const char *source, tonies_snapshot_source_t *info);
+
+/**
+ * @brief Loads the snapshot next to a source file if it was built from exactly that content.
+ *
+ * The snapshot is read with a single read into one arena block, the stored offsets are relocated in place.
+ * With image caching enabled, the cache entries of the pictures are registered again without hashing their URLs.
+ *
+ * @param source Path of the tonies.json file, the snapshot is at the same path plus TONIES_SNAPSHOT_EXT.
+ * @param info Identity of the source file as returned by tonies_snapshot_source().
+ * @param flags TONIES_SNAPSHOT_FLAG_* of the settings the items would be parsed with.
+ * @param retCache Receives the items.
+ * @param retCount Receives the number of items.
+ * @param retArena Receives the arena holding the items.
+ * @param retPictureSources Receives per item the original URL of a cached picture or NULL, to be freed with osFreeMem().
+ * @return true if the snapshot was valid and loaded, false if the source has to be parsed.
+ */
+bool tonies_snapshot_load(const char *source, const tonies_snapshot_source_t *info, uint32_t flags, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena, const char ***retPictureSources);
+
+/**
+ * @brief Writes the parsed items of a source file as snapshot.
+ *
+ * @param pictureSources Per item the original picture URL of a cached picture or NULL, may be NULL for none.
+ */
+error_t tonies_snapshot_save(const char *source, const tonies_snapshot_source_t *info, uint32_t flags, const toniesJson_item_t *items, size_t count, const char *const *pictureSources);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define WORKER_POOL_MAX_WORKERS 16
+
+/**
+ * @brief Processes a single element of a job, called with the index of the element.
+ */
+typedef void (*worker_pool_fn_t)(void *ctx, size_t index);
+
+/**
+ * @brief Calls fn for every index in [0, count) using up to the given number of workers.
+ *
+ * The calling task works on the job too and the call returns when all elements are done, so results
+ * that are stored per index can be consumed in order afterwards. With one worker or a single element
+ * everything runs serially in the caller. The pool tasks are started on first use.
+ *
+ * @param fn Function processing one element, must be safe to run concurrently for different indexes.
+ * @param ctx Context passed to fn.
+ * @param count Number of elements.
+ * @param workers Maximum number of tasks working on this job including the caller.
+ */
+void worker_pool_run(worker_pool_fn_t fn, void *ctx, size_t count, size_t workers);
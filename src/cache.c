@@ -5,16 +5,245 @@
 #include "fs_port.h"
 #include "os_port.h"
 #include "server_helpers.h"
+#include "mem_arena.h"
+#include "mutex_manager.h"
+#include "settings.h"
 #include "hash/sha256.h" // for sha256Update, sha256Final, sha256Init
 
-cache_entry_t cache_table = {.next = NULL, .hash = 0, .original_url = NULL, .cached_url = NULL, .file_path = NULL};
-uint32_t cache_entries = 0;
+#define CACHE_MIN_BUCKETS 256
+
+/* entries are never removed, so they and their strings live in an arena and stay valid without the lock */
+static mem_arena_t *cache_arena = NULL;
+static cache_entry_t *cache_head = NULL;
+static cache_entry_t *cache_tail = NULL;
+static uint32_t cache_entries = 0;
+
+/* two chained hash tables of the same size, one keyed by the SHA-256 of the URL and one by the URL itself */
+static cache_entry_t **cache_by_hash = NULL;
+static cache_entry_t **cache_by_url = NULL;
+static uint32_t cache_buckets = 0; /* power of two */
+
+/* entries with an existing file, most recently used first, and their accounting */
+static cache_entry_t *cache_lru_head = NULL;
+static cache_entry_t *cache_lru_tail = NULL;
+static size_t cache_files = 0;
+static size_t cache_bytes = 0;
+static size_t cache_evicted = 0;
+static systime_t cache_sweep_last = 0;
+
+/* entries to download in the background, and failed ones waiting for their retry time */
+static cache_entry_t *cache_prefetch_head = NULL;
+static cache_entry_t *cache_prefetch_tail = NULL;
+static cache_entry_t *cache_prefetch_retry = NULL;
+static size_t cache_prefetch_pending = 0;
+static size_t cache_prefetch_done = 0;
+static size_t cache_prefetch_failed = 0;
+static size_t cache_prefetch_reported = 0;
+static bool cache_prefetch_started = false;
+static OsEvent cache_prefetch_event;
+
+static uint32_t cache_url_hash(const char *url)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = url; *c; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t cache_hash_prefix(const uint8_t *sha256)
+{
+    return ((uint32_t)sha256[0] << 24) | ((uint32_t)sha256[1] << 16) | ((uint32_t)sha256[2] << 8) | ((uint32_t)sha256[3] << 0);
+}
+
+/* parses the hex SHA-256 at the start of a cached file name, which has to be followed by the extension */
+static bool cache_parse_name(const char *name, uint8_t *sha256)
+{
+    for (size_t pos = 0; pos < SHA256_DIGEST_SIZE; pos++)
+    {
+        uint8_t value = 0;
+        for (size_t nibble = 0; nibble < 2; nibble++)
+        {
+            char c = name[2 * pos + nibble];
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+            {
+                value |= c - '0';
+            }
+            else if (c >= 'A' && c <= 'F')
+            {
+                value |= c - 'A' + 10;
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                value |= c - 'a' + 10;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        sha256[pos] = value;
+    }
+    return name[2 * SHA256_DIGEST_SIZE] == '.';
+}
+
+static bool cache_table_grow()
+{
+    uint32_t buckets = cache_buckets ? cache_buckets * 2 : CACHE_MIN_BUCKETS;
+    cache_entry_t **by_hash = osAllocMem(buckets * sizeof(cache_entry_t *));
+    cache_entry_t **by_url = osAllocMem(buckets * sizeof(cache_entry_t *));
+    if (by_hash == NULL || by_url == NULL)
+    {
+        osFreeMem(by_hash);
+        osFreeMem(by_url);
+        return false;
+    }
+    osMemset(by_hash, 0, buckets * sizeof(cache_entry_t *));
+    osMemset(by_url, 0, buckets * sizeof(cache_entry_t *));
+
+    /* URLs are unique, so the order within a bucket does not matter */
+    for (cache_entry_t *pos = cache_head; pos != NULL; pos = pos->next)
+    {
+        uint32_t bucket = pos->hash & (buckets - 1);
+        pos->next_by_hash = by_hash[bucket];
+        by_hash[bucket] = pos;
+
+        /* files found by cache_scan() are only known by name until their URL is added */
+        if (pos->original_url)
+        {
+            bucket = pos->url_hash & (buckets - 1);
+            pos->next_by_url = by_url[bucket];
+            by_url[bucket] = pos;
+        }
+    }
+
+    osFreeMem(cache_by_hash);
+    osFreeMem(cache_by_url);
+    cache_by_hash = by_hash;
+    cache_by_url = by_url;
+    cache_buckets = buckets;
+    return true;
+}
+
+/* must be called with MUTEX_CACHE held */
+static cache_entry_t *cache_lookup_url(const char *url, uint32_t url_hash)
+{
+    if (cache_buckets == 0)
+    {
+        return NULL;
+    }
+    for (cache_entry_t *pos = cache_by_url[url_hash & (cache_buckets - 1)]; pos != NULL; pos = pos->next_by_url)
+    {
+        if (pos->url_hash == url_hash && osStrcmp(pos->original_url, url) == 0)
+        {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* must be called with MUTEX_CACHE held, name is the cached file name '[hash].[ext]' */
+static cache_entry_t *cache_lookup_name(const uint8_t *sha256, const char *name)
+{
+    if (cache_buckets == 0)
+    {
+        return NULL;
+    }
+    uint32_t hash = cache_hash_prefix(sha256);
+    for (cache_entry_t *pos = cache_by_hash[hash & (cache_buckets - 1)]; pos != NULL; pos = pos->next_by_hash)
+    {
+        if (pos->hash == hash && osMemcmp(pos->sha256, sha256, SHA256_DIGEST_SIZE) == 0 && osStrcmp(&pos->cached_url[7], name) == 0)
+        {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+static void cache_lru_unlink(cache_entry_t *entry)
+{
+    if (entry->lru_prev)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        cache_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        cache_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void cache_lru_push(cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_lru_head;
+    if (cache_lru_head)
+    {
+        cache_lru_head->lru_prev = entry;
+    }
+    cache_lru_head = entry;
+    if (!cache_lru_tail)
+    {
+        cache_lru_tail = entry;
+    }
+    entry->last_access = (uint32_t)osGetSystemTime();
+}
+
+static void cache_lru_append(cache_entry_t *entry)
+{
+    entry->lru_next = NULL;
+    entry->lru_prev = cache_lru_tail;
+    if (cache_lru_tail)
+    {
+        cache_lru_tail->lru_next = entry;
+    }
+    cache_lru_tail = entry;
+    if (!cache_lru_head)
+    {
+        cache_lru_head = entry;
+    }
+}
+
+/* must be called with MUTEX_CACHE held, keeps the LRU list and the counters in sync with the exists flag */
+static void cache_set_exists(cache_entry_t *entry, bool exists)
+{
+    if (entry->exists)
+    {
+        cache_lru_unlink(entry);
+        cache_files--;
+        cache_bytes -= entry->size;
+        entry->size = 0;
+    }
+    entry->exists = exists;
+    if (exists)
+    {
+        uint32_t size = 0;
+        fsGetFileSize(entry->file_path, &size);
+        entry->size = size;
+        cache_lru_push(entry);
+        cache_files++;
+        cache_bytes += entry->size;
+    }
+}
 
 uint32_t cache_flush()
 {
     uint32_t deleted = 0;
-    cache_entry_t *pos = &cache_table;
 
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *pos = cache_head;
     while (pos != NULL)
     {
         if (pos->exists)
@@ -31,20 +260,16 @@ uint32_t cache_flush()
             }
 
             // Set the exists flag to false
-            pos->exists = false;
+            cache_set_exists(pos, false);
         }
 
         pos = pos->next;
     }
+    mutex_unlock(MUTEX_CACHE);
 
     return deleted;
 }
 
-/**
- * @brief Gathers statistics about the current cache.
- *
- * @param stats Pointer to a structure where the statistics will be stored.
- */
 void cache_stats(cache_stats_t *stats)
 {
     if (stats == NULL)
@@ -52,112 +277,246 @@ void cache_stats(cache_stats_t *stats)
         return;
     }
 
-    cache_entry_t *pos = &cache_table;
     memset(stats, 0, sizeof(cache_stats_t)); // Initialize all stats to zero
 
-    while (pos != NULL)
+    mutex_lock(MUTEX_CACHE);
+    if (cache_arena)
     {
-        stats->total_entries++;
-        stats->memory_used += sizeof(*pos); // Add size of the cache entry structure
+        /* entries and their strings are in the arena */
+        stats->memory_used = mem_arena_size(cache_arena) + 2 * cache_buckets * sizeof(cache_entry_t *);
+    }
 
-        if (pos->original_url)
-        {
-            stats->memory_used += strlen(pos->original_url) + 1; // Add length of original_url string
-        }
-        if (pos->cached_url)
-        {
-            stats->memory_used += strlen(pos->cached_url) + 1; // Add length of cached_url string
-        }
-        if (pos->file_path)
-        {
-            stats->memory_used += strlen(pos->file_path) + 1; // Add length of file_path string
-        }
-        if (pos->exists)
-        {
-            stats->exists_entries++;
-        }
-        if (fsFileExists(pos->file_path))
+    stats->total_entries = cache_entries;
+    stats->exists_entries = cache_files;
+    stats->total_files = cache_files;
+    stats->total_size = cache_bytes;
+    stats->evicted_files = cache_evicted;
+    stats->prefetch_pending = cache_prefetch_pending;
+    stats->prefetch_done = cache_prefetch_done;
+    stats->prefetch_failed = cache_prefetch_failed;
+    mutex_unlock(MUTEX_CACHE);
+
+    stats->max_size = (size_t)get_settings()->core.cachedir_max_mb * 1024 * 1024;
+}
+
+void cache_loop()
+{
+    systime_t now = osGetSystemTime();
+    if (now - cache_sweep_last < CACHE_SWEEP_INTERVAL_MS)
+    {
+        return;
+    }
+    cache_sweep_last = now;
+
+    size_t max_size = (size_t)get_settings()->core.cachedir_max_mb * 1024 * 1024;
+    if (max_size == 0)
+    {
+        return;
+    }
+
+    /* evict in small batches, the next sweep continues if still above the limit */
+    size_t evicted = 0;
+    mutex_lock(MUTEX_CACHE);
+    while (cache_bytes > max_size && cache_lru_tail && evicted < CACHE_SWEEP_BATCH)
+    {
+        cache_entry_t *entry = cache_lru_tail;
+        if (fsDeleteFile(entry->file_path) != NO_ERROR && fsFileExists(entry->file_path))
         {
-            stats->total_files++;
-            uint32_t size = 0;
-            fsGetFileSize(pos->file_path, &size);
-            stats->total_size += size;
+            TRACE_WARNING("Failed to evict cached file: %s\r\n", entry->file_path);
+            /* keep it accounted, but try the others first next time */
+            cache_lru_unlink(entry);
+            cache_lru_push(entry);
+            break;
         }
-        pos = pos->next;
+        cache_set_exists(entry, false);
+        evicted++;
+    }
+    cache_evicted += evicted;
+    size_t remaining = cache_bytes;
+    mutex_unlock(MUTEX_CACHE);
+
+    if (evicted > 0)
+    {
+        TRACE_INFO("Evicted %zu cached files, %zu KB of %zu KB used\r\n", evicted, remaining / 1024, max_size / 1024);
     }
 }
 
-void cache_entry_add(cache_entry_t *entry)
+/* must be called with MUTEX_CACHE held, url is NULL for files found by cache_scan() that no URL claimed yet */
+static cache_entry_t *cache_insert_entry(const char *url, uint32_t url_hash, const uint8_t *sha256, const char *name)
 {
-    if (!entry)
+    const char *cachePath = get_settings()->internal.cachedirfull;
+
+    if (!cache_arena)
     {
-        TRACE_ERROR("entry is NULL\r\n");
-        return;
+        cache_arena = mem_arena_create();
+    }
+    if ((cache_entries + 1 > cache_buckets && !cache_table_grow()) || !cache_arena)
+    {
+        TRACE_ERROR("Could not allocate the cache table\r\n");
+        return NULL;
     }
 
-    cache_entry_t *pos = &cache_table;
+    char *file_path = custom_asprintf("%s%c%s", cachePath, PATH_SEPARATOR, name);
+    char *cached_url = custom_asprintf("/cache/%s", name);
 
-    if (!pos)
+    cache_entry_t *entry = mem_arena_alloc(cache_arena, sizeof(cache_entry_t));
+    if (entry)
     {
-        TRACE_ERROR("cache_table is NULL\r\n");
-        return;
+        osMemset(entry, 0, sizeof(cache_entry_t));
+        entry->hash = cache_hash_prefix(sha256);
+        entry->url_hash = url_hash;
+        osMemcpy(entry->sha256, sha256, SHA256_DIGEST_SIZE);
+        entry->original_url = url ? mem_arena_strdup(cache_arena, url) : NULL;
+        entry->file_path = mem_arena_strdup(cache_arena, file_path);
+        entry->cached_url = mem_arena_strdup(cache_arena, cached_url);
+    }
+    osFreeMem(file_path);
+    osFreeMem(cached_url);
+
+    if (!entry || (url && !entry->original_url) || !entry->file_path || !entry->cached_url)
+    {
+        TRACE_ERROR("Could not allocate cache entry for %s\r\n", url ? url : name);
+        return NULL;
+    }
+    if (fsFileExists(entry->file_path))
+    {
+        cache_set_exists(entry, true);
     }
 
-    TRACE_DEBUG("Starting to add cache entry with the following details:\r\n");
-    TRACE_DEBUG("  Hash: %08X\r\n", entry->hash);
-    TRACE_DEBUG("  Original URL: %s\r\n", entry->original_url ? entry->original_url : "NULL");
-    TRACE_DEBUG("  Cached URL: %s\r\n", entry->cached_url ? entry->cached_url : "NULL");
-    TRACE_DEBUG("  File Path: %s\r\n", entry->file_path ? entry->file_path : "NULL");
+    TRACE_DEBUG("Adding cache entry with hash %08X for %s as %s\r\n", entry->hash, url ? url : "(unknown)", entry->cached_url);
+
+    if (cache_tail)
+    {
+        cache_tail->next = entry;
+    }
+    else
+    {
+        cache_head = entry;
+    }
+    cache_tail = entry;
 
-    while (pos)
+    uint32_t bucket = entry->hash & (cache_buckets - 1);
+    entry->next_by_hash = cache_by_hash[bucket];
+    cache_by_hash[bucket] = entry;
+    if (url)
     {
-        cache_entry_t *next = pos->next;
+        bucket = entry->url_hash & (cache_buckets - 1);
+        entry->next_by_url = cache_by_url[bucket];
+        cache_by_url[bucket] = entry;
+    }
+    cache_entries++;
 
-        if (!next)
+    return entry;
+}
+
+/* returns the entry for the URL, which is the existing one if the URL was already added */
+static cache_entry_t *cache_create_entry(const char *url, const uint8_t *sha256, const char *name)
+{
+    uint32_t url_hash = cache_url_hash(url);
+
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *entry = cache_lookup_url(url, url_hash);
+    if (entry)
+    {
+        TRACE_DEBUG("Already added: %s\r\n", url);
+        mutex_unlock(MUTEX_CACHE);
+        return entry;
+    }
+
+    /* a file found by cache_scan() is already accounted, it only learns its URL */
+    entry = cache_lookup_name(sha256, name);
+    if (entry && entry->original_url == NULL)
+    {
+        entry->original_url = mem_arena_strdup(cache_arena, url);
+        if (entry->original_url)
         {
-            TRACE_DEBUG("End of list reached, adding entry with hash: %08X at the end\r\n", entry->hash);
-            pos->next = entry;
-            entry->next = NULL;
-            return;
+            entry->url_hash = url_hash;
+            uint32_t bucket = url_hash & (cache_buckets - 1);
+            entry->next_by_url = cache_by_url[bucket];
+            cache_by_url[bucket] = entry;
         }
+        mutex_unlock(MUTEX_CACHE);
+        return entry->original_url ? entry : NULL;
+    }
+
+    entry = cache_insert_entry(url, url_hash, sha256, name);
+    mutex_unlock(MUTEX_CACHE);
+
+    return entry;
+}
+
+/* accounts the files already in the cache directory that no URL was added for yet, e.g. pictures of removed tonies */
+static void cache_scan()
+{
+    const char *cachePath = get_settings()->internal.cachedirfull;
+    FsDir *dir = cachePath ? fsOpenDir(cachePath) : NULL;
+    if (dir == NULL)
+    {
+        return;
+    }
 
-        if (entry->hash < next->hash)
+    size_t found = 0;
+    size_t foundBytes = 0;
+    FsDirEntry dirEntry;
+    while (fsReadDir(dir, &dirEntry) == NO_ERROR)
+    {
+        uint8_t sha256[SHA256_DIGEST_SIZE];
+        if ((dirEntry.attributes & FS_FILE_ATTR_DIRECTORY) || osStrlen(dirEntry.name) < 2 * SHA256_DIGEST_SIZE + 1 || !cache_parse_name(dirEntry.name, sha256))
         {
-            TRACE_DEBUG("Inserting entry with hash: %08X before entry with hash: %08X\r\n", entry->hash, next->hash);
-            pos->next = entry;
-            entry->next = next;
-            return;
+            continue;
         }
 
-        if (entry->hash == next->hash)
+        mutex_lock(MUTEX_CACHE);
+        if (cache_lookup_name(sha256, dirEntry.name) == NULL)
         {
-            if (!osStrcmp(entry->original_url, next->original_url))
+            cache_entry_t *entry = cache_insert_entry(NULL, 0, sha256, dirEntry.name);
+            if (entry && entry->exists)
             {
-                TRACE_DEBUG("Already added: %08X\r\n", entry->hash);
-                return;
+                /* unused since the last run, so these go first when the cache is above its limit */
+                cache_lru_unlink(entry);
+                cache_lru_append(entry);
+                found++;
+                foundBytes += entry->size;
             }
-            TRACE_DEBUG("Inserting (duplicate short hash) entry with hash: %08X before entry with hash: %08X\r\n", entry->hash, next->hash);
-            pos->next = entry;
-            entry->next = next;
-            return;
         }
-
-        pos = next;
+        mutex_unlock(MUTEX_CACHE);
     }
+    fsCloseDir(dir);
 
-    TRACE_DEBUG("Finished adding cache entry with hash: %08X\r\n", entry->hash);
+    if (found > 0)
+    {
+        TRACE_INFO("Found %zu cached files (%zu KB) without a known URL\r\n", found, foundBytes / 1024);
+    }
 }
 
-cache_entry_t *cache_add(const char *url)
+static bool cache_path_valid()
 {
     const char *cachePath = get_settings()->internal.cachedirfull;
 
     if (cachePath == NULL || !fsDirExists(cachePath))
     {
         TRACE_ERROR("core.cachedirfull not set to a valid path: '%s'", cachePath);
+        return false;
+    }
+    return true;
+}
+
+cache_entry_t *cache_add(const char *url)
+{
+    if (!cache_path_valid())
+    {
         return NULL;
     }
 
+    /* skip hashing for URLs that were added already, e.g. on every tonies.json reload */
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *entry = cache_lookup_url(url, cache_url_hash(url));
+    mutex_unlock(MUTEX_CACHE);
+    if (entry)
+    {
+        return entry;
+    }
+
     uint8_t sha256_calc[SHA256_DIGEST_SIZE];
     char sha256_calc_str[2 * SHA256_DIGEST_SIZE + 1];
 
@@ -189,168 +548,345 @@ cache_entry_t *cache_add(const char *url)
         }
     }
 
-    cache_entry_t *entry = osAllocMem(sizeof(cache_entry_t));
-
-    entry->hash = (sha256_calc[0] << 24) | (sha256_calc[1] << 16) | (sha256_calc[2] << 8) | (sha256_calc[3] << 0);
-    entry->original_url = strdup(url);
-    entry->file_path = custom_asprintf("%s%c%s.%s", cachePath, PATH_SEPARATOR, sha256_calc_str, extension);
-    entry->cached_url = custom_asprintf("/cache/%s.%s", sha256_calc_str, extension);
-    entry->exists = fsFileExists(entry->file_path);
-
-    cache_entry_add(entry);
+    char *name = custom_asprintf("%s.%s", sha256_calc_str, extension);
+    entry = cache_create_entry(url, sha256_calc, name);
 
+    osFreeMem(name);
     osFreeMem(extension);
 
     return entry;
 }
 
-bool cache_fetch_entry(cache_entry_t *entry)
+cache_entry_t *cache_add_cached(const char *url, const char *cached_url)
 {
-    if (entry->exists && fsFileExists(entry->file_path))
+    if (!cache_path_valid())
     {
-        return true;
+        return NULL;
     }
 
-    error_t err = web_download(entry->original_url, entry->file_path, &entry->statusCode);
-    entry->exists = (err == NO_ERROR);
+    /* the name is the hex SHA-256 of the URL plus the extension, as generated by cache_add() */
+    if (osStrncmp(cached_url, "/cache/", 7) != 0)
+    {
+        TRACE_ERROR("Not a cached URL: %s\r\n", cached_url);
+        return NULL;
+    }
+    const char *name = &cached_url[7];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    if (osStrlen(name) < 2 * SHA256_DIGEST_SIZE + 1 || !cache_parse_name(name, sha256) || osStrchr(name, '/') || osStrchr(name, PATH_SEPARATOR))
+    {
+        TRACE_ERROR("Invalid cached URL: %s\r\n", cached_url);
+        return NULL;
+    }
 
-    return entry->exists;
+    return cache_create_entry(url, sha256, name);
 }
 
-cache_entry_t *cache_fetch_by_url(const char *url)
+bool cache_fetch_entry(cache_entry_t *entry)
 {
-    if (url == NULL)
+    if (entry->exists && fsFileExists(entry->file_path))
     {
-        TRACE_ERROR("URL is NULL\r\n");
-        return NULL;
+        mutex_lock(MUTEX_CACHE);
+        if (entry->exists)
+        {
+            cache_lru_unlink(entry);
+            cache_lru_push(entry);
+        }
+        mutex_unlock(MUTEX_CACHE);
+        return true;
+    }
+    if (entry->original_url == NULL)
+    {
+        /* found by cache_scan() and deleted since, there is nothing to download it from */
+        return false;
     }
 
-    cache_entry_t *pos = &cache_table;
-
-    while (pos != NULL)
+    mutex_lock(MUTEX_CACHE);
+    if (entry->fetching)
     {
-        if (pos->original_url && osStrcmp(pos->original_url, url) == 0)
+        /* single flight, wait for the running download instead of starting another one */
+        systime_t start = osGetSystemTime();
+        while (entry->fetching && osGetSystemTime() - start < CACHE_FETCH_WAIT_MS)
         {
-            TRACE_DEBUG("Cache entry found for URL: %s\r\n", url);
-            cache_fetch_entry(pos);
-            return pos;
+            mutex_unlock(MUTEX_CACHE);
+            osDelayTask(50);
+            mutex_lock(MUTEX_CACHE);
         }
+        bool exists = entry->exists;
+        mutex_unlock(MUTEX_CACHE);
+        return exists;
+    }
+    if (entry->failures > 0 && (int32_t)(entry->retry_at - (uint32_t)osGetSystemTime()) > 0)
+    {
+        mutex_unlock(MUTEX_CACHE);
+        TRACE_DEBUG("Download of '%s' failed recently, not retrying yet\r\n", entry->original_url);
+        return false;
+    }
+    entry->fetching = true;
+    mutex_unlock(MUTEX_CACHE);
 
-        pos = pos->next;
+    uint32_t statusCode = 0;
+    error_t err = web_download(entry->original_url, entry->file_path, &statusCode);
+
+    mutex_lock(MUTEX_CACHE);
+    entry->statusCode = statusCode;
+    cache_set_exists(entry, err == NO_ERROR);
+    if (entry->exists)
+    {
+        entry->failures = 0;
+    }
+    else
+    {
+        /* exponential backoff, 2s, 4s, 8s, ... */
+        uint32_t backoff = CACHE_FETCH_BACKOFF_MS << MIN(entry->failures, 16);
+        entry->retry_at = (uint32_t)osGetSystemTime() + MIN(backoff, CACHE_FETCH_BACKOFF_MAX_MS);
+        if (entry->failures < UINT8_MAX)
+        {
+            entry->failures++;
+        }
     }
+    entry->fetching = false;
+    bool exists = entry->exists;
+    mutex_unlock(MUTEX_CACHE);
 
-    TRACE_DEBUG("No cache entry found for URL: %s\r\n", url);
-    return NULL;
+    return exists;
 }
 
-cache_entry_t *cache_fetch_by_cached_url(const char *cached_url)
+/* must be called with MUTEX_CACHE held */
+static void cache_prefetch_enqueue(cache_entry_t *entry)
 {
-    if (cached_url == NULL)
+    entry->prefetch_next = NULL;
+    if (cache_prefetch_tail)
     {
-        TRACE_ERROR("cached_url is NULL\r\n");
-        return NULL;
+        cache_prefetch_tail->prefetch_next = entry;
     }
-
-    /* Find the position of "/cache/" in the URL */
-    const char *cache_pos = osStrstr(cached_url, "/cache/");
-    if (!cache_pos)
+    else
     {
-        TRACE_ERROR("'/cache/' not found in cached URL: %s\r\n", cached_url);
-        return NULL;
+        cache_prefetch_head = entry;
     }
+    cache_prefetch_tail = entry;
+}
 
-    cache_pos += osStrlen("/cache/");
+void cache_prefetch(cache_entry_t *entry)
+{
+    if (entry == NULL)
+    {
+        return;
+    }
 
-    if (osStrlen(cache_pos) < 8)
+    mutex_lock(MUTEX_CACHE);
+    bool queue = !entry->queued && !entry->exists;
+    if (queue)
     {
-        TRACE_ERROR("Cached URL hash is too short in URL: %s\r\n", cached_url);
-        return NULL;
+        entry->queued = true;
+        cache_prefetch_pending++;
+        cache_prefetch_enqueue(entry);
     }
+    mutex_unlock(MUTEX_CACHE);
 
-    /* Extract the first 8 characters of the hash from the URL */
-    char hash_str[9] = {0};
-    osStrncpy(hash_str, cache_pos, 8);
+    if (queue && cache_prefetch_started)
+    {
+        osSetEvent(&cache_prefetch_event);
+    }
+}
 
-    /* Convert the extracted hash part to a uint32_t */
-    uint32_t hash_from_url = (uint32_t)osStrtoul(hash_str, NULL, 16);
+/* takes the next queued entry, or a failed one whose retry time has come */
+static cache_entry_t *cache_prefetch_pop()
+{
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *entry = cache_prefetch_head;
+    if (entry)
+    {
+        cache_prefetch_head = entry->prefetch_next;
+        if (!cache_prefetch_head)
+        {
+            cache_prefetch_tail = NULL;
+        }
+    }
+    else
+    {
+        uint32_t now = (uint32_t)osGetSystemTime();
+        for (cache_entry_t **pos = &cache_prefetch_retry; *pos; pos = &(*pos)->prefetch_next)
+        {
+            if ((int32_t)((*pos)->retry_at - now) <= 0)
+            {
+                entry = *pos;
+                *pos = entry->prefetch_next;
+                break;
+            }
+        }
+    }
+    if (entry)
+    {
+        entry->prefetch_next = NULL;
+    }
+    mutex_unlock(MUTEX_CACHE);
+    return entry;
+}
 
-    cache_entry_t *pos = &cache_table;
+static bool cache_prefetch_transient(uint32_t statusCode)
+{
+    /* no response at all, rate limiting or server errors */
+    return statusCode == 0 || statusCode == 429 || statusCode >= 500;
+}
 
-    while (pos != NULL)
+static void cache_prefetch_task(void *param)
+{
+    while (!settings_get_bool("internal.exit"))
     {
-        if (pos->hash == hash_from_url)
+        cache_entry_t *entry = cache_prefetch_pop();
+        if (entry == NULL)
         {
-            TRACE_INFO("Hash match found for hash: %08X. Checking full cached URL...\r\n", hash_from_url);
-
-            /* Compare the full cached URL */
-            if (strcmp(pos->cached_url, cached_url) == 0)
+            mutex_lock(MUTEX_CACHE);
+            size_t finished = cache_prefetch_done + cache_prefetch_failed;
+            bool report = (cache_prefetch_pending == 0 && cache_prefetch_reported != finished);
+            cache_prefetch_reported = finished;
+            size_t done = cache_prefetch_done;
+            size_t failed = cache_prefetch_failed;
+            mutex_unlock(MUTEX_CACHE);
+            if (report)
             {
-                TRACE_INFO("Full cached URL match found for URL: %s\r\n", cached_url);
-                cache_fetch_entry(pos);
-                return pos;
+                TRACE_INFO("Image prefetch finished, %zu downloaded, %zu failed\r\n", done, failed);
             }
+            osWaitForEvent(&cache_prefetch_event, 1000);
+            continue;
         }
 
-        pos = pos->next;
+        bool success = cache_fetch_entry(entry);
+
+        mutex_lock(MUTEX_CACHE);
+        if (!success && entry->failures > 0 && entry->failures <= CACHE_FETCH_RETRIES && cache_prefetch_transient(entry->statusCode))
+        {
+            TRACE_DEBUG("Prefetch of '%s' failed with %" PRIu32 ", retry %u\r\n", entry->original_url, entry->statusCode, entry->failures);
+            entry->prefetch_next = cache_prefetch_retry;
+            cache_prefetch_retry = entry;
+        }
+        else
+        {
+            if (success)
+            {
+                cache_prefetch_done++;
+            }
+            else
+            {
+                TRACE_WARNING("Prefetch of '%s' failed with %" PRIu32 "\r\n", entry->original_url, entry->statusCode);
+                cache_prefetch_failed++;
+            }
+            entry->queued = false;
+            cache_prefetch_pending--;
+            if ((cache_prefetch_done + cache_prefetch_failed) % 100 == 0)
+            {
+                TRACE_INFO("Image prefetch: %zu downloaded, %zu failed, %zu pending\r\n", cache_prefetch_done, cache_prefetch_failed, cache_prefetch_pending);
+            }
+        }
+        mutex_unlock(MUTEX_CACHE);
     }
+    osDeleteTask(OS_SELF_TASK_ID);
+}
 
-    TRACE_INFO("No cache entry found for hash: %08X in cached URL: %s\r\n", hash_from_url, cached_url);
-    return NULL;
+void cache_init()
+{
+    if (cache_prefetch_started)
+    {
+        return;
+    }
+    cache_scan();
+    osCreateEvent(&cache_prefetch_event);
+    for (size_t i = 0; i < CACHE_PREFETCH_WORKERS; i++)
+    {
+        osCreateTask("CachePrefetch", &cache_prefetch_task, NULL, 16 * 1024, 0);
+    }
+    cache_prefetch_started = true;
+    osSetEvent(&cache_prefetch_event);
 }
 
-cache_entry_t *cache_fetch_by_path(const char *path)
+cache_entry_t *cache_fetch_by_url(const char *url)
 {
-    if (path == NULL)
+    if (url == NULL)
     {
-        TRACE_ERROR("URI is NULL\r\n");
+        TRACE_ERROR("URL is NULL\r\n");
         return NULL;
     }
 
-    // Find the position of "/cache/" in the URI
-    const char *cache_pos = strstr(path, "/cache/");
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *entry = cache_lookup_url(url, cache_url_hash(url));
+    mutex_unlock(MUTEX_CACHE);
+
+    if (entry == NULL)
+    {
+        TRACE_DEBUG("No cache entry found for URL: %s\r\n", url);
+        return NULL;
+    }
+
+    TRACE_DEBUG("Cache entry found for URL: %s\r\n", url);
+    cache_fetch_entry(entry);
+    return entry;
+}
+
+/* looks up the cache entry of the '[hash].[ext]' name following '/cache/' in the given string */
+static cache_entry_t *cache_find_by_name(const char *str)
+{
+    /* Find the position of "/cache/" in the URL */
+    const char *cache_pos = osStrstr(str, "/cache/");
     if (!cache_pos)
     {
-        TRACE_ERROR("'/cache/' not found in URI: %s\r\n", path);
+        TRACE_ERROR("'/cache/' not found in: %s\r\n", str);
         return NULL;
     }
 
-    // Move the pointer to the start of the hash part
     cache_pos += osStrlen("/cache/");
 
-    // Ensure that the hash part exists and has enough characters
-    if (osStrlen(cache_pos) < 8) // 4 bytes of hash = 8 hex characters
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    if (osStrlen(cache_pos) < 2 * SHA256_DIGEST_SIZE + 1 || !cache_parse_name(cache_pos, sha256))
     {
-        TRACE_ERROR("URI hash is too short in URI: %s\r\n", path);
+        TRACE_ERROR("No valid hash in: %s\r\n", str);
         return NULL;
     }
 
-    // Extract the first 8 characters of the hash from the URI
-    char hash_str[9] = {0}; // 8 characters + 1 for null terminator
-    osStrncpy(hash_str, cache_pos, 8);
+    mutex_lock(MUTEX_CACHE);
+    cache_entry_t *entry = cache_lookup_name(sha256, cache_pos);
+    mutex_unlock(MUTEX_CACHE);
 
-    // Convert the extracted hash part to a uint32_t
-    uint32_t hash_from_uri = (uint32_t)osStrtoul(hash_str, NULL, 16);
+    return entry;
+}
+
+cache_entry_t *cache_fetch_by_cached_url(const char *cached_url)
+{
+    if (cached_url == NULL)
+    {
+        TRACE_ERROR("cached_url is NULL\r\n");
+        return NULL;
+    }
 
-    cache_entry_t *pos = &cache_table;
+    cache_entry_t *entry = cache_find_by_name(cached_url);
 
-    while (pos != NULL)
+    /* Compare the full cached URL */
+    if (entry == NULL || osStrcmp(entry->cached_url, cached_url) != 0)
     {
-        if (pos->hash == hash_from_uri)
-        {
-            TRACE_DEBUG("Hash match found for hash: %08X. Checking full URI...\r\n", hash_from_uri);
+        TRACE_INFO("No cache entry found for cached URL: %s\r\n", cached_url);
+        return NULL;
+    }
 
-            // Compare the path "/cache/[hash].[ext]" in the URI
-            if (osStrstr(pos->cached_url, cache_pos) != NULL)
-            {
-                TRACE_DEBUG("Full URI match found for URI: %s\r\n", path);
-                cache_fetch_entry(pos);
-                return pos;
-            }
-        }
+    TRACE_DEBUG("Cache entry found for cached URL: %s\r\n", cached_url);
+    cache_fetch_entry(entry);
+    return entry;
+}
 
-        pos = pos->next;
+cache_entry_t *cache_fetch_by_path(const char *path)
+{
+    if (path == NULL)
+    {
+        TRACE_ERROR("URI is NULL\r\n");
+        return NULL;
     }
 
-    TRACE_ERROR("No cache entry found for URI: %s\r\n", path);
-    return NULL;
-}
\ No newline at end of file
+    cache_entry_t *entry = cache_find_by_name(path);
+    if (entry == NULL)
+    {
+        TRACE_ERROR("No cache entry found for URI: %s\r\n", path);
+        return NULL;
+    }
+
+    TRACE_DEBUG("Cache entry found for URI: %s\r\n", path);
+    cache_fetch_entry(entry);
+    return entry;
+}
@@ -308,6 +308,11 @@ error_t web_request(const char *server, int port, bool https, const char *uri, c
                 httpClientAddHeaderField(&httpClientContext, "User-Agent", cbr_ctx->user_agent);
             }
 
+            if (cbr && cbr->request)
+            {
+                cbr->request(cbr->ctx, &httpClientContext);
+            }
+
             // Send HTTP request header
             error = httpClientWriteHeader(&httpClientContext);
             // Any error to report?
@@ -8,6 +8,7 @@
 #include "toniesJson.h"
 #include "handler.h"
 #include "json_helper.h"
+#include "mutex_manager.h"
 
 error_t load_content_json(const char *content_path, contentJson_t *content_json, bool create_if_missing, settings_t *settings)
 {
@@ -96,7 +97,7 @@ error_t load_content_json(const char *content_path, contentJson_t *content_json,
                 if (osStrlen(content_json->source) > 0)
                 {
                     resolveSpecialPathPrefix(&content_json->_source_resolved, settings);
-                    if (isValidTaf(content_json->_source_resolved, settings->core.full_taf_validation))
+                    if (isValidTafCached(content_json->_source_resolved, settings->core.full_taf_validation))
                     {
                         content_json->_source_type = CT_SOURCE_TAF;
                     }
@@ -200,6 +201,8 @@ error_t save_content_json(const char *json_path, contentJson_t *content_json)
 
     char *jsonRaw = cJSON_Print(contentJson);
 
+    /* a TAF and its json can be resolved by different index workers, which both save the same json through the same .tmp file */
+    mutex_lock(MUTEX_CONTENT_JSON);
     FsFile *file = fsOpenFile(jsonPathTmp, FS_FILE_MODE_WRITE);
     if (file != NULL)
     {
@@ -215,6 +218,7 @@ error_t save_content_json(const char *json_path, contentJson_t *content_json)
     {
         error = fsMoveFile(jsonPathTmp, json_path, true);
     }
+    mutex_unlock(MUTEX_CONTENT_JSON);
 
     if (error == NO_ERROR)
     {
@@ -232,10 +236,10 @@ void content_json_update_model(contentJson_t *content_json, uint32_t audio_id, u
 {
     if (content_json->_valid)
     {
-        toniesJson_item_t *toniesJson = tonies_byAudioIdHash(audio_id, hash);
-        if (toniesJson != NULL)
+        char *model = tonies_modelByAudioIdHash(audio_id, hash);
+        if (model != NULL)
         {
-            if (osStrcmp(content_json->tonie_model, toniesJson->model) != 0)
+            if (osStrcmp(content_json->tonie_model, model) != 0)
             {
                 if (audio_id == SPECIAL_AUDIO_ID_ONE && hash == NULL)
                 { // don't update special tonies without hash
@@ -243,10 +247,12 @@ void content_json_update_model(contentJson_t *content_json, uint32_t audio_id, u
                 else
                 {
                     osFreeMem(content_json->tonie_model);
-                    content_json->tonie_model = strdup(toniesJson->model);
+                    content_json->tonie_model = model;
                     content_json->_updated = true;
+                    model = NULL;
                 }
             }
+            osFreeMem(model);
         }
         else
         {
@@ -0,0 +1,267 @@
+#include "content_cache.h"
+#include "os_port.h"
+#include "debug.h"
+#include "settings.h"
+#include "stats.h"
+#include "mutex_manager.h"
+
+static content_cache_segment_t *content_cache_table[CONTENT_CACHE_BUCKETS];
+static content_cache_segment_t *content_cache_lru_head = NULL;
+static content_cache_segment_t *content_cache_lru_tail = NULL;
+static size_t content_cache_bytes = 0;
+
+static uint32_t content_cache_hash(const taf_index_key_t *key, uint32_t index)
+{
+    uint64_t hash = key->device * 31 + key->inode;
+    hash = hash * 31 + key->mtime;
+    hash = hash * 31 + index;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool content_cache_matches(const content_cache_segment_t *segment, const taf_index_key_t *key, uint32_t index)
+{
+    return segment->index == index && segment->key.device == key->device && segment->key.inode == key->inode &&
+           segment->key.size == key->size && segment->key.mtime == key->mtime;
+}
+
+static void content_cache_lru_unlink(content_cache_segment_t *segment)
+{
+    if (segment->lru_prev)
+    {
+        segment->lru_prev->lru_next = segment->lru_next;
+    }
+    else
+    {
+        content_cache_lru_head = segment->lru_next;
+    }
+    if (segment->lru_next)
+    {
+        segment->lru_next->lru_prev = segment->lru_prev;
+    }
+    else
+    {
+        content_cache_lru_tail = segment->lru_prev;
+    }
+    segment->lru_prev = NULL;
+    segment->lru_next = NULL;
+}
+
+static void content_cache_lru_push(content_cache_segment_t *segment)
+{
+    segment->lru_prev = NULL;
+    segment->lru_next = content_cache_lru_head;
+    if (content_cache_lru_head)
+    {
+        content_cache_lru_head->lru_prev = segment;
+    }
+    content_cache_lru_head = segment;
+    if (!content_cache_lru_tail)
+    {
+        content_cache_lru_tail = segment;
+    }
+}
+
+static void content_cache_free_segment(content_cache_segment_t *segment)
+{
+    osFreeMem(segment->data);
+    osFreeMem(segment);
+}
+
+/* removes the segment from table and LRU, the memory stays valid until the last reference is gone */
+static void content_cache_detach(content_cache_segment_t *segment)
+{
+    content_cache_segment_t **pos = &content_cache_table[content_cache_hash(&segment->key, segment->index) % CONTENT_CACHE_BUCKETS];
+    while (*pos && *pos != segment)
+    {
+        pos = &(*pos)->next;
+    }
+    if (*pos)
+    {
+        *pos = segment->next;
+    }
+    content_cache_lru_unlink(segment);
+    content_cache_bytes -= segment->length;
+    stats_update("content_cache_bytes", -(int)segment->length);
+
+    if (segment->refs == 0)
+    {
+        content_cache_free_segment(segment);
+    }
+    else
+    {
+        segment->detached = true;
+    }
+}
+
+static void content_cache_evict(size_t budget)
+{
+    while (content_cache_bytes > budget && content_cache_lru_tail)
+    {
+        content_cache_detach(content_cache_lru_tail);
+    }
+}
+
+static size_t content_cache_budget()
+{
+    return (size_t)get_settings()->core.content_cache_mb * 1024 * 1024;
+}
+
+void content_cache_init()
+{
+    mutex_lock(MUTEX_CONTENT_CACHE);
+    osMemset(content_cache_table, 0, sizeof(content_cache_table));
+    content_cache_lru_head = NULL;
+    content_cache_lru_tail = NULL;
+    content_cache_bytes = 0;
+    mutex_unlock(MUTEX_CONTENT_CACHE);
+}
+
+void content_cache_deinit()
+{
+    mutex_lock(MUTEX_CONTENT_CACHE);
+    content_cache_evict(0);
+    mutex_unlock(MUTEX_CONTENT_CACHE);
+}
+
+bool content_cache_enabled()
+{
+    return get_settings()->core.content_cache_mb > 0;
+}
+
+content_cache_segment_t *content_cache_get(const taf_index_key_t *key, FsFile *file, uint32_t index)
+{
+    uint32_t bucket = content_cache_hash(key, index) % CONTENT_CACHE_BUCKETS;
+
+    mutex_lock(MUTEX_CONTENT_CACHE);
+    for (content_cache_segment_t *segment = content_cache_table[bucket]; segment; segment = segment->next)
+    {
+        if (content_cache_matches(segment, key, index))
+        {
+            segment->refs++;
+            content_cache_lru_unlink(segment);
+            content_cache_lru_push(segment);
+            mutex_unlock(MUTEX_CONTENT_CACHE);
+            stats_update("content_cache_hits", 1);
+            return segment;
+        }
+    }
+    mutex_unlock(MUTEX_CONTENT_CACHE);
+    stats_update("content_cache_misses", 1);
+
+    /* read outside of the lock, concurrent misses on the same segment are resolved on insert */
+    size_t offset = (size_t)index * CONTENT_CACHE_SEGMENT_SIZE;
+    if (offset >= key->size)
+    {
+        return NULL;
+    }
+    size_t length = MIN(CONTENT_CACHE_SEGMENT_SIZE, key->size - offset);
+    content_cache_segment_t *created = osAllocMem(sizeof(content_cache_segment_t));
+    if (created == NULL)
+    {
+        return NULL;
+    }
+    osMemset(created, 0, sizeof(content_cache_segment_t));
+    created->data = osAllocMem(length);
+    if (created->data == NULL)
+    {
+        osFreeMem(created);
+        return NULL;
+    }
+    created->key = *key;
+    created->index = index;
+    created->refs = 1;
+
+    error_t error = fsSeekFile(file, offset, FS_SEEK_SET);
+    while (error == NO_ERROR && created->length < length)
+    {
+        size_t read = 0;
+        error = fsReadFile(file, &created->data[created->length], length - created->length, &read);
+        created->length += read;
+    }
+    if (created->length < length)
+    {
+        TRACE_WARNING("Could not read content segment %" PRIu32 ", error=%s\r\n", index, error2text(error));
+        content_cache_free_segment(created);
+        return NULL;
+    }
+
+    mutex_lock(MUTEX_CONTENT_CACHE);
+    for (content_cache_segment_t *segment = content_cache_table[bucket]; segment; segment = segment->next)
+    {
+        if (content_cache_matches(segment, key, index))
+        {
+            segment->refs++;
+            mutex_unlock(MUTEX_CONTENT_CACHE);
+            content_cache_free_segment(created);
+            return segment;
+        }
+    }
+    size_t budget = content_cache_budget();
+    if (length <= budget)
+    {
+        content_cache_evict(budget - length);
+        created->next = content_cache_table[bucket];
+        content_cache_table[bucket] = created;
+        content_cache_lru_push(created);
+        content_cache_bytes += length;
+        stats_update("content_cache_bytes", (int)length);
+    }
+    else
+    {
+        /* cache got disabled meanwhile, hand out a private copy */
+        created->detached = true;
+    }
+    mutex_unlock(MUTEX_CONTENT_CACHE);
+
+    return created;
+}
+
+void content_cache_release(content_cache_segment_t *segment)
+{
+    if (segment == NULL)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_CACHE);
+    segment->refs--;
+    bool release = segment->detached && segment->refs == 0;
+    mutex_unlock(MUTEX_CONTENT_CACHE);
+
+    if (release)
+    {
+        content_cache_free_segment(segment);
+    }
+}
+
+error_t content_cache_send(HttpConnection *connection, const taf_index_key_t *key, FsFile *file, size_t offset, size_t length)
+{
+    if (!content_cache_enabled() || key->size == 0)
+    {
+        return ERROR_NOT_IMPLEMENTED;
+    }
+
+    error_t error = NO_ERROR;
+    length = MIN(length, connection->response.byteCount);
+    while (length > 0 && offset < key->size)
+    {
+        content_cache_segment_t *segment = content_cache_get(key, file, offset / CONTENT_CACHE_SEGMENT_SIZE);
+        if (segment == NULL)
+        {
+            error = ERROR_READ_FAILED;
+            break;
+        }
+        size_t inner = offset % CONTENT_CACHE_SEGMENT_SIZE;
+        size_t n = MIN(length, segment->length - inner);
+
+        error = httpWriteStream(connection, &segment->data[inner], n);
+        content_cache_release(segment);
+        if (error)
+        {
+            break;
+        }
+        offset += n;
+        length -= n;
+    }
+
+    return error;
+}
@@ -51,6 +51,11 @@
 #include "http/ssi.h"
 #include "str.h"
 #include "debug.h"
+#include "platform.h"
+#include "pcaplog.h"
+#include "content_cache.h"
+#include "stream_buffer.h"
+#include "stats.h"
 
 // Check TCP/IP stack configuration
 #if (HTTP_SERVER_SUPPORT == ENABLED)
@@ -872,6 +877,259 @@ error_t httpWriteStream(HttpConnection *connection,
    return error;
 }
 
+/**
+ * @brief Send a region of a file to the client without copying it to user space
+ *
+ * Only plain connections without chunked encoding and pcap logging qualify.
+ * ERROR_NOT_IMPLEMENTED is returned before anything was sent, so the caller
+ * can fall back to httpWriteStream()
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @param[in] file File to send from
+ * @param[in] offset Absolute file offset of the first byte to send
+ * @param[in] length Number of bytes to send
+ * @return Error code
+ **/
+
+#if (HTTP_SERVER_FS_SUPPORT == ENABLED)
+error_t httpWriteStreamFile(HttpConnection *connection, FsFile *file,
+                            size_t offset, size_t length)
+{
+   error_t error = NO_ERROR;
+   size_t n;
+   bool_t sent = FALSE;
+
+#if (HTTP_SERVER_TLS_SUPPORT == ENABLED)
+   if (connection->tlsContext != NULL)
+      return ERROR_NOT_IMPLEMENTED;
+#endif
+   if (connection->response.chunkedEncoding || pcaplog_enabled())
+      return ERROR_NOT_IMPLEMENTED;
+
+   // The length of the body shall not exceed the value
+   // specified in the Content-Length field
+   length = MIN(length, connection->response.byteCount);
+
+   while (length > 0)
+   {
+      n = 0;
+      error = socketSendFile(connection->socket, file, offset, length, &n);
+      if (error == ERROR_NOT_IMPLEMENTED && sent)
+         error = ERROR_WRITE_FAILED;
+      if (error)
+         break;
+
+      sent = TRUE;
+      offset += n;
+      length -= n;
+      connection->response.byteCount -= n;
+   }
+
+   // Return status code
+   return error;
+}
+
+/**
+ * @brief Write a region of a complete file to the client
+ *
+ * Uses sendfile() where possible, then the shared content cache and
+ * finally a buffered copy through the connection buffer
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @param[in] file File to send from
+ * @param[in] key Identity of the file for the content cache
+ * @param[in] offset Absolute file offset of the first byte to send
+ * @param[in] length Number of bytes to send
+ * @return Error code
+ **/
+
+error_t httpWriteFileRegion(HttpConnection *connection, FsFile *file,
+                            const taf_index_key_t *key, size_t offset, size_t length)
+{
+   error_t error;
+   size_t n;
+
+   error = httpWriteStreamFile(connection, file, offset, length);
+   if (error == ERROR_NOT_IMPLEMENTED)
+      error = content_cache_send(connection, key, file, offset, length);
+   if (error != ERROR_NOT_IMPLEMENTED)
+      return error;
+
+   error = fsSeekFile(file, offset, FS_SEEK_SET);
+
+   while (!error && length > 0)
+   {
+      // Limit the number of bytes to read at a time
+      n = MIN(length, HTTP_SERVER_BUFFER_SIZE);
+
+      // Read data from the specified file
+      error = fsReadFile(file, connection->buffer, n, &n);
+      if (error)
+         break;
+
+      // Send data to the client
+      error = httpWriteStream(connection, connection->buffer, n);
+
+      // Decrement the count of remaining bytes to be transferred
+      length -= n;
+   }
+
+   // Return status code
+   return error;
+}
+
+/**
+ * @brief Send a complete file honoring conditional and range requests
+ *
+ * Answers If-None-Match and If-Modified-Since with 304, ignores the Range
+ * field if If-Range does not match the entity tag, answers unsatisfiable
+ * ranges with 416 and sends one range as 206 and several ranges as 206
+ * multipart/byteranges. Entity tags are only compared if
+ * connection->response.etag is set, which httpSendResponseStreamUnsafe()
+ * derives from the file identity unless the caller set one.
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @param[in] file Opened file
+ * @param[in] key Identity of the file for the content cache
+ * @param[in] baseOffset File offset of the first byte of the representation
+ * @param[in] length Length of the representation
+ * @return Error code
+ **/
+
+error_t httpSendFileRanges(HttpConnection *connection, FsFile *file,
+                           const taf_index_key_t *key, size_t baseOffset, size_t length)
+{
+   error_t error;
+   uint_t i;
+   uint_t count = 0;
+   uint64_t first[HTTP_SERVER_MAX_RANGES];
+   uint64_t last[HTTP_SERVER_MAX_RANGES];
+   HttpRangeHeader *range = &connection->request.Range;
+   bool_t useRanges = range->present && !range->invalid;
+   const char_t *etag = connection->response.etag;
+
+   connection->response.chunkedEncoding = FALSE;
+
+   // Cached representation is still current
+   if (httpIsNotModified(connection))
+   {
+      connection->response.statusCode = 304;
+      connection->response.contentType = NULL;
+      connection->response.contentLength = 0;
+      error = httpWriteHeader(connection);
+      if (!error)
+         error = httpCloseStream(connection);
+      return error;
+   }
+
+   // Ranges of a changed representation would corrupt the client's copy
+   if (useRanges && connection->request.ifRange[0] != '\0' &&
+       !httpMatchEntityTag(connection->request.ifRange, etag, TRUE))
+   {
+      TRACE_DEBUG("If-Range %s does not match %s, sending full content\r\n", connection->request.ifRange, etag);
+      useRanges = FALSE;
+   }
+
+   // Resolve the requested ranges against the representation length
+   for (i = 0; useRanges && i < range->count; i++)
+   {
+      const HttpByteRange *spec = &range->spec[i];
+
+      if (spec->first < 0)
+      {
+         if (spec->last == 0 || length == 0)
+            continue;
+         first[count] = (spec->last >= (int64_t)length) ? 0 : length - spec->last;
+         last[count] = length - 1;
+      }
+      else
+      {
+         if ((uint64_t)spec->first >= length)
+            continue;
+         first[count] = spec->first;
+         last[count] = (spec->last < 0 || (uint64_t)spec->last >= length) ? length - 1 : (uint64_t)spec->last;
+      }
+      count++;
+   }
+
+   if (useRanges && count == 0)
+   {
+      TRACE_DEBUG("Range not satisfiable for length %zu\r\n", length);
+      osSnprintf(connection->response.contentRangeBuffer, sizeof(connection->response.contentRangeBuffer),
+                 "bytes */%zu", length);
+      connection->response.contentRange = connection->response.contentRangeBuffer;
+      connection->response.statusCode = 416;
+      connection->response.contentType = NULL;
+      connection->response.contentLength = 0;
+      error = httpWriteHeader(connection);
+      if (!error)
+         error = httpCloseStream(connection);
+      return error;
+   }
+
+   if (count == 1)
+   {
+      osSnprintf(connection->response.contentRangeBuffer, sizeof(connection->response.contentRangeBuffer),
+                 "bytes %" PRIu64 "-%" PRIu64 "/%zu", first[0], last[0], length);
+      connection->response.contentRange = connection->response.contentRangeBuffer;
+      connection->response.statusCode = 206;
+      connection->response.contentLength = last[0] - first[0] + 1;
+      TRACE_DEBUG("Added response range %s\r\n", connection->response.contentRange);
+
+      error = httpWriteHeader(connection);
+      if (!error)
+         error = httpWriteFileRegion(connection, file, key, baseOffset + first[0], connection->response.contentLength);
+   }
+   else if (count > 1)
+   {
+      const char_t *partType = connection->response.contentType;
+      char_t *partHeader = connection->buffer;
+      size_t total = 0;
+
+      // The length of every part header is needed upfront for the Content-Length field
+      for (i = 0; i < count; i++)
+      {
+         total += osSprintf(partHeader, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %" PRIu64 "-%" PRIu64 "/%zu\r\n\r\n",
+                            HTTP_SERVER_BYTERANGES_BOUNDARY, partType ? partType : "application/octet-stream", first[i], last[i], length);
+         total += last[i] - first[i] + 1;
+      }
+      total += osStrlen("\r\n--" HTTP_SERVER_BYTERANGES_BOUNDARY "--\r\n");
+
+      connection->response.statusCode = 206;
+      connection->response.contentType = "multipart/byteranges; boundary=" HTTP_SERVER_BYTERANGES_BOUNDARY;
+      connection->response.contentLength = total;
+
+      error = httpWriteHeader(connection);
+      for (i = 0; !error && i < count; i++)
+      {
+         size_t n = osSprintf(partHeader, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %" PRIu64 "-%" PRIu64 "/%zu\r\n\r\n",
+                              HTTP_SERVER_BYTERANGES_BOUNDARY, partType ? partType : "application/octet-stream", first[i], last[i], length);
+         error = httpWriteStream(connection, partHeader, n);
+         if (!error)
+            error = httpWriteFileRegion(connection, file, key, baseOffset + first[i], last[i] - first[i] + 1);
+      }
+      if (!error)
+         error = httpWriteStream(connection, "\r\n--" HTTP_SERVER_BYTERANGES_BOUNDARY "--\r\n",
+                                 osStrlen("\r\n--" HTTP_SERVER_BYTERANGES_BOUNDARY "--\r\n"));
+   }
+   else
+   {
+      connection->response.statusCode = 200;
+      connection->response.contentLength = length;
+
+      error = httpWriteHeader(connection);
+      if (!error)
+         error = httpWriteFileRegion(connection, file, key, baseOffset, length);
+   }
+
+   if (!error)
+      error = httpCloseStream(connection);
+
+   // Return status code
+   return error;
+}
+#endif
+
 /**
  * @brief Close output stream
  * @param[in] connection Structure representing an HTTP connection
@@ -985,6 +1243,33 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
    // Failed to open the file?
    if (file == NULL)
       return ERROR_NOT_FOUND;
+
+   // Identity of the file for the shared content cache
+   taf_index_key_t contentKey = {0};
+   if (!isStream && taf_index_stat(connection->buffer, &contentKey))
+   {
+      // Validators from the file identity, unless the caller set a content based tag
+      if (connection->response.etag[0] == '\0')
+      {
+         osSnprintf(connection->response.etag, sizeof(connection->response.etag), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "%s%s\"",
+                    contentKey.inode, contentKey.size, contentKey.mtime,
+                    connection->private.client_ctx.skip_taf_header ? "-ogg" : "",
+#if (HTTP_SERVER_GZIP_TYPE_SUPPORT == ENABLED)
+                    connection->response.gzipEncoding ? "-gz" : ""
+#else
+                    ""
+#endif
+         );
+      }
+      if (connection->response.lastModified[0] == '\0')
+         httpFormatDate((time_t)(contentKey.mtime / 1000000000ULL), connection->response.lastModified);
+   }
+
+   // Streams that are being encoded right now are read from memory
+   stream_buffer_t *streamBuffer = NULL;
+   stream_buffer_reader_t streamReader;
+   if (isStream)
+      streamBuffer = stream_buffer_open(connection->buffer);
 #else
    error_t error;
    size_t length;
@@ -1056,8 +1341,27 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
       }
    }
 
+#if (HTTP_SERVER_FS_SUPPORT == ENABLED)
+   // Complete files support conditional, multiple and suffix ranges
+   if (!isStream)
+   {
+      if (connection->response.contentType == NULL || osStrlen(connection->response.contentType) == 0 || osStrcmp(connection->response.contentType, "application/octet-stream") == 0)
+      {
+         connection->response.contentType = mimeGetType(uri);
+      }
+      if (connection->response.contentType == NULL || osStrlen(connection->response.contentType) == 0 || osStrcmp(connection->response.contentType, "application/octet-stream") == 0)
+      {
+         connection->response.contentType = mimeGetType(absolutePath);
+      }
+
+      error = httpSendFileRanges(connection, file, &contentKey,
+                                 connection->private.client_ctx.skip_taf_header ? TONIE_HEADER_LENGTH : 0, length);
+      fsCloseFile(file);
+      return error;
+   }
+#endif
+
    // Format HTTP response header
-   //  TODO add status 416 on invalid ranges
    if (connection->request.Range.start > 0)
    {
       connection->request.Range.size = file_length;
@@ -1099,11 +1403,13 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
 #if (HTTP_SERVER_FS_SUPPORT == ENABLED)
       // Close the file
       fsCloseFile(file);
+      stream_buffer_release(streamBuffer);
 #endif
       // Return status code
       return error;
    }
 
+   uint32_t offset = 0;
    if (connection->private.client_ctx.skip_taf_header)
    {
       if (connection->request.Range.start > 0)
@@ -1112,12 +1418,14 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
       }
       else
       {
+         offset = TONIE_HEADER_LENGTH;
          fsSeekFile(file, TONIE_HEADER_LENGTH, FS_SEEK_SET);
       }
    }
    if (connection->request.Range.start > 0 && connection->request.Range.start < connection->request.Range.size)
    {
       TRACE_DEBUG("Seeking file to %" PRIu32 "\r\n", connection->request.Range.start);
+      offset = connection->request.Range.start;
       fsSeekFile(file, connection->request.Range.start, FS_SEEK_SET);
    }
    else
@@ -1126,16 +1434,45 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
    }
 
 #if (HTTP_SERVER_FS_SUPPORT == ENABLED)
+   if (streamBuffer != NULL && stream_buffer_reader_attach(&streamReader, streamBuffer, offset) != NO_ERROR)
+   {
+      stream_buffer_release(streamBuffer);
+      streamBuffer = NULL;
+   }
+
    // Send response body
    while (length > 0)
    {
       // Limit the number of bytes to read at a time
       n = MIN(length, HTTP_SERVER_BUFFER_SIZE);
 
-      // Read data from the specified file
-      error = fsReadFile(file, connection->buffer, n, &n);
+      if (streamBuffer != NULL)
+      {
+         // The encoder may be shared with other boxes, so stop once this box stopped playback
+         if (!connection->private.client_ctx.state->box.stream_ctx.active)
+         {
+            error = ERROR_END_OF_FILE;
+            break;
+         }
+         // Wait for the encoder to finish the next block
+         error = stream_buffer_read_file(&streamReader, file, (uint8_t *)connection->buffer, n, &n, STREAM_BUFFER_WAIT_MS);
+         if (error == ERROR_TIMEOUT)
+         {
+            error = httpCloseStream(connection);
+            if (error)
+               break;
+            continue;
+         }
+         if (error == ERROR_END_OF_STREAM)
+            error = ERROR_END_OF_FILE;
+      }
+      else
+      {
+         // Read data from the specified file
+         error = fsReadFile(file, connection->buffer, n, &n);
+      }
       // End of input stream?
-      if (isStream && error == ERROR_END_OF_FILE && connection->private.client_ctx.state->box.stream_ctx.active)
+      if (isStream && streamBuffer == NULL && error == ERROR_END_OF_FILE && connection->private.client_ctx.state->box.stream_ctx.active)
       {
          osDelayTask(100);
          error = httpCloseStream(connection); // Test connection??? won't work TODO: exit after some seconds
@@ -1152,12 +1489,25 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
       if (error)
          break;
 
+      // Time to first byte of live streams, counted once the box got data
+      stream_ctx_t *streamCtx = &connection->private.client_ctx.state->box.stream_ctx;
+      if (isStream && streamCtx->ttfb_start != 0)
+      {
+         stats_set("stream_ttfb_ms", (uint32_t)(osGetSystemTime() - streamCtx->ttfb_start));
+         streamCtx->ttfb_start = 0;
+      }
+
       // Decrement the count of remaining bytes to be transferred
       length -= n;
    }
 
    // Close the file
    fsCloseFile(file);
+   if (streamBuffer != NULL)
+   {
+      stream_buffer_reader_detach(&streamReader);
+      stream_buffer_release(streamBuffer);
+   }
 
    // Successful file transfer?
    if (error == NO_ERROR || error == ERROR_END_OF_FILE)
@@ -213,11 +213,37 @@
 
 // HTTP 206 ifRange
 #ifndef HTTP_SERVER_IFRANGE_MAX_LEN
-#define HTTP_SERVER_IFRANGE_MAX_LEN 31
+#define HTTP_SERVER_IFRANGE_MAX_LEN 79
 #elif (HTTP_SERVER_IFRANGE_MAX_LEN < 7)
 #error HTTP_SERVER_IFRANGE_MAX_LEN parameter is not valid
 #endif
 
+//Maximum entity tag length
+#ifndef HTTP_SERVER_ETAG_MAX_LEN
+#define HTTP_SERVER_ETAG_MAX_LEN 79
+#elif (HTTP_SERVER_ETAG_MAX_LEN < 7)
+#error HTTP_SERVER_ETAG_MAX_LEN parameter is not valid
+#endif
+
+//Maximum length of an HTTP date
+#ifndef HTTP_SERVER_DATE_MAX_LEN
+#define HTTP_SERVER_DATE_MAX_LEN 39
+#elif (HTTP_SERVER_DATE_MAX_LEN < 29)
+#error HTTP_SERVER_DATE_MAX_LEN parameter is not valid
+#endif
+
+//Maximum number of byte ranges per request
+#ifndef HTTP_SERVER_MAX_RANGES
+#define HTTP_SERVER_MAX_RANGES 8
+#elif (HTTP_SERVER_MAX_RANGES < 1)
+#error HTTP_SERVER_MAX_RANGES parameter is not valid
+#endif
+
+//Boundary of multipart/byteranges responses
+#ifndef HTTP_SERVER_BYTERANGES_BOUNDARY
+#define HTTP_SERVER_BYTERANGES_BOUNDARY "teddycloud_byteranges_7c1e5a9d3b"
+#endif
+
 //Maximum user name length
 #ifndef HTTP_SERVER_USERNAME_MAX_LEN
    #define HTTP_SERVER_USERNAME_MAX_LEN 31
@@ -472,6 +498,16 @@ typedef struct
 #endif
 } HttpAuthenticateHeader;
 
+/**
+* @brief Single byte range of a Range header
+*
+*/
+typedef struct
+{
+    int64_t first; ///< First byte position, -1 for a suffix range "-N"
+    int64_t last;  ///< Last byte position, -1 if open-ended, suffix length N for a suffix range
+} HttpByteRange;
+
 /**
 * @brief Range header
 *
@@ -481,6 +517,10 @@ typedef struct
     uint32_t start;
     uint32_t end;
     uint32_t size;
+    bool_t present;                       ///< A byte Range header was received
+    bool_t invalid;                       ///< The Range header could not be parsed
+    uint_t count;                         ///< Number of byte ranges
+    HttpByteRange spec[HTTP_SERVER_MAX_RANGES]; ///< Requested byte ranges in request order
 } HttpRangeHeader;
 
 /**
@@ -496,6 +536,8 @@ typedef struct
    char_t host[HTTP_SERVER_HOST_MAX_LEN + 1];                ///<Host name
    char_t userAgent[128 + 1];
    char_t ifRange[HTTP_SERVER_IFRANGE_MAX_LEN + 1];          ///< IfRange tag
+   char_t ifNoneMatch[HTTP_SERVER_ETAG_MAX_LEN + 1];         ///< If-None-Match tag list
+   char_t ifModifiedSince[HTTP_SERVER_DATE_MAX_LEN + 1];     ///< If-Modified-Since date
    HttpRangeHeader Range;                                    ///< Range field
    bool_t keepAlive;
    bool_t chunkedEncoding;
@@ -535,9 +577,13 @@ typedef struct
    bool_t keepAlive;
    bool_t noCache;
    uint_t maxAge;
+   const char_t *cacheControl;                       ///<Cache-Control value replacing max-age, NULL if none
    const char_t *location;
    const char_t *contentType;
    const char_t *contentRange;
+   char_t contentRangeBuffer[64];                    ///<Storage for contentRange
+   char_t etag[HTTP_SERVER_ETAG_MAX_LEN + 1];        ///<Strong entity tag, empty if none
+   char_t lastModified[HTTP_SERVER_DATE_MAX_LEN + 1]; ///<Last-Modified date, empty if none
    bool_t chunkedEncoding;
    size_t contentLength;
    size_t byteCount;
@@ -678,6 +724,17 @@ error_t httpReadStream(HttpConnection *connection,
 error_t httpWriteStream(HttpConnection *connection,
    const void *data, size_t length);
 
+#if (HTTP_SERVER_FS_SUPPORT == ENABLED)
+struct taf_index_key_s;
+
+error_t httpWriteStreamFile(HttpConnection *connection, FsFile *file,
+   size_t offset, size_t length);
+error_t httpWriteFileRegion(HttpConnection *connection, FsFile *file,
+   const struct taf_index_key_s *key, size_t offset, size_t length);
+error_t httpSendFileRanges(HttpConnection *connection, FsFile *file,
+   const struct taf_index_key_s *key, size_t baseOffset, size_t length);
+#endif
+
 error_t httpCloseStream(HttpConnection *connection);
 
 error_t httpSendResponse(HttpConnection *connection, const char_t *uri);
@@ -42,6 +42,7 @@
 #include "str.h"
 #include "path.h"
 #include "debug.h"
+#include "date_time.h"
 #include "pcaplog.h"
 
 //Check TCP/IP stack configuration
@@ -454,11 +455,8 @@ void httpParseHeaderField(HttpConnection *connection,
    // Range header field?
    else if (!osStrcasecmp(name, "Range"))
    {
-      sscanf(value, "bytes=%" PRIu32 "-%" PRIu32, &connection->request.Range.start, &connection->request.Range.end);
-      if (connection->request.Range.start < 0)
-         connection->request.Range.start = 0;
-      if (connection->request.Range.end < 0)
-         connection->request.Range.end = 0;
+      //Parse Range header field
+      httpParseRangeField(connection, value);
    }
    // If-Range header field?
    else if (!osStrcasecmp(name, "If-Range"))
@@ -466,6 +464,18 @@ void httpParseHeaderField(HttpConnection *connection,
       strSafeCopy(connection->request.ifRange, value,
                   HTTP_SERVER_IFRANGE_MAX_LEN);
    }
+   // If-None-Match header field?
+   else if (!osStrcasecmp(name, "If-None-Match"))
+   {
+      strSafeCopy(connection->request.ifNoneMatch, value,
+                  HTTP_SERVER_ETAG_MAX_LEN);
+   }
+   // If-Modified-Since header field?
+   else if (!osStrcasecmp(name, "If-Modified-Since"))
+   {
+      strSafeCopy(connection->request.ifModifiedSince, value,
+                  HTTP_SERVER_DATE_MAX_LEN);
+   }
 #if (HTTP_SERVER_WEB_SOCKET_SUPPORT == ENABLED)
    //Upgrade header field?
    else if(!osStrcasecmp(name, "Upgrade"))
@@ -648,6 +658,205 @@ void httpParseAcceptEncodingField(HttpConnection *connection,
 }
 
 
+/**
+ * @brief Parse Range header field
+ *
+ * Accepts a comma-separated list of "first-last", "first-" and "-suffix" byte
+ * ranges. The first range is also stored in Range.start/end for handlers that
+ * only support a single, absolute range.
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @param[in] value Range field value
+ **/
+
+void httpParseRangeField(HttpConnection *connection,
+   char_t *value)
+{
+   char_t *p;
+   char_t *token;
+   HttpRangeHeader *range = &connection->request.Range;
+
+   //Only byte ranges are supported, other units are ignored (RFC 9110, 14.2)
+   if(osStrncasecmp(value, "bytes=", 6))
+      return;
+
+   range->present = TRUE;
+   range->invalid = FALSE;
+   range->count = 0;
+
+   //Get the first value of the list
+   token = osStrtok_r(value + 6, ",", &p);
+
+   //Parse the comma-separated list
+   while(token != NULL)
+   {
+      char_t *dash;
+      char_t *end;
+      HttpByteRange spec;
+
+      //Trim whitespace characters
+      token = strTrimWhitespace(token);
+      dash = osStrchr(token, '-');
+
+      if(*token == '\0')
+      {
+         //Empty list elements are allowed
+      }
+      else if(dash == NULL || range->count >= HTTP_SERVER_MAX_RANGES)
+      {
+         range->invalid = TRUE;
+         break;
+      }
+      else
+      {
+         *dash = '\0';
+         token = strTrimWhitespace(token);
+         dash = strTrimWhitespace(dash + 1);
+
+         if(*token == '\0')
+         {
+            //Suffix range "-N"
+            spec.first = -1;
+            spec.last = osStrtoull(dash, &end, 10);
+            if(*dash == '\0' || *end != '\0')
+               range->invalid = TRUE;
+         }
+         else
+         {
+            spec.first = osStrtoull(token, &end, 10);
+            if(*end != '\0')
+               range->invalid = TRUE;
+
+            if(*dash == '\0')
+            {
+               //Open-ended range "N-"
+               spec.last = -1;
+            }
+            else
+            {
+               spec.last = osStrtoull(dash, &end, 10);
+               if(*end != '\0' || spec.last < spec.first)
+                  range->invalid = TRUE;
+            }
+         }
+
+         if(range->invalid)
+            break;
+
+         range->spec[range->count++] = spec;
+      }
+
+      //Get next value
+      token = osStrtok_r(NULL, ",", &p);
+   }
+
+   if(range->count == 0)
+      range->invalid = TRUE;
+
+   //Legacy single range representation
+   if(!range->invalid && range->spec[0].first >= 0 && range->spec[0].first <= UINT32_MAX)
+   {
+      range->start = (uint32_t)range->spec[0].first;
+      range->end = (range->spec[0].last >= 0 && range->spec[0].last <= UINT32_MAX) ?
+         (uint32_t)range->spec[0].last : 0;
+   }
+}
+
+
+/**
+ * @brief Compare an entity tag against an If-None-Match or If-Range value
+ * @param[in] list Comma-separated list of entity tags or "*"
+ * @param[in] etag Strong entity tag of the current representation
+ * @param[in] strong Use the strong comparison function (If-Range), otherwise the weak one
+ * @return TRUE if one of the listed tags matches
+ **/
+
+bool_t httpMatchEntityTag(const char_t *list, const char_t *etag, bool_t strong)
+{
+   size_t etagLen = osStrlen(etag);
+
+   if(etagLen == 0)
+      return FALSE;
+
+   while(*list != '\0')
+   {
+      const char_t *end;
+      size_t len;
+      bool_t weak = FALSE;
+
+      //Skip separators
+      while(*list == ' ' || *list == '\t' || *list == ',')
+         list++;
+      if(*list == '\0')
+         break;
+
+      if(*list == '*' && !strong)
+         return TRUE;
+
+      if(!osStrncmp(list, "W/", 2))
+      {
+         weak = TRUE;
+         list += 2;
+      }
+
+      end = osStrchr(list, ',');
+      len = (end != NULL) ? (size_t)(end - list) : osStrlen(list);
+      while(len > 0 && (list[len - 1] == ' ' || list[len - 1] == '\t'))
+         len--;
+
+      if(len == etagLen && !osStrncmp(list, etag, len) && !(strong && weak))
+         return TRUE;
+
+      list += len;
+      while(*list != '\0' && *list != ',')
+         list++;
+   }
+
+   return FALSE;
+}
+
+
+/**
+ * @brief Check whether the client's cached copy is still current
+ *
+ * If-None-Match takes precedence. If-Modified-Since is only honored without it
+ * and compared exactly against Last-Modified, which is what clients send back.
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @return TRUE if the response can be 304 Not Modified
+ **/
+
+bool_t httpIsNotModified(HttpConnection *connection)
+{
+   if(connection->request.ifNoneMatch[0] != '\0')
+      return httpMatchEntityTag(connection->request.ifNoneMatch, connection->response.etag, FALSE);
+
+   return connection->request.ifModifiedSince[0] != '\0' && connection->response.lastModified[0] != '\0' &&
+          !osStrcmp(connection->request.ifModifiedSince, connection->response.lastModified);
+}
+
+
+/**
+ * @brief Format a time as HTTP date (IMF-fixdate)
+ * @param[in] time Seconds since the epoch
+ * @param[out] buffer Buffer of at least HTTP_SERVER_DATE_MAX_LEN + 1 characters
+ **/
+
+void httpFormatDate(time_t time, char_t *buffer)
+{
+   static const char_t days[7][4] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};
+   static const char_t months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+   DateTime date;
+
+   convertUnixTimeToDate(time, &date);
+
+   //The epoch was a Thursday
+   osSnprintf(buffer, HTTP_SERVER_DATE_MAX_LEN + 1, "%s, %02u %s %04u %02u:%02u:%02u GMT",
+      days[(time / 86400) % 7], date.day, months[(date.month - 1) % 12], date.year,
+      date.hours, date.minutes, date.seconds);
+}
+
+
 /**
  * @brief Parse Cookie header field
  * @param[in] connection Structure representing an HTTP connection
@@ -878,6 +1087,11 @@ error_t httpFormatResponseHeader(HttpConnection *connection, char_t *buffer)
       p += osSprintf(p, "Cache-Control: no-store, no-cache, must-revalidate\r\n");
       p += osSprintf(p, "Cache-Control: max-age=0, post-check=0, pre-check=0\r\n");
    }
+   else if(connection->response.cacheControl != NULL)
+   {
+      //Set Cache-Control field
+      p += osSprintf(p, "Cache-Control: %s\r\n", connection->response.cacheControl);
+   }
    else if(connection->response.maxAge != 0)
    {
       //Set Cache-Control field
@@ -930,6 +1144,18 @@ error_t httpFormatResponseHeader(HttpConnection *connection, char_t *buffer)
       p += osSprintf(p, "Content-Range: %s\r\n", connection->response.contentRange);
    }
 
+   //Entity tag of the representation
+   if(connection->response.etag[0] != '\0')
+   {
+      p += osSprintf(p, "ETag: %s\r\n", connection->response.etag);
+   }
+
+   //Modification date of the representation
+   if(connection->response.lastModified[0] != '\0')
+   {
+      p += osSprintf(p, "Last-Modified: %s\r\n", connection->response.lastModified);
+   }
+
 #if (HTTP_SERVER_GZIP_TYPE_SUPPORT == ENABLED)
    //Use gzip encoding?
    if(connection->response.gzipEncoding)
@@ -64,6 +64,7 @@ static const HttpStatusCodeDesc statusCodeList[] =
    {403, "Forbidden"},
    {404, "Not Found"},
    {410, "Gone"},
+   {416, "Range Not Satisfiable"},
    //Server error
    {500, "Internal Server Error"},
    {501, "Not Implemented"},
@@ -97,6 +98,10 @@ void httpParseRangeField(HttpConnection *connection,
 
 void httpParseCookieField(HttpConnection *connection, char_t *value);
 
+bool_t httpMatchEntityTag(const char_t *list, const char_t *etag, bool_t strong);
+bool_t httpIsNotModified(HttpConnection *connection);
+void httpFormatDate(time_t time, char_t *buffer);
+
 error_t httpReadChunkSize(HttpConnection *connection);
 
 void httpInitResponseHeader(HttpConnection *connection);
@@ -0,0 +1,501 @@
+#include <string.h>
+
+#include "file_watch.h"
+#include "platform.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "debug.h"
+#include "error.h"
+#include "date_time.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "settings.h"
+
+typedef struct file_watch_sub
+{
+    int32_t id;
+    char *name;
+    char *dir;
+    char *file;
+    bool recursive;
+    bool notified; /* all directories are watched, otherwise polled */
+    bool retry;    /* the directory was missing, watch it once it is there */
+    uint32_t debounceMs;
+    file_watch_cb_t callback;
+    void *ctx;
+
+    char *pending[FILE_WATCH_MAX_PENDING];
+    size_t pendingCount;
+    bool pendingAll;
+    bool hasPending;
+    systime_t firstChange;
+    systime_t lastChange;
+
+    bool hasStat; /* last polled state */
+    bool exists;
+    FsFileStat stat;
+
+    struct file_watch_sub *next;
+} file_watch_sub_t;
+
+/* a directory watched for one or more subscriptions, the platform returns the same id for the same path */
+typedef struct
+{
+    int32_t id;
+    char *path;
+} file_watch_dir_t;
+
+/* all of it with MUTEX_FILE_WATCH held */
+static file_watch_sub_t *file_watch_subs = NULL;
+static int32_t file_watch_next_id = 0;
+static FsWatch *file_watch = NULL;
+static bool file_watch_limited = false;
+static file_watch_dir_t *file_watch_dirs = NULL;
+static size_t file_watch_dir_count = 0;
+static size_t file_watch_dir_size = 0;
+static bool file_watch_started = false;
+
+static file_watch_dir_t *file_watch_dir_by_id(int32_t id)
+{
+    for (size_t i = 0; i < file_watch_dir_count; i++)
+    {
+        if (file_watch_dirs[i].id == id)
+        {
+            return &file_watch_dirs[i];
+        }
+    }
+    return NULL;
+}
+
+static void file_watch_dir_remove(int32_t id)
+{
+    file_watch_dir_t *dir = file_watch_dir_by_id(id);
+    if (dir != NULL)
+    {
+        osFreeMem(dir->path);
+        *dir = file_watch_dirs[--file_watch_dir_count];
+    }
+}
+
+/* watches a directory and with recursive all below it, returns false if not all of them could be watched */
+static bool file_watch_dir_add(const char *path, bool recursive)
+{
+    if (file_watch == NULL || file_watch_limited)
+    {
+        return false;
+    }
+
+    int32_t id = -1;
+    error_t error = fsWatchAdd(file_watch, path, &id);
+    if (error == ERROR_OUT_OF_RESOURCES)
+    {
+        TRACE_WARNING("File watch: limit of watched directories reached, falling back to polling. Raise fs.inotify.max_user_watches to avoid this\r\n");
+        file_watch_limited = true;
+        return false;
+    }
+    if (error != NO_ERROR)
+    {
+        return false;
+    }
+    if (file_watch_dir_by_id(id) == NULL)
+    {
+        if (file_watch_dir_count == file_watch_dir_size)
+        {
+            size_t size = MAX(file_watch_dir_size * 2, 64);
+            file_watch_dir_t *dirs = osAllocMem(size * sizeof(file_watch_dir_t));
+            if (dirs == NULL)
+            {
+                return false;
+            }
+            if (file_watch_dir_count > 0)
+            {
+                osMemcpy(dirs, file_watch_dirs, file_watch_dir_count * sizeof(file_watch_dir_t));
+            }
+            osFreeMem(file_watch_dirs);
+            file_watch_dirs = dirs;
+            file_watch_dir_size = size;
+        }
+        file_watch_dirs[file_watch_dir_count].id = id;
+        file_watch_dirs[file_watch_dir_count].path = custom_asprintf("%s", path);
+        file_watch_dir_count++;
+    }
+    if (!recursive)
+    {
+        return true;
+    }
+
+    bool complete = true;
+    FsDir *dir = fsOpenDir(path);
+    if (dir == NULL)
+    {
+        return complete;
+    }
+    FsDirEntry entry;
+    while (complete && fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (!(entry.attributes & FS_FILE_ATTR_DIRECTORY) || !osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
+        {
+            continue;
+        }
+        char *subPath = custom_asprintf("%s%c%s", path, PATH_SEPARATOR, entry.name);
+        complete = file_watch_dir_add(subPath, true);
+        osFreeMem(subPath);
+    }
+    fsCloseDir(dir);
+    return complete;
+}
+
+/* if an entry named name in the directory dirPath belongs to the subscription */
+static bool file_watch_covers(const file_watch_sub_t *sub, const char *dirPath, const char *name)
+{
+    if (sub->file != NULL)
+    {
+        return !osStrcmp(sub->dir, dirPath) && !osStrcmp(sub->file, name);
+    }
+    size_t length = osStrlen(sub->dir);
+    if (osStrncmp(sub->dir, dirPath, length))
+    {
+        return false;
+    }
+    return dirPath[length] == '\0' || (sub->recursive && dirPath[length] == PATH_SEPARATOR);
+}
+
+static void file_watch_mark(file_watch_sub_t *sub, const char *path)
+{
+    systime_t now = osGetSystemTime();
+    if (!sub->hasPending)
+    {
+        sub->firstChange = now;
+        sub->hasPending = true;
+    }
+    sub->lastChange = now;
+
+    if (path == NULL || sub->pendingAll)
+    {
+        sub->pendingAll = true;
+        return;
+    }
+    for (size_t i = 0; i < sub->pendingCount; i++)
+    {
+        if (!osStrcmp(sub->pending[i], path))
+        {
+            return;
+        }
+    }
+    if (sub->pendingCount == FILE_WATCH_MAX_PENDING)
+    {
+        sub->pendingAll = true;
+        return;
+    }
+    sub->pending[sub->pendingCount++] = custom_asprintf("%s", path);
+}
+
+static void file_watch_clear(file_watch_sub_t *sub)
+{
+    for (size_t i = 0; i < sub->pendingCount; i++)
+    {
+        osFreeMem(sub->pending[i]);
+    }
+    sub->pendingCount = 0;
+    sub->pendingAll = false;
+    sub->hasPending = false;
+}
+
+static void file_watch_event(const FsWatchEvent *event)
+{
+    if (event->flags & FS_WATCH_OVERFLOW)
+    {
+        TRACE_WARNING("File watch: notifications were lost\r\n");
+        for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+        {
+            file_watch_mark(sub, NULL);
+        }
+        return;
+    }
+
+    file_watch_dir_t *dir = file_watch_dir_by_id(event->id);
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    if (event->flags & FS_WATCH_GONE)
+    {
+        /* subscriptions on the directory itself continue by polling until it is back */
+        for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+        {
+            if (!osStrcmp(sub->dir, dir->path))
+            {
+                sub->notified = false;
+                sub->retry = true;
+                sub->hasStat = false;
+                file_watch_mark(sub, sub->file == NULL ? sub->dir : NULL);
+            }
+        }
+        file_watch_dir_remove(event->id);
+        return;
+    }
+
+    char *path = custom_asprintf("%s%c%s", dir->path, PATH_SEPARATOR, event->name);
+    bool newDir = (event->flags & FS_WATCH_DIRECTORY) && (event->flags & FS_WATCH_CREATED);
+    for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+    {
+        if (!file_watch_covers(sub, dir->path, event->name))
+        {
+            continue;
+        }
+        /* entries created before the new directory is watched are covered by reporting the directory */
+        if (newDir && sub->recursive && !file_watch_dir_add(path, true))
+        {
+            sub->notified = false;
+        }
+        file_watch_mark(sub, path);
+    }
+    osFreeMem(path);
+}
+
+/* checks the subscriptions without notifications and tries to watch them again */
+static void file_watch_poll()
+{
+    for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+    {
+        if (sub->notified)
+        {
+            continue;
+        }
+        if (sub->retry && fsDirExists(sub->dir))
+        {
+            sub->retry = false;
+            if (file_watch_dir_add(sub->dir, sub->recursive))
+            {
+                /* whatever happened while polling is not known in detail */
+                sub->notified = true;
+                file_watch_mark(sub, NULL);
+                continue;
+            }
+        }
+
+        char *path = (sub->file != NULL) ? custom_asprintf("%s%c%s", sub->dir, PATH_SEPARATOR, sub->file) : custom_asprintf("%s", sub->dir);
+        FsFileStat stat;
+        osMemset(&stat, 0, sizeof(stat));
+        bool exists = (fsGetFileStat(path, &stat) == NO_ERROR);
+        if (sub->hasStat && (exists != sub->exists || stat.size != sub->stat.size || compareDateTime(&stat.modified, &sub->stat.modified)))
+        {
+            file_watch_mark(sub, (sub->file != NULL) ? path : NULL);
+        }
+        sub->hasStat = true;
+        sub->exists = exists;
+        sub->stat = stat;
+        osFreeMem(path);
+    }
+}
+
+/* reports the settled changes of one subscription, returns false if there are none */
+static bool file_watch_deliver(systime_t now, systime_t *wait)
+{
+    mutex_lock(MUTEX_FILE_WATCH);
+    file_watch_sub_t *due = NULL;
+    for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+    {
+        if (!sub->hasPending)
+        {
+            continue;
+        }
+        systime_t quiet = now - sub->lastChange;
+        systime_t delayed = now - sub->firstChange;
+        if (quiet >= sub->debounceMs || delayed >= FILE_WATCH_MAX_DELAY_FACTOR * sub->debounceMs)
+        {
+            due = sub;
+            break;
+        }
+        *wait = MIN(*wait, sub->debounceMs - quiet);
+    }
+    if (due == NULL)
+    {
+        mutex_unlock(MUTEX_FILE_WATCH);
+        return false;
+    }
+
+    file_watch_cb_t callback = due->callback;
+    void *ctx = due->ctx;
+    bool all = due->pendingAll;
+    size_t count = all ? 0 : due->pendingCount;
+    char *paths[FILE_WATCH_MAX_PENDING];
+    osMemcpy(paths, due->pending, count * sizeof(char *));
+    if (all)
+    {
+        file_watch_clear(due);
+    }
+    due->pendingCount = 0;
+    due->pendingAll = false;
+    due->hasPending = false;
+    mutex_unlock(MUTEX_FILE_WATCH);
+
+    /* without the lock, the callback may subscribe or read files that are watched themselves */
+    if (all)
+    {
+        callback(NULL, ctx);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        callback(paths[i], ctx);
+        osFreeMem(paths[i]);
+    }
+    return true;
+}
+
+static void file_watch_task(void *param)
+{
+    systime_t lastPoll = 0;
+
+    while (!settings_get_bool("internal.exit"))
+    {
+        systime_t now = osGetSystemTime();
+        if (now - lastPoll >= FILE_WATCH_POLL_MS)
+        {
+            mutex_lock(MUTEX_FILE_WATCH);
+            file_watch_poll();
+            mutex_unlock(MUTEX_FILE_WATCH);
+            lastPoll = now;
+        }
+
+        systime_t wait = FILE_WATCH_POLL_MS;
+        while (file_watch_deliver(osGetSystemTime(), &wait))
+        {
+            wait = FILE_WATCH_POLL_MS;
+        }
+
+        if (file_watch == NULL)
+        {
+            osDelayTask(wait);
+            continue;
+        }
+
+        FsWatchEvent event;
+        error_t error = fsWatchRead(file_watch, &event, wait);
+        if (error == ERROR_TIMEOUT)
+        {
+            continue;
+        }
+
+        mutex_lock(MUTEX_FILE_WATCH);
+        if (error == NO_ERROR)
+        {
+            file_watch_event(&event);
+        }
+        else
+        {
+            TRACE_ERROR("File watch: reading notifications failed with %s, falling back to polling\r\n", error2text(error));
+            fsWatchClose(file_watch);
+            file_watch = NULL;
+            for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+            {
+                sub->notified = false;
+            }
+        }
+        mutex_unlock(MUTEX_FILE_WATCH);
+    }
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+/* with MUTEX_FILE_WATCH held */
+static void file_watch_start()
+{
+    if (file_watch_started)
+    {
+        return;
+    }
+    error_t error = fsWatchOpen(&file_watch);
+    if (error != NO_ERROR)
+    {
+        file_watch = NULL;
+        TRACE_INFO("File watch: no change notifications (%s), polling every %d ms\r\n", error2text(error), FILE_WATCH_POLL_MS);
+    }
+    if (osCreateTask("FileWatch", &file_watch_task, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start file watch task\r\n");
+        return;
+    }
+    file_watch_started = true;
+}
+
+int32_t file_watch_subscribe(const char *name, const char *dir, const char *file, bool recursive, uint32_t debounceMs, file_watch_cb_t callback, void *ctx)
+{
+    if (dir == NULL || callback == NULL)
+    {
+        return -1;
+    }
+    file_watch_sub_t *sub = osAllocMem(sizeof(file_watch_sub_t));
+    if (sub == NULL)
+    {
+        return -1;
+    }
+    osMemset(sub, 0, sizeof(file_watch_sub_t));
+    sub->name = custom_asprintf("%s", name);
+    sub->dir = custom_asprintf("%s", dir);
+    /* events name the directory without a trailing separator */
+    for (size_t length = osStrlen(sub->dir); length > 1 && sub->dir[length - 1] == PATH_SEPARATOR; length--)
+    {
+        sub->dir[length - 1] = '\0';
+    }
+    sub->file = (file != NULL) ? custom_asprintf("%s", file) : NULL;
+    sub->recursive = recursive;
+    sub->debounceMs = debounceMs;
+    sub->callback = callback;
+    sub->ctx = ctx;
+
+    mutex_lock(MUTEX_FILE_WATCH);
+    file_watch_start();
+    sub->id = file_watch_next_id++;
+    sub->notified = file_watch_dir_add(sub->dir, recursive);
+    sub->retry = !sub->notified && !fsDirExists(sub->dir);
+    sub->next = file_watch_subs;
+    file_watch_subs = sub;
+    int32_t id = sub->id;
+    mutex_unlock(MUTEX_FILE_WATCH);
+
+    TRACE_INFO("File watch: %s %s%s\r\n", sub->name, sub->notified ? "notified about " : "polling ", sub->dir);
+    return id;
+}
+
+void file_watch_unsubscribe(int32_t id)
+{
+    mutex_lock(MUTEX_FILE_WATCH);
+    file_watch_sub_t **link = &file_watch_subs;
+    while (*link != NULL && (*link)->id != id)
+    {
+        link = &(*link)->next;
+    }
+    file_watch_sub_t *sub = *link;
+    if (sub != NULL)
+    {
+        *link = sub->next;
+    }
+    mutex_unlock(MUTEX_FILE_WATCH);
+
+    /* the directories stay watched, other subscriptions may share them and removed ones drop out by themselves */
+    if (sub != NULL)
+    {
+        file_watch_clear(sub);
+        osFreeMem(sub->name);
+        osFreeMem(sub->dir);
+        osFreeMem(sub->file);
+        osFreeMem(sub);
+    }
+}
+
+bool file_watch_notified(int32_t id)
+{
+    bool notified = false;
+    mutex_lock(MUTEX_FILE_WATCH);
+    for (file_watch_sub_t *sub = file_watch_subs; sub != NULL; sub = sub->next)
+    {
+        if (sub->id == id)
+        {
+            notified = sub->notified;
+            break;
+        }
+    }
+    mutex_unlock(MUTEX_FILE_WATCH);
+    return notified;
+}
@@ -3,6 +3,7 @@
 #include "server_helpers.h"
 #include "fs_ext.h"
 #include "mutex_manager.h"
+#include "taf_index.h"
 
 void fillBaseCtx(HttpConnection *connection, const char_t *uri, const char_t *queryString, cloudapi_t api, cbr_ctx_t *ctx, client_ctx_t *client_ctx)
 {
@@ -451,6 +452,23 @@ void setTonieboxSettings(TonieFreshnessCheckResponse *freshResp, settings_t *set
 bool_t isValidTaf(const char *contentPath, bool checkHashAndSize)
 {
     bool_t valid = false;
+    taf_index_key_t indexKey = {0};
+    if (!checkHashAndSize)
+    {
+        bool isTaf = false;
+        if (taf_index_get(contentPath, &indexKey, &isTaf, NULL, NULL))
+        {
+            return isTaf;
+        }
+    }
+    else
+    {
+        taf_verdict_t verdict = taf_index_get_verdict(contentPath, &indexKey);
+        if (verdict != TAF_VERDICT_UNKNOWN)
+        {
+            return verdict == TAF_VERDICT_VALID;
+        }
+    }
     FsFile *file = fsOpenFile(contentPath, FS_FILE_MODE_READ);
     if (file)
     {
@@ -513,9 +531,35 @@ bool_t isValidTaf(const char *contentPath, bool checkHashAndSize)
         }
         fsCloseFile(file);
     }
+    if (checkHashAndSize)
+    {
+        taf_index_set_verdict(contentPath, &indexKey, valid);
+    }
     return valid;
 }
 
+bool_t isValidTafCached(const char *contentPath, bool checkHashAndSize)
+{
+    if (!checkHashAndSize)
+    {
+        return isValidTaf(contentPath, false);
+    }
+
+    taf_index_key_t indexKey = {0};
+    taf_verdict_t verdict = taf_index_get_verdict(contentPath, &indexKey);
+    if (verdict != TAF_VERDICT_UNKNOWN)
+    {
+        return verdict == TAF_VERDICT_VALID;
+    }
+    if (indexKey.size == 0)
+    {
+        return false;
+    }
+
+    /* no verdict yet means nothing was validated, run the full check once, isValidTaf() caches its result */
+    return isValidTaf(contentPath, true);
+}
+
 void readTrackPositions(tonie_info_t *tonieInfo, FsFile *file)
 {
     bool hasError = false;
@@ -586,12 +630,29 @@ void readTrackPositions(tonie_info_t *tonieInfo, FsFile *file)
             osFreeMem(trackPos->pos);
             trackPos->pos = NULL;
 
-            if (!isValidTaf(tonieInfo->contentPath, true))
-            {
-                TRACE_ERROR("SHA1 not valid or length different for TAF %s\r\n", tonieInfo->contentPath);
-            }
+            taf_index_queue_validation(tonieInfo->contentPath);
+        }
+    }
+}
+
+static void applyTafHeader(tonie_info_t *tonieInfo, settings_t *settings)
+{
+    if (tonieInfo->tafHeader->num_bytes == get_settings()->encode.stream_max_size)
+    {
+        /* still being written, a full check cannot succeed */
+        tonieInfo->valid = !settings->core.full_taf_validation;
+        tonieInfo->json._source_type = CT_SOURCE_TAF_INCOMPLETE;
+    }
+    else
+    {
+        /* the header was already checked for a proper sha1 length, only the full check needs the file */
+        tonieInfo->valid = settings->core.full_taf_validation ? isValidTafCached(tonieInfo->contentPath, true) : true;
+        if ((tonieInfo->json.tonie_model == NULL || tonieInfo->json.tonie_model[0] == '\0') && (tonieInfo->json._source_type == CT_SOURCE_NONE || tonieInfo->json._source_type == CT_SOURCE_TAF)) // TAF beside the content json
+        {
+            content_json_update_model(&tonieInfo->json, tonieInfo->tafHeader->audio_id, tonieInfo->tafHeader->sha1_hash.data);
         }
     }
+    tonieInfo->json._source_model = tonies_modelByAudioIdHash(tonieInfo->tafHeader->audio_id, tonieInfo->tafHeader->sha1_hash.data);
 }
 
 tonie_info_t *getTonieInfoFromUid(uint64_t uid, bool lock, settings_t *settings)
@@ -640,6 +701,12 @@ tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *setti
             load_content_json(contentPath, &tonieInfo->json, true, settings);
         }
 
+        if (tonieInfo->json._source_type == CT_SOURCE_TAP_CACHED && tap_cache_invalid(&tonieInfo->json._tap))
+        {
+            /* the cached TAF was accepted before its validation finished, generate it again */
+            TRACE_WARNING("Cached TAP TAF %s is invalid, regenerating\r\n", tonieInfo->json._source_resolved);
+            tonieInfo->json._source_type = CT_SOURCE_TAP_STREAM;
+        }
         if (tonieInfo->json._source_type == CT_SOURCE_TAF || tonieInfo->json._source_type == CT_SOURCE_TAP_CACHED)
         {
             osFreeMem(tonieInfo->contentPath);
@@ -652,6 +719,16 @@ tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *setti
         }
         tonieInfo->exists = fsFileExists(tonieInfo->contentPath);
 
+        taf_index_key_t indexKey = {0};
+        if (tonieInfo->exists && taf_index_get(tonieInfo->contentPath, &indexKey, NULL, &tonieInfo->tafHeader, &tonieInfo->additional.track_positions))
+        {
+            if (tonieInfo->tafHeader)
+            {
+                applyTafHeader(tonieInfo, settings);
+            }
+            return tonieInfo;
+        }
+
         FsFile *file = fsOpenFile(tonieInfo->contentPath, FS_FILE_MODE_READ);
         if (file)
         {
@@ -671,20 +748,15 @@ tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *setti
                         {
                             if (tonieInfo->tafHeader->sha1_hash.len == 20)
                             {
-                                tonieInfo->valid = isValidTaf(tonieInfo->contentPath, settings->core.full_taf_validation);
                                 readTrackPositions(tonieInfo, file);
-                                if (tonieInfo->tafHeader->num_bytes == get_settings()->encode.stream_max_size)
-                                {
-                                    tonieInfo->json._source_type = CT_SOURCE_TAF_INCOMPLETE;
-                                }
-                                else if ((tonieInfo->json.tonie_model == NULL || tonieInfo->json.tonie_model[0] == '\0') && (tonieInfo->json._source_type == CT_SOURCE_NONE || tonieInfo->json._source_type == CT_SOURCE_TAF)) // TAF beside the content json
-                                {
-                                    content_json_update_model(&tonieInfo->json, tonieInfo->tafHeader->audio_id, tonieInfo->tafHeader->sha1_hash.data);
-                                }
-                                toniesJson_item_t *toniesJson = tonies_byAudioIdHash(tonieInfo->tafHeader->audio_id, tonieInfo->tafHeader->sha1_hash.data);
-                                if (toniesJson != NULL)
+                                applyTafHeader(tonieInfo, settings);
+
+                                /* growing stream files and files with broken track pages are not worth caching */
+                                bool indexable = tonieInfo->json._source_type != CT_SOURCE_TAF_INCOMPLETE &&
+                                            tonieInfo->additional.track_positions.count == tonieInfo->tafHeader->n_track_page_nums;
+                                if (indexable)
                                 {
-                                    tonieInfo->json._source_model = strdup(toniesJson->model);
+                                    taf_index_put(tonieInfo->contentPath, &indexKey, headerBuffer, protobufSize, &tonieInfo->additional.track_positions);
                                 }
                             }
                             else
@@ -692,6 +764,10 @@ tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *setti
                                 TRACE_WARNING("Invalid TAF-header on %s, sha1_hash.len=%zu != 20\r\n", tonieInfo->contentPath, tonieInfo->tafHeader->sha1_hash.len);
                             }
                         }
+                        else
+                        {
+                            taf_index_put(tonieInfo->contentPath, &indexKey, NULL, 0, NULL);
+                        }
                     }
                     else
                     {
@@ -701,6 +777,7 @@ tonie_info_t *getTonieInfo(const char *contentPath, bool lock, settings_t *setti
                 else
                 {
                     TRACE_VERBOSE("Invalid TAF-header on %s, protobufSize=%" PRIu32 " >= TAF_HEADER_SIZE=%u\r\n", tonieInfo->contentPath, protobufSize, TAF_HEADER_SIZE);
+                    taf_index_put(tonieInfo->contentPath, &indexKey, NULL, 0, NULL);
                 }
             }
             else if (read_length == 0)
@@ -814,6 +891,26 @@ error_t httpFlushStream(HttpConnection *connection)
     return httpCloseStream(connection);
 }
 
+void httpSetTafEntityTag(HttpConnection *connection, const tonie_info_t *tonieInfo, bool skipHeader)
+{
+    connection->response.etag[0] = '\0';
+
+    const TonieboxAudioFileHeader *tafHeader = tonieInfo->tafHeader;
+    if (!tonieInfo->valid || tafHeader == NULL || tafHeader->sha1_hash.len != 20 || tonieInfo->json._source_type == CT_SOURCE_TAF_INCOMPLETE)
+    {
+        return;
+    }
+
+    /* the header hash covers the audio data, size and audio id tell apart reencoded files with equal payload */
+    char sha1[41];
+    for (size_t i = 0; i < 20; i++)
+    {
+        osSprintf(&sha1[i * 2], "%02x", tafHeader->sha1_hash.data[i]);
+    }
+    osSnprintf(connection->response.etag, sizeof(connection->response.etag), "\"%s-%" PRIx64 "-%08" PRIx32 "%s\"",
+               sha1, tafHeader->num_bytes, tafHeader->audio_id, skipHeader ? "-ogg" : "");
+}
+
 error_t httpOkResponse(HttpConnection *connection)
 {
     httpInitResponseHeader(connection);
@@ -24,6 +24,17 @@
 #include "cert.h"
 #include "esp32.h"
 #include "cache.h"
+#include "taf_index.h"
+#include "stream_buffer.h"
+#include "json_writer.h"
+#include "worker_pool.h"
+#include "mem_arena.h"
+#include "tag_registry.h"
+
+#define INDEX_BATCH_SIZE 64
+#define INDEX_CURSOR_LEN (FS_MAX_NAME_LEN + 24)
+#define INDEX_FIELDS_LEN 256
+#define INDEX_MODEL_PREFIX_LEN 32
 
 error_t parsePostData(HttpConnection *connection, char_t *post_data, size_t buffer_size)
 {
@@ -187,6 +198,37 @@ void addToniesJsonInfoJson(toniesJson_item_t *item, char *fallbackModel, cJSON *
     }
 }
 
+void writeToniesJsonInfo(json_writer_t *writer, const char *key, toniesJson_item_t *item, char *fallbackModel)
+{
+    json_writer_object_begin(writer, key);
+    json_writer_array_begin(writer, "tracks");
+    if (item != NULL)
+    {
+        for (size_t i = 0; i < item->tracks_count; i++)
+        {
+            json_writer_string(writer, NULL, item->tracks[i]);
+        }
+    }
+    json_writer_array_end(writer);
+
+    if (item != NULL)
+    {
+        json_writer_string(writer, "model", item->model);
+        json_writer_string(writer, "series", item->series);
+        json_writer_string(writer, "episode", item->episodes);
+        json_writer_string(writer, "picture", item->picture);
+        json_writer_string(writer, "language", item->language);
+    }
+    else
+    {
+        json_writer_string(writer, "model", fallbackModel != NULL ? fallbackModel : "");
+        json_writer_string(writer, "series", "");
+        json_writer_string(writer, "episode", "");
+        json_writer_string(writer, "picture", "/img_unknown.png");
+    }
+    json_writer_object_end(writer);
+}
+
 error_t handleApiAssignUnknown(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
     const char *rootPath = NULL;
@@ -223,9 +265,6 @@ error_t handleApiAssignUnknown(HttpConnection *connection, const char_t *uri, co
 
 error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    cJSON *json = cJSON_CreateObject();
-    cJSON *jsonArray = cJSON_AddArrayToObject(json, "options");
-
     char overlay[16];
     osStrcpy(overlay, "");
     char internal[6];
@@ -254,6 +293,16 @@ error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const c
             isNoLevel = true;
         }
     }
+
+    json_writer_t *writer = osAllocMem(sizeof(json_writer_t));
+    if (writer == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    json_writer_begin(writer, connection, "text/json");
+    json_writer_object_begin(writer, NULL);
+    json_writer_array_begin(writer, "options");
+
     for (size_t pos = 0; pos < settings_get_size(); pos++)
     {
         setting_item_t *opt = settings_get_ovl(pos, overlay);
@@ -274,73 +323,71 @@ error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const c
             continue;
         }
 
-        cJSON *jsonEntry = cJSON_CreateObject();
-        cJSON_AddStringToObject(jsonEntry, "ID", opt->option_name);
-        cJSON_AddStringToObject(jsonEntry, "shortname", opt->option_name);
-        cJSON_AddStringToObject(jsonEntry, "description", opt->description);
-        cJSON_AddStringToObject(jsonEntry, "label", opt->label);
-        cJSON_AddBoolToObject(jsonEntry, "overlayed", opt->overlayed);
-        cJSON_AddBoolToObject(jsonEntry, "internal", opt->internal);
-        cJSON_AddNumberToObject(jsonEntry, "level", opt->level);
+        json_writer_object_begin(writer, NULL);
+        json_writer_string(writer, "ID", opt->option_name);
+        json_writer_string(writer, "shortname", opt->option_name);
+        json_writer_string(writer, "description", opt->description);
+        json_writer_string(writer, "label", opt->label);
+        json_writer_bool(writer, "overlayed", opt->overlayed);
+        json_writer_bool(writer, "internal", opt->internal);
+        json_writer_number(writer, "level", opt->level);
 
         switch (opt->type)
         {
         case TYPE_BOOL:
-            cJSON_AddStringToObject(jsonEntry, "type", "bool");
-            cJSON_AddBoolToObject(jsonEntry, "value", settings_get_bool_ovl(opt->option_name, overlay));
-            cJSON_AddBoolToObject(jsonEntry, "valueInit", opt->init.bool_value);
+            json_writer_string(writer, "type", "bool");
+            json_writer_bool(writer, "value", settings_get_bool_ovl(opt->option_name, overlay));
+            json_writer_bool(writer, "valueInit", opt->init.bool_value);
             break;
         case TYPE_UNSIGNED:
-            cJSON_AddStringToObject(jsonEntry, "type", "uint");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
-            cJSON_AddNumberToObject(jsonEntry, "valueInit", opt->init.unsigned_value);
-            cJSON_AddNumberToObject(jsonEntry, "min", opt->min.unsigned_value);
-            cJSON_AddNumberToObject(jsonEntry, "max", opt->max.unsigned_value);
+            json_writer_string(writer, "type", "uint");
+            json_writer_number(writer, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
+            json_writer_number(writer, "valueInit", opt->init.unsigned_value);
+            json_writer_number(writer, "min", opt->min.unsigned_value);
+            json_writer_number(writer, "max", opt->max.unsigned_value);
             break;
         case TYPE_SIGNED:
-            cJSON_AddStringToObject(jsonEntry, "type", "int");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_signed_ovl(opt->option_name, overlay));
-            cJSON_AddNumberToObject(jsonEntry, "valueInit", opt->init.signed_value);
-            cJSON_AddNumberToObject(jsonEntry, "min", opt->min.signed_value);
-            cJSON_AddNumberToObject(jsonEntry, "max", opt->max.signed_value);
+            json_writer_string(writer, "type", "int");
+            json_writer_number(writer, "value", settings_get_signed_ovl(opt->option_name, overlay));
+            json_writer_number(writer, "valueInit", opt->init.signed_value);
+            json_writer_number(writer, "min", opt->min.signed_value);
+            json_writer_number(writer, "max", opt->max.signed_value);
             break;
         case TYPE_HEX:
-            cJSON_AddStringToObject(jsonEntry, "type", "hex");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
-            cJSON_AddNumberToObject(jsonEntry, "valueInit", opt->init.unsigned_value);
-            cJSON_AddNumberToObject(jsonEntry, "min", opt->min.unsigned_value);
-            cJSON_AddNumberToObject(jsonEntry, "max", opt->max.unsigned_value);
+            json_writer_string(writer, "type", "hex");
+            json_writer_number(writer, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
+            json_writer_number(writer, "valueInit", opt->init.unsigned_value);
+            json_writer_number(writer, "min", opt->min.unsigned_value);
+            json_writer_number(writer, "max", opt->max.unsigned_value);
             break;
         case TYPE_STRING:
-            cJSON_AddStringToObject(jsonEntry, "type", "string");
-            cJSON_AddStringToObject(jsonEntry, "value", settings_get_string_ovl(opt->option_name, overlay));
-            cJSON_AddStringToObject(jsonEntry, "valueInit", opt->init.string_value);
+            json_writer_string(writer, "type", "string");
+            json_writer_string(writer, "value", settings_get_string_ovl(opt->option_name, overlay));
+            json_writer_string(writer, "valueInit", opt->init.string_value);
             break;
         case TYPE_FLOAT:
-            cJSON_AddStringToObject(jsonEntry, "type", "float");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_float_ovl(opt->option_name, overlay));
-            cJSON_AddNumberToObject(jsonEntry, "valueInit", opt->init.float_value);
-            cJSON_AddNumberToObject(jsonEntry, "min", opt->min.float_value);
-            cJSON_AddNumberToObject(jsonEntry, "max", opt->max.float_value);
+            json_writer_string(writer, "type", "float");
+            json_writer_number(writer, "value", settings_get_float_ovl(opt->option_name, overlay));
+            json_writer_number(writer, "valueInit", opt->init.float_value);
+            json_writer_number(writer, "min", opt->min.float_value);
+            json_writer_number(writer, "max", opt->max.float_value);
             break;
         case TYPE_TREE_DESC:
-            cJSON_AddStringToObject(jsonEntry, "type", "desc");
+            json_writer_string(writer, "type", "desc");
             break;
         default:
             break;
         }
 
-        cJSON_AddItemToArray(jsonArray, jsonEntry);
+        json_writer_object_end(writer);
     }
 
-    char *jsonString = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
+    json_writer_array_end(writer);
+    json_writer_object_end(writer);
+    error_t error = json_writer_end(writer);
+    osFreeMem(writer);
 
-    httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
-
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+    return error;
 }
 
 error_t handleApiGetBoxes(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -571,163 +618,641 @@ error_t handleApiSettingsReset(HttpConnection *connection, const char_t *uri, co
     return httpWriteResponseString(connection, response, false);
 }
 
-error_t handleApiFileIndexV2(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+typedef enum
 {
-    char overlay[16];
-    const char *rootPath = NULL;
+    INDEX_SORT_NONE = 0,
+    INDEX_SORT_NAME,
+    INDEX_SORT_DATE,
+    INDEX_SORT_SIZE
+} index_sort_t;
+
+/**
+ * @brief Paging, filters and field selection of a file or tag listing, as given in the query string.
+ */
+typedef struct
+{
+    size_t limit; /* 0 for no limit */
+    index_sort_t sort;
+    bool descending;
+    bool hasCursor;
+    uint64_t cursorKey;
+    char cursorName[FS_MAX_NAME_LEN + 1];
+    char fields[INDEX_FIELDS_LEN]; /* comma separated, empty for all */
+    bool validOnly;
+    int8_t hidden;       /* -1 for any, else the required value */
+    int8_t hasCloudAuth; /* -1 for any, else the required value */
+    char modelPrefix[INDEX_MODEL_PREFIX_LEN];
+    bool hasAudioId;
+    uint32_t audioId;
+} index_query_t;
 
-    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay), &client_ctx->settings) != NO_ERROR)
+typedef struct
+{
+    char *name;
+    uint64_t date;
+    uint64_t size;
+    bool isDir;
+    bool deleted;     /* tombstone of a tag registry listing */
+    const char *ruid; /* last known tag of a tombstone */
+} index_dir_entry_t;
+
+typedef struct
+{
+    mem_arena_t *arena;
+    index_dir_entry_t *entries;
+    size_t count;
+    size_t size;
+} index_dir_t;
+
+static int8_t indexQueryFlag(const char *queryString, const char *key)
+{
+    char value[8];
+    if (!queryGet(queryString, key, value, sizeof(value)))
     {
-        return ERROR_FAILURE;
+        return -1;
     }
+    return (value[0] == 't' || value[0] == '1') ? 1 : 0;
+}
 
-    char path[128];
+static void indexQueryParse(const char *queryString, index_query_t *query)
+{
+    char value[INDEX_CURSOR_LEN];
 
-    if (!queryGet(queryString, "path", path, sizeof(path)))
+    osMemset(query, 0, sizeof(index_query_t));
+    if (queryGet(queryString, "limit", value, sizeof(value)))
     {
-        osStrcpy(path, "/");
+        query->limit = strtoul(value, NULL, 10);
+    }
+    if (queryGet(queryString, "sort", value, sizeof(value)))
+    {
+        const char *key = value;
+        if (key[0] == '-')
+        {
+            query->descending = true;
+            key++;
+        }
+        if (!osStrcmp(key, "date"))
+        {
+            query->sort = INDEX_SORT_DATE;
+        }
+        else if (!osStrcmp(key, "size"))
+        {
+            query->sort = INDEX_SORT_SIZE;
+        }
+        else
+        {
+            query->sort = INDEX_SORT_NAME;
+        }
+    }
+    /* the cursor is "<sort key>:<name>" of the last entry of the previous page */
+    if (queryGet(queryString, "cursor", value, sizeof(value)))
+    {
+        char *separator = osStrchr(value, ':');
+        if (separator != NULL)
+        {
+            *separator = '\0';
+            query->cursorKey = strtoull(value, NULL, 10);
+            osStrncpy(query->cursorName, separator + 1, sizeof(query->cursorName) - 1);
+            query->hasCursor = true;
+        }
+    }
+    /* pages need a stable order, directory order is not */
+    if (query->sort == INDEX_SORT_NONE && (query->limit > 0 || query->hasCursor))
+    {
+        query->sort = INDEX_SORT_NAME;
     }
 
-    /* first canonicalize path, then merge to prevent directory traversal bugs */
-    pathSafeCanonicalize(path);
-    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
-    pathSafeCanonicalize(pathAbsolute);
+    queryGet(queryString, "fields", query->fields, sizeof(query->fields));
+    query->validOnly = (indexQueryFlag(queryString, "valid") == 1);
+    query->hidden = indexQueryFlag(queryString, "hidden");
+    query->hasCloudAuth = indexQueryFlag(queryString, "has_cloud_auth");
+    queryGet(queryString, "model", query->modelPrefix, sizeof(query->modelPrefix));
+    if (queryGet(queryString, "audio_id", value, sizeof(value)))
+    {
+        query->audioId = strtoul(value, NULL, 0);
+        query->hasAudioId = true;
+    }
+}
 
-    FsDir *dir = fsOpenDir(pathAbsolute);
-    if (dir == NULL)
+/* if a field was requested with fields=, all are when none is given */
+static bool indexQueryField(const index_query_t *query, const char *field)
+{
+    if (query == NULL || query->fields[0] == '\0')
     {
-        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
-        osFreeMem(pathAbsolute);
-        return ERROR_FAILURE;
+        return true;
     }
+    size_t len = osStrlen(field);
+    for (const char *pos = query->fields; (pos = osStrstr(pos, field)) != NULL; pos += len)
+    {
+        if ((pos == query->fields || pos[-1] == ',') && (pos[len] == '\0' || pos[len] == ','))
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-    cJSON *json = cJSON_CreateObject();
-    cJSON *jsonArray = cJSON_AddArrayToObject(json, "files");
+static bool indexQueryModel(const index_query_t *query, const char *model)
+{
+    if (query == NULL || query->modelPrefix[0] == '\0')
+    {
+        return true;
+    }
+    return model != NULL && !osStrncasecmp(model, query->modelPrefix, osStrlen(query->modelPrefix));
+}
 
-    while (true)
+static uint64_t indexSortKey(const index_query_t *query, const index_dir_entry_t *entry)
+{
+    switch (query->sort)
     {
-        FsDirEntry entry;
+    case INDEX_SORT_DATE:
+        return entry->date;
+    case INDEX_SORT_SIZE:
+        return entry->size;
+    default:
+        return 0;
+    }
+}
+
+/* compares two entries in the requested order, by sort key first and name second */
+static int indexCompare(const index_query_t *query, uint64_t keyA, const char *nameA, uint64_t keyB, const char *nameB)
+{
+    int result = (keyA < keyB) ? -1 : (keyA > keyB);
+    if (result == 0)
+    {
+        result = osStrcmp(nameA, nameB);
+    }
+    return query->descending ? -result : result;
+}
+
+static int indexCompareName(const void *a, const void *b)
+{
+    return osStrcmp(((const index_dir_entry_t *)a)->name, ((const index_dir_entry_t *)b)->name);
+}
 
-        if (fsReadDir(dir, &entry) != NO_ERROR)
+static int indexCompareDate(const void *a, const void *b)
+{
+    const index_dir_entry_t *entryA = (const index_dir_entry_t *)a;
+    const index_dir_entry_t *entryB = (const index_dir_entry_t *)b;
+    if (entryA->date != entryB->date)
+    {
+        return (entryA->date < entryB->date) ? -1 : 1;
+    }
+    return osStrcmp(entryA->name, entryB->name);
+}
+
+static int indexCompareSize(const void *a, const void *b)
+{
+    const index_dir_entry_t *entryA = (const index_dir_entry_t *)a;
+    const index_dir_entry_t *entryB = (const index_dir_entry_t *)b;
+    if (entryA->size != entryB->size)
+    {
+        return (entryA->size < entryB->size) ? -1 : 1;
+    }
+    return osStrcmp(entryA->name, entryB->name);
+}
+
+static error_t indexInitDir(index_dir_t *list)
+{
+    osMemset(list, 0, sizeof(index_dir_t));
+    list->arena = mem_arena_create();
+    if (list->arena == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    return NO_ERROR;
+}
+
+static index_dir_entry_t *indexAddEntry(index_dir_t *list, const char *name)
+{
+    if (list->count == list->size)
+    {
+        size_t size = MAX(list->size * 2, INDEX_BATCH_SIZE);
+        index_dir_entry_t *entries = osAllocMem(size * sizeof(index_dir_entry_t));
+        if (entries == NULL)
         {
-            fsCloseDir(dir);
-            break;
+            return NULL;
         }
+        if (list->count > 0)
+        {
+            osMemcpy(entries, list->entries, list->count * sizeof(index_dir_entry_t));
+        }
+        osFreeMem(list->entries);
+        list->entries = entries;
+        list->size = size;
+    }
+    index_dir_entry_t *dirEntry = &list->entries[list->count];
+    osMemset(dirEntry, 0, sizeof(index_dir_entry_t));
+    dirEntry->name = mem_arena_strdup(list->arena, name);
+    if (dirEntry->name == NULL)
+    {
+        return NULL;
+    }
+    list->count++;
+    return dirEntry;
+}
 
-        if (!osStrcmp(entry.name, "."))
+static void indexSortDir(const index_query_t *query, index_dir_t *list)
+{
+    if (query->sort == INDEX_SORT_NONE || list->count <= 1)
+    {
+        return;
+    }
+    int (*compare)(const void *, const void *) = indexCompareName;
+    if (query->sort == INDEX_SORT_DATE)
+    {
+        compare = indexCompareDate;
+    }
+    else if (query->sort == INDEX_SORT_SIZE)
+    {
+        compare = indexCompareSize;
+    }
+    qsort(list->entries, list->count, sizeof(index_dir_entry_t), compare);
+    if (query->descending)
+    {
+        for (size_t i = 0; i < list->count / 2; i++)
         {
-            continue;
+            index_dir_entry_t tmp = list->entries[i];
+            list->entries[i] = list->entries[list->count - 1 - i];
+            list->entries[list->count - 1 - i] = tmp;
         }
-        if (!osStrcmp(entry.name, "..") && path[0] == '\0')
+    }
+}
+
+/**
+ * @brief Reads the names and attributes of all accepted directory entries and sorts them as requested.
+ *
+ * Only this cheap part is done for the whole directory, resolving the entries is left to the page.
+ */
+static error_t indexReadDir(FsDir *dir, const index_query_t *query, bool (*accept)(const FsDirEntry *entry, const void *ctx), const void *ctx, index_dir_t *list)
+{
+    error_t error = indexInitDir(list);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
+    FsDirEntry entry;
+    while (fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (!accept(&entry, ctx))
         {
             continue;
         }
-        bool isDir = (entry.attributes & FS_FILE_ATTR_DIRECTORY);
-        char *filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, entry.name);
-        pathSafeCanonicalize(filePathAbsolute);
+        index_dir_entry_t *dirEntry = indexAddEntry(list, entry.name);
+        if (dirEntry == NULL)
+        {
+            return ERROR_OUT_OF_MEMORY;
+        }
+        dirEntry->date = convertDateToUnixTime(&entry.modified);
+        dirEntry->size = entry.size;
+        dirEntry->isDir = (entry.attributes & FS_FILE_ATTR_DIRECTORY);
+    }
+    indexSortDir(query, list);
+    return NO_ERROR;
+}
 
-        cJSON *jsonEntry = cJSON_CreateObject();
-        cJSON_AddStringToObject(jsonEntry, "name", entry.name);
-        cJSON_AddNumberToObject(jsonEntry, "date", convertDateToUnixTime(&entry.modified));
-        cJSON_AddNumberToObject(jsonEntry, "size", entry.size);
-        cJSON_AddBoolToObject(jsonEntry, "isDir", isDir);
+static void indexFreeDir(index_dir_t *list)
+{
+    osFreeMem(list->entries);
+    mem_arena_free(list->arena);
+}
 
-        tonie_info_t *tafInfo = getTonieInfo(filePathAbsolute, false, client_ctx->settings);
-        toniesJson_item_t *item = NULL;
-        if (tafInfo->valid)
+/* position of the first entry after the cursor */
+static size_t indexStart(const index_query_t *query, const index_dir_t *list)
+{
+    if (!query->hasCursor)
+    {
+        return 0;
+    }
+    size_t pos = 0;
+    while (pos < list->count && indexCompare(query, indexSortKey(query, &list->entries[pos]), list->entries[pos].name, query->cursorKey, query->cursorName) <= 0)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/* number of entries to resolve next, not more than the page can still take */
+static size_t indexBatchCount(const index_query_t *query, const index_dir_t *list, size_t pos, size_t written)
+{
+    size_t count = MIN(INDEX_BATCH_SIZE, list->count - pos);
+    if (query->limit > 0)
+    {
+        count = MIN(count, query->limit - written);
+    }
+    return count;
+}
+
+/* closes the listing array and adds the cursor of the next page, if there are entries left, the caller closes the object */
+static void indexWriteEnd(json_writer_t *writer, const index_query_t *query, const index_dir_t *list, size_t pos)
+{
+    json_writer_array_end(writer);
+    if (query->limit > 0 && pos > 0 && pos < list->count)
+    {
+        char cursor[INDEX_CURSOR_LEN];
+        const index_dir_entry_t *last = &list->entries[pos - 1];
+        osSnprintf(cursor, sizeof(cursor), "%" PRIu64 ":%s", indexSortKey(query, last), last->name);
+        json_writer_string(writer, "nextCursor", cursor);
+    }
+}
+
+typedef struct
+{
+    const index_dir_entry_t *entry;
+    char *filePathAbsolute;
+    tonie_info_t *tafInfo;
+    toniesJson_item_t *item;
+    bool hasContentJson;
+    bool hide;
+    bool hasCloudAuth;
+} file_index_entry_t;
+
+typedef struct
+{
+    file_index_entry_t *entries;
+    const index_query_t *query;
+    settings_t *settings;
+    const tonies_db_t *db; /* held until the items are written */
+} file_index_batch_t;
+
+static bool fileIndexAccept(const FsDirEntry *entry, const void *ctx)
+{
+    const char *path = (const char *)ctx;
+    if (!osStrcmp(entry->name, "."))
+    {
+        return false;
+    }
+    if (!osStrcmp(entry->name, "..") && path[0] == '\0')
+    {
+        return false;
+    }
+    return true;
+}
+
+/* reads the TAF header or content json of one entry, runs on the worker pool */
+static void fileIndexResolve(void *ctx, size_t index)
+{
+    file_index_batch_t *batch = (file_index_batch_t *)ctx;
+    file_index_entry_t *fileEntry = &batch->entries[index];
+    bool isDir = fileEntry->entry->isDir;
+    char *filePathAbsolute = fileEntry->filePathAbsolute;
+    /* the tonies.json lookups are only done for rows that show or filter by them */
+    bool needsItem = indexQueryField(batch->query, "tonieInfo") || batch->query->modelPrefix[0] != '\0';
+
+    tonie_info_t *tafInfo = getTonieInfo(filePathAbsolute, false, batch->settings);
+    toniesJson_item_t *item = NULL;
+    if (tafInfo->valid)
+    {
+        if (needsItem)
         {
-            cJSON *tafHeaderEntry = cJSON_AddObjectToObject(jsonEntry, "tafHeader");
-            cJSON_AddNumberToObject(tafHeaderEntry, "audioId", tafInfo->tafHeader->audio_id);
-            char sha1Hash[41];
-            sha1Hash[0] = '\0';
-            for (int pos = 0; pos < tafInfo->tafHeader->sha1_hash.len; pos++)
+            item = tonies_byAudioIdHashModel(batch->db, tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
+        }
+    }
+    else
+    {
+        char *json_extension = NULL;
+        if (isDir)
+        {
+            char *filePathAbsoluteSub = NULL;
+            FsDir *subdir = needsItem ? fsOpenDir(filePathAbsolute) : NULL;
+            FsDirEntry subentry;
+            if (subdir != NULL)
             {
-                char tmp[3];
-                osSprintf(tmp, "%02x", tafInfo->tafHeader->sha1_hash.data[pos]);
-                osStrcat(sha1Hash, tmp);
+                while (true)
+                {
+                    if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
+                    {
+                        fsCloseDir(subdir);
+                        break;
+                    }
+                    filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
+
+                    json_extension = osStrstr(filePathAbsoluteSub, ".json");
+                    if (json_extension != NULL)
+                    {
+                        *json_extension = '\0';
+                    }
+
+                    contentJson_t contentJson = {0};
+                    load_content_json(filePathAbsoluteSub, &contentJson, false, batch->settings);
+                    item = tonies_byModel(batch->db, contentJson.tonie_model);
+                    osFreeMem(filePathAbsoluteSub);
+                    free_content_json(&contentJson);
+                }
             }
-            cJSON_AddStringToObject(tafHeaderEntry, "sha1Hash", sha1Hash);
-            cJSON_AddNumberToObject(tafHeaderEntry, "size", tafInfo->tafHeader->num_bytes);
-            cJSON_AddBoolToObject(tafHeaderEntry, "valid", tafInfo->valid);
-            cJSON *tracksArray = cJSON_AddArrayToObject(tafHeaderEntry, "trackSeconds");
-            for (size_t i = 0; i < tafInfo->additional.track_positions.count; i++)
+        }
+        else
+        {
+            json_extension = osStrstr(filePathAbsolute, ".json");
+            if (json_extension != NULL)
             {
-                cJSON_AddItemToArray(tracksArray, cJSON_CreateNumber(tafInfo->additional.track_positions.pos[i]));
+                *json_extension = '\0';
+            }
+            contentJson_t contentJson = {0};
+            load_content_json(filePathAbsolute, &contentJson, false, batch->settings);
+            if (needsItem)
+            {
+                item = tonies_byModel(batch->db, contentJson.tonie_model);
             }
 
-            item = tonies_byAudioIdHashModel(tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
+            fileEntry->hasContentJson = true;
+            fileEntry->hide = contentJson.hide;
+            fileEntry->hasCloudAuth = contentJson._has_cloud_auth;
+            free_content_json(&contentJson);
         }
-        else
+    }
+    fileEntry->tafInfo = tafInfo;
+    fileEntry->item = item;
+}
+
+static bool fileIndexMatches(const index_query_t *query, const file_index_entry_t *fileEntry)
+{
+    tonie_info_t *tafInfo = fileEntry->tafInfo;
+
+    if (query->validOnly && !tafInfo->valid)
+    {
+        return false;
+    }
+    if (query->hidden >= 0 && fileEntry->hide != query->hidden)
+    {
+        return false;
+    }
+    if (query->hasCloudAuth >= 0 && fileEntry->hasCloudAuth != query->hasCloudAuth)
+    {
+        return false;
+    }
+    if (query->hasAudioId && (!tafInfo->valid || tafInfo->tafHeader->audio_id != query->audioId))
+    {
+        return false;
+    }
+    if (query->modelPrefix[0] != '\0' && !indexQueryModel(query, fileEntry->item ? fileEntry->item->model : NULL))
+    {
+        return false;
+    }
+    return true;
+}
+
+static void fileIndexWrite(json_writer_t *writer, const index_query_t *query, file_index_entry_t *fileEntry)
+{
+    tonie_info_t *tafInfo = fileEntry->tafInfo;
+
+    json_writer_object_begin(writer, NULL);
+    if (indexQueryField(query, "name"))
+    {
+        json_writer_string(writer, "name", fileEntry->entry->name);
+    }
+    if (indexQueryField(query, "date"))
+    {
+        json_writer_number(writer, "date", fileEntry->entry->date);
+    }
+    if (indexQueryField(query, "size"))
+    {
+        json_writer_number(writer, "size", fileEntry->entry->size);
+    }
+    if (indexQueryField(query, "isDir"))
+    {
+        json_writer_bool(writer, "isDir", fileEntry->entry->isDir);
+    }
+
+    if (tafInfo->valid && indexQueryField(query, "tafHeader"))
+    {
+        json_writer_object_begin(writer, "tafHeader");
+        json_writer_number(writer, "audioId", tafInfo->tafHeader->audio_id);
+        char sha1Hash[41];
+        sha1Hash[0] = '\0';
+        for (int pos = 0; pos < tafInfo->tafHeader->sha1_hash.len; pos++)
+        {
+            char tmp[3];
+            osSprintf(tmp, "%02x", tafInfo->tafHeader->sha1_hash.data[pos]);
+            osStrcat(sha1Hash, tmp);
+        }
+        json_writer_string(writer, "sha1Hash", sha1Hash);
+        json_writer_number(writer, "size", tafInfo->tafHeader->num_bytes);
+        json_writer_bool(writer, "valid", tafInfo->valid);
+        if (indexQueryField(query, "trackSeconds"))
         {
-            char *json_extension = NULL;
-            if (isDir)
+            json_writer_array_begin(writer, "trackSeconds");
+            for (size_t i = 0; i < tafInfo->additional.track_positions.count; i++)
             {
-                char *filePathAbsoluteSub = NULL;
-                FsDir *subdir = fsOpenDir(filePathAbsolute);
-                FsDirEntry subentry;
-                if (subdir != NULL)
-                {
-                    while (true)
-                    {
-                        if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
-                        {
-                            fsCloseDir(subdir);
-                            break;
-                        }
-                        filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
+                json_writer_number(writer, NULL, tafInfo->additional.track_positions.pos[i]);
+            }
+            json_writer_array_end(writer);
+        }
+        json_writer_object_end(writer);
+    }
+    else if (!tafInfo->valid && fileEntry->hasContentJson)
+    {
+        if (indexQueryField(query, "hide"))
+        {
+            json_writer_bool(writer, "hide", fileEntry->hide);
+        }
+        if (fileEntry->hasCloudAuth && indexQueryField(query, "has_cloud_auth"))
+        {
+            json_writer_bool(writer, "has_cloud_auth", true);
+        }
+    }
+    if (fileEntry->item != NULL && indexQueryField(query, "tonieInfo"))
+    {
+        writeToniesJsonInfo(writer, "tonieInfo", fileEntry->item, NULL);
+    }
+    json_writer_object_end(writer);
+}
+
+error_t handleApiFileIndexV2(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay), &client_ctx->settings) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    char path[128];
+
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+    index_query_t query;
+    indexQueryParse(queryString, &query);
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    pathSafeCanonicalize(path);
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+    pathSafeCanonicalize(pathAbsolute);
+
+    FsDir *dir = fsOpenDir(pathAbsolute);
+    if (dir == NULL)
+    {
+        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
+        osFreeMem(pathAbsolute);
+        return ERROR_FAILURE;
+    }
 
-                        json_extension = osStrstr(filePathAbsoluteSub, ".json");
-                        if (json_extension != NULL)
-                        {
-                            *json_extension = '\0';
-                        }
+    systime_t start = osGetSystemTime();
+    index_dir_t list;
+    error_t error = indexReadDir(dir, &query, &fileIndexAccept, path, &list);
+    fsCloseDir(dir);
 
-                        contentJson_t contentJson = {0};
-                        load_content_json(filePathAbsoluteSub, &contentJson, false, client_ctx->settings);
-                        item = tonies_byModel(contentJson.tonie_model);
-                        osFreeMem(filePathAbsoluteSub);
-                        free_content_json(&contentJson);
-                    }
-                }
-            }
-            else
-            {
-                json_extension = osStrstr(filePathAbsolute, ".json");
-                if (json_extension != NULL)
-                {
-                    *json_extension = '\0';
-                }
-                contentJson_t contentJson = {0};
-                load_content_json(filePathAbsolute, &contentJson, false, client_ctx->settings);
-                item = tonies_byModel(contentJson.tonie_model);
+    json_writer_t *writer = osAllocMem(sizeof(json_writer_t));
+    file_index_entry_t *entries = osAllocMem(INDEX_BATCH_SIZE * sizeof(file_index_entry_t));
+    if (error != NO_ERROR || writer == NULL || entries == NULL)
+    {
+        osFreeMem(writer);
+        osFreeMem(entries);
+        indexFreeDir(&list);
+        osFreeMem(pathAbsolute);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    json_writer_begin(writer, connection, "text/json");
+    json_writer_object_begin(writer, NULL);
+    json_writer_array_begin(writer, "files");
 
-                cJSON_AddBoolToObject(jsonEntry, "hide", contentJson.hide);
-                if (contentJson._has_cloud_auth)
-                {
-                    cJSON_AddBoolToObject(jsonEntry, "has_cloud_auth", true);
-                }
-                free_content_json(&contentJson);
-            }
-        }
-        if (item != NULL)
+    /* entries of the page are resolved in batches on the worker pool and written in listing order */
+    tonies_db_t *db = tonies_dbAcquire();
+    file_index_batch_t batch = {.entries = entries, .query = &query, .settings = client_ctx->settings, .db = db};
+    uint32_t workers = client_ctx->settings->core.index_workers;
+    size_t pos = indexStart(&query, &list);
+    size_t written = 0;
+    while (pos < list.count && (query.limit == 0 || written < query.limit))
+    {
+        size_t count = indexBatchCount(&query, &list, pos, written);
+        for (size_t i = 0; i < count; i++)
         {
-            addToniesJsonInfoJson(item, NULL, jsonEntry);
+            file_index_entry_t *fileEntry = &entries[i];
+            osMemset(fileEntry, 0, sizeof(file_index_entry_t));
+            fileEntry->entry = &list.entries[pos + i];
+            fileEntry->filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, fileEntry->entry->name);
+            pathSafeCanonicalize(fileEntry->filePathAbsolute);
         }
-        freeTonieInfo(tafInfo);
 
-        osFreeMem(filePathAbsolute);
-        cJSON_AddItemToArray(jsonArray, jsonEntry);
+        worker_pool_run(&fileIndexResolve, &batch, count, workers);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (fileIndexMatches(&query, &entries[i]))
+            {
+                fileIndexWrite(writer, &query, &entries[i]);
+                written++;
+            }
+            freeTonieInfo(entries[i].tafInfo);
+            osFreeMem(entries[i].filePathAbsolute);
+        }
+        pos += count;
     }
+    tonies_dbRelease(db);
+    indexWriteEnd(writer, &query, &list, pos);
+    json_writer_object_end(writer);
+    TRACE_DEBUG("Indexed %zu of %zu files of '%s' in %" PRIu32 " ms with %" PRIu32 " workers\r\n", written, list.count, pathAbsolute, (uint32_t)(osGetSystemTime() - start), workers);
 
+    osFreeMem(entries);
+    indexFreeDir(&list);
     osFreeMem(pathAbsolute);
-    char *jsonString = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
-
-    httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    error = json_writer_end(writer);
+    osFreeMem(writer);
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+    return error;
 }
 error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
@@ -767,6 +1292,7 @@ error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const
 
         cJSON *json = cJSON_CreateObject();
         cJSON *jsonArray = cJSON_AddArrayToObject(json, "files");
+        tonies_db_t *db = tonies_dbAcquire();
 
         while (true)
         {
@@ -815,7 +1341,7 @@ error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const
                 osSnprintf(extraDesc, sizeof(extraDesc), ":%" PRIu64 ":%" PRIuSIZE, tafInfo->tafHeader->num_bytes, tafInfo->tafHeader->n_track_page_nums);
                 osStrcat(desc, extraDesc);
 
-                item = tonies_byAudioIdHashModel(tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
+                item = tonies_byAudioIdHashModel(db, tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
             }
             else
             {
@@ -844,7 +1370,7 @@ error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const
 
                             contentJson_t contentJson = {0};
                             load_content_json(filePathAbsoluteSub, &contentJson, false, client_ctx->settings);
-                            item = tonies_byModel(contentJson.tonie_model);
+                            item = tonies_byModel(db, contentJson.tonie_model);
                             osFreeMem(filePathAbsoluteSub);
                             free_content_json(&contentJson);
                         }
@@ -859,7 +1385,7 @@ error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const
                     }
                     contentJson_t contentJson = {0};
                     load_content_json(filePathAbsolute, &contentJson, false, client_ctx->settings);
-                    item = tonies_byModel(contentJson.tonie_model);
+                    item = tonies_byModel(db, contentJson.tonie_model);
 
                     if (contentJson._has_cloud_auth)
                     {
@@ -881,6 +1407,7 @@ error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const
 
             pos++;
         }
+        tonies_dbRelease(db);
 
         osFreeMem(pathAbsolute);
         osFreeMem(jsonString);
@@ -1646,6 +2173,10 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
         length = client_ctx->settings->encode.stream_max_size;
         connection->response.noCache = true;
     }
+    else
+    {
+        httpSetTafEntityTag(connection, tafInfo, skipFileHeader);
+    }
 
     freeTonieInfo(tafInfo);
 
@@ -1660,62 +2191,55 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
 
     // Open the file for reading
     file = fsOpenFile(file_path, FS_FILE_MODE_READ);
+
+    taf_index_key_t contentKey = {0};
+    stream_buffer_t *streamBuffer = NULL;
+    if (!isStream)
+    {
+        taf_index_stat(file_path, &contentKey);
+    }
+    else
+    {
+        streamBuffer = stream_buffer_open(file_path);
+    }
     free(file_path);
 
     // Failed to open the file?
     if (file == NULL)
     {
+        stream_buffer_release(streamBuffer);
         return ERROR_NOT_FOUND;
     }
 
-    char *range_hdr = NULL;
-
-    // Format HTTP response header
-    // TODO add status 416 on invalid ranges
-    if (!isStream && connection->request.Range.start > 0)
-    {
-        connection->request.Range.size = length;
-        if (connection->request.Range.end >= connection->request.Range.size || connection->request.Range.end == 0)
-        {
-            connection->request.Range.end = connection->request.Range.size - 1;
-        }
+    connection->response.contentType = "audio/ogg";
 
-        range_hdr = custom_asprintf("bytes %" PRIu32 "-%" PRIu32 "/%" PRIu32, connection->request.Range.start, connection->request.Range.end, connection->request.Range.size);
-        connection->response.contentRange = range_hdr;
-        connection->response.statusCode = 206;
-        connection->response.contentLength = connection->request.Range.end - connection->request.Range.start + 1;
-        TRACE_DEBUG("Added response range %s\r\n", connection->response.contentRange);
-    }
-    else
+    /* complete files support conditional and multi range requests and are sent by the kernel or the content cache */
+    if (!isStream)
     {
-        connection->response.statusCode = 200;
-        connection->response.contentLength = length;
+        error = httpSendFileRanges(connection, file, &contentKey, startOffset, length);
+        fsCloseFile(file);
+        return error;
     }
-    connection->response.contentType = "audio/ogg";
+
+    connection->response.statusCode = 200;
+    connection->response.contentLength = length;
     connection->response.chunkedEncoding = FALSE;
 
     error = httpWriteHeader(connection);
-
-    if (range_hdr)
-    {
-        osFreeMem(range_hdr);
-    }
-
     if (error)
     {
         fsCloseFile(file);
+        stream_buffer_release(streamBuffer);
         return error;
     }
 
-    if (!isStream && connection->request.Range.start > 0 && connection->request.Range.start < connection->request.Range.size)
-    {
-        TRACE_DEBUG("Seeking file to %" PRIu32 "\r\n", connection->request.Range.start);
-        fsSeekFile(file, startOffset + connection->request.Range.start, FS_SEEK_SET);
-    }
-    else
+    fsSeekFile(file, startOffset, FS_SEEK_SET);
+
+    stream_buffer_reader_t streamReader;
+    if (streamBuffer && stream_buffer_reader_attach(&streamReader, streamBuffer, startOffset) != NO_ERROR)
     {
-        TRACE_DEBUG("No seeking, sending from beginning\r\n");
-        fsSeekFile(file, startOffset, FS_SEEK_SET);
+        stream_buffer_release(streamBuffer);
+        streamBuffer = NULL;
     }
 
     // Send response body
@@ -1724,13 +2248,29 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
         // Limit the number of bytes to read at a time
         n = MIN(length, HTTP_SERVER_BUFFER_SIZE);
 
-        // Read data from the specified file
-        error = fsReadFile(file, connection->buffer, n, &n);
-        // End of input stream?
-        if (isStream && error == ERROR_END_OF_FILE && connection->running)
+        if (streamBuffer)
         {
-            osDelayTask(500);
-            continue;
+            /* woken up by the encoder for every finished block */
+            error = stream_buffer_read_file(&streamReader, file, (uint8_t *)connection->buffer, n, &n, STREAM_BUFFER_WAIT_MS);
+            if (error == ERROR_TIMEOUT && connection->running)
+            {
+                continue;
+            }
+            if (error == ERROR_END_OF_STREAM)
+            {
+                error = ERROR_END_OF_FILE;
+            }
+        }
+        else
+        {
+            // Read data from the specified file
+            error = fsReadFile(file, connection->buffer, n, &n);
+            // End of input stream?
+            if (isStream && error == ERROR_END_OF_FILE && connection->running)
+            {
+                osDelayTask(500);
+                continue;
+            }
         }
         if (error)
             break;
@@ -1747,6 +2287,11 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
 
     // Close the file
     fsCloseFile(file);
+    if (streamBuffer)
+    {
+        stream_buffer_reader_detach(&streamReader);
+        stream_buffer_release(streamBuffer);
+    }
 
     // Successful file transfer?
     if (error == NO_ERROR || error == ERROR_END_OF_FILE)
@@ -2326,8 +2871,7 @@ error_t handleApiFileMove(HttpConnection *connection, const char_t *uri, const c
 
 error_t handleApiToniesJsonReload(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    tonies_deinit();
-    tonies_init();
+    tonies_reload();
     httpPrepareHeader(connection, "text/plain; charset=utf-8", 2);
     return httpWriteResponseString(connection, "OK", false);
 }
@@ -2335,6 +2879,8 @@ error_t handleApiToniesJson(HttpConnection *connection, const char_t *uri, const
 {
     char *tonies_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_FILE);
 
+    /* may be cached, but has to be revalidated, which is answered with 304 while unchanged */
+    connection->response.cacheControl = "no-cache";
     error_t err = httpSendResponseUnsafe(connection, uri, tonies_path);
     osFreeMem(tonies_path);
     return err;
@@ -2351,6 +2897,7 @@ error_t handleApiToniesCustomJson(HttpConnection *connection, const char_t *uri,
 {
     char *tonies_custom_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_CUSTOM_JSON_FILE);
 
+    connection->response.cacheControl = "no-cache";
     error_t err = httpSendResponseUnsafe(connection, uri, tonies_custom_path);
     osFreeMem(tonies_custom_path);
     return err;
@@ -2440,8 +2987,8 @@ error_t handleApiTonieboxJson(HttpConnection *connection, const char_t *uri, con
 
                 if (settings_get_bool("tonie_json.cache_preload"))
                 {
-                    /* try to download and cache the file */
-                    cache_fetch_entry(cache);
+                    /* download and cache the file in the background */
+                    cache_prefetch(cache);
                 }
             }
         }
@@ -2522,34 +3069,77 @@ error_t handleApiTonieboxCustomJson(HttpConnection *connection, const char_t *ur
 
 error_t handleApiToniesJsonSearch(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    char searchModel[256];
-    char searchSeries[256];
-    char searchEpisode[256];
+    char searchText[TONIES_SEARCH_QUERY_LEN];
+    char searchModel[TONIES_SEARCH_QUERY_LEN];
+    char searchSeries[TONIES_SEARCH_QUERY_LEN];
+    char searchEpisode[TONIES_SEARCH_QUERY_LEN];
+    char number[16];
+    searchText[0] = '\0';
     searchModel[0] = '\0';
     searchSeries[0] = '\0';
     searchEpisode[0] = '\0';
-    toniesJson_item_t *result[18];
-    size_t result_size;
+    size_t offset = 0;
+    size_t limit = TONIES_SEARCH_DEFAULT_LIMIT;
 
+    queryGet(queryString, "q", searchText, sizeof(searchText));
     queryGet(queryString, "searchModel", searchModel, sizeof(searchModel));
     queryGet(queryString, "searchSeries", searchSeries, sizeof(searchSeries));
     queryGet(queryString, "searchEpisode", searchEpisode, sizeof(searchEpisode));
+    if (queryGet(queryString, "offset", number, sizeof(number)))
+    {
+        offset = strtoul(number, NULL, 10);
+    }
+    if (queryGet(queryString, "limit", number, sizeof(number)))
+    {
+        limit = MIN(strtoul(number, NULL, 10), TONIES_SEARCH_MAX_LIMIT);
+    }
 
-    tonies_byModelSeriesEpisode(searchModel, searchSeries, searchEpisode, result, &result_size);
+    tonies_search_term_t terms[] = {
+        {.text = searchText, .fields = TONIES_SEARCH_FIELD_ALL},
+        {.text = searchModel, .fields = TONIES_SEARCH_FIELD_MODEL},
+        {.text = searchSeries, .fields = TONIES_SEARCH_FIELD_SERIES},
+        {.text = searchEpisode, .fields = TONIES_SEARCH_FIELD_EPISODES},
+    };
+    toniesJson_item_t *result[TONIES_SEARCH_MAX_LIMIT];
+    size_t total = 0;
+    /* the results point into the version, which is held until they are sent */
+    tonies_db_t *db = tonies_dbAcquire();
+    size_t result_size = tonies_search(db, terms, sizeof(terms) / sizeof(terms[0]), offset, limit, result, &total);
 
-    cJSON *jsonArray = cJSON_CreateArray();
+    json_writer_t *writer = osAllocMem(sizeof(json_writer_t));
+    if (writer == NULL)
+    {
+        tonies_dbRelease(db);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    json_writer_begin(writer, connection, "text/json");
+
+    /* the field searches of the web frontend get the plain array, free text searches a page with the total count */
+    const char *itemsKey = NULL;
+    if (searchText[0] != '\0')
+    {
+        json_writer_object_begin(writer, NULL);
+        json_writer_number(writer, "total", total);
+        json_writer_number(writer, "offset", offset);
+        json_writer_number(writer, "limit", limit);
+        itemsKey = "items";
+    }
+    json_writer_array_begin(writer, itemsKey);
     for (size_t i = 0; i < result_size; i++)
     {
-        addToniesJsonInfoJson(result[i], NULL, jsonArray);
+        writeToniesJsonInfo(writer, NULL, result[i], NULL);
+    }
+    json_writer_array_end(writer);
+    if (searchText[0] != '\0')
+    {
+        json_writer_object_end(writer);
     }
 
-    char *jsonString = cJSON_PrintUnformatted(jsonArray);
-    cJSON_Delete(jsonArray);
-    httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    error_t error = json_writer_end(writer);
+    osFreeMem(writer);
+    tonies_dbRelease(db);
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+    return error;
 }
 error_t handleApiContentJson(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
@@ -2725,7 +3315,23 @@ bool isHexString(const char *buf, size_t maxLen)
     return isHex;
 }
 
-error_t getTagInfoJson(char ruid[17], cJSON *jsonTarget, client_ctx_t *client_ctx)
+/* if a tag passes the filters of a listing, the tag registry keeps the values for this */
+static bool indexTagMatches(const index_query_t *query, const tag_registry_attr_t *attr)
+{
+    if (query == NULL)
+    {
+        return true;
+    }
+    return (!query->validOnly || attr->valid) &&
+           (query->hidden < 0 || attr->hide == query->hidden) &&
+           (query->hasCloudAuth < 0 || attr->hasCloudAuth == query->hasCloudAuth) &&
+           (!query->hasAudioId || (attr->hasAudioId && attr->audioId == query->audioId)) &&
+           indexQueryModel(query, attr->model);
+}
+
+/* with a query, tags not matching its filters are skipped and the tonies.json lookups are only done when needed,
+ * attr receives the filtered values if given */
+error_t getTagInfoJson(char ruid[17], cJSON *jsonTarget, client_ctx_t *client_ctx, const index_query_t *query, tag_registry_attr_t *attr)
 {
     error_t error = NO_ERROR;
     /* build filename with 8 chars of the taf/json */
@@ -2747,7 +3353,27 @@ error_t getTagInfoJson(char ruid[17], cJSON *jsonTarget, client_ctx_t *client_ct
         saveTonieInfo(tafInfo, true);
         contentJson = tafInfo->json;
 
-        if (contentJson._valid)
+        tag_registry_attr_t tagAttr;
+        osMemset(&tagAttr, 0, sizeof(tagAttr));
+        tagAttr.valid = tafInfo->valid;
+        tagAttr.hide = tafInfo->json.hide;
+        tagAttr.hasCloudAuth = tafInfo->json._has_cloud_auth && !tafInfo->json.cloud_override;
+        if (tafInfo->valid)
+        {
+            tagAttr.hasAudioId = true;
+            tagAttr.audioId = tafInfo->tafHeader->audio_id;
+        }
+        if (contentJson.tonie_model != NULL)
+        {
+            osStrncpy(tagAttr.model, contentJson.tonie_model, sizeof(tagAttr.model) - 1);
+        }
+        if (attr != NULL)
+        {
+            *attr = tagAttr;
+        }
+        bool matches = indexTagMatches(query, &tagAttr);
+
+        if (contentJson._valid && matches)
         {
             /* only process one TAF/json per directory */
             cJSON *jsonEntry = cJSON_CreateObject();
@@ -2806,17 +3432,31 @@ error_t getTagInfoJson(char ruid[17], cJSON *jsonTarget, client_ctx_t *client_ct
             osFreeMem(audioUrl);
             osFreeMem(downloadUrl);
 
-            toniesJson_item_t *item = tonies_byModel(contentJson.tonie_model);
-            addToniesJsonInfoJson(item, contentJson.tonie_model, jsonEntry);
+            bool withTonieInfo = indexQueryField(query, "tonieInfo");
+            bool withSourceInfo = indexQueryField(query, "sourceInfo");
+            tonies_db_t *db = tonies_dbAcquire();
+            toniesJson_item_t *item = NULL;
+            if (withTonieInfo || withSourceInfo)
+            {
+                item = tonies_byModel(db, contentJson.tonie_model);
+            }
+            if (withTonieInfo)
+            {
+                addToniesJsonInfoJson(item, contentJson.tonie_model, jsonEntry);
+            }
 
-            toniesJson_item_t *item2 = tonies_byModel(contentJson._source_model);
-            if (tafInfo->exists && item != item2)
+            if (withSourceInfo)
             {
-                cJSON *jsonSourceInfo = cJSON_CreateObject();
-                addToniesJsonInfoJson(item2, contentJson._source_model, jsonSourceInfo);
-                cJSON *tonieInfoCopy = cJSON_DetachItemFromObject(jsonSourceInfo, "tonieInfo");
-                cJSON_AddItemToObject(jsonEntry, "sourceInfo", tonieInfoCopy);
+                toniesJson_item_t *item2 = tonies_byModel(db, contentJson._source_model);
+                if (tafInfo->exists && item != item2)
+                {
+                    cJSON *jsonSourceInfo = cJSON_CreateObject();
+                    addToniesJsonInfoJson(item2, contentJson._source_model, jsonSourceInfo);
+                    cJSON *tonieInfoCopy = cJSON_DetachItemFromObject(jsonSourceInfo, "tonieInfo");
+                    cJSON_AddItemToObject(jsonEntry, "sourceInfo", tonieInfoCopy);
+                }
             }
+            tonies_dbRelease(db);
 
             if (cJSON_IsArray(jsonTarget))
             {
@@ -2862,7 +3502,7 @@ error_t handleApiTagInfo(HttpConnection *connection, const char_t *uri, const ch
 
     cJSON *json = cJSON_CreateObject();
 
-    error_t error = getTagInfoJson(ruid, json, client_ctx);
+    error_t error = getTagInfoJson(ruid, json, client_ctx, NULL, NULL);
     if (error != NO_ERROR)
     {
         cJSON_Delete(json);
@@ -2878,99 +3518,311 @@ error_t handleApiTagInfo(HttpConnection *connection, const char_t *uri, const ch
 
     return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
 }
-error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+typedef struct
 {
-    char overlay[16];
-    const char *rootPath = NULL;
+    const index_dir_entry_t *entry;
+    cJSON *json;
+} tag_index_entry_t;
 
-    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay), &client_ctx->settings) != NO_ERROR)
-    {
-        return ERROR_FAILURE;
-    }
+typedef struct
+{
+    tag_index_entry_t *entries;
+    const index_query_t *query;
+    const char *rootPath;
+    client_ctx_t *client_ctx;
+} tag_index_batch_t;
 
-    FsDir *dir = fsOpenDir(rootPath);
-    if (dir == NULL)
-    {
-        TRACE_ERROR("Failed to open dir '%s'\r\n", rootPath);
-        return ERROR_FAILURE;
-    }
+static bool tagIndexAccept(const FsDirEntry *entry, const void *ctx)
+{
+    return (entry->attributes & FS_FILE_ATTR_DIRECTORY) && osStrlen(entry->name) == 8 && isHexString(entry->name, 8);
+}
 
-    cJSON *json = cJSON_CreateObject();
-    cJSON *jsonArray = cJSON_AddArrayToObject(json, "tags");
+/* finds the content of a tag directory and adds its info to jsonArray */
+static void tagIndexFind(const char *rootPath, const char *name, cJSON *jsonArray, client_ctx_t *client_ctx, const index_query_t *query, tag_registry_attr_t *attr)
+{
+    char ruid[17];
+    osStrncpy(ruid, name, 8);
+    ruid[8] = '\0';
 
-    while (true)
+    char *subDirPath = custom_asprintf("%s/%s", rootPath, name);
+    FsDir *subDir = fsOpenDir(subDirPath);
+
+    while (subDir != NULL)
     {
-        FsDirEntry entry;
-        if (fsReadDir(dir, &entry) != NO_ERROR)
+        FsDirEntry subEntry;
+        if (fsReadDir(subDir, &subEntry) != NO_ERROR)
         {
-            fsCloseDir(dir);
             break;
         }
 
-        if (!(entry.attributes & FS_FILE_ATTR_DIRECTORY))
+        /* do not process directories here */
+        if ((subEntry.attributes & FS_FILE_ATTR_DIRECTORY))
         {
             continue;
         }
-        if (osStrlen(entry.name) != 8)
+        /* filename must start with 8 hex characters */
+        if (!isHexString(subEntry.name, 8))
         {
             continue;
         }
 
-        if (!isHexString(entry.name, 8))
+        /* fill rest of reverse UID */
+        osStrncpy(&ruid[8], subEntry.name, 8);
+        ruid[16] = '\0';
+        for (size_t i = 0; ruid[i] != '\0'; i++)
+        {
+            ruid[i] = tolower(ruid[i]);
+        }
+
+        if (getTagInfoJson(ruid, jsonArray, client_ctx, query, attr) == NO_ERROR)
+        {
+            break;
+        }
+    }
+    if (subDir != NULL)
+    {
+        fsCloseDir(subDir);
+    }
+    osFreeMem(subDirPath);
+}
+
+/* finds the content of one tag directory and builds its info, runs on the worker pool */
+static void tagIndexResolve(void *ctx, size_t index)
+{
+    tag_index_batch_t *batch = (tag_index_batch_t *)ctx;
+    tag_index_entry_t *tagEntry = &batch->entries[index];
+
+    tagEntry->json = cJSON_CreateArray();
+    tagIndexFind(batch->rootPath, tagEntry->entry->name, tagEntry->json, batch->client_ctx, batch->query, NULL);
+}
+
+cJSON *getTagRegistryInfo(const char *name, client_ctx_t *client_ctx, tag_registry_attr_t *attr)
+{
+    cJSON *jsonArray = cJSON_CreateArray();
+    tagIndexFind(client_ctx->settings->internal.contentdirfull, name, jsonArray, client_ctx, NULL, attr);
+    cJSON *tag = NULL;
+    if (jsonArray->child != NULL)
+    {
+        tag = cJSON_DetachItemViaPointer(jsonArray, jsonArray->child);
+    }
+    cJSON_Delete(jsonArray);
+    return tag;
+}
+
+static void tagIndexWrite(json_writer_t *writer, const index_query_t *query, const cJSON *tag)
+{
+    json_writer_object_begin(writer, NULL);
+    for (const cJSON *field = tag->child; field != NULL; field = field->next)
+    {
+        if (indexQueryField(query, field->string))
+        {
+            json_writer_cjson(writer, field->string, field);
+        }
+    }
+    json_writer_object_end(writer);
+}
+
+/* the registry builds the URLs for the main settings, they are changed to the overlay of the request */
+static void tagIndexWriteUrl(json_writer_t *writer, const char *key, const char *url, const char *overlayUniqueId)
+{
+    const char *overlay = osStrstr(url, "?overlay=");
+    if (overlay == NULL || overlayUniqueId == NULL)
+    {
+        json_writer_string(writer, key, url);
+        return;
+    }
+    const char *rest = osStrchr(overlay, '&');
+    char *overlayUrl = custom_asprintf("%.*s?overlay=%s%s", (int)(overlay - url), url, overlayUniqueId, rest ? rest : "");
+    json_writer_string(writer, key, overlayUrl);
+    osFreeMem(overlayUrl);
+}
+
+static void tagIndexWriteRegistry(json_writer_t *writer, const index_query_t *query, const cJSON *tag, const char *overlayUniqueId)
+{
+    json_writer_object_begin(writer, NULL);
+    for (const cJSON *field = tag->child; field != NULL; field = field->next)
+    {
+        if (!indexQueryField(query, field->string))
         {
             continue;
         }
+        if (cJSON_IsString(field) && (!osStrcmp(field->string, "audioUrl") || !osStrcmp(field->string, "downloadTriggerUrl")))
+        {
+            tagIndexWriteUrl(writer, field->string, field->valuestring, overlayUniqueId);
+        }
+        else
+        {
+            json_writer_cjson(writer, field->string, field);
+        }
+    }
+    json_writer_object_end(writer);
+}
 
-        char ruid[17];
-        osStrcpy(ruid, entry.name);
+/**
+ * @brief Lists the tags from the tag registry instead of reading the content directory.
+ *
+ * The tags come prebuilt, so they are filtered and written without touching the files. With since,
+ * only the tags changed after that generation are listed and removed ones are sent as tombstones.
+ */
+static error_t tagIndexFromRegistry(HttpConnection *connection, const index_query_t *query, client_ctx_t *client_ctx, const tag_registry_item_t *items, size_t itemCount, uint64_t generation)
+{
+    systime_t start = osGetSystemTime();
+    index_dir_t list;
+    error_t error = indexInitDir(&list);
+    for (size_t i = 0; i < itemCount && error == NO_ERROR; i++)
+    {
+        index_dir_entry_t *dirEntry = indexAddEntry(&list, items[i].name);
+        if (dirEntry == NULL)
+        {
+            error = ERROR_OUT_OF_MEMORY;
+            break;
+        }
+        dirEntry->date = items[i].date;
+        dirEntry->isDir = true;
+        dirEntry->deleted = items[i].deleted;
+        dirEntry->ruid = items[i].ruid;
+    }
+    json_writer_t *writer = osAllocMem(sizeof(json_writer_t));
+    if (error != NO_ERROR || writer == NULL)
+    {
+        osFreeMem(writer);
+        indexFreeDir(&list);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    indexSortDir(query, &list);
 
-        char *subDirPath = custom_asprintf("%s/%s", rootPath, entry.name);
-        FsDir *subDir = fsOpenDir(subDirPath);
+    json_writer_begin(writer, connection, "text/json");
+    json_writer_object_begin(writer, NULL);
+    json_writer_array_begin(writer, "tags");
 
-        while (true)
+    size_t pos = indexStart(query, &list);
+    size_t written = 0;
+    while (pos < list.count && (query->limit == 0 || written < query->limit))
+    {
+        const index_dir_entry_t *dirEntry = &list.entries[pos++];
+        tag_registry_attr_t attr;
+        cJSON *tag = dirEntry->deleted ? NULL : tag_registry_get(dirEntry->name, &attr);
+        if (tag == NULL)
         {
-            FsDirEntry subEntry;
-            if (fsReadDir(subDir, &subEntry) != NO_ERROR)
+            /* removed in the meantime, only clients asking for changes need to know */
+            if (dirEntry->deleted)
             {
-                break;
+                json_writer_object_begin(writer, NULL);
+                json_writer_string(writer, "ruid", dirEntry->ruid);
+                json_writer_bool(writer, "deleted", true);
+                json_writer_object_end(writer);
+                written++;
             }
+            continue;
+        }
+        if (indexTagMatches(query, &attr))
+        {
+            tagIndexWriteRegistry(writer, query, tag, client_ctx->settings->internal.overlayUniqueId);
+            written++;
+        }
+        cJSON_Delete(tag);
+    }
+    indexWriteEnd(writer, query, &list, pos);
+    json_writer_number(writer, "generation", (double)generation);
+    json_writer_object_end(writer);
+    TRACE_DEBUG("Listed %zu of %zu tags from the registry in %" PRIu32 " ms\r\n", written, list.count, (uint32_t)(osGetSystemTime() - start));
 
-            /* do not process directories here */
-            if ((subEntry.attributes & FS_FILE_ATTR_DIRECTORY))
-            {
-                continue;
-            }
-            /* filename must start with 8 hex characters */
-            if (!isHexString(subEntry.name, 8))
-            {
-                continue;
-            }
+    indexFreeDir(&list);
+    error = json_writer_end(writer);
+    osFreeMem(writer);
 
-            /* fill rest of reverse UID */
-            osStrncpy(&ruid[8], subEntry.name, 8);
-            ruid[16] = '\0';
-            for (size_t i = 0; ruid[i] != '\0'; i++)
-            {
-                ruid[i] = tolower(ruid[i]);
-            }
+    return error;
+}
+
+error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay), &client_ctx->settings) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+    index_query_t query;
+    indexQueryParse(queryString, &query);
 
-            if (getTagInfoJson(ruid, jsonArray, client_ctx) == NO_ERROR)
+    char since[24];
+    tag_registry_item_t *items = NULL;
+    size_t itemCount = 0;
+    uint64_t generation = 0;
+    if (!queryGet(queryString, "since", since, sizeof(since)))
+    {
+        osStrcpy(since, "0");
+    }
+    if (tag_registry_list(rootPath, strtoull(since, NULL, 10), &items, &itemCount, &generation))
+    {
+        error_t error = tagIndexFromRegistry(connection, &query, client_ctx, items, itemCount, generation);
+        osFreeMem(items);
+        return error;
+    }
+
+    FsDir *dir = fsOpenDir(rootPath);
+    if (dir == NULL)
+    {
+        TRACE_ERROR("Failed to open dir '%s'\r\n", rootPath);
+        return ERROR_FAILURE;
+    }
+
+    systime_t start = osGetSystemTime();
+    index_dir_t list;
+    error_t error = indexReadDir(dir, &query, &tagIndexAccept, NULL, &list);
+    fsCloseDir(dir);
+
+    json_writer_t *writer = osAllocMem(sizeof(json_writer_t));
+    tag_index_entry_t *entries = osAllocMem(INDEX_BATCH_SIZE * sizeof(tag_index_entry_t));
+    if (error != NO_ERROR || writer == NULL || entries == NULL)
+    {
+        osFreeMem(writer);
+        osFreeMem(entries);
+        indexFreeDir(&list);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    json_writer_begin(writer, connection, "text/json");
+    json_writer_object_begin(writer, NULL);
+    json_writer_array_begin(writer, "tags");
+
+    /* tags of the page are built in batches on the worker pool and sent in listing order,
+     * so memory stays bounded by one batch instead of the whole listing */
+    tag_index_batch_t batch = {.entries = entries, .query = &query, .rootPath = rootPath, .client_ctx = client_ctx};
+    uint32_t workers = client_ctx->settings->core.index_workers;
+    size_t pos = indexStart(&query, &list);
+    size_t written = 0;
+    while (pos < list.count && (query.limit == 0 || written < query.limit))
+    {
+        size_t count = indexBatchCount(&query, &list, pos, written);
+        for (size_t i = 0; i < count; i++)
+        {
+            entries[i].entry = &list.entries[pos + i];
+            entries[i].json = NULL;
+        }
+
+        worker_pool_run(&tagIndexResolve, &batch, count, workers);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (entries[i].json->child != NULL)
             {
-                break;
+                tagIndexWrite(writer, &query, entries[i].json->child);
+                written++;
             }
+            cJSON_Delete(entries[i].json);
         }
-        fsCloseDir(subDir);
-        osFreeMem(subDirPath);
+        pos += count;
     }
+    indexWriteEnd(writer, &query, &list, pos);
+    json_writer_object_end(writer);
+    TRACE_DEBUG("Indexed %zu of %zu tags in %" PRIu32 " ms with %" PRIu32 " workers\r\n", written, list.count, (uint32_t)(osGetSystemTime() - start), workers);
 
-    char *jsonString = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
-
-    httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    osFreeMem(entries);
+    indexFreeDir(&list);
+    error = json_writer_end(writer);
+    osFreeMem(writer);
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+    return error;
 }
 
 #define TEST_TOKEN "THIS_IS_A_TEST_TOKEN"
@@ -3142,13 +3994,23 @@ error_t handleApiCacheStats(HttpConnection *connection, const char_t *uri, const
              "\"exists_entries\": %zu,"
              "\"total_files\": %zu,"
              "\"total_size\": %zu,"
-             "\"memory_used\": %zu"
+             "\"memory_used\": %zu,"
+             "\"max_size\": %zu,"
+             "\"evicted_files\": %zu,"
+             "\"prefetch_pending\": %zu,"
+             "\"prefetch_done\": %zu,"
+             "\"prefetch_failed\": %zu"
              "}",
              stats.total_entries,
              stats.exists_entries,
              stats.total_files,
              stats.total_size,
-             stats.memory_used);
+             stats.memory_used,
+             stats.max_size,
+             stats.evicted_files,
+             stats.prefetch_pending,
+             stats.prefetch_done,
+             stats.prefetch_failed);
 
     httpPrepareHeader(connection, "application/json; charset=utf-8", osStrlen(stats_json));
     return httpWriteResponseString(connection, stats_json, false);
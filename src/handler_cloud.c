@@ -16,6 +16,7 @@
 #include "toniefile.h"
 #include "toniesJson.h"
 #include "tonie_audio_playlist.h"
+#include "stream_registry.h"
 
 #include <byteswap.h>
 
@@ -586,52 +587,69 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
     bool can_use_cloud = !(!client_ctx->settings->cloud.enabled || !client_ctx->settings->cloud.enableV2Content || (tonieInfo->json.nocloud && !tonieInfo->json.cloud_override));
     if (tonieInfo->json._source_type == CT_SOURCE_STREAM)
     {
-        char *streamFileRel = &tonieInfo->json._streamFile[osStrlen(client_ctx->settings->internal.datadirfull)];
         TRACE_INFO("Serve streaming content from %s\r\n", tonieInfo->json._source_resolved);
         connection->response.keepAlive = true;
+        systime_t requestTime = osGetSystemTime();
 
-        ffmpeg_stream_ctx_t ffmpeg_ctx;
-        ffmpeg_ctx.append = (connection->request.Range.start != 0);
-        ffmpeg_ctx.sweep = client_ctx->settings->encode.ffmpeg_sweep_startup_buffer;
-        ffmpeg_ctx.source = tonieInfo->json._source_resolved;
-        ffmpeg_ctx.skip_seconds = tonieInfo->json.skip_seconds;
-        ffmpeg_ctx.targetFile = tonieInfo->json._streamFile;
+        /* boxes playing the same source share one encoder, the first one starts it */
+        bool created = false;
+        stream_pipeline_t *pipeline = stream_registry_subscribe(tonieInfo->json._source_resolved, tonieInfo->json.skip_seconds,
+                                                                tonieInfo->json._streamFile, (connection->request.Range.start != 0),
+                                                                client_ctx->settings, &created);
 
+        /* the box context only tracks this subscription, playback stop ends our sender */
         stream_ctx_t *stream_ctx = &client_ctx->state->box.stream_ctx;
-        stream_ctx->active = false;
+        stream_ctx->active = true;
         stream_ctx->quit = false;
         stream_ctx->error = NO_ERROR;
         stream_ctx->stop_on_playback_stop = true;
-        stream_ctx->ctx = &ffmpeg_ctx;
-        stream_ctx->taskId = osCreateTask(streamFileRel, &ffmpeg_stream_task, stream_ctx, 10 * 1024, 0);
+        stream_ctx->ttfb_start = requestTime;
+        stream_ctx->ctx = NULL;
 
-        while (!stream_ctx->active && stream_ctx->error == NO_ERROR)
+        error_t start_error = ERROR_OUT_OF_RESOURCES;
+        if (pipeline)
         {
-            osDelayTask(100);
+            /* the encoder wakes us up as soon as the TAF header is written */
+            start_error = stream_buffer_wait(pipeline->stream_buffer, 0, INFINITE_DELAY);
         }
-        if (stream_ctx->error == NO_ERROR)
+        if (start_error == NO_ERROR)
         {
-            if (client_ctx->settings->encode.ffmpeg_sweep_startup_buffer)
+            if (created)
             {
-                osDelayTask(client_ctx->settings->encode.ffmpeg_sweep_delay_ms);
+                if (client_ctx->settings->encode.ffmpeg_sweep_startup_buffer)
+                {
+                    /* the startup burst is over once the source delivers at about real time speed */
+                    stream_buffer_wait_input(pipeline->stream_buffer, 0, STREAM_BUFFER_RATE_STEADY_MIN, STREAM_BUFFER_RATE_STEADY_MAX,
+                                             client_ctx->settings->encode.ffmpeg_sweep_delay_ms);
+                }
+                pipeline->ffmpeg_ctx.sweep = false;
+
+                size_t readyBytes = (size_t)client_ctx->settings->encode.stream_ready_blocks * STREAM_BUFFER_BLOCK_SIZE;
+                error_t ready_error = stream_buffer_wait_input(pipeline->stream_buffer, readyBytes, STREAM_BUFFER_RATE_STEADY_MIN, UINT32_MAX,
+                                                               client_ctx->settings->encode.ffmpeg_stream_buffer_ms);
+
+                uint64_t encoded = 0;
+                uint32_t inputRate = 0;
+                stream_buffer_get_telemetry(pipeline->stream_buffer, &encoded, &inputRate);
+                TRACE_INFO("Serve streaming content from %s, %s after %" PRIu32 "ms, %" PRIu64 " bytes encoded, input at %" PRIu32 "%%\r\n",
+                           tonieInfo->json.source, ready_error == NO_ERROR ? "ready" : "not ready", (uint32_t)(osGetSystemTime() - requestTime),
+                           encoded, inputRate / 10);
             }
-
-            uint32_t delay = client_ctx->settings->encode.ffmpeg_stream_buffer_ms;
-            TRACE_INFO("Serve streaming content from %s, delay %" PRIu32 "ms\r\n", tonieInfo->json.source, delay);
-            ffmpeg_ctx.sweep = false;
-
-            osDelayTask(delay);
-            error_t response_error = httpSendResponseStream(connection, streamFileRel, true);
+            char *streamFileRel = &pipeline->targetFile[osStrlen(client_ctx->settings->internal.datadirfull)];
+            error_t response_error = httpSendResponseStreamUnsafe(connection, streamFileRel, pipeline->targetFile, true);
             if (response_error)
             {
                 TRACE_ERROR(" >> file %s not available or not send, error=%s...\r\n", tonieInfo->contentPath, error2text(response_error));
             }
         }
-        stream_ctx->active = false;
-        while (!stream_ctx->quit)
+        else
         {
-            osDelayTask(100);
+            TRACE_ERROR(" >> stream %s could not be started, error=%s...\r\n", tonieInfo->json._source_resolved, error2text(start_error));
         }
+        stream_ctx->active = false;
+        stream_ctx->quit = true;
+        stream_ctx->ttfb_start = 0;
+        stream_registry_unsubscribe(pipeline);
     }
     else if (tonieInfo->json._source_type == CT_SOURCE_TAP_STREAM)
     {
@@ -651,6 +669,7 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         stream_ctx->quit = false;
         stream_ctx->error = NO_ERROR;
         stream_ctx->stop_on_playback_stop = true;
+        stream_ctx->ttfb_start = 0;
         stream_ctx->ctx = &tap_param;
         stream_ctx->taskId = osCreateTask(streamFileRel, &tap_generate_task, stream_ctx, 10 * 1024, 0);
 
@@ -688,6 +707,10 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         {
             TRACE_INFO("Found incomplete TAF, streaming...\r\n");
         }
+        else
+        {
+            httpSetTafEntityTag(connection, tonieInfo, connection->private.client_ctx.skip_taf_header);
+        }
 
         size_t dataPathLen = osStrlen(client_ctx->settings->internal.datadirfull);
         if (osStrncmp(tonieInfo->contentPath, client_ctx->settings->internal.datadirfull, dataPathLen) == 0)
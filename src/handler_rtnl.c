@@ -349,7 +349,9 @@ void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *clie
             uint32_t audioId = read_little_endian32(rpc->log2->field6.data);
             client_ctx->state->tag.audio_id = audioId;
             osSprintf(str_buf, "%u", audioId);
-            toniesJson_item_t *item = tonies_byAudioId(audioId);
+            /* the item is only valid while its tonies json version is held */
+            tonies_db_t *db = tonies_dbAcquire();
+            toniesJson_item_t *item = tonies_byAudioId(db, audioId);
             sse_sendEvent("ContentAudioId", str_buf, true);
             mqtt_sendBoxEvent("ContentAudioId", str_buf, client_ctx);
 
@@ -358,7 +360,7 @@ void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *clie
                 tonie_info_t *tonieInfo = getTonieInfoFromUid(client_ctx->state->tag.uid, false, client_ctx->settings);
                 if (tonieInfo->valid)
                 {
-                    item = tonies_byModel(tonieInfo->json.tonie_model);
+                    item = tonies_byModel(db, tonieInfo->json.tonie_model);
                 }
                 freeTonieInfo(tonieInfo);
             }
@@ -393,6 +395,7 @@ void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *clie
 
                 osFreeMem(url);
             }
+            tonies_dbRelease(db);
         }
         else if (rpc->log2->function_group == RTNL2_FUGR_TILT)
         {
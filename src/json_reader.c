@@ -0,0 +1,345 @@
+#include <string.h>
+
+#include "json_reader.h"
+#include "os_port.h"
+
+static bool json_reader_skipDepth(json_reader_t *reader, size_t depth);
+
+void json_reader_init(json_reader_t *reader, FsFile *file)
+{
+    reader->file = file;
+    reader->pos = 0;
+    reader->length = 0;
+    reader->failed = false;
+    reader->text = reader->textBuffer;
+    reader->text[0] = '\0';
+    reader->textLength = 0;
+    reader->textSize = sizeof(reader->textBuffer);
+}
+
+void json_reader_deinit(json_reader_t *reader)
+{
+    if (reader->text != reader->textBuffer)
+    {
+        osFreeMem(reader->text);
+    }
+    reader->text = reader->textBuffer;
+    reader->textSize = sizeof(reader->textBuffer);
+}
+
+static int json_reader_peekRaw(json_reader_t *reader)
+{
+    if (reader->pos >= reader->length)
+    {
+        if (reader->failed || reader->file == NULL)
+        {
+            return -1;
+        }
+        size_t read = 0;
+        error_t error = fsReadFile(reader->file, reader->buffer, sizeof(reader->buffer), &read);
+        if (error != NO_ERROR || read == 0)
+        {
+            return -1;
+        }
+        reader->pos = 0;
+        reader->length = read;
+    }
+    return (uint8_t)reader->buffer[reader->pos];
+}
+
+static int json_reader_get(json_reader_t *reader)
+{
+    int c = json_reader_peekRaw(reader);
+    if (c >= 0)
+    {
+        reader->pos++;
+    }
+    return c;
+}
+
+static bool json_reader_fail(json_reader_t *reader)
+{
+    reader->failed = true;
+    return false;
+}
+
+static void json_reader_put(json_reader_t *reader, char c)
+{
+    if (reader->failed)
+    {
+        return;
+    }
+    if (reader->textLength + 1 >= reader->textSize)
+    {
+        /* a cut value could end mid UTF-8 sequence, so grow it or give up on the file */
+        size_t size = reader->textSize * 2;
+        char *text = (size <= JSON_READER_TEXT_MAX_SIZE) ? osAllocMem(size) : NULL;
+        if (text == NULL)
+        {
+            json_reader_fail(reader);
+            return;
+        }
+        osMemcpy(text, reader->text, reader->textLength);
+        if (reader->text != reader->textBuffer)
+        {
+            osFreeMem(reader->text);
+        }
+        reader->text = text;
+        reader->textSize = size;
+    }
+    reader->text[reader->textLength++] = c;
+}
+
+static void json_reader_putCodepoint(json_reader_t *reader, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        json_reader_put(reader, (char)cp);
+    }
+    else if (cp < 0x800)
+    {
+        json_reader_put(reader, (char)(0xC0 | (cp >> 6)));
+        json_reader_put(reader, (char)(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000)
+    {
+        json_reader_put(reader, (char)(0xE0 | (cp >> 12)));
+        json_reader_put(reader, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        json_reader_put(reader, (char)(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        json_reader_put(reader, (char)(0xF0 | (cp >> 18)));
+        json_reader_put(reader, (char)(0x80 | ((cp >> 12) & 0x3F)));
+        json_reader_put(reader, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        json_reader_put(reader, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static bool json_reader_hex4(json_reader_t *reader, uint32_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        int c = json_reader_get(reader);
+        *value <<= 4;
+        if (c >= '0' && c <= '9')
+        {
+            *value |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            *value |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            *value |= c - 'A' + 10;
+        }
+        else
+        {
+            return json_reader_fail(reader);
+        }
+    }
+    return true;
+}
+
+int json_reader_peek(json_reader_t *reader)
+{
+    while (true)
+    {
+        int c = json_reader_peekRaw(reader);
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        {
+            return c;
+        }
+        reader->pos++;
+    }
+}
+
+static bool json_reader_expect(json_reader_t *reader, char c)
+{
+    if (reader->failed || json_reader_peek(reader) != (uint8_t)c)
+    {
+        return json_reader_fail(reader);
+    }
+    reader->pos++;
+    return true;
+}
+
+bool json_reader_enter(json_reader_t *reader, char open)
+{
+    return json_reader_expect(reader, open);
+}
+
+bool json_reader_more(json_reader_t *reader, char close)
+{
+    if (reader->failed)
+    {
+        return false;
+    }
+    int c = json_reader_peek(reader);
+    if (c == ',')
+    {
+        reader->pos++;
+        c = json_reader_peek(reader);
+    }
+    if (c == (uint8_t)close)
+    {
+        reader->pos++;
+        return false;
+    }
+    if (c < 0)
+    {
+        return json_reader_fail(reader);
+    }
+    return true;
+}
+
+bool json_reader_string(json_reader_t *reader)
+{
+    reader->textLength = 0;
+    reader->text[0] = '\0';
+    if (!json_reader_expect(reader, '"'))
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        int c = json_reader_get(reader);
+        if (c < 0)
+        {
+            return json_reader_fail(reader);
+        }
+        if (c == '"')
+        {
+            break;
+        }
+        if (c == '\\')
+        {
+            c = json_reader_get(reader);
+            switch (c)
+            {
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+            {
+                uint32_t cp;
+                if (!json_reader_hex4(reader, &cp))
+                {
+                    return false;
+                }
+                if (cp >= 0xD800 && cp < 0xDC00 && json_reader_peekRaw(reader) == '\\')
+                {
+                    /* surrogate pair */
+                    uint32_t low;
+                    reader->pos++;
+                    if (json_reader_get(reader) != 'u' || !json_reader_hex4(reader, &low))
+                    {
+                        return json_reader_fail(reader);
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                json_reader_putCodepoint(reader, cp);
+                continue;
+            }
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            default:
+                return json_reader_fail(reader);
+            }
+        }
+        json_reader_put(reader, (char)c);
+    }
+    reader->text[reader->textLength] = '\0';
+
+    return !reader->failed;
+}
+
+bool json_reader_key(json_reader_t *reader)
+{
+    return json_reader_string(reader) && json_reader_expect(reader, ':');
+}
+
+bool json_reader_scalar(json_reader_t *reader)
+{
+    int c = json_reader_peek(reader);
+    if (c == '"')
+    {
+        return json_reader_string(reader);
+    }
+    if (c == '{' || c == '[')
+    {
+        bool success = json_reader_skip(reader);
+        reader->textLength = 0;
+        reader->text[0] = '\0';
+        return success;
+    }
+
+    reader->textLength = 0;
+    while ((c = json_reader_peekRaw(reader)) >= 0 && !strchr(",]}: \t\r\n", c))
+    {
+        json_reader_put(reader, (char)c);
+        reader->pos++;
+    }
+    reader->text[reader->textLength] = '\0';
+    if (reader->failed || reader->textLength == 0)
+    {
+        return json_reader_fail(reader);
+    }
+    if (!osStrcmp(reader->text, "null"))
+    {
+        reader->textLength = 0;
+        reader->text[0] = '\0';
+    }
+
+    return true;
+}
+
+static bool json_reader_skipDepth(json_reader_t *reader, size_t depth)
+{
+    int c = json_reader_peek(reader);
+    if (c != '{' && c != '[')
+    {
+        return json_reader_scalar(reader);
+    }
+    if (depth >= JSON_READER_MAX_DEPTH)
+    {
+        return json_reader_fail(reader);
+    }
+
+    char close = (c == '{') ? '}' : ']';
+    reader->pos++;
+    while (json_reader_more(reader, close))
+    {
+        if (close == '}' && !json_reader_key(reader))
+        {
+            return false;
+        }
+        if (!json_reader_skipDepth(reader, depth + 1))
+        {
+            return false;
+        }
+    }
+    return !reader->failed;
+}
+
+bool json_reader_skip(json_reader_t *reader)
+{
+    return json_reader_skipDepth(reader, 0);
+}
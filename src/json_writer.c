@@ -0,0 +1,295 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_writer.h"
+#include "os_port.h"
+#include "debug.h"
+#include "http/http_server_misc.h"
+
+static void json_writer_flush(json_writer_t *writer)
+{
+    if (writer->error == NO_ERROR && writer->length > 0)
+    {
+        writer->error = httpWriteStream(writer->connection, writer->buffer, writer->length);
+    }
+    writer->length = 0;
+}
+
+static void json_writer_raw(json_writer_t *writer, const char *data, size_t length)
+{
+    if (writer->error != NO_ERROR)
+    {
+        return;
+    }
+    if (writer->length + length > sizeof(writer->buffer))
+    {
+        json_writer_flush(writer);
+        if (length > sizeof(writer->buffer))
+        {
+            /* too large to be buffered, e.g. long strings */
+            if (writer->error == NO_ERROR)
+            {
+                writer->error = httpWriteStream(writer->connection, data, length);
+            }
+            return;
+        }
+    }
+    osMemcpy(&writer->buffer[writer->length], data, length);
+    writer->length += length;
+}
+
+static void json_writer_char(json_writer_t *writer, char c)
+{
+    json_writer_raw(writer, &c, 1);
+}
+
+static void json_writer_escaped(json_writer_t *writer, const char *str)
+{
+    json_writer_char(writer, '"');
+    const char *start = str;
+    for (const char *c = str; *c; c++)
+    {
+        uint8_t ch = (uint8_t)*c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+        {
+            continue;
+        }
+        json_writer_raw(writer, start, c - start);
+        start = c + 1;
+
+        char escape[8];
+        switch (ch)
+        {
+        case '"':
+            json_writer_raw(writer, "\\\"", 2);
+            break;
+        case '\\':
+            json_writer_raw(writer, "\\\\", 2);
+            break;
+        case '\b':
+            json_writer_raw(writer, "\\b", 2);
+            break;
+        case '\f':
+            json_writer_raw(writer, "\\f", 2);
+            break;
+        case '\n':
+            json_writer_raw(writer, "\\n", 2);
+            break;
+        case '\r':
+            json_writer_raw(writer, "\\r", 2);
+            break;
+        case '\t':
+            json_writer_raw(writer, "\\t", 2);
+            break;
+        default:
+            osSnprintf(escape, sizeof(escape), "\\u%04x", ch);
+            json_writer_raw(writer, escape, 6);
+            break;
+        }
+    }
+    json_writer_raw(writer, start, osStrlen(start));
+    json_writer_char(writer, '"');
+}
+
+/* writes the separator and the key, if any, in front of a value */
+static void json_writer_prefix(json_writer_t *writer, const char *key)
+{
+    if (writer->depth > 0)
+    {
+        if (writer->hasElements[writer->depth - 1])
+        {
+            json_writer_char(writer, ',');
+        }
+        writer->hasElements[writer->depth - 1] = true;
+    }
+    if (key != NULL)
+    {
+        json_writer_escaped(writer, key);
+        json_writer_char(writer, ':');
+    }
+}
+
+static void json_writer_open(json_writer_t *writer, const char *key, char bracket)
+{
+    json_writer_prefix(writer, key);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH)
+    {
+        TRACE_ERROR("JSON nested too deep\r\n");
+        writer->error = ERROR_BUFFER_OVERFLOW;
+        return;
+    }
+    writer->hasElements[writer->depth++] = false;
+    json_writer_char(writer, bracket);
+}
+
+static void json_writer_close(json_writer_t *writer, char bracket)
+{
+    if (writer->depth > 0)
+    {
+        writer->depth--;
+    }
+    json_writer_char(writer, bracket);
+}
+
+error_t json_writer_begin(json_writer_t *writer, HttpConnection *connection, const char *contentType)
+{
+    writer->connection = connection;
+    writer->length = 0;
+    writer->depth = 0;
+    writer->error = NO_ERROR;
+
+    httpInitResponseHeader(connection);
+    connection->response.contentType = contentType;
+    if (connection->request.version >= HTTP_VERSION_1_1)
+    {
+        connection->response.chunkedEncoding = TRUE;
+    }
+    else
+    {
+        /* without chunked encoding the end of the body is the end of the connection */
+        connection->response.chunkedEncoding = FALSE;
+        connection->response.keepAlive = FALSE;
+    }
+
+    writer->error = httpWriteHeader(connection);
+    return writer->error;
+}
+
+error_t json_writer_end(json_writer_t *writer)
+{
+    json_writer_flush(writer);
+    if (writer->error == NO_ERROR)
+    {
+        writer->error = httpCloseStream(writer->connection);
+    }
+    return writer->error;
+}
+
+void json_writer_object_begin(json_writer_t *writer, const char *key)
+{
+    json_writer_open(writer, key, '{');
+}
+
+void json_writer_object_end(json_writer_t *writer)
+{
+    json_writer_close(writer, '}');
+}
+
+void json_writer_array_begin(json_writer_t *writer, const char *key)
+{
+    json_writer_open(writer, key, '[');
+}
+
+void json_writer_array_end(json_writer_t *writer)
+{
+    json_writer_close(writer, ']');
+}
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value)
+{
+    if (value == NULL)
+    {
+        json_writer_null(writer, key);
+        return;
+    }
+    json_writer_prefix(writer, key);
+    json_writer_escaped(writer, value);
+}
+
+void json_writer_number(json_writer_t *writer, const char *key, double value)
+{
+    char number[32];
+    json_writer_prefix(writer, key);
+
+    /* same representation as cJSON_PrintUnformatted() */
+    if (isnan(value) || isinf(value))
+    {
+        osStrcpy(number, "null");
+    }
+    else if (value == (double)(int64_t)value && fabs(value) < 1e15)
+    {
+        osSnprintf(number, sizeof(number), "%" PRId64, (int64_t)value);
+    }
+    else
+    {
+        osSnprintf(number, sizeof(number), "%1.15g", value);
+        if (strtod(number, NULL) != value)
+        {
+            osSnprintf(number, sizeof(number), "%1.17g", value);
+        }
+    }
+    json_writer_raw(writer, number, osStrlen(number));
+}
+
+void json_writer_bool(json_writer_t *writer, const char *key, bool value)
+{
+    json_writer_prefix(writer, key);
+    if (value)
+    {
+        json_writer_raw(writer, "true", 4);
+    }
+    else
+    {
+        json_writer_raw(writer, "false", 5);
+    }
+}
+
+void json_writer_null(json_writer_t *writer, const char *key)
+{
+    json_writer_prefix(writer, key);
+    json_writer_raw(writer, "null", 4);
+}
+
+void json_writer_cjson(json_writer_t *writer, const char *key, const cJSON *item)
+{
+    if (item == NULL)
+    {
+        json_writer_null(writer, key);
+        return;
+    }
+
+    switch (item->type & 0xFF)
+    {
+    case cJSON_False:
+        json_writer_bool(writer, key, false);
+        break;
+    case cJSON_True:
+        json_writer_bool(writer, key, true);
+        break;
+    case cJSON_Number:
+        json_writer_number(writer, key, item->valuedouble);
+        break;
+    case cJSON_String:
+        json_writer_string(writer, key, item->valuestring);
+        break;
+    case cJSON_Raw:
+        json_writer_prefix(writer, key);
+        if (item->valuestring)
+        {
+            json_writer_raw(writer, item->valuestring, osStrlen(item->valuestring));
+        }
+        break;
+    case cJSON_Array:
+        json_writer_array_begin(writer, key);
+        for (const cJSON *child = item->child; child; child = child->next)
+        {
+            json_writer_cjson(writer, NULL, child);
+        }
+        json_writer_array_end(writer);
+        break;
+    case cJSON_Object:
+        json_writer_object_begin(writer, key);
+        for (const cJSON *child = item->child; child; child = child->next)
+        {
+            json_writer_cjson(writer, child->string, child);
+        }
+        json_writer_object_end(writer);
+        break;
+    default:
+        json_writer_null(writer, key);
+        break;
+    }
+}
@@ -23,6 +23,8 @@
 #include "mqtt.h"
 #include "cert.h"
 #include "toniefile.h"
+#include "toniesJson.h"
+#include "mutex_manager.h"
 #include "fs_ext.h"
 
 #define COUNT(x) (sizeof(x) / sizeof((x)[0]))
@@ -258,6 +260,8 @@ int_t main(int argc, char *argv[])
         const char *generate_client_cert;
         const char *encode;
         const char *encode_test;
+        const char *encode_check;
+        int tonies_benchmark;
         int skip_seconds;
         const char *esp32_hostpatch;
         const char *esp32_fixup;
@@ -291,6 +295,8 @@ int_t main(int argc, char *argv[])
                 {"esp32-hostpatch", required_argument, 0, 'P'},
                 {"oldrtnlhost", required_argument, 0, 0x100},
                 {"oldapihost", required_argument, 0, 0x101},
+                {"tonies-benchmark", required_argument, 0, 0x102},
+                {"encode-check", required_argument, 0, 0x103},
                 {"esp32-fixup", required_argument, 0, 'F'},
                 {"esp32-inject", required_argument, 0, 'I'},
                 {"esp32-extract", required_argument, 0, 'X'},
@@ -338,6 +344,8 @@ int_t main(int argc, char *argv[])
             OPT_SIMPLE_STR('C', config_set);
             OPT_SIMPLE_STR(0x100, oldrtnlhost);
             OPT_SIMPLE_STR(0x101, oldapihost);
+            OPT_SIMPLE_INT(0x102, tonies_benchmark);
+            OPT_SIMPLE_STR(0x103, encode_check);
 
         case '?':
             print_usage(argv);
@@ -355,6 +363,8 @@ int_t main(int argc, char *argv[])
     /* for these operation modes, we do not need autogenerated certs */
     autogen &= !options.encode;
     autogen &= !options.encode_test;
+    autogen &= !options.encode_check;
+    autogen &= !options.tonies_benchmark;
     autogen &= !options.esp32_hostpatch;
     autogen &= !options.esp32_fixup;
     autogen &= !options.esp32_inject;
@@ -414,7 +424,7 @@ int_t main(int argc, char *argv[])
         exit_cleanup(error);
     }
 
-    if (options.encode)
+    if (options.encode || options.encode_check)
     {
         options.multisource_size = argc - optind;
 
@@ -437,6 +447,12 @@ int_t main(int argc, char *argv[])
 #if !defined(FFMPEG_DECODING)
         TRACE_ERROR("Feature not available in your build.\r\n");
 #else
+        if (options.encode_check)
+        {
+            TRACE_WARNING("Check the parallel encode of %zu files to '%s'\r\n", options.multisource_size, options.encode_check);
+            int_t error = ffmpeg_convert_check(options.multisource, options.multisource_size, options.encode_check, options.skip_seconds);
+            exit(error);
+        }
         TRACE_WARNING("Encode %zu files to '%s'\r\n", options.multisource_size, options.encode);
         size_t current_source = 0;
         int_t error = ffmpeg_convert(options.multisource, options.multisource_size, &current_source, options.encode, options.skip_seconds);
@@ -604,6 +620,22 @@ int_t main(int argc, char *argv[])
         exit_cleanup(1);
     }
 
+    if (options.tonies_benchmark > 0)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***   tonies.json benchmark    ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        /* only the lookups are measured, the pictures do not need to be cached */
+        settings_set_bool("tonie_json.cache_images", false);
+        mutex_manager_init();
+        tonies_init();
+        tonies_benchmark(options.tonies_benchmark);
+        tonies_deinit();
+        mutex_manager_deinit();
+        exit_cleanup(0);
+    }
+
     tls_init();
 
     mqtt_init();
@@ -682,6 +714,18 @@ static void print_usage(char *argv[])
         "  --encode-test <FILE>\r\n"
         "    Perform an internal encoding test on the specified file.\r\n"
         "\r\n"
+        "  --encode-check <TARGET-FILE> (--skip-seconds <SECONDS>) <SOURCE1> <SOURCE2> (<SOURCE3>...)\r\n"
+#if !defined(FFMPEG_DECODING)
+        "    Check the parallel encoding. <NOT ENABLED IN YOUR BUILD>\r\n"
+#else
+        "    Encode local files serially to <TARGET-FILE>.serial and in parallel to <TARGET-FILE>, then compare\r\n"
+        "    granule position, chapters and decoded duration of both. Fails if they differ.\r\n"
+#endif
+        "\r\n"
+        "  --tonies-benchmark <MS>\r\n"
+        "    Resolve the ids of toniesV2.json through tonies.json and toniesV2.json for <MS> milliseconds each\r\n"
+        "    and print the lookups per millisecond of both.\r\n"
+        "\r\n"
         "  --config-set <NAME>=<VALUE>,<NAME2>=<VALUE2>,...\r\n"
         "    Perform an internal encoding test on the specified file.\r\n"
         "\r\n",
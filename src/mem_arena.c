@@ -0,0 +1,190 @@
+#include <string.h>
+
+#include "mem_arena.h"
+#include "os_port.h"
+
+#define MEM_ARENA_INTERN_MIN_SLOTS 256
+
+typedef struct mem_arena_chunk_s mem_arena_chunk_t;
+struct mem_arena_chunk_s
+{
+    mem_arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    uint8_t *data;
+};
+
+struct mem_arena_s
+{
+    mem_arena_chunk_t *chunks; /* the first chunk is the one currently filled */
+    size_t bytes;
+    char **intern;      /* open addressing set of interned strings */
+    size_t internSlots; /* power of two */
+    size_t internCount;
+};
+
+static uint32_t mem_arena_hash(const char *str)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = str; *c; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+mem_arena_t *mem_arena_create()
+{
+    mem_arena_t *arena = osAllocMem(sizeof(mem_arena_t));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    osMemset(arena, 0, sizeof(mem_arena_t));
+    return arena;
+}
+
+static mem_arena_chunk_t *mem_arena_chunk(mem_arena_t *arena, size_t size)
+{
+    size_t header = (sizeof(mem_arena_chunk_t) + MEM_ARENA_ALIGNMENT - 1) & ~(size_t)(MEM_ARENA_ALIGNMENT - 1);
+    mem_arena_chunk_t *chunk = osAllocMem(header + size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->data = (uint8_t *)chunk + header;
+    arena->bytes += header + size;
+    return chunk;
+}
+
+void *mem_arena_alloc(mem_arena_t *arena, size_t size)
+{
+    size = (size + MEM_ARENA_ALIGNMENT - 1) & ~(size_t)(MEM_ARENA_ALIGNMENT - 1);
+    mem_arena_chunk_t *chunk = arena->chunks;
+
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        if (size > MEM_ARENA_CHUNK_SIZE / 4)
+        {
+            /* large blocks get their own chunk behind the current one, which is still filled */
+            mem_arena_chunk_t *own = mem_arena_chunk(arena, size);
+            if (own == NULL)
+            {
+                return NULL;
+            }
+            own->used = size;
+            if (chunk)
+            {
+                own->next = chunk->next;
+                chunk->next = own;
+            }
+            else
+            {
+                own->next = NULL;
+                arena->chunks = own;
+            }
+            return own->data;
+        }
+        chunk = mem_arena_chunk(arena, MEM_ARENA_CHUNK_SIZE);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = &chunk->data[chunk->used];
+    chunk->used += size;
+    return ptr;
+}
+
+char *mem_arena_strdup(mem_arena_t *arena, const char *str)
+{
+    size_t len = osStrlen(str);
+    char *copy = mem_arena_alloc(arena, len + 1);
+    if (copy)
+    {
+        osMemcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+static bool mem_arena_internGrow(mem_arena_t *arena)
+{
+    size_t slots = arena->internSlots ? arena->internSlots * 2 : MEM_ARENA_INTERN_MIN_SLOTS;
+    char **intern = osAllocMem(slots * sizeof(char *));
+    if (intern == NULL)
+    {
+        return false;
+    }
+    osMemset(intern, 0, slots * sizeof(char *));
+    for (size_t i = 0; i < arena->internSlots; i++)
+    {
+        char *str = arena->intern[i];
+        if (str)
+        {
+            size_t slot = mem_arena_hash(str) & (slots - 1);
+            while (intern[slot])
+            {
+                slot = (slot + 1) & (slots - 1);
+            }
+            intern[slot] = str;
+        }
+    }
+    osFreeMem(arena->intern);
+    arena->intern = intern;
+    arena->internSlots = slots;
+    return true;
+}
+
+char *mem_arena_intern(mem_arena_t *arena, const char *str)
+{
+    if ((arena->internCount + 1) * 2 > arena->internSlots && !mem_arena_internGrow(arena))
+    {
+        return mem_arena_strdup(arena, str);
+    }
+
+    size_t mask = arena->internSlots - 1;
+    size_t slot = mem_arena_hash(str) & mask;
+    for (; arena->intern[slot]; slot = (slot + 1) & mask)
+    {
+        if (!osStrcmp(arena->intern[slot], str))
+        {
+            return arena->intern[slot];
+        }
+    }
+
+    char *copy = mem_arena_strdup(arena, str);
+    if (copy)
+    {
+        arena->intern[slot] = copy;
+        arena->internCount++;
+    }
+    return copy;
+}
+
+size_t mem_arena_size(const mem_arena_t *arena)
+{
+    return arena->bytes + arena->internSlots * sizeof(char *);
+}
+
+void mem_arena_free(mem_arena_t *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    mem_arena_chunk_t *chunk = arena->chunks;
+    while (chunk)
+    {
+        mem_arena_chunk_t *next = chunk->next;
+        osFreeMem(chunk);
+        chunk = next;
+    }
+    osFreeMem(arena->intern);
+    osFreeMem(arena);
+}
@@ -110,6 +110,11 @@ static void pcaplog_write_flags(pcaplog_ctx_t *ctx, bool is_tx, const uint8_t *p
     free(packet);
 }
 
+bool pcaplog_enabled()
+{
+    return pcap != NULL;
+}
+
 void pcaplog_write(pcaplog_ctx_t *ctx, bool is_tx, const uint8_t *payload, size_t payload_len)
 {
     if (!pcap || !payload_len || !ctx)
@@ -9,6 +9,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <signal.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
 
 #include "platform.h"
 #include "tls.h"
@@ -31,6 +37,8 @@ typedef struct
 
 void platform_init()
 {
+    /* sendfile() has no MSG_NOSIGNAL, a client closing the connection must not kill us */
+    signal(SIGPIPE, SIG_IGN);
 }
 
 void platform_deinit()
@@ -244,6 +252,180 @@ error_t socketSend(Socket *socket, const void *data, size_t length,
     return error;
 }
 
+error_t socketSendFile(Socket *socket, FsFile *file, size_t offset, size_t length,
+                       size_t *written)
+{
+#if defined(__linux__)
+    /* FsFile is a stdio FILE on posix */
+    off_t pos = (off_t)offset;
+    ssize_t n = sendfile(socket->descriptor, fileno((FILE *)file), &pos, length);
+
+    if (n > 0)
+    {
+        if (written)
+        {
+            *written = n;
+        }
+        return NO_ERROR;
+    }
+    if (n == 0)
+    {
+        return ERROR_END_OF_FILE;
+    }
+    if (errno == EINVAL || errno == ENOSYS)
+    {
+        return ERROR_NOT_IMPLEMENTED;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        return ERROR_TIMEOUT;
+    }
+    return ERROR_WRITE_FAILED;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+#if defined(__linux__)
+struct FsWatch
+{
+    int fd;
+    size_t pos;
+    size_t length;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+};
+#endif
+
+error_t fsWatchOpen(FsWatch **watch)
+{
+#if defined(__linux__)
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        return (errno == ENOSYS) ? ERROR_NOT_IMPLEMENTED : ERROR_FAILURE;
+    }
+    *watch = osAllocMem(sizeof(FsWatch));
+    if (*watch == NULL)
+    {
+        close(fd);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    (*watch)->fd = fd;
+    (*watch)->pos = 0;
+    (*watch)->length = 0;
+    return NO_ERROR;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+error_t fsWatchAdd(FsWatch *watch, const char *path, int32_t *id)
+{
+#if defined(__linux__)
+    int wd = inotify_add_watch(watch->fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        /* ENOSPC is the limit of fs.inotify.max_user_watches */
+        return (errno == ENOSPC) ? ERROR_OUT_OF_RESOURCES : ERROR_FAILURE;
+    }
+    *id = wd;
+    return NO_ERROR;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+void fsWatchRemove(FsWatch *watch, int32_t id)
+{
+#if defined(__linux__)
+    inotify_rm_watch(watch->fd, id);
+#endif
+}
+
+error_t fsWatchRead(FsWatch *watch, FsWatchEvent *event, systime_t timeout)
+{
+#if defined(__linux__)
+    while (watch->pos >= watch->length)
+    {
+        struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, (timeout == INFINITE_DELAY) ? -1 : (int)timeout);
+        if (ret == 0)
+        {
+            return ERROR_TIMEOUT;
+        }
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ERROR_FAILURE;
+        }
+        ssize_t n = read(watch->fd, watch->buffer, sizeof(watch->buffer));
+        if (n <= 0)
+        {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                continue;
+            }
+            return ERROR_FAILURE;
+        }
+        watch->pos = 0;
+        watch->length = (size_t)n;
+    }
+
+    const struct inotify_event *notification = (const struct inotify_event *)&watch->buffer[watch->pos];
+    watch->pos += sizeof(struct inotify_event) + notification->len;
+
+    event->id = notification->wd;
+    event->flags = 0;
+    if (notification->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        event->flags |= FS_WATCH_CREATED;
+    }
+    if (notification->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        event->flags |= FS_WATCH_DELETED;
+    }
+    if (notification->mask & (IN_CLOSE_WRITE | IN_ATTRIB))
+    {
+        event->flags |= FS_WATCH_MODIFIED;
+    }
+    if (notification->mask & IN_ISDIR)
+    {
+        event->flags |= FS_WATCH_DIRECTORY;
+    }
+    if (notification->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+        event->flags |= FS_WATCH_GONE;
+    }
+    if (notification->mask & IN_Q_OVERFLOW)
+    {
+        event->flags |= FS_WATCH_OVERFLOW;
+    }
+    event->name[0] = '\0';
+    if (notification->len > 0)
+    {
+        osStrncpy(event->name, notification->name, sizeof(event->name) - 1);
+        event->name[sizeof(event->name) - 1] = '\0';
+    }
+    return NO_ERROR;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+void fsWatchClose(FsWatch *watch)
+{
+#if defined(__linux__)
+    if (watch != NULL)
+    {
+        close(watch->fd);
+        osFreeMem(watch);
+    }
+#endif
+}
+
 error_t socketReceive(Socket *socket, void *data_in,
                       size_t size, size_t *received, uint_t flags)
 {
@@ -293,6 +293,35 @@ error_t socketSend(Socket *socket, const void *data, size_t length,
     return error;
 }
 
+error_t socketSendFile(Socket *socket, FsFile *file, size_t offset, size_t length,
+                       size_t *written)
+{
+    return ERROR_NOT_IMPLEMENTED;
+}
+
+error_t fsWatchOpen(FsWatch **watch)
+{
+    return ERROR_NOT_IMPLEMENTED;
+}
+
+error_t fsWatchAdd(FsWatch *watch, const char *path, int32_t *id)
+{
+    return ERROR_NOT_IMPLEMENTED;
+}
+
+void fsWatchRemove(FsWatch *watch, int32_t id)
+{
+}
+
+error_t fsWatchRead(FsWatch *watch, FsWatchEvent *event, systime_t timeout)
+{
+    return ERROR_NOT_IMPLEMENTED;
+}
+
+void fsWatchClose(FsWatch *watch)
+{
+}
+
 error_t socketReceive(Socket *socket, void *data_in,
                       size_t size, size_t *received, uint_t flags)
 {
@@ -41,6 +41,7 @@
 #include "core/socket.h"          // for _Socket
 #include "web.h"                  // for web_download
 #include "cache.h"                // for image cache functions
+#include "tag_registry.h"         // for tag_registry_init
 #include "debug.h"                // for TRACE_DEBUG, TRACE_ERROR, TRACE_INFO
 #include "error.h"                // for NO_ERROR, error2text, ERROR_FAILURE
 #include "fs_port_posix.h"        // for fsDirExists
@@ -66,6 +67,8 @@
 #include "toniebox_state.h"       // for get_toniebox_state, get_toniebox_s...
 #include "toniebox_state_type.h"  // for toniebox_state_box_t, toniebox_sta...
 #include "toniesJson.h"           // for tonieboxes_update, tonies_deinit
+#include "taf_index.h"            // for taf_index_init, taf_index_loop
+#include "content_cache.h"        // for content_cache_init, content_cache_deinit
 
 #define APP_HTTP_MAX_CONNECTIONS 32
 HttpConnection httpConnections[APP_HTTP_MAX_CONNECTIONS];
@@ -217,6 +220,11 @@ error_t handleCacheDownload(HttpConnection *connection, const char_t *uri, const
                  "<tr><th>Total Cached Files</th><td>%zu</td></tr>"
                  "<tr><th>Total Cache Size</th><td>%zu bytes</td></tr>"
                  "<tr><th>Memory Used</th><td>%zu bytes</td></tr>"
+                 "<tr><th>Size Limit</th><td>%zu bytes</td></tr>"
+                 "<tr><th>Evicted Files</th><td>%zu</td></tr>"
+                 "<tr><th>Prefetch Pending</th><td>%zu</td></tr>"
+                 "<tr><th>Prefetched Files</th><td>%zu</td></tr>"
+                 "<tr><th>Failed Prefetches</th><td>%zu</td></tr>"
                  "</table>"
                  "<button class=\"btn\" onclick=\"flushCache()\">Flush Cache</button>"
                  "</div>"
@@ -226,7 +234,12 @@ error_t handleCacheDownload(HttpConnection *connection, const char_t *uri, const
                  stats.exists_entries,
                  stats.total_files,
                  stats.total_size,
-                 stats.memory_used);
+                 stats.memory_used,
+                 stats.max_size,
+                 stats.evicted_files,
+                 stats.prefetch_pending,
+                 stats.prefetch_done,
+                 stats.prefetch_failed);
 
         httpPrepareHeader(connection, "text/html; charset=utf-8", osStrlen(stats_page));
         return httpWriteResponseString(connection, stats_page, false);
@@ -241,6 +254,10 @@ error_t handleCacheDownload(HttpConnection *connection, const char_t *uri, const
 
     if (!entry->exists)
     {
+        if (entry->original_url == NULL)
+        {
+            return ERROR_NOT_FOUND;
+        }
         if (entry->statusCode == 404)
         {
             TRACE_WARNING("Failed, server reported 404 for '%s' cached: '%s'\r\n", entry->original_url, entry->cached_url);
@@ -250,6 +267,9 @@ error_t handleCacheDownload(HttpConnection *connection, const char_t *uri, const
         return httpSendRedirectResponse(connection, 301, entry->original_url);
     }
 
+    /* the name is the hash of the original URL, so the content behind it does not change */
+    connection->response.cacheControl = "public, max-age=31536000, immutable";
+
     error_t err = httpSendResponseUnsafe(connection, uri, entry->file_path);
     return err;
 }
@@ -878,12 +898,22 @@ void server_init(bool test)
         return;
     }
 
+    taf_index_init();
+    content_cache_init();
     tonies_init();
     if (get_settings()->core.tonies_json_auto_update || test)
     {
         tonies_update();
         tonieboxes_update();
     }
+    /* pictures queued for preloading while reading the json files are downloaded from now on */
+    cache_init();
+    /* reads the content directory in the background, tag listings scan it themselves until it is done */
+    tag_registry_init();
+    /* changed files are reported by the file watch instead of polling them */
+    settings_watch();
+    taf_index_watch();
+    tonies_watch();
 
     systime_t last = osGetSystemTime();
     size_t openWebConnectionsLast = 0;
@@ -891,7 +921,6 @@ void server_init(bool test)
     while (!settings_get_bool("internal.exit"))
     {
         osDelayTask(250);
-        settings_loop();
         systime_t now = osGetSystemTime();
         if ((now - last) / 1000 > 5)
         {
@@ -899,6 +928,9 @@ void server_init(bool test)
             sanityChecks();
         }
         mutex_manager_loop();
+        taf_index_loop();
+        tonies_loop();
+        cache_loop();
 
         size_t openConnections = 0;
         for (size_t i = 0; i < APP_HTTP_MAX_CONNECTIONS; i++)
@@ -978,6 +1010,8 @@ void server_init(bool test)
         }
     }
     tonies_deinit();
+    content_cache_deinit();
+    taf_index_deinit();
     mutex_manager_deinit();
 
     pcaplog_close();
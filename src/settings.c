@@ -14,6 +14,7 @@
 #include "fs_ext.h"
 #include "os_ext.h"
 #include "server_helpers.h"
+#include "file_watch.h"
 #include "cert.h"
 
 /* static functions*/
@@ -117,6 +118,9 @@ static void option_map_init(uint8_t settingsId)
     OPTION_UNSIGNED("core.settings_level", &settings->core.settings_level, 1, 1, 3, "Settings level", "1: Basic, 2: Detail, 3: Expert", LEVEL_BASIC)
     OPTION_BOOL("core.tonies_json_auto_update", &settings->core.tonies_json_auto_update, TRUE, "Auto-Update tonies.json", "Auto-Update tonies.json for Tonies information and images.", LEVEL_DETAIL)
     OPTION_BOOL("core.full_taf_validation", &settings->core.full_taf_validation, FALSE, "Full TAF validation", "Validate TAFs by checking the audio length and the SHA1 hash. (may be slow, as file needs to be fully read!)", LEVEL_EXPERT)
+    OPTION_UNSIGNED("core.content_cache_mb", &settings->core.content_cache_mb, 32, 0, 1024, "Content cache (MB)", "Memory used to keep recently served content in RAM for HTTPS clients, 0 disables the cache", LEVEL_EXPERT)
+    OPTION_UNSIGNED("core.cachedir_max_mb", &settings->core.cachedir_max_mb, 0, 0, 65535, "Cache dir limit (MB)", "Size of the downloaded images in 'cachedir' above which the least recently used ones are deleted, 0 for no limit", LEVEL_EXPERT)
+    OPTION_UNSIGNED("core.index_workers", &settings->core.index_workers, 4, 1, 16, "Index workers", "Number of files or tags read in parallel when listing the library and the tag index, 1 reads them one after another", LEVEL_EXPERT)
 
     OPTION_TREE_DESC("security_mit", "Security mitigation", LEVEL_EXPERT)
     OPTION_BOOL("security_mit.warnAccess", &settings->security_mit.warnAccess, TRUE, "Warning on unwanted access", "If teddyCloud detects unusal access, warn on frontend until restart. (See on*)", LEVEL_EXPERT)
@@ -237,11 +241,14 @@ static void option_map_init(uint8_t settingsId)
 
     OPTION_TREE_DESC("encode", "TAF encoding", LEVEL_EXPERT)
     OPTION_UNSIGNED("encode.bitrate", &settings->encode.bitrate, 96, 0, 256, "Opus bitrate", "Opus bitrate, tested 64, 96(default), 128, 192, 256 - be aware that this increases the TAF size!", LEVEL_EXPERT)
-    OPTION_UNSIGNED("encode.ffmpeg_stream_buffer_ms", &settings->encode.ffmpeg_stream_buffer_ms, 2000, 0, 60000, "Stream buffer ms", "Stream buffer for ffmpeg based streaming.", LEVEL_EXPERT)
+    OPTION_UNSIGNED("encode.ffmpeg_stream_buffer_ms", &settings->encode.ffmpeg_stream_buffer_ms, 2000, 0, 60000, "Stream buffer ms", "Maximum time to wait for an ffmpeg based stream to become ready. The stream starts earlier as soon as 'Stream ready blocks' are encoded and the source keeps up with real time.", LEVEL_EXPERT)
+    OPTION_UNSIGNED("encode.stream_ready_blocks", &settings->encode.stream_ready_blocks, 6, 0, 128, "Stream ready blocks", "Number of encoded 4 KB blocks (about 340ms each at 96 kbit/s) needed before a stream is sent to the box.", LEVEL_EXPERT)
     OPTION_BOOL("encode.ffmpeg_stream_restart", &settings->encode.ffmpeg_stream_restart, FALSE, "Stream force restart", "If a stream is continued by the box, a new file is forced. This has the cost of a slower restart, but does not play the old buffered content and deletes the previous stream data on the box.", LEVEL_EXPERT)
     OPTION_BOOL("encode.ffmpeg_sweep_startup_buffer", &settings->encode.ffmpeg_sweep_startup_buffer, TRUE, "Sweep stream prebuffer", "Webradio streams often send several seconds as a buffer immediately. This may contain ads and will add up if you disalbe 'Stream force restart'.", LEVEL_EXPERT)
-    OPTION_UNSIGNED("encode.ffmpeg_sweep_delay_ms", &settings->encode.ffmpeg_sweep_delay_ms, 2000, 0, 10000, "Sweep delay ms", "Wait x ms until sweeping is stopped and stream is started. Delays stream start, but may increase success.", LEVEL_EXPERT)
+    OPTION_UNSIGNED("encode.ffmpeg_sweep_delay_ms", &settings->encode.ffmpeg_sweep_delay_ms, 2000, 0, 10000, "Sweep delay ms", "Sweep at most x ms. Sweeping stops earlier as soon as the source delivers at real time speed.", LEVEL_EXPERT)
     OPTION_UNSIGNED("encode.stream_max_size", &settings->encode.stream_max_size, 1024 * 1024 * 40 * 6 - 1, 1024 * 1024 - 1, INT32_MAX, "Max stream filesize", "The box may create an empty file this length for each stream. So if you have 10 streaming tonies you use, the box may block 10*240MB. The only downside is, that the box will stop after the file is full and you'll need to replace the tag onto the box. Must not be a multiply of 4096, Default: 251.658.239, so 240MB, which means around 6h.", LEVEL_EXPERT)
+    OPTION_UNSIGNED("encode.stream_join_backlog", &settings->encode.stream_join_backlog, 16, 0, 256, "Stream join backlog", "If a box starts a stream that another box is already playing, it shares the running encoder. It gets this many already encoded 4 KB blocks and skips older ones to stay close to live.", LEVEL_EXPERT)
+    OPTION_UNSIGNED("encode.workers", &settings->encode.workers, 4, 1, 16, "Encoding workers", "Number of local sources of a multi-file or TAP conversion encoded in parallel, each by its own ffmpeg and Opus encoder. The sources are decoded twice to keep the gapless stream of a serial encode. 1 encodes them one after another", LEVEL_EXPERT)
 
     OPTION_TREE_DESC("frontend", "Frontend", LEVEL_BASIC)
     OPTION_BOOL("frontend.split_model_content", &settings->frontend.split_model_content, TRUE, "Split content / model", "If enabled, the content of the TAF will be shown beside the model of the figurine", LEVEL_DETAIL)
@@ -1503,6 +1510,19 @@ bool settings_set_u64_array_id(const char *item, const uint64_t *value, size_t l
     return true;
 }
 
+/* settings_save() rewrites the files as well, settings_loop() only reloads what differs from the last load */
+static void settings_file_changed(const char *path, void *ctx)
+{
+    settings_loop();
+}
+
+void settings_watch()
+{
+    const char *configDir = settings_get_string("internal.configdirfull");
+    file_watch_subscribe("settings", configDir, CONFIG_FILE, false, SETTINGS_WATCH_DEBOUNCE_MS, &settings_file_changed, NULL);
+    file_watch_subscribe("overlay settings", configDir, CONFIG_OVERLAY_FILE, false, SETTINGS_WATCH_DEBOUNCE_MS, &settings_file_changed, NULL);
+}
+
 void settings_loop()
 {
     FsFileStat stat;
@@ -8,6 +8,15 @@ STATS_ENTRY("reverse_requests", "Reverse proxy calls made by clients")
 STATS_ENTRY("cloud_requests", "Cloud requests executed")
 STATS_ENTRY("cloud_blocked", "Blocked cloud requests")
 STATS_ENTRY("cloud_failed", "Failed cloud requests")
+STATS_ENTRY("taf_index_hits", "TAF header reads answered from the index")
+STATS_ENTRY("taf_index_misses", "TAF header reads that had to open the file")
+STATS_ENTRY("taf_validations", "Full TAF validations done by the background validator")
+STATS_ENTRY("content_cache_hits", "Content segments served from memory")
+STATS_ENTRY("content_cache_misses", "Content segments read from disk")
+STATS_ENTRY("content_cache_bytes", "Bytes currently held by the content cache")
+STATS_ENTRY("stream_joins", "Boxes that joined an already running live stream encoder")
+STATS_ENTRY("stream_ttfb_ms", "Time to first byte of the last started live stream in ms")
+STATS_ENTRY("tonies_json_not_modified", "Updates of tonies.json and tonieboxes.json answered with 304 Not Modified")
 STATS_END()
 
 void stats_update(const char *item, int count)
@@ -24,6 +33,20 @@ void stats_update(const char *item, int count)
     }
 }
 
+void stats_set(const char *item, uint32_t value)
+{
+    int pos = 0;
+    while (statistics[pos].name)
+    {
+        if (!osStrcmp(item, statistics[pos].name))
+        {
+            statistics[pos].value = value;
+            return;
+        }
+        pos++;
+    }
+}
+
 stat_t *stats_get(int index)
 {
     int pos = 0;
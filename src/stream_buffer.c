@@ -0,0 +1,481 @@
+#include <string.h>
+
+#include "stream_buffer.h"
+#include "debug.h"
+#include "mutex_manager.h"
+
+struct stream_buffer_s
+{
+    stream_buffer_t *next; /* next registered buffer */
+    char *path;
+    uint32_t refs;
+    bool registered;
+
+    OsMutex mutex;
+    uint8_t header[STREAM_BUFFER_BLOCK_SIZE];
+    size_t header_length;
+    uint8_t head[STREAM_BUFFER_BLOCK_SIZE]; /* first audio block with the opus headers, needed by late joiners */
+    size_t head_length;
+    size_t join_backlog;
+    uint8_t *data;
+    size_t capacity;
+    uint64_t start; /* offset of the first byte ever written, older data is only on disk */
+    uint64_t end;   /* offset following the last written byte */
+    bool closed;
+    error_t error;
+    uint64_t input_samples; /* decoded samples since the first report */
+    uint64_t window_samples;
+    systime_t window_start;
+    bool window_started;
+    uint32_t input_rate; /* permille of real time, measured over the last window */
+    bool input_rate_valid;
+    stream_buffer_reader_t *readers[STREAM_BUFFER_MAX_READERS];
+};
+
+static stream_buffer_t *stream_buffers = NULL;
+
+static error_t stream_buffer_reader_add(stream_buffer_reader_t *reader, stream_buffer_t *buffer, uint64_t pos, bool join);
+
+static void stream_buffer_unregister(stream_buffer_t *buffer)
+{
+    stream_buffer_t **pos = &stream_buffers;
+    while (*pos && *pos != buffer)
+    {
+        pos = &(*pos)->next;
+    }
+    if (*pos)
+    {
+        *pos = buffer->next;
+    }
+    buffer->registered = false;
+}
+
+static void stream_buffer_notify(stream_buffer_t *buffer)
+{
+    for (size_t i = 0; i < STREAM_BUFFER_MAX_READERS; i++)
+    {
+        if (buffer->readers[i])
+        {
+            osSetEvent(&buffer->readers[i]->event);
+        }
+    }
+}
+
+stream_buffer_t *stream_buffer_create(const char *path)
+{
+    stream_buffer_t *buffer = osAllocMem(sizeof(stream_buffer_t));
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    osMemset(buffer, 0, sizeof(stream_buffer_t));
+    buffer->capacity = (size_t)STREAM_BUFFER_BLOCKS * STREAM_BUFFER_BLOCK_SIZE;
+    buffer->data = osAllocMem(buffer->capacity);
+    buffer->path = strdup(path);
+    if (buffer->data == NULL || buffer->path == NULL || !osCreateMutex(&buffer->mutex))
+    {
+        TRACE_ERROR("Could not allocate stream buffer for %s\r\n", path);
+        osFreeMem(buffer->data);
+        osFreeMem(buffer->path);
+        osFreeMem(buffer);
+        return NULL;
+    }
+    buffer->refs = 1;
+    buffer->error = NO_ERROR;
+    buffer->join_backlog = SIZE_MAX;
+
+    mutex_lock(MUTEX_STREAM_BUFFERS);
+    buffer->next = stream_buffers;
+    stream_buffers = buffer;
+    buffer->registered = true;
+    mutex_unlock(MUTEX_STREAM_BUFFERS);
+
+    return buffer;
+}
+
+stream_buffer_t *stream_buffer_open(const char *path)
+{
+    stream_buffer_t *found = NULL;
+
+    mutex_lock(MUTEX_STREAM_BUFFERS);
+    for (stream_buffer_t *buffer = stream_buffers; buffer; buffer = buffer->next)
+    {
+        if (!osStrcmp(buffer->path, path))
+        {
+            buffer->refs++;
+            found = buffer;
+            break;
+        }
+    }
+    mutex_unlock(MUTEX_STREAM_BUFFERS);
+
+    return found;
+}
+
+void stream_buffer_release(stream_buffer_t *buffer)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_STREAM_BUFFERS);
+    bool release = (--buffer->refs == 0);
+    if (release && buffer->registered)
+    {
+        stream_buffer_unregister(buffer);
+    }
+    mutex_unlock(MUTEX_STREAM_BUFFERS);
+
+    if (release)
+    {
+        osDeleteMutex(&buffer->mutex);
+        osFreeMem(buffer->data);
+        osFreeMem(buffer->path);
+        osFreeMem(buffer);
+    }
+}
+
+void stream_buffer_write_header(stream_buffer_t *buffer, const uint8_t *data, size_t length)
+{
+    osAcquireMutex(&buffer->mutex);
+    buffer->header_length = MIN(length, sizeof(buffer->header));
+    osMemcpy(buffer->header, data, buffer->header_length);
+    stream_buffer_notify(buffer);
+    osReleaseMutex(&buffer->mutex);
+}
+
+void stream_buffer_set_join_backlog(stream_buffer_t *buffer, size_t blocks)
+{
+    osAcquireMutex(&buffer->mutex);
+    buffer->join_backlog = blocks;
+    osReleaseMutex(&buffer->mutex);
+}
+
+void stream_buffer_write(stream_buffer_t *buffer, uint64_t offset, const uint8_t *data, size_t length)
+{
+    osAcquireMutex(&buffer->mutex);
+    if (offset >= STREAM_BUFFER_BLOCK_SIZE && offset < 2 * STREAM_BUFFER_BLOCK_SIZE)
+    {
+        size_t headPos = offset - STREAM_BUFFER_BLOCK_SIZE;
+        size_t n = MIN(length, sizeof(buffer->head) - headPos);
+        osMemcpy(&buffer->head[headPos], data, n);
+        buffer->head_length = MAX(buffer->head_length, headPos + n);
+    }
+    if (buffer->end == 0 || offset != buffer->end)
+    {
+        if (buffer->end != 0)
+        {
+            TRACE_WARNING("Stream buffer %s got data at %" PRIu64 " instead of %" PRIu64 ", restarting\r\n", buffer->path, offset, buffer->end);
+        }
+        buffer->start = offset;
+        buffer->end = offset;
+    }
+
+    /* only the last capacity bytes can be held, the older ones are overwritten */
+    if (length > buffer->capacity)
+    {
+        data += length - buffer->capacity;
+        offset += length - buffer->capacity;
+        length = buffer->capacity;
+    }
+    while (length > 0)
+    {
+        size_t pos = offset % buffer->capacity;
+        size_t n = MIN(length, buffer->capacity - pos);
+        osMemcpy(&buffer->data[pos], data, n);
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    buffer->end = offset;
+    stream_buffer_notify(buffer);
+    osReleaseMutex(&buffer->mutex);
+}
+
+void stream_buffer_close(stream_buffer_t *buffer, error_t error)
+{
+    mutex_lock(MUTEX_STREAM_BUFFERS);
+    if (buffer->registered)
+    {
+        stream_buffer_unregister(buffer);
+    }
+    mutex_unlock(MUTEX_STREAM_BUFFERS);
+
+    osAcquireMutex(&buffer->mutex);
+    buffer->closed = true;
+    buffer->error = error;
+    stream_buffer_notify(buffer);
+    osReleaseMutex(&buffer->mutex);
+}
+
+void stream_buffer_report_input(stream_buffer_t *buffer, size_t samples, uint32_t sample_rate)
+{
+    systime_t now = osGetSystemTime();
+
+    osAcquireMutex(&buffer->mutex);
+    buffer->input_samples += samples;
+    if (!buffer->window_started)
+    {
+        /* the first chunk includes the connection setup, measure from its arrival on */
+        buffer->window_started = true;
+        buffer->window_start = now;
+        buffer->window_samples = 0;
+    }
+    else
+    {
+        buffer->window_samples += samples;
+        systime_t elapsed = now - buffer->window_start;
+        if (elapsed >= STREAM_BUFFER_RATE_WINDOW_MS)
+        {
+            uint64_t rate = buffer->window_samples * 1000 * 1000 / sample_rate / elapsed;
+            buffer->input_rate = (uint32_t)MIN(rate, UINT32_MAX - 1);
+            buffer->input_rate_valid = true;
+            buffer->window_start = now;
+            buffer->window_samples = 0;
+            stream_buffer_notify(buffer);
+        }
+    }
+    osReleaseMutex(&buffer->mutex);
+}
+
+void stream_buffer_get_telemetry(stream_buffer_t *buffer, uint64_t *encoded, uint32_t *input_rate)
+{
+    osAcquireMutex(&buffer->mutex);
+    *encoded = buffer->end - buffer->start;
+    *input_rate = buffer->input_rate_valid ? buffer->input_rate : 0;
+    osReleaseMutex(&buffer->mutex);
+}
+
+error_t stream_buffer_wait(stream_buffer_t *buffer, size_t bytes, systime_t timeout)
+{
+    return stream_buffer_wait_input(buffer, bytes, 0, UINT32_MAX, timeout);
+}
+
+error_t stream_buffer_wait_input(stream_buffer_t *buffer, size_t bytes, uint32_t min_rate, uint32_t max_rate, systime_t timeout)
+{
+    bool anyRate = (min_rate == 0 && max_rate == UINT32_MAX);
+    stream_buffer_reader_t reader;
+    error_t error = stream_buffer_reader_add(&reader, buffer, 0, false);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
+    systime_t startTime = osGetSystemTime();
+    while (true)
+    {
+        osAcquireMutex(&buffer->mutex);
+        bool ready = buffer->header_length > 0 && buffer->end - buffer->start >= bytes;
+        if (!anyRate)
+        {
+            ready &= buffer->input_rate_valid && buffer->input_rate >= min_rate && buffer->input_rate <= max_rate;
+        }
+        bool closed = buffer->closed;
+        error_t closeError = buffer->error;
+        osReleaseMutex(&buffer->mutex);
+
+        if (ready)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        if (closed)
+        {
+            error = (closeError != NO_ERROR) ? closeError : ERROR_END_OF_STREAM;
+            break;
+        }
+        systime_t elapsed = osGetSystemTime() - startTime;
+        if (elapsed >= timeout)
+        {
+            error = ERROR_TIMEOUT;
+            break;
+        }
+        osWaitForEvent(&reader.event, timeout - elapsed);
+    }
+
+    stream_buffer_reader_detach(&reader);
+    return error;
+}
+
+static error_t stream_buffer_reader_add(stream_buffer_reader_t *reader, stream_buffer_t *buffer, uint64_t pos, bool join)
+{
+    error_t error = ERROR_OUT_OF_RESOURCES;
+
+    osMemset(reader, 0, sizeof(stream_buffer_reader_t));
+    if (!osCreateEvent(&reader->event))
+    {
+        return ERROR_OUT_OF_RESOURCES;
+    }
+    reader->buffer = buffer;
+    reader->pos = pos;
+    reader->split = UINT64_MAX;
+    reader->delta = 0;
+
+    osAcquireMutex(&buffer->mutex);
+
+    /* late joiners get the headers and then continue close to the live position */
+    uint64_t from = MAX(pos, 2 * STREAM_BUFFER_BLOCK_SIZE);
+    from -= from % STREAM_BUFFER_BLOCK_SIZE;
+    uint64_t backlog = (buffer->join_backlog == SIZE_MAX) ? UINT64_MAX : (uint64_t)buffer->join_backlog * STREAM_BUFFER_BLOCK_SIZE;
+    if (join && buffer->end > buffer->start && (from > buffer->end || buffer->end - from > backlog))
+    {
+        uint64_t oldest = MAX(buffer->start, buffer->end > buffer->capacity ? buffer->end - buffer->capacity : 0);
+        uint64_t live = buffer->end - MIN(backlog, buffer->end - oldest);
+        live += (STREAM_BUFFER_BLOCK_SIZE - live % STREAM_BUFFER_BLOCK_SIZE) % STREAM_BUFFER_BLOCK_SIZE;
+        reader->split = from;
+        reader->delta = (int64_t)live - (int64_t)from;
+        TRACE_INFO("Joining stream %s at %" PRIu64 " instead of %" PRIu64 "\r\n", buffer->path, live, from);
+    }
+
+    for (size_t i = 0; i < STREAM_BUFFER_MAX_READERS; i++)
+    {
+        if (buffer->readers[i] == NULL)
+        {
+            buffer->readers[i] = reader;
+            error = NO_ERROR;
+            break;
+        }
+    }
+    osReleaseMutex(&buffer->mutex);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_WARNING("Too many readers on stream buffer %s\r\n", buffer->path);
+        osDeleteEvent(&reader->event);
+        reader->buffer = NULL;
+    }
+    return error;
+}
+
+error_t stream_buffer_reader_attach(stream_buffer_reader_t *reader, stream_buffer_t *buffer, uint64_t pos)
+{
+    return stream_buffer_reader_add(reader, buffer, pos, true);
+}
+
+void stream_buffer_reader_detach(stream_buffer_reader_t *reader)
+{
+    stream_buffer_t *buffer = reader->buffer;
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    osAcquireMutex(&buffer->mutex);
+    for (size_t i = 0; i < STREAM_BUFFER_MAX_READERS; i++)
+    {
+        if (buffer->readers[i] == reader)
+        {
+            buffer->readers[i] = NULL;
+        }
+    }
+    osReleaseMutex(&buffer->mutex);
+
+    osDeleteEvent(&reader->event);
+    reader->buffer = NULL;
+}
+
+uint64_t stream_buffer_reader_offset(const stream_buffer_reader_t *reader)
+{
+    if (reader->pos < reader->split)
+    {
+        return reader->pos;
+    }
+    return (uint64_t)((int64_t)reader->pos + reader->delta);
+}
+
+error_t stream_buffer_read(stream_buffer_reader_t *reader, uint8_t *data, size_t size, size_t *read, systime_t timeout)
+{
+    stream_buffer_t *buffer = reader->buffer;
+    bool waited = false;
+
+    *read = 0;
+    if (reader->pos < reader->split)
+    {
+        /* never read across the join point in one go */
+        size = MIN(size, reader->split - reader->pos);
+    }
+
+    osAcquireMutex(&buffer->mutex);
+    while (true)
+    {
+        uint64_t pos = stream_buffer_reader_offset(reader);
+
+        if (pos < STREAM_BUFFER_BLOCK_SIZE && buffer->header_length == STREAM_BUFFER_BLOCK_SIZE)
+        {
+            size_t n = MIN(size, STREAM_BUFFER_BLOCK_SIZE - pos);
+            osMemcpy(data, &buffer->header[pos], n);
+            *read = n;
+            break;
+        }
+        if (pos >= STREAM_BUFFER_BLOCK_SIZE && pos < 2 * STREAM_BUFFER_BLOCK_SIZE && buffer->head_length == STREAM_BUFFER_BLOCK_SIZE)
+        {
+            size_t n = MIN(size, 2 * STREAM_BUFFER_BLOCK_SIZE - pos);
+            osMemcpy(data, &buffer->head[pos - STREAM_BUFFER_BLOCK_SIZE], n);
+            *read = n;
+            break;
+        }
+        if (buffer->end > 0 && (pos < buffer->start || pos + buffer->capacity < buffer->end))
+        {
+            /* never written to memory or already overwritten */
+            osReleaseMutex(&buffer->mutex);
+            return ERROR_OUT_OF_RANGE;
+        }
+        if (buffer->end > 0 && pos < buffer->end)
+        {
+            size_t n = MIN(size, buffer->end - pos);
+            size_t ringPos = pos % buffer->capacity;
+            size_t first = MIN(n, buffer->capacity - ringPos);
+            osMemcpy(data, &buffer->data[ringPos], first);
+            osMemcpy(&data[first], buffer->data, n - first);
+            *read = n;
+            break;
+        }
+        if (buffer->closed)
+        {
+            osReleaseMutex(&buffer->mutex);
+            return (buffer->end > 0 || pos >= STREAM_BUFFER_BLOCK_SIZE) ? ERROR_END_OF_STREAM : ERROR_OUT_OF_RANGE;
+        }
+        if (waited)
+        {
+            osReleaseMutex(&buffer->mutex);
+            return ERROR_TIMEOUT;
+        }
+
+        osReleaseMutex(&buffer->mutex);
+        osWaitForEvent(&reader->event, timeout);
+        waited = true;
+        osAcquireMutex(&buffer->mutex);
+    }
+    osReleaseMutex(&buffer->mutex);
+
+    reader->pos += *read;
+    return NO_ERROR;
+}
+
+error_t stream_buffer_read_file(stream_buffer_reader_t *reader, FsFile *file, uint8_t *data, size_t size, size_t *read, systime_t timeout)
+{
+    error_t error = stream_buffer_read(reader, data, size, read, timeout);
+    if (error != ERROR_OUT_OF_RANGE)
+    {
+        return error;
+    }
+
+    /* not held in memory, the data has to be on disk already */
+    error = fsSeekFile(file, stream_buffer_reader_offset(reader), FS_SEEK_SET);
+    if (error == NO_ERROR)
+    {
+        error = fsReadFile(file, data, size, read);
+    }
+    if (error == NO_ERROR)
+    {
+        reader->pos += *read;
+    }
+    else if (error == ERROR_END_OF_FILE)
+    {
+        /* still in the stdio buffers of the encoder */
+        osDelayTask(MIN(timeout, 100));
+        error = ERROR_TIMEOUT;
+    }
+    return error;
+}
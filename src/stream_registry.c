@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "stream_registry.h"
+#include "debug.h"
+#include "os_port.h"
+#include "mutex_manager.h"
+#include "stats.h"
+
+static stream_pipeline_t *stream_pipelines = NULL;
+
+static void stream_registry_unlink(stream_pipeline_t *pipeline)
+{
+    stream_pipeline_t **pos = &stream_pipelines;
+    while (*pos && *pos != pipeline)
+    {
+        pos = &(*pos)->next;
+    }
+    if (*pos)
+    {
+        *pos = pipeline->next;
+    }
+    pipeline->registered = false;
+}
+
+static void stream_registry_free(stream_pipeline_t *pipeline)
+{
+    stream_buffer_release(pipeline->stream_buffer);
+    osFreeMem(pipeline->source);
+    osFreeMem(pipeline->targetFile);
+    osFreeMem(pipeline);
+}
+
+stream_pipeline_t *stream_registry_subscribe(const char *source, size_t skip_seconds, const char *targetFile, bool append, settings_t *settings, bool *created)
+{
+    *created = false;
+
+    mutex_lock(MUTEX_STREAM_REGISTRY);
+    while (true)
+    {
+        bool targetBusy = false;
+        for (stream_pipeline_t *pipeline = stream_pipelines; pipeline; pipeline = pipeline->next)
+        {
+            if (pipeline->stopping)
+            {
+                /* its encoder may still write the .stream file, a second one must not start on it */
+                targetBusy |= !osStrcmp(pipeline->targetFile, targetFile);
+                continue;
+            }
+            /* pipelines whose encoder already ended are not joined anymore */
+            if (!pipeline->stream_ctx.quit && pipeline->skip_seconds == skip_seconds && !osStrcmp(pipeline->source, source))
+            {
+                pipeline->subscribers++;
+                mutex_unlock(MUTEX_STREAM_REGISTRY);
+                TRACE_INFO("Joining running stream of %s, %" PRIu32 " listeners\r\n", source, pipeline->subscribers);
+                stats_update("stream_joins", 1);
+                return pipeline;
+            }
+        }
+        if (!targetBusy)
+        {
+            break;
+        }
+        mutex_unlock(MUTEX_STREAM_REGISTRY);
+        TRACE_DEBUG("Waiting for the previous encoder of %s to stop\r\n", targetFile);
+        osDelayTask(100);
+        mutex_lock(MUTEX_STREAM_REGISTRY);
+    }
+
+    stream_pipeline_t *pipeline = osAllocMem(sizeof(stream_pipeline_t));
+    if (pipeline == NULL)
+    {
+        mutex_unlock(MUTEX_STREAM_REGISTRY);
+        return NULL;
+    }
+    osMemset(pipeline, 0, sizeof(stream_pipeline_t));
+    pipeline->source = strdup(source);
+    pipeline->skip_seconds = skip_seconds;
+    pipeline->targetFile = strdup(targetFile);
+    pipeline->subscribers = 1;
+    pipeline->stream_buffer = stream_buffer_create(targetFile);
+    if (pipeline->stream_buffer == NULL)
+    {
+        mutex_unlock(MUTEX_STREAM_REGISTRY);
+        stream_registry_free(pipeline);
+        return NULL;
+    }
+    stream_buffer_set_join_backlog(pipeline->stream_buffer, settings->encode.stream_join_backlog);
+
+    pipeline->ffmpeg_ctx.append = append;
+    pipeline->ffmpeg_ctx.sweep = settings->encode.ffmpeg_sweep_startup_buffer;
+    pipeline->ffmpeg_ctx.source = pipeline->source;
+    pipeline->ffmpeg_ctx.skip_seconds = skip_seconds;
+    pipeline->ffmpeg_ctx.targetFile = pipeline->targetFile;
+    pipeline->ffmpeg_ctx.stream_buffer = pipeline->stream_buffer;
+
+    pipeline->stream_ctx.active = false;
+    pipeline->stream_ctx.quit = false;
+    pipeline->stream_ctx.error = NO_ERROR;
+    pipeline->stream_ctx.ctx = &pipeline->ffmpeg_ctx;
+
+    pipeline->next = stream_pipelines;
+    stream_pipelines = pipeline;
+    pipeline->registered = true;
+    mutex_unlock(MUTEX_STREAM_REGISTRY);
+
+    pipeline->stream_ctx.taskId = osCreateTask("FfmpegStream", &ffmpeg_stream_task, &pipeline->stream_ctx, 10 * 1024, 0);
+    if (pipeline->stream_ctx.taskId == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Could not start encoder task for %s\r\n", source);
+        pipeline->stream_ctx.error = ERROR_OUT_OF_RESOURCES;
+        stream_buffer_close(pipeline->stream_buffer, pipeline->stream_ctx.error);
+        pipeline->stream_ctx.quit = true;
+    }
+    *created = true;
+
+    return pipeline;
+}
+
+void stream_registry_unsubscribe(stream_pipeline_t *pipeline)
+{
+    if (pipeline == NULL)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_STREAM_REGISTRY);
+    bool last = (--pipeline->subscribers == 0);
+    if (last)
+    {
+        /* stays registered until the encoder quit, so nobody starts another one on the same file */
+        pipeline->stopping = true;
+    }
+    mutex_unlock(MUTEX_STREAM_REGISTRY);
+
+    if (!last)
+    {
+        return;
+    }
+
+    TRACE_INFO("Last listener left, stopping stream of %s\r\n", pipeline->source);
+    /* the encoder sets active itself once it started, so keep clearing it until it quit */
+    while (!pipeline->stream_ctx.quit)
+    {
+        pipeline->stream_ctx.active = false;
+        osDelayTask(100);
+    }
+
+    mutex_lock(MUTEX_STREAM_REGISTRY);
+    if (pipeline->registered)
+    {
+        stream_registry_unlink(pipeline);
+    }
+    mutex_unlock(MUTEX_STREAM_REGISTRY);
+    stream_registry_free(pipeline);
+}
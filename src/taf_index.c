@@ -0,0 +1,656 @@
+#include <sys/stat.h>
+
+#include "taf_index.h"
+#include "handler.h"
+#include "fs_port.h"
+#include "fs_ext.h"
+#include "os_port.h"
+#include "debug.h"
+#include "settings.h"
+#include "stats.h"
+#include "server_helpers.h"
+#include "mutex_manager.h"
+#include "handler_sse.h"
+#include "cJSON.h"
+#include "file_watch.h"
+
+static taf_index_entry_t *taf_index_table[TAF_INDEX_BUCKETS];
+static bool taf_index_initialized = false;
+static bool taf_index_dirty = false;
+static systime_t taf_index_last_save = 0;
+static char *taf_index_path = NULL;
+static char *taf_index_tmp_path = NULL;
+
+typedef struct taf_index_queue_s taf_index_queue_t;
+struct taf_index_queue_s
+{
+    taf_index_queue_t *next;
+    char *path;
+};
+static taf_index_queue_t *taf_index_queue = NULL;
+static OsEvent taf_index_queue_event;
+static bool taf_index_validator_started = false;
+
+static uint32_t taf_index_hash(const char *path)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    while (*path)
+    {
+        hash ^= (uint8_t)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void taf_index_free_entry(taf_index_entry_t *entry)
+{
+    osFreeMem(entry->path);
+    osFreeMem(entry->header);
+    osFreeMem(entry->track_pos);
+    osFreeMem(entry);
+}
+
+static taf_index_entry_t *taf_index_find(const char *path, uint32_t hash, taf_index_entry_t ***prev)
+{
+    taf_index_entry_t **pos = &taf_index_table[hash % TAF_INDEX_BUCKETS];
+    while (*pos)
+    {
+        if ((*pos)->hash == hash && !osStrcmp((*pos)->path, path))
+        {
+            if (prev)
+            {
+                *prev = pos;
+            }
+            return *pos;
+        }
+        pos = &(*pos)->next;
+    }
+    return NULL;
+}
+
+static bool taf_index_key_equal(const taf_index_key_t *a, const taf_index_key_t *b)
+{
+    return a->device == b->device && a->inode == b->inode && a->size == b->size && a->mtime == b->mtime;
+}
+
+static void taf_index_insert(taf_index_entry_t *entry)
+{
+    taf_index_entry_t **prev = NULL;
+    taf_index_entry_t *existing = taf_index_find(entry->path, entry->hash, &prev);
+    if (existing)
+    {
+        if (entry->verdict == TAF_VERDICT_UNKNOWN && taf_index_key_equal(&entry->key, &existing->key))
+        {
+            entry->verdict = existing->verdict;
+        }
+        entry->next = existing->next;
+        *prev = entry;
+        taf_index_free_entry(existing);
+        return;
+    }
+    taf_index_entry_t **bucket = &taf_index_table[entry->hash % TAF_INDEX_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+}
+
+bool taf_index_stat(const char *path, taf_index_key_t *key)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+    {
+        return false;
+    }
+    key->device = (uint64_t)st.st_dev;
+    key->inode = (uint64_t)st.st_ino;
+    key->size = (uint64_t)st.st_size;
+#if defined(__linux__)
+    key->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    key->mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000ull + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+    key->mtime = (uint64_t)st.st_mtime * 1000000000ull;
+#endif
+    return true;
+}
+
+static bool taf_index_read(const uint8_t **data, const uint8_t *end, void *target, size_t length)
+{
+    if ((size_t)(end - *data) < length)
+    {
+        return false;
+    }
+    osMemcpy(target, *data, length);
+    *data += length;
+    return true;
+}
+
+static taf_index_entry_t *taf_index_parse_entry(const uint8_t **data, const uint8_t *end)
+{
+    uint16_t path_len = 0;
+    if (!taf_index_read(data, end, &path_len, sizeof(path_len)) || path_len == 0)
+    {
+        return NULL;
+    }
+
+    taf_index_entry_t *entry = osAllocMem(sizeof(taf_index_entry_t));
+    osMemset(entry, 0, sizeof(taf_index_entry_t));
+    entry->path = osAllocMem(path_len + 1);
+    bool ok = taf_index_read(data, end, entry->path, path_len);
+    entry->path[path_len] = '\0';
+
+    ok = ok && taf_index_read(data, end, &entry->key, sizeof(entry->key));
+    ok = ok && taf_index_read(data, end, &entry->has_header, sizeof(entry->has_header));
+    ok = ok && taf_index_read(data, end, &entry->verdict, sizeof(entry->verdict));
+    ok = ok && taf_index_read(data, end, &entry->header_size, sizeof(entry->header_size));
+    ok = ok && entry->header_size <= TAF_HEADER_SIZE;
+    if (ok && entry->header_size > 0)
+    {
+        entry->header = osAllocMem(entry->header_size);
+        ok = taf_index_read(data, end, entry->header, entry->header_size);
+    }
+    ok = ok && taf_index_read(data, end, &entry->track_count, sizeof(entry->track_count));
+    ok = ok && entry->track_count <= TAF_HEADER_SIZE;
+    if (ok && entry->track_count > 0)
+    {
+        entry->track_pos = osAllocMem(entry->track_count * sizeof(uint32_t));
+        ok = taf_index_read(data, end, entry->track_pos, entry->track_count * sizeof(uint32_t));
+    }
+
+    if (!ok)
+    {
+        taf_index_free_entry(entry);
+        return NULL;
+    }
+    entry->hash = taf_index_hash(entry->path);
+    return entry;
+}
+
+static void taf_index_load()
+{
+    uint32_t fileSize = 0;
+    if (!fsFileExists(taf_index_path) || fsGetFileSize(taf_index_path, &fileSize) != NO_ERROR || fileSize < 3 * sizeof(uint32_t))
+    {
+        return;
+    }
+
+    FsFile *file = fsOpenFile(taf_index_path, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        TRACE_WARNING("Could not open TAF index %s\r\n", taf_index_path);
+        return;
+    }
+    uint8_t *buffer = osAllocMem(fileSize);
+    size_t read_length = 0;
+    fsReadFile(file, buffer, fileSize, &read_length);
+    fsCloseFile(file);
+
+    const uint8_t *data = buffer;
+    const uint8_t *end = buffer + read_length;
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t count = 0;
+    taf_index_read(&data, end, &magic, sizeof(magic));
+    taf_index_read(&data, end, &version, sizeof(version));
+    taf_index_read(&data, end, &count, sizeof(count));
+
+    if (magic != TAF_INDEX_MAGIC || version != TAF_INDEX_VERSION)
+    {
+        TRACE_WARNING("Ignoring TAF index %s with unknown format\r\n", taf_index_path);
+        osFreeMem(buffer);
+        return;
+    }
+
+    size_t loaded = 0;
+    size_t dropped = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        taf_index_entry_t *entry = taf_index_parse_entry(&data, end);
+        if (entry == NULL)
+        {
+            TRACE_WARNING("TAF index %s truncated after %" PRIu32 " entries\r\n", taf_index_path, i);
+            break;
+        }
+
+        taf_index_key_t key;
+        if (!taf_index_stat(entry->path, &key) || !taf_index_key_equal(&key, &entry->key))
+        {
+            taf_index_free_entry(entry);
+            dropped++;
+            continue;
+        }
+        taf_index_insert(entry);
+        loaded++;
+    }
+    osFreeMem(buffer);
+
+    taf_index_dirty = (dropped > 0);
+    TRACE_INFO("Loaded TAF index with %" PRIuSIZE " entries, dropped %" PRIuSIZE " stale ones\r\n", loaded, dropped);
+}
+
+static char *taf_index_queue_pop()
+{
+    char *path = NULL;
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_queue_t *item = taf_index_queue;
+    if (item)
+    {
+        taf_index_queue = item->next;
+        path = item->path;
+        osFreeMem(item);
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+    return path;
+}
+
+static void taf_index_publish_verdict(const char *path, bool valid)
+{
+    const char *datadir = settings_get_string("internal.datadirfull");
+    size_t datadirLen = osStrlen(datadir);
+    if (datadirLen > 0 && osStrncmp(path, datadir, datadirLen) == 0)
+    {
+        path = &path[datadirLen];
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "path", path);
+    cJSON_AddBoolToObject(json, "valid", valid);
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    sse_sendEvent("TafValidation", jsonString, false);
+    osFreeMem(jsonString);
+}
+
+static void taf_index_validator_task(void *param)
+{
+    while (!settings_get_bool("internal.exit"))
+    {
+        char *path = taf_index_queue_pop();
+        if (path == NULL)
+        {
+            osWaitForEvent(&taf_index_queue_event, 1000);
+            continue;
+        }
+
+        taf_index_key_t key = {0};
+        if (taf_index_get_verdict(path, &key) == TAF_VERDICT_UNKNOWN && key.size > 0)
+        {
+            systime_t start = osGetSystemTime();
+            bool valid = isValidTaf(path, true);
+            TRACE_DEBUG("Validated TAF %s in %" PRIu32 "ms: %s\r\n", path, (uint32_t)(osGetSystemTime() - start), valid ? "valid" : "invalid");
+            if (!valid)
+            {
+                TRACE_ERROR("SHA1 not valid or length different for TAF %s\r\n", path);
+            }
+            stats_update("taf_validations", 1);
+            taf_index_publish_verdict(path, valid);
+        }
+        osFreeMem(path);
+    }
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+static void taf_index_queue_unknown()
+{
+    for (size_t i = 0; i < TAF_INDEX_BUCKETS; i++)
+    {
+        for (taf_index_entry_t *entry = taf_index_table[i]; entry; entry = entry->next)
+        {
+            if (entry->header && entry->verdict == TAF_VERDICT_UNKNOWN)
+            {
+                taf_index_queue_t *item = osAllocMem(sizeof(taf_index_queue_t));
+                item->path = strdup(entry->path);
+                item->next = taf_index_queue;
+                taf_index_queue = item;
+            }
+        }
+    }
+}
+
+void taf_index_init()
+{
+    mutex_lock(MUTEX_TAF_INDEX);
+    if (!taf_index_initialized)
+    {
+        osMemset(taf_index_table, 0, sizeof(taf_index_table));
+        taf_index_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TAF_INDEX_FILE);
+        taf_index_tmp_path = custom_asprintf("%s.tmp", taf_index_path);
+        taf_index_load();
+        taf_index_last_save = osGetSystemTime();
+        taf_index_initialized = true;
+
+        /* files fully validated before are not hashed again, only new or changed ones */
+        if (get_settings()->core.full_taf_validation)
+        {
+            taf_index_queue_unknown();
+        }
+        if (!taf_index_validator_started)
+        {
+            osCreateEvent(&taf_index_queue_event);
+            osCreateTask("TafValidator", &taf_index_validator_task, NULL, 16 * 1024, 0);
+            taf_index_validator_started = true;
+        }
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+    osSetEvent(&taf_index_queue_event);
+}
+
+/* removes the entry of a path unless it still belongs to the given file identity */
+static void taf_index_remove_stale(const char *path, const taf_index_key_t *current)
+{
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_entry_t **prev = NULL;
+    taf_index_entry_t *entry = taf_index_find(path, taf_index_hash(path), &prev);
+    if (entry && (current == NULL || !taf_index_key_equal(current, &entry->key)))
+    {
+        *prev = entry->next;
+        taf_index_free_entry(entry);
+        taf_index_dirty = true;
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
+
+/* drops the entry of a changed or removed file, unknown changes are left to the check against the file identity on every use */
+static void taf_index_file_changed(const char *path, void *ctx)
+{
+    if (path == NULL)
+    {
+        return;
+    }
+    taf_index_key_t key;
+    if (!taf_index_stat(path, &key))
+    {
+        taf_index_remove(path);
+        return;
+    }
+    /* files written by the server itself are indexed right away, those entries are current already */
+    taf_index_remove_stale(path, &key);
+}
+
+void taf_index_watch()
+{
+    settings_t *settings = get_settings();
+    file_watch_subscribe("TAF index content", settings->internal.contentdirfull, NULL, true, TAF_INDEX_WATCH_DEBOUNCE_MS, &taf_index_file_changed, NULL);
+    file_watch_subscribe("TAF index library", settings->internal.librarydirfull, NULL, true, TAF_INDEX_WATCH_DEBOUNCE_MS, &taf_index_file_changed, NULL);
+}
+
+void taf_index_deinit()
+{
+    taf_index_save();
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    for (size_t i = 0; i < TAF_INDEX_BUCKETS; i++)
+    {
+        taf_index_entry_t *entry = taf_index_table[i];
+        while (entry)
+        {
+            taf_index_entry_t *next = entry->next;
+            taf_index_free_entry(entry);
+            entry = next;
+        }
+        taf_index_table[i] = NULL;
+    }
+    while (taf_index_queue)
+    {
+        taf_index_queue_t *next = taf_index_queue->next;
+        osFreeMem(taf_index_queue->path);
+        osFreeMem(taf_index_queue);
+        taf_index_queue = next;
+    }
+    osFreeMem(taf_index_path);
+    osFreeMem(taf_index_tmp_path);
+    taf_index_path = NULL;
+    taf_index_tmp_path = NULL;
+    taf_index_initialized = false;
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
+
+void taf_index_loop()
+{
+    systime_t now = osGetSystemTime();
+    if (taf_index_dirty && (now - taf_index_last_save) >= TAF_INDEX_SAVE_INTERVAL_MS)
+    {
+        taf_index_save();
+    }
+}
+
+error_t taf_index_save()
+{
+    error_t error = NO_ERROR;
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    if (!taf_index_initialized || !taf_index_dirty)
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        return NO_ERROR;
+    }
+
+    FsFile *file = fsOpenFile(taf_index_tmp_path, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        TRACE_ERROR("Could not write TAF index %s\r\n", taf_index_tmp_path);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+
+    uint32_t magic = TAF_INDEX_MAGIC;
+    uint32_t version = TAF_INDEX_VERSION;
+    uint32_t count = 0;
+    for (size_t i = 0; i < TAF_INDEX_BUCKETS; i++)
+    {
+        for (taf_index_entry_t *entry = taf_index_table[i]; entry; entry = entry->next)
+        {
+            count++;
+        }
+    }
+    fsWriteFile(file, &magic, sizeof(magic));
+    fsWriteFile(file, &version, sizeof(version));
+    error = fsWriteFile(file, &count, sizeof(count));
+
+    for (size_t i = 0; i < TAF_INDEX_BUCKETS && error == NO_ERROR; i++)
+    {
+        for (taf_index_entry_t *entry = taf_index_table[i]; entry && error == NO_ERROR; entry = entry->next)
+        {
+            uint16_t path_len = (uint16_t)osStrlen(entry->path);
+            fsWriteFile(file, &path_len, sizeof(path_len));
+            fsWriteFile(file, entry->path, path_len);
+            fsWriteFile(file, &entry->key, sizeof(entry->key));
+            fsWriteFile(file, &entry->has_header, sizeof(entry->has_header));
+            fsWriteFile(file, &entry->verdict, sizeof(entry->verdict));
+            fsWriteFile(file, &entry->header_size, sizeof(entry->header_size));
+            if (entry->header_size > 0)
+            {
+                fsWriteFile(file, entry->header, entry->header_size);
+            }
+            error = fsWriteFile(file, &entry->track_count, sizeof(entry->track_count));
+            if (entry->track_count > 0)
+            {
+                error = fsWriteFile(file, entry->track_pos, entry->track_count * sizeof(uint32_t));
+            }
+        }
+    }
+    fsCloseFile(file);
+
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(taf_index_tmp_path, taf_index_path, true);
+    }
+    if (error == NO_ERROR)
+    {
+        taf_index_dirty = false;
+        TRACE_DEBUG("Saved TAF index with %" PRIu32 " entries\r\n", count);
+    }
+    else
+    {
+        TRACE_ERROR("Could not save TAF index %s, error=%s\r\n", taf_index_path, error2text(error));
+    }
+    taf_index_last_save = osGetSystemTime();
+    mutex_unlock(MUTEX_TAF_INDEX);
+
+    return error;
+}
+
+bool taf_index_get(const char *path, taf_index_key_t *key, bool *isTaf, TonieboxAudioFileHeader **tafHeader, track_positions_t *trackPos)
+{
+    if (!taf_index_stat(path, key))
+    {
+        return false;
+    }
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_entry_t *entry = taf_index_find(path, taf_index_hash(path), NULL);
+    if (entry == NULL || !entry->has_header || !taf_index_key_equal(key, &entry->key))
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        stats_update("taf_index_misses", 1);
+        return false;
+    }
+
+    if (isTaf)
+    {
+        *isTaf = (entry->header != NULL);
+    }
+    if (tafHeader)
+    {
+        *tafHeader = NULL;
+        if (entry->header)
+        {
+            *tafHeader = toniebox_audio_file_header__unpack(NULL, entry->header_size, entry->header);
+        }
+    }
+    if (trackPos)
+    {
+        trackPos->count = entry->track_count;
+        trackPos->pos = NULL;
+        if (entry->track_count > 0)
+        {
+            trackPos->pos = osAllocMem(entry->track_count * sizeof(uint32_t));
+            osMemcpy(trackPos->pos, entry->track_pos, entry->track_count * sizeof(uint32_t));
+        }
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+    stats_update("taf_index_hits", 1);
+
+    return true;
+}
+
+void taf_index_put(const char *path, const taf_index_key_t *key, const uint8_t *header, size_t headerSize, const track_positions_t *trackPos)
+{
+    /* a zeroed key means the file could not be stat'ed before reading it */
+    if (key->size == 0 || osStrlen(path) > UINT16_MAX || headerSize > TAF_HEADER_SIZE)
+    {
+        return;
+    }
+
+    taf_index_entry_t *entry = osAllocMem(sizeof(taf_index_entry_t));
+    osMemset(entry, 0, sizeof(taf_index_entry_t));
+    entry->path = strdup(path);
+    entry->hash = taf_index_hash(path);
+    entry->key = *key;
+    entry->has_header = true;
+    if (header && headerSize > 0)
+    {
+        entry->header_size = headerSize;
+        entry->header = osAllocMem(headerSize);
+        osMemcpy(entry->header, header, headerSize);
+    }
+    if (trackPos && trackPos->count > 0)
+    {
+        entry->track_count = trackPos->count;
+        entry->track_pos = osAllocMem(trackPos->count * sizeof(uint32_t));
+        osMemcpy(entry->track_pos, trackPos->pos, trackPos->count * sizeof(uint32_t));
+    }
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    if (!taf_index_initialized)
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        taf_index_free_entry(entry);
+        return;
+    }
+    taf_index_insert(entry);
+    taf_index_dirty = true;
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
+
+void taf_index_remove(const char *path)
+{
+    taf_index_remove_stale(path, NULL);
+}
+
+taf_verdict_t taf_index_get_verdict(const char *path, taf_index_key_t *key)
+{
+    if (!taf_index_stat(path, key))
+    {
+        osMemset(key, 0, sizeof(taf_index_key_t));
+        return TAF_VERDICT_UNKNOWN;
+    }
+
+    taf_verdict_t verdict = TAF_VERDICT_UNKNOWN;
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_entry_t *entry = taf_index_find(path, taf_index_hash(path), NULL);
+    if (entry != NULL && taf_index_key_equal(key, &entry->key))
+    {
+        verdict = (taf_verdict_t)entry->verdict;
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+
+    return verdict;
+}
+
+void taf_index_set_verdict(const char *path, const taf_index_key_t *key, bool valid)
+{
+    if (key->size == 0 || osStrlen(path) > UINT16_MAX)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    if (!taf_index_initialized)
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        return;
+    }
+    taf_index_entry_t *entry = taf_index_find(path, taf_index_hash(path), NULL);
+    if (entry == NULL || !taf_index_key_equal(key, &entry->key))
+    {
+        /* the header is read separately by getTonieInfo(), only remember the verdict */
+        entry = osAllocMem(sizeof(taf_index_entry_t));
+        osMemset(entry, 0, sizeof(taf_index_entry_t));
+        entry->path = strdup(path);
+        entry->hash = taf_index_hash(path);
+        entry->key = *key;
+        taf_index_insert(entry);
+    }
+    entry->verdict = valid ? TAF_VERDICT_VALID : TAF_VERDICT_INVALID;
+    taf_index_dirty = true;
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
+
+void taf_index_queue_validation(const char *path)
+{
+    mutex_lock(MUTEX_TAF_INDEX);
+    if (!taf_index_initialized)
+    {
+        mutex_unlock(MUTEX_TAF_INDEX);
+        return;
+    }
+    taf_index_queue_t **pos = &taf_index_queue;
+    while (*pos)
+    {
+        if (!osStrcmp((*pos)->path, path))
+        {
+            mutex_unlock(MUTEX_TAF_INDEX);
+            return;
+        }
+        pos = &(*pos)->next;
+    }
+    taf_index_queue_t *item = osAllocMem(sizeof(taf_index_queue_t));
+    item->path = strdup(path);
+    item->next = NULL;
+    *pos = item;
+    mutex_unlock(MUTEX_TAF_INDEX);
+
+    osSetEvent(&taf_index_queue_event);
+}
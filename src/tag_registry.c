@@ -0,0 +1,558 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "tag_registry.h"
+#include "handler_api.h"
+#include "file_watch.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "debug.h"
+#include "date_time.h"
+#include "mutex_manager.h"
+#include "net_config.h"
+#include "server_helpers.h"
+#include "settings.h"
+#include "toniesJson.h"
+#include "worker_pool.h"
+
+#define TAG_REGISTRY_BATCH_SIZE 64
+#define TAG_REGISTRY_MAX_QUEUED 256
+
+typedef struct tag_registry_entry
+{
+    char name[9];
+    char ruid[17];
+    uint64_t date;
+    uint64_t generation; /* of the last change */
+    bool present;        /* the directory exists and holds a tag */
+    bool dirty;          /* has to be read again */
+    bool seen;           /* found by the running scan */
+    bool hasSource;      /* content comes from the library */
+    cJSON *info;
+    tag_registry_attr_t attr;
+    struct tag_registry_entry *next;
+    struct tag_registry_entry *bucket_next;
+} tag_registry_entry_t;
+
+/* the entries are only added and changed by the registry task, everything the requests
+ * read is changed with MUTEX_TAG_REGISTRY held */
+static tag_registry_entry_t *tag_registry_buckets[TAG_REGISTRY_BUCKETS];
+static tag_registry_entry_t *tag_registry_entries = NULL;
+static size_t tag_registry_count = 0;
+static uint64_t tag_registry_generation = 0;
+static bool tag_registry_ready = false;
+static char *tag_registry_dir = NULL;
+static bool tag_registry_started = false;
+
+/* changes reported by the file watch, with MUTEX_TAG_REGISTRY held */
+static char tag_registry_queued[TAG_REGISTRY_MAX_QUEUED][9];
+static size_t tag_registry_queued_count = 0;
+static bool tag_registry_queued_rescan = false;
+static bool tag_registry_queued_library = false;
+static OsEvent tag_registry_event;
+
+/* only used by the registry task */
+static int32_t tag_registry_content_sub = -1;
+static int32_t tag_registry_library_sub = -1;
+/* the tonies json the infos were built from, their tonieInfo and sourceInfo come from it */
+static uint32_t tag_registry_tonies_version = 0;
+
+static uint32_t tag_registry_hash(const char *name)
+{
+    /* FNV-1a, case insensitive like the file systems the content may live on */
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c; c++)
+    {
+        hash ^= (uint8_t)toupper(*c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* if the first 8 characters are hex */
+static bool tag_registry_is_tag_dir_n(const char *name)
+{
+    for (size_t i = 0; i < 8; i++)
+    {
+        if (!isxdigit((uint8_t)name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tag_registry_is_tag_dir(const char *name)
+{
+    return osStrlen(name) == 8 && tag_registry_is_tag_dir_n(name);
+}
+
+static tag_registry_entry_t *tag_registry_lookup(const char *name)
+{
+    for (tag_registry_entry_t *entry = tag_registry_buckets[tag_registry_hash(name) % TAG_REGISTRY_BUCKETS]; entry != NULL; entry = entry->bucket_next)
+    {
+        if (!osStrcasecmp(entry->name, name))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* registry task only */
+static tag_registry_entry_t *tag_registry_add(const char *name)
+{
+    tag_registry_entry_t *entry = tag_registry_lookup(name);
+    if (entry != NULL)
+    {
+        return entry;
+    }
+    entry = osAllocMem(sizeof(tag_registry_entry_t));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    osMemset(entry, 0, sizeof(tag_registry_entry_t));
+    osStrncpy(entry->name, name, sizeof(entry->name) - 1);
+
+    uint32_t bucket = tag_registry_hash(name) % TAG_REGISTRY_BUCKETS;
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    entry->bucket_next = tag_registry_buckets[bucket];
+    tag_registry_buckets[bucket] = entry;
+    entry->next = tag_registry_entries;
+    tag_registry_entries = entry;
+    tag_registry_count++;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+    return entry;
+}
+
+/* runs on the file watch task, only queues the tag directory for the registry task */
+static void tag_registry_content_changed(const char *path, void *ctx)
+{
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    size_t length = (tag_registry_dir != NULL) ? osStrlen(tag_registry_dir) : 0;
+    if (path == NULL || length == 0 || osStrncmp(path, tag_registry_dir, length) || path[length] != PATH_SEPARATOR)
+    {
+        tag_registry_queued_rescan = true;
+    }
+    else
+    {
+        /* the first path component below the content directory is the tag directory */
+        const char *name = &path[length + 1];
+        const char *end = osStrchr(name, PATH_SEPARATOR);
+        size_t nameLength = (end != NULL) ? (size_t)(end - name) : osStrlen(name);
+        if (nameLength == 8 && tag_registry_is_tag_dir_n(name))
+        {
+            if (tag_registry_queued_count < TAG_REGISTRY_MAX_QUEUED)
+            {
+                osStrncpy(tag_registry_queued[tag_registry_queued_count], name, 8);
+                tag_registry_queued[tag_registry_queued_count][8] = '\0';
+                tag_registry_queued_count++;
+            }
+            else
+            {
+                tag_registry_queued_rescan = true;
+            }
+        }
+    }
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+    osSetEvent(&tag_registry_event);
+}
+
+/* runs on the file watch task, tags using the library as source are read again */
+static void tag_registry_library_changed(const char *path, void *ctx)
+{
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    tag_registry_queued_library = true;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+    osSetEvent(&tag_registry_event);
+}
+
+/* if all changes are notified, otherwise the registry relies on rescans */
+static bool tag_registry_notified()
+{
+    return file_watch_notified(tag_registry_content_sub) && (tag_registry_library_sub < 0 || file_watch_notified(tag_registry_library_sub));
+}
+
+/* registry task only, drops everything when the content directory changed */
+static void tag_registry_reset(const char *contentDir)
+{
+    file_watch_unsubscribe(tag_registry_content_sub);
+    file_watch_unsubscribe(tag_registry_library_sub);
+    tag_registry_library_sub = -1;
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    tag_registry_entry_t *entry = tag_registry_entries;
+    while (entry != NULL)
+    {
+        tag_registry_entry_t *next = entry->next;
+        cJSON_Delete(entry->info);
+        osFreeMem(entry);
+        entry = next;
+    }
+    osMemset(tag_registry_buckets, 0, sizeof(tag_registry_buckets));
+    tag_registry_entries = NULL;
+    tag_registry_count = 0;
+    tag_registry_ready = false;
+    osFreeMem(tag_registry_dir);
+    tag_registry_dir = custom_asprintf("%s", contentDir);
+    tag_registry_queued_count = 0;
+    tag_registry_queued_library = false;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+
+    tag_registry_content_sub = file_watch_subscribe("tag registry", contentDir, NULL, true, TAG_REGISTRY_DEBOUNCE_MS, &tag_registry_content_changed, NULL);
+    const char *libraryDir = get_settings()->internal.librarydirfull;
+    if (libraryDir != NULL)
+    {
+        tag_registry_library_sub = file_watch_subscribe("tag registry library", libraryDir, NULL, true, TAG_REGISTRY_DEBOUNCE_MS, &tag_registry_library_changed, NULL);
+    }
+    if (!tag_registry_notified())
+    {
+        TRACE_INFO("Tag registry: changes are not fully notified, rescanning every %d s\r\n", TAG_REGISTRY_POLL_RESCAN_MS / 1000);
+    }
+}
+
+static bool tag_registry_attr_equal(const tag_registry_attr_t *a, const tag_registry_attr_t *b)
+{
+    return a->valid == b->valid && a->hide == b->hide && a->hasCloudAuth == b->hasCloudAuth &&
+           a->hasAudioId == b->hasAudioId && a->audioId == b->audioId && !osStrcmp(a->model, b->model);
+}
+
+typedef struct
+{
+    tag_registry_entry_t **entries;
+    cJSON **info;
+    tag_registry_attr_t *attr;
+    uint64_t *date;
+    bool *isDir;
+    client_ctx_t *client_ctx;
+} tag_registry_batch_t;
+
+/* reads one tag directory, runs on the worker pool */
+static void tag_registry_resolve(void *ctx, size_t index)
+{
+    tag_registry_batch_t *batch = (tag_registry_batch_t *)ctx;
+    tag_registry_entry_t *entry = batch->entries[index];
+
+    char *path = custom_asprintf("%s%c%s", tag_registry_dir, PATH_SEPARATOR, entry->name);
+    FsFileStat stat;
+    batch->info[index] = NULL;
+    batch->isDir[index] = (fsGetFileStat(path, &stat) == NO_ERROR && (stat.attributes & FS_FILE_ATTR_DIRECTORY));
+    if (batch->isDir[index])
+    {
+        batch->date[index] = convertDateToUnixTime(&stat.modified);
+        osMemset(&batch->attr[index], 0, sizeof(tag_registry_attr_t));
+        batch->info[index] = getTagRegistryInfo(entry->name, batch->client_ctx, &batch->attr[index]);
+    }
+    osFreeMem(path);
+}
+
+/* registry task only, takes over the results of a batch */
+static void tag_registry_apply(tag_registry_batch_t *batch, size_t count, uint64_t generation)
+{
+    bool changed = false;
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    for (size_t i = 0; i < count; i++)
+    {
+        tag_registry_entry_t *entry = batch->entries[i];
+        cJSON *info = batch->info[i];
+        bool present = (info != NULL);
+
+        bool entryChanged = (present != entry->present);
+        if (present && !entryChanged)
+        {
+            entryChanged = (batch->date[i] != entry->date) ||
+                           !tag_registry_attr_equal(&batch->attr[i], &entry->attr) ||
+                           !cJSON_Compare(info, entry->info, true);
+        }
+        if (!entryChanged)
+        {
+            cJSON_Delete(info);
+            continue;
+        }
+
+        cJSON_Delete(entry->info);
+        entry->info = info;
+        entry->present = present;
+        entry->generation = generation;
+        if (present)
+        {
+            entry->date = batch->date[i];
+            entry->attr = batch->attr[i];
+            cJSON *ruid = cJSON_GetObjectItemCaseSensitive(info, "ruid");
+            if (cJSON_IsString(ruid))
+            {
+                osStrncpy(entry->ruid, ruid->valuestring, sizeof(entry->ruid) - 1);
+            }
+            cJSON *source = cJSON_GetObjectItemCaseSensitive(info, "source");
+            entry->hasSource = cJSON_IsString(source) && source->valuestring[0] != '\0';
+        }
+        else
+        {
+            entry->hasSource = false;
+        }
+        changed = true;
+    }
+    if (changed)
+    {
+        tag_registry_generation = generation;
+    }
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+}
+
+/* registry task only, reads all entries marked dirty again */
+static size_t tag_registry_refresh()
+{
+    size_t dirtyCount = 0;
+    for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+    {
+        dirtyCount += entry->dirty;
+    }
+    if (dirtyCount == 0)
+    {
+        return 0;
+    }
+
+    tag_registry_entry_t *entries[TAG_REGISTRY_BATCH_SIZE];
+    cJSON *info[TAG_REGISTRY_BATCH_SIZE];
+    tag_registry_attr_t attr[TAG_REGISTRY_BATCH_SIZE];
+    uint64_t date[TAG_REGISTRY_BATCH_SIZE];
+    bool isDir[TAG_REGISTRY_BATCH_SIZE];
+    client_ctx_t client_ctx = {.settings = get_settings()};
+    tag_registry_batch_t batch = {.entries = entries, .info = info, .attr = attr, .date = date, .isDir = isDir, .client_ctx = &client_ctx};
+
+    /* all changes of one refresh share a generation, so clients see them at once */
+    uint64_t generation = tag_registry_generation + 1;
+    tag_registry_entry_t *entry = tag_registry_entries;
+    while (entry != NULL)
+    {
+        size_t count = 0;
+        for (; entry != NULL && count < TAG_REGISTRY_BATCH_SIZE; entry = entry->next)
+        {
+            if (entry->dirty)
+            {
+                entry->dirty = false;
+                entries[count++] = entry;
+            }
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        worker_pool_run(&tag_registry_resolve, &batch, count, client_ctx.settings->core.index_workers);
+        tag_registry_apply(&batch, count, generation);
+    }
+    return dirtyCount;
+}
+
+/* registry task only, finds added and removed tag directories and reads all of them again */
+static void tag_registry_scan()
+{
+    systime_t start = osGetSystemTime();
+    const char *contentDir = tag_registry_dir;
+
+    for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+    {
+        entry->seen = false;
+    }
+    FsDir *dir = fsOpenDir(contentDir);
+    if (dir != NULL)
+    {
+        FsDirEntry dirEntry;
+        while (fsReadDir(dir, &dirEntry) == NO_ERROR)
+        {
+            if (!(dirEntry.attributes & FS_FILE_ATTR_DIRECTORY) || !tag_registry_is_tag_dir(dirEntry.name))
+            {
+                continue;
+            }
+            tag_registry_entry_t *entry = tag_registry_add(dirEntry.name);
+            if (entry != NULL)
+            {
+                entry->seen = true;
+            }
+        }
+        fsCloseDir(dir);
+    }
+    for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+    {
+        /* removed ones are read again too, which turns them into tombstones */
+        if (entry->seen || entry->present)
+        {
+            entry->dirty = true;
+        }
+    }
+
+    tag_registry_refresh();
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    bool first = !tag_registry_ready;
+    tag_registry_ready = true;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+    if (first)
+    {
+        TRACE_INFO("Tag registry: %zu tags in %" PRIu32 " ms\r\n", tag_registry_count, (uint32_t)(osGetSystemTime() - start));
+    }
+}
+
+/* registry task only, marks the queued changes and returns true if a full rescan is needed */
+static bool tag_registry_take_queued()
+{
+    char queued[TAG_REGISTRY_MAX_QUEUED][9];
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    size_t count = tag_registry_queued_count;
+    osMemcpy(queued, tag_registry_queued, count * sizeof(queued[0]));
+    bool rescan = tag_registry_queued_rescan;
+    bool library = tag_registry_queued_library;
+    uint32_t toniesVersion = tonies_version();
+    tag_registry_queued_count = 0;
+    tag_registry_queued_rescan = false;
+    tag_registry_queued_library = false;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        /* also new directories, they may hold no tag yet and turn up with the next change */
+        tag_registry_entry_t *entry = tag_registry_add(queued[i]);
+        if (entry != NULL)
+        {
+            entry->dirty = true;
+        }
+    }
+    if (library)
+    {
+        for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+        {
+            if (entry->hasSource)
+            {
+                entry->dirty = true;
+            }
+        }
+    }
+    if (toniesVersion != tag_registry_tonies_version)
+    {
+        /* a reloaded tonies json may change the tonieInfo and sourceInfo of every tag */
+        tag_registry_tonies_version = toniesVersion;
+        for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+        {
+            if (entry->present)
+            {
+                entry->dirty = true;
+            }
+        }
+    }
+    return rescan;
+}
+
+static void tag_registry_task(void *param)
+{
+    systime_t lastScan = 0;
+    bool rescan = true;
+
+    while (!settings_get_bool("internal.exit"))
+    {
+        const char *contentDir = get_settings()->internal.contentdirfull;
+        if (contentDir == NULL || !fsDirExists(contentDir))
+        {
+            osDelayTask(1000);
+            continue;
+        }
+        if (tag_registry_dir == NULL || osStrcmp(tag_registry_dir, contentDir))
+        {
+            tag_registry_reset(contentDir);
+            rescan = true;
+        }
+
+        rescan |= tag_registry_take_queued();
+
+        systime_t now = osGetSystemTime();
+        systime_t interval = tag_registry_notified() ? TAG_REGISTRY_RESCAN_MS : TAG_REGISTRY_POLL_RESCAN_MS;
+        if (rescan || now - lastScan >= interval)
+        {
+            tag_registry_scan();
+            lastScan = osGetSystemTime();
+            rescan = false;
+            continue;
+        }
+
+        /* the file watch reports the changes once they settled */
+        size_t count = tag_registry_refresh();
+        if (count > 0)
+        {
+            TRACE_DEBUG("Tag registry: read %zu changed tags, generation %" PRIu64 "\r\n", count, tag_registry_generation);
+        }
+        osWaitForEvent(&tag_registry_event, 1000);
+    }
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void tag_registry_init()
+{
+    if (tag_registry_started)
+    {
+        return;
+    }
+    osCreateEvent(&tag_registry_event);
+    if (osCreateTask("TagRegistry", &tag_registry_task, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start tag registry task\r\n");
+        return;
+    }
+    tag_registry_started = true;
+}
+
+bool tag_registry_list(const char *contentDir, uint64_t since, tag_registry_item_t **items, size_t *count, uint64_t *generation)
+{
+    *items = NULL;
+    *count = 0;
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    if (!tag_registry_ready || tag_registry_dir == NULL || contentDir == NULL || osStrcmp(tag_registry_dir, contentDir))
+    {
+        mutex_unlock(MUTEX_TAG_REGISTRY);
+        return false;
+    }
+
+    *items = osAllocMem(MAX(tag_registry_count, 1) * sizeof(tag_registry_item_t));
+    if (*items == NULL)
+    {
+        mutex_unlock(MUTEX_TAG_REGISTRY);
+        return false;
+    }
+    for (tag_registry_entry_t *entry = tag_registry_entries; entry != NULL; entry = entry->next)
+    {
+        /* removed directories are only of interest to clients that have seen them */
+        if ((!entry->present && since == 0) || entry->generation <= since)
+        {
+            continue;
+        }
+        tag_registry_item_t *item = &(*items)[(*count)++];
+        osStrcpy(item->name, entry->name);
+        osStrcpy(item->ruid, entry->ruid);
+        item->date = entry->date;
+        item->generation = entry->generation;
+        item->deleted = !entry->present;
+    }
+    *generation = tag_registry_generation;
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+
+    return true;
+}
+
+cJSON *tag_registry_get(const char *name, tag_registry_attr_t *attr)
+{
+    cJSON *info = NULL;
+
+    mutex_lock(MUTEX_TAG_REGISTRY);
+    tag_registry_entry_t *entry = tag_registry_lookup(name);
+    if (entry != NULL && entry->present)
+    {
+        info = cJSON_Duplicate(entry->info, true);
+        *attr = entry->attr;
+    }
+    mutex_unlock(MUTEX_TAG_REGISTRY);
+
+    return info;
+}
@@ -6,6 +6,7 @@
 #include "cJSON.h"
 #include "json_helper.h"
 #include "handler.h"
+#include "taf_index.h"
 
 bool_t is_valid_tap_file(char *filename)
 {
@@ -96,7 +97,8 @@ error_t tap_load(char *filename, tonie_audio_playlist_t *tap)
     cJSON_Delete(tapJson);
     if (error == NO_ERROR)
     {
-        if (isValidTaf(tap->_filepath_resolved, true))
+        /* a TAF without verdict is used right away, the verdict is checked again by tap_cache_invalid() on every use */
+        if (isValidTafCached(tap->_filepath_resolved, true))
         {
             tap->_cached = true;
             // TODO check audio id if different and check settings.
@@ -176,6 +178,12 @@ void tap_free(tonie_audio_playlist_t *tap)
     osMemset(tap, 0, sizeof(tonie_audio_playlist_t));
 }
 
+bool_t tap_cache_invalid(tonie_audio_playlist_t *tap)
+{
+    taf_index_key_t indexKey = {0};
+    return taf_index_get_verdict(tap->_filepath_resolved, &indexKey) == TAF_VERDICT_INVALID;
+}
+
 error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force)
 {
     error_t error = NO_ERROR;
@@ -183,7 +191,7 @@ error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bo
     tonie_info_t *tonieInfo = getTonieInfo(tap->_filepath_resolved, false, get_settings());
 
     // TODO custom audio id resolving
-    if (force || !tonieInfo->valid || tonieInfo->tafHeader->audio_id != tap->audio_id)
+    if (force || !tonieInfo->valid || tap_cache_invalid(tap) || tonieInfo->tafHeader->audio_id != tap->audio_id)
     {
         char *tmp_taf = custom_asprintf("%s.tmp", tap->_filepath_resolved);
         char source[99][PATH_LEN];
@@ -199,7 +207,7 @@ error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bo
             osStrcpy(source[i], tap->files[i]._filepath_resolved);
         }
         // toniefile_t *taf = toniefile_create(tmp_taf, tap->audio_id, false, 0);
-        error = ffmpeg_stream(source, tap->filesCount, current_source, tmp_taf, 0, active, &sweep, false, false);
+        error = ffmpeg_stream(source, tap->filesCount, current_source, tmp_taf, 0, active, &sweep, false, false, NULL);
         // toniefile_close(taf);
         if (error != NO_ERROR)
         {
@@ -2,6 +2,7 @@
 
 #include <sys/types.h>
 #include <time.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -22,6 +23,12 @@
 #include "server_helpers.h"
 #include "version.h"
 #include "proto/toniebox.pb.taf-header.pb-c.h"
+#include "stream_buffer.h"
+#include "worker_pool.h"
+
+/* a page may hold 255 lacing values, keep enough of them free to pad the last packet up to the end of the block */
+#define TONIEFILE_BLOCK_LACING (255 - TONIEFILE_FRAME_SIZE / 255 - 1)
+#define TONIEFILE_BLOCK_PACKETS 255
 
 struct toniefile_s
 {
@@ -40,12 +47,37 @@ struct toniefile_s
     uint64_t ogg_granule_position;
     uint64_t ogg_packet_count;
 
+    /* packets of the block being filled, written as one page once the block is complete */
+    uint8_t block_data[TONIEFILE_FRAME_SIZE];
+    int block_packet_length[TONIEFILE_BLOCK_PACKETS];
+    size_t block_packets;
+    size_t block_data_used;
+    size_t block_lacing;
+
     /* TAF */
     TonieboxAudioFileHeader taf;
     Sha1Context sha1;
     size_t taf_block_num;
+    bool_t chapter_pending;
+
+    /* optional in-memory copy for live senders */
+    stream_buffer_t *stream_buffer;
+
+    /* only audio pages without TAF header, see toniefile_create_segment() */
+    bool_t segment;
+    size_t preroll;
 };
 
+static void toniefile_publish_page(toniefile_t *ctx, ogg_page *og)
+{
+    if (ctx->stream_buffer)
+    {
+        uint64_t offset = TONIEFILE_FRAME_SIZE + ctx->audio_length;
+        stream_buffer_write(ctx->stream_buffer, offset, og->header, og->header_len);
+        stream_buffer_write(ctx->stream_buffer, offset + og->header_len, og->body, og->body_len);
+    }
+}
+
 static void toniefile_comment_add(uint8_t *buffer, size_t *length, const char *str)
 {
     uint32_t value = strlen(str);
@@ -92,13 +124,27 @@ static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFile
     return size;
 }
 
-toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool append, int32_t size)
+static error_t toniefile_chapter_add(toniefile_t *ctx)
+{
+    if (ctx->taf.n_track_page_nums >= TONIEFILE_MAX_CHAPTERS - 1)
+    {
+        return ERROR_FAILURE;
+    }
+    ctx->taf.track_page_nums[ctx->taf.n_track_page_nums++] = ctx->taf_block_num;
+    TRACE_INFO("new chapter at 0x%08" PRIX32 "\r\n", (uint32_t)ctx->taf_block_num);
+
+    return NO_ERROR;
+}
+
+static toniefile_t *toniefile_create_ex(const char *fullPath, uint32_t audio_id, bool append, int32_t size, stream_buffer_t *stream_buffer, bool_t segment)
 {
     int err;
     TonieboxAudioFileHeader *tafHeader = NULL;
 
     toniefile_t *ctx = osAllocMem(sizeof(toniefile_t));
     osMemset(ctx, 0x00, sizeof(toniefile_t));
+    ctx->stream_buffer = stream_buffer;
+    ctx->segment = segment;
 
     int32_t tonie_audio_size = TONIE_LENGTH_MAX;
     if (size > 0)
@@ -147,8 +193,11 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         osFreeMem(ctx);
         return NULL;
     }
-    toniefile_write_header(ctx);
-    fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
+    if (!segment)
+    {
+        toniefile_write_header(ctx);
+        fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
+    }
 
     /* init OPUS */
     ctx->enc = opus_encoder_create(OPUS_SAMPLING_RATE, OPUS_CHANNELS, OPUS_APPLICATION_AUDIO, &err);
@@ -168,6 +217,14 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
     /* init OGG */
     ogg_stream_init(&ctx->os, audio_id);
 
+    /* the stream headers are part of the TAF the segment gets appended to, so the stream is already started there.
+     * otherwise the first page would get the begin of stream flag and only hold a single packet. */
+    if (segment)
+    {
+        ctx->os.b_o_s = 1;
+        return ctx;
+    }
+
     // TODO: read header data to check if the same header channel / sampling rate is used
     unsigned char header_data[] = {
         'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',                         // "OpusHead" string
@@ -252,6 +309,7 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
             {
                 return NULL;
             }
+            toniefile_publish_page(ctx, &og);
             ctx->file_pos += og.header_len + og.body_len;
             ctx->audio_length += og.header_len + og.body_len;
 
@@ -304,7 +362,29 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         //  TRACE_WARNING("Seek file to %zu, blockrest=%zu\r\n", ctx->file_pos, block_rest);
     }
 
-    toniefile_new_chapter(ctx);
+    toniefile_chapter_add(ctx);
+    return ctx;
+}
+
+toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool append, int32_t size)
+{
+    return toniefile_create_stream(fullPath, audio_id, append, size, NULL);
+}
+
+toniefile_t *toniefile_create_stream(const char *fullPath, uint32_t audio_id, bool append, int32_t size, stream_buffer_t *stream_buffer)
+{
+    return toniefile_create_ex(fullPath, audio_id, append, size, stream_buffer, false);
+}
+
+toniefile_t *toniefile_create_segment(const char *fullPath, uint32_t audio_id, size_t offset, size_t preroll)
+{
+    toniefile_t *ctx = toniefile_create_ex(fullPath, audio_id, false, 0, NULL, true);
+    if (ctx)
+    {
+        /* the blocks of the segment are laid out as if it started at this position of the TAF */
+        ctx->file_pos = offset % TONIEFILE_FRAME_SIZE;
+        ctx->preroll = preroll;
+    }
     return ctx;
 }
 
@@ -348,26 +428,259 @@ error_t toniefile_write_header(toniefile_t *ctx)
     {
         return ERROR_WRITE_FAILED;
     }
+
+    if (ctx->stream_buffer)
+    {
+        uint8_t block[TONIEFILE_FRAME_SIZE];
+        osMemset(block, 0x00, sizeof(block));
+        osMemcpy(block, proto_be, sizeof(proto_be));
+        osMemcpy(&block[sizeof(proto_be)], buffer, MIN(proto_size, sizeof(block) - sizeof(proto_be)));
+        stream_buffer_write_header(ctx->stream_buffer, block, sizeof(block));
+    }
     return NO_ERROR;
 }
 
-error_t toniefile_close(toniefile_t *ctx)
+static int toniefile_block_remain(toniefile_t *ctx)
+{
+    return TONIEFILE_FRAME_SIZE - (int)((ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->block_lacing + ctx->block_data_used);
+}
+
+/* the largest packet that still fits into the page of the current block */
+static int toniefile_block_space(toniefile_t *ctx)
+{
+    int page_remain = toniefile_block_remain(ctx);
+    if (ctx->block_lacing >= TONIEFILE_BLOCK_LACING || page_remain < 2)
+    {
+        return 0;
+    }
+    /* every started 255 bytes of a packet take another lacing value */
+    return (page_remain / 256) * 255 + (page_remain % 256) - 1;
+}
+
+/* writes the packets of the current block as one page */
+static error_t toniefile_block_write(toniefile_t *ctx)
+{
+    size_t offset = 0;
+    for (size_t packet = 0; packet < ctx->block_packets; packet++)
+    {
+        ogg_packet op;
+        op.packet = &ctx->block_data[offset];
+        op.bytes = ctx->block_packet_length[packet];
+        op.b_o_s = 0;
+        op.e_o_s = 0;
+        op.granulepos = ctx->ogg_granule_position;
+        op.packetno = ctx->ogg_packet_count - ctx->block_packets + packet;
+
+        ogg_stream_packetin(&ctx->os, &op);
+        offset += op.bytes;
+    }
+    ctx->block_packets = 0;
+    ctx->block_data_used = 0;
+    ctx->block_lacing = 0;
+
+    ogg_page og;
+    while (ogg_stream_flush(&ctx->os, &og))
+    {
+        if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
+        {
+            return ERROR_FAILURE;
+        }
+        if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
+        {
+            return ERROR_FAILURE;
+        }
+        size_t prev = ctx->file_pos;
+        toniefile_publish_page(ctx, &og);
+        ctx->file_pos += og.header_len + og.body_len;
+        ctx->audio_length += og.header_len + og.body_len;
+        // TRACE_INFO("Header_len %zu Body_len %zu prev %zu File_pos %zu\r\n", og.header_len, og.body_len, prev, ctx->file_pos);
+
+        sha1Update(&ctx->sha1, og.header, og.header_len);
+        sha1Update(&ctx->sha1, og.body, og.body_len);
+
+        if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
+        {
+            ctx->taf_block_num++;
+            if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
+            {
+                TRACE_ERROR("Block alignment mismatch 0x%08" PRIX32 "\r\n", (uint32_t)ctx->file_pos)
+                return ERROR_FAILURE;
+            }
+        }
+    }
+    return NO_ERROR;
+}
+
+/* pads the packets of the current block until its page ends exactly at the block end and writes it.
+ * the last packet takes the padding, a single byte it cannot take due to the lacing goes to one before. */
+static error_t toniefile_block_fill(toniefile_t *ctx)
+{
+    if (ctx->block_packets == 0)
+    {
+        return NO_ERROR;
+    }
+
+    int remain = toniefile_block_remain(ctx);
+    size_t packet = ctx->block_packets;
+    size_t end = ctx->block_data_used;
+    while (remain > 0 && packet > 0)
+    {
+        packet--;
+        int length = ctx->block_packet_length[packet];
+        size_t start = end - length;
+        int available = length + (length / 255) + 1 + remain;
+        int padded = (available / 256) * 255 + (available % 256) - 1;
+
+        if (padded > length)
+        {
+            /* padding moves the packet in place, a failed one leaves it broken */
+            uint8_t original[TONIEFILE_FRAME_SIZE];
+            osMemcpy(original, &ctx->block_data[start], length);
+
+            size_t grow = padded - length;
+            osMemmove(&ctx->block_data[end + grow], &ctx->block_data[end], ctx->block_data_used - end);
+
+            int ret = opus_packet_pad(&ctx->block_data[start], length, padded);
+            // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", length, padded);
+            if (ret < 0)
+            {
+                TRACE_WARNING("Cannot pad: %s\r\n", opus_strerror(ret));
+                osMemmove(&ctx->block_data[end], &ctx->block_data[end + grow], ctx->block_data_used - end);
+                osMemcpy(&ctx->block_data[start], original, length);
+            }
+            else
+            {
+                ctx->block_packet_length[packet] = padded;
+                ctx->block_data_used += grow;
+                ctx->block_lacing += (padded / 255) - (length / 255);
+                remain = toniefile_block_remain(ctx);
+            }
+        }
+        end = start;
+    }
+
+    if (remain != 0)
+    {
+        TRACE_ERROR("Could not pad block 0x%08" PRIX32 ", %d bytes left\r\n", (uint32_t)ctx->taf_block_num, remain);
+        return ERROR_FAILURE;
+    }
+    return toniefile_block_write(ctx);
+}
+
+/* adds an encoded packet to the current block. a packet that does not fit anymore completes the block and starts the next one */
+static error_t toniefile_block_add(toniefile_t *ctx, const uint8_t *data, int length)
+{
+    error_t error = NO_ERROR;
+
+    if (length > toniefile_block_space(ctx))
+    {
+        error = toniefile_block_fill(ctx);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+        if (length > toniefile_block_space(ctx))
+        {
+            TRACE_ERROR("Packet of %d bytes does not fit into a block\r\n", length);
+            return ERROR_FAILURE;
+        }
+    }
+
+    if (ctx->chapter_pending)
+    {
+        ctx->chapter_pending = false;
+        error = toniefile_chapter_add(ctx);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+
+    /* we have to retrieve the actually encoded samples in this frame */
+    int frames = opus_packet_get_samples_per_frame(data, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(data, length);
+    if (frames != OPUS_FRAME_SIZE)
+    {
+        TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
+    }
+    ctx->ogg_granule_position += frames;
+    ctx->ogg_packet_count++;
+
+    osMemcpy(&ctx->block_data[ctx->block_data_used], data, length);
+    ctx->block_packet_length[ctx->block_packets++] = length;
+    ctx->block_data_used += length;
+    ctx->block_lacing += (length / 255) + 1;
+
+    /* no room for another packet, pad this one up to the end of the block */
+    if (toniefile_block_space(ctx) < OPUS_PACKET_MINSIZE)
+    {
+        error = toniefile_block_fill(ctx);
+    }
+    return error;
+}
+
+/* encodes the full audio frame into the current block */
+static error_t toniefile_encode_frame(toniefile_t *ctx)
 {
-    ctx->taf.sha1_hash.data = osAllocMem(SHA1_DIGEST_SIZE);
-    ctx->taf.sha1_hash.len = SHA1_DIGEST_SIZE;
-    ctx->taf.num_bytes = ctx->audio_length;
-    sha1Final(&ctx->sha1, ctx->taf.sha1_hash.data);
+    uint8_t output_frame[TONIEFILE_FRAME_SIZE];
+    int frame_payload = toniefile_block_space(ctx);
+
+    int frame_len = opus_encode(ctx->enc, ctx->audio_frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
+    // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_payload);
+
+    /* fill again */
+    ctx->audio_frame_used = 0;
+
+    if (frame_len <= 0)
+    {
+        TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
+        return ERROR_FAILURE;
+    }
 
-    error_t error = toniefile_write_header(ctx);
+    /* the pre-roll of a segment only brings the encoder into the state it has in a continuous encode */
+    if (ctx->preroll > 0)
+    {
+        ctx->preroll--;
+        return NO_ERROR;
+    }
+
+    return toniefile_block_add(ctx, output_frame, frame_len);
+}
 
-    fsCloseFile(ctx->file);
+error_t toniefile_close(toniefile_t *ctx)
+{
+    error_t error = NO_ERROR;
 
-    if (!isValidTaf(ctx->fullPath, true))
+    if (ctx->segment)
     {
-        TRACE_ERROR("SHA1 not valid or length different for TAF %s\r\n", ctx->fullPath);
+        /* the packets get laid out again when the segment is appended, so the last block stays incomplete */
+        error = toniefile_block_write(ctx);
+        fsCloseFile(ctx->file);
     }
+    else
+    {
+        /* keep the complete frames of the last block, only a partial frame is dropped */
+        error = toniefile_block_fill(ctx);
+
+        ctx->taf.sha1_hash.data = osAllocMem(SHA1_DIGEST_SIZE);
+        ctx->taf.sha1_hash.len = SHA1_DIGEST_SIZE;
+        ctx->taf.num_bytes = ctx->audio_length;
+        sha1Final(&ctx->sha1, ctx->taf.sha1_hash.data);
+
+        error_t header_error = toniefile_write_header(ctx);
+        if (error == NO_ERROR)
+        {
+            error = header_error;
+        }
+
+        fsCloseFile(ctx->file);
+
+        if (!isValidTaf(ctx->fullPath, true))
+        {
+            TRACE_ERROR("SHA1 not valid or length different for TAF %s\r\n", ctx->fullPath);
+        }
 
-    osFreeMem(ctx->taf.sha1_hash.data);
+        osFreeMem(ctx->taf.sha1_hash.data);
+    }
     osFreeMem(ctx->taf.track_page_nums);
     opus_encoder_destroy(ctx->enc);
     ogg_stream_clear(&ctx->os);
@@ -390,8 +703,8 @@ error_t toniefile_new_chapter(toniefile_t *ctx)
     {
         return ERROR_FAILURE;
     }
-    ctx->taf.track_page_nums[ctx->taf.n_track_page_nums++] = ctx->taf_block_num;
-    TRACE_INFO("new chapter at 0x%08" PRIX32 "\r\n", (uint32_t)ctx->taf_block_num);
+    /* the chapter starts in the block of the packet that holds its first samples */
+    ctx->chapter_pending = true;
 
     return NO_ERROR;
 }
@@ -399,7 +712,6 @@ error_t toniefile_new_chapter(toniefile_t *ctx)
 error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
 {
     int samples_processed = 0;
-    uint8_t output_frame[TONIEFILE_FRAME_SIZE];
 
     // TRACE_INFO("samples_available: %zu\n", samples_available);
     while (samples_processed < samples_available)
@@ -418,122 +730,178 @@ error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t sample
         /* buffer full? */
         if (ctx->audio_frame_used >= OPUS_FRAME_SIZE)
         {
-            int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->os.body_fill - ctx->os.body_returned;
-            int page_remain = TONIEFILE_FRAME_SIZE - page_used;
-
-            int frame_payload = (page_remain / 256) * 255 + (page_remain % 256) - 1;
-            int reconstructed = (frame_payload / 255) + 1 + frame_payload;
-
-            /* when due to segment sizes we would end up with a 1 byte gap, make sure that the next run will have at least 64 byte.
-             * reason why this could happen is that "adding one byte" would require one segment more and thus occupies two byte more.
-             * if this would happen, just reduce the calculated free space such that there is room for another segment.
-             */
-            bool frame_payload_minified = false;
-            if (page_remain != reconstructed && frame_payload > OPUS_PACKET_MINSIZE)
+            error_t error = toniefile_encode_frame(ctx);
+            if (error != NO_ERROR)
             {
-                frame_payload -= OPUS_PACKET_MINSIZE;
-                frame_payload_minified = true;
-            }
-            if (frame_payload < OPUS_PACKET_MINSIZE - 1)
-            {
-                TRACE_ERROR("Not enough space in this block, mini=%X, frame_payload=%i, page_remain=%i, reconstructed=%i\r\n", frame_payload_minified, frame_payload, page_remain, reconstructed);
-                return ERROR_FAILURE;
+                return error;
             }
+        }
+    }
 
-            int frame_len = opus_encode(ctx->enc, ctx->audio_frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
-            // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_payload);
+    return NO_ERROR;
+}
 
-            if (frame_len <= 0)
-            {
-                TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
-                return ERROR_FAILURE;
-            }
+static uint64_t toniefile_load_le(const uint8_t *data, size_t length)
+{
+    uint64_t value = 0;
+    for (size_t pos = length; pos > 0; pos--)
+    {
+        value = (value << 8) | data[pos - 1];
+    }
+    return value;
+}
 
-            /* we did not exactly hit the destination size and are close to block size. pad packet */
-            if (frame_payload - frame_len < OPUS_PACKET_PAD)
-            {
-                int target_length = frame_payload;
+static void toniefile_store_le(uint8_t *data, size_t length, uint64_t value)
+{
+    for (size_t pos = 0; pos < length; pos++)
+    {
+        data[pos] = (uint8_t)(value >> (pos * 8));
+    }
+}
 
-                int ret = opus_packet_pad(output_frame, frame_len, target_length);
-                // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", frame_len, target_length);
-                if (ret < 0)
-                {
-                    TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
-                    return ERROR_FAILURE;
-                }
-                frame_len = target_length;
-            }
+/* copies a page that fills a whole block of the segment, continuing granule and page numbers of the TAF */
+static error_t toniefile_block_copy(toniefile_t *ctx, uint8_t *header, size_t header_len, uint8_t *body, size_t body_len)
+{
+    if (ctx->chapter_pending)
+    {
+        ctx->chapter_pending = false;
+        error_t error = toniefile_chapter_add(ctx);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
 
-            /* we have to retrieve the actually encoded samples in this frame */
-            int frames = opus_packet_get_samples_per_frame(output_frame, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(output_frame, frame_len);
-            if (frames != OPUS_FRAME_SIZE)
-            {
-                TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
-            }
-            ctx->ogg_granule_position += frames;
+    size_t packet_start = 0;
+    size_t packet_len = 0;
+    for (size_t index = OGG_HEADER_LENGTH; index < header_len; index++)
+    {
+        packet_len += header[index];
+        if (header[index] < 255)
+        {
+            ctx->ogg_granule_position += opus_packet_get_samples_per_frame(&body[packet_start], OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(&body[packet_start], packet_len);
+            ctx->ogg_packet_count++;
+            packet_start += packet_len;
+            packet_len = 0;
+        }
+    }
+    toniefile_store_le(&header[6], 8, ctx->ogg_granule_position);
+    toniefile_store_le(&header[14], 4, (uint32_t)ctx->os.serialno);
+    toniefile_store_le(&header[18], 4, (uint32_t)ctx->os.pageno++);
 
-            /* now fill output page */
-            ogg_packet op;
-            op.packet = output_frame;
-            op.bytes = frame_len;
-            op.b_o_s = 0;
-            op.e_o_s = 0;
-            op.granulepos = ctx->ogg_granule_position;
-            op.packetno = ctx->ogg_packet_count;
+    ogg_page og;
+    og.header = header;
+    og.header_len = header_len;
+    og.body = body;
+    og.body_len = body_len;
+    ogg_page_checksum_set(&og);
 
-            ctx->ogg_packet_count++;
+    if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR || fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
+    {
+        return ERROR_WRITE_FAILED;
+    }
+    toniefile_publish_page(ctx, &og);
+    ctx->file_pos += og.header_len + og.body_len;
+    ctx->audio_length += og.header_len + og.body_len;
+    sha1Update(&ctx->sha1, og.header, og.header_len);
+    sha1Update(&ctx->sha1, og.body, og.body_len);
+    ctx->taf_block_num++;
 
-            ogg_stream_packetin(&ctx->os, &op);
+    return NO_ERROR;
+}
 
-            page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill + ctx->os.body_fill;
-            page_remain = TONIEFILE_FRAME_SIZE - page_used;
+error_t toniefile_append_segment(toniefile_t *ctx, const char *segmentPath)
+{
+    FsFile *file = fsOpenFile(segmentPath, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        TRACE_ERROR("Cannot open segment %s\r\n", segmentPath);
+        return ERROR_FILE_OPENING_FAILED;
+    }
 
-            // TRACE_INFO("(%zu MOD 4096) + 27 + %li + %li;\r\n", ctx->file_pos, ctx->os.lacing_fill, ctx->os.body_fill)
+    /* blocks of the segment are copied once the TAF is at a block start, the packets of its partial blocks continue the current block of the TAF */
+    error_t error = NO_ERROR;
+    uint8_t header[OGG_HEADER_LENGTH + 255];
+    uint8_t body[TONIEFILE_FRAME_SIZE];
+    while (true)
+    {
+        size_t length = 0;
+        error = fsReadFile(file, header, OGG_HEADER_LENGTH, &length);
+        if (error == ERROR_END_OF_FILE && length == 0)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        if (error != NO_ERROR || length != OGG_HEADER_LENGTH || osMemcmp(header, "OggS", 4) != 0 || header[26] == 0)
+        {
+            error = ERROR_INVALID_FILE;
+            break;
+        }
+        size_t lacing_count = header[26];
+        error = fsReadFile(file, &header[OGG_HEADER_LENGTH], lacing_count, &length);
+        if (error != NO_ERROR || length != lacing_count)
+        {
+            error = ERROR_INVALID_FILE;
+            break;
+        }
+        size_t body_len = 0;
+        for (size_t index = 0; index < lacing_count; index++)
+        {
+            body_len += header[OGG_HEADER_LENGTH + index];
+        }
+        /* the segment never continues a packet on the next page */
+        if (body_len > sizeof(body) || header[OGG_HEADER_LENGTH + lacing_count - 1] == 255)
+        {
+            error = ERROR_INVALID_FILE;
+            break;
+        }
+        error = fsReadFile(file, body, body_len, &length);
+        if (error != NO_ERROR || length != body_len)
+        {
+            error = ERROR_INVALID_FILE;
+            break;
+        }
 
-            if (page_remain < TONIEFILE_PAD_END)
+        if (OGG_HEADER_LENGTH + lacing_count + body_len == TONIEFILE_FRAME_SIZE)
+        {
+            /* pads the packets carried over from the previous segment */
+            error = toniefile_block_fill(ctx);
+            if (error == NO_ERROR && ctx->block_packets == 0 && (ctx->file_pos % TONIEFILE_FRAME_SIZE) == 0)
             {
-                if (page_remain)
+                error = toniefile_block_copy(ctx, header, OGG_HEADER_LENGTH + lacing_count, body, body_len);
+                if (error != NO_ERROR)
                 {
-                    TRACE_INFO("unexpected small padding at %" PRIu64 " (%" PRIu64 " s)\r\n", ctx->ogg_granule_position, ctx->ogg_granule_position / OPUS_FRAME_SIZE * 60 / 1000)
-                    return ERROR_FAILURE;
+                    break;
                 }
+                continue;
+            }
+        }
 
-                ogg_page og;
-                while (ogg_stream_flush(&ctx->os, &og))
-                {
-                    if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    size_t prev = ctx->file_pos;
-                    ctx->file_pos += og.header_len + og.body_len;
-                    ctx->audio_length += og.header_len + og.body_len;
-                    // TRACE_INFO("Header_len %zu Body_len %zu prev %zu File_pos %zu\r\n", og.header_len, og.body_len, prev, ctx->file_pos);
-
-                    sha1Update(&ctx->sha1, og.header, og.header_len);
-                    sha1Update(&ctx->sha1, og.body, og.body_len);
-
-                    if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
-                    {
-                        ctx->taf_block_num++;
-                        if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
-                        {
-                            TRACE_ERROR("Block alignment mismatch 0x%08" PRIX32 "\r\n", (uint32_t)ctx->file_pos)
-                            return ERROR_FAILURE;
-                        }
-                    }
-                }
+        size_t packet_start = 0;
+        size_t packet_len = 0;
+        for (size_t index = 0; index < lacing_count && error == NO_ERROR; index++)
+        {
+            uint8_t lacing = header[OGG_HEADER_LENGTH + index];
+            packet_len += lacing;
+            if (lacing < 255)
+            {
+                error = toniefile_block_add(ctx, &body[packet_start], (int)packet_len);
+                packet_start += packet_len;
+                packet_len = 0;
             }
-            /* fill again */
-            ctx->audio_frame_used = 0;
         }
+        if (error != NO_ERROR)
+        {
+            break;
+        }
+    }
+    if (error == ERROR_INVALID_FILE)
+    {
+        TRACE_ERROR("Invalid page in segment %s at 0x%08" PRIX32 "\r\n", segmentPath, (uint32_t)ctx->file_pos);
     }
+    fsCloseFile(file);
 
-    return NO_ERROR;
+    return error;
 }
 
 bool toniefile_is_valid(const char *file_path)
@@ -670,30 +1038,305 @@ error_t ffmpeg_convert(char source[99][PATH_LEN], size_t source_len, size_t *cur
 {
     bool_t active = true;
     bool_t sweep = false;
-    return ffmpeg_stream(source, source_len, current_source, target_taf, skip_seconds, &active, &sweep, false, false);
+    return ffmpeg_stream(source, source_len, current_source, target_taf, skip_seconds, &active, &sweep, false, false, NULL);
+}
+
+/* the segment of a chapter starts at the frame holding the end of the previous source.
+ * its encoder gets the two frames before as pre-roll, so the first kept packet is encoded with the same history as in a continuous encode */
+#define FFMPEG_PREROLL_FRAMES 2
+#define FFMPEG_TAIL_SAMPLES ((FFMPEG_PREROLL_FRAMES + 1) * OPUS_FRAME_SIZE)
+
+typedef struct
+{
+    char (*source)[PATH_LEN];
+    size_t skip_seconds;
+    bool_t *active;
+    uint32_t audio_id;
+    char **segments;        /* segment files of the sources */
+    size_t *lengths;        /* samples of every source, measured by the first pass */
+    size_t *starts;         /* sample position of every source in the TAF */
+    size_t *offsets;        /* file position the segments are laid out for */
+    int16_t **tails;        /* last FFMPEG_TAIL_SAMPLES of every source */
+    error_t *errors;
+    size_t *current_source; /* counts the finished sources */
+} ffmpeg_chapters_t;
+
+static void ffmpeg_keep_tail(int16_t *tail, const int16_t *samples, size_t count)
+{
+    size_t take = MIN(count, FFMPEG_TAIL_SAMPLES);
+    size_t keep = FFMPEG_TAIL_SAMPLES - take;
+
+    osMemmove(tail, &tail[take * OPUS_CHANNELS], keep * OPUS_CHANNELS * sizeof(int16_t));
+    osMemcpy(&tail[keep * OPUS_CHANNELS], &samples[(count - take) * OPUS_CHANNELS], take * OPUS_CHANNELS * sizeof(int16_t));
 }
 
-error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, bool_t isStream)
+/* decodes a source into the TAF if given, counts its samples and keeps the last FFMPEG_TAIL_SAMPLES of them if wanted */
+static error_t ffmpeg_encode_source(const char *source, size_t skip_seconds, toniefile_t *taf, int16_t *tail, size_t *length, bool_t *active)
 {
-    TRACE_INFO("Encode %zu sources: \r\n", source_len);
-    for (size_t i = 0; i < source_len; i++)
-    {
-        TRACE_INFO(" %s\r\n", source[i]);
-    }
-    TRACE_INFO("as TAF to %s\r\n", target_taf);
-    if (skip_seconds > 0)
+    size_t skip_bytes = 0;
+    if (toniefile_is_valid(source))
     {
-        TRACE_INFO(" and skip %zu seconds\r\n", skip_seconds);
+        skip_bytes = 0x1000;
+        TRACE_INFO(" detected TAF file, skipping %zu bytes\r\n", skip_bytes);
     }
 
-    FILE *ffmpeg_pipe = NULL;
+    FILE *ffmpeg_pipe = ffmpeg_decode_audio_start_skip(source, skip_seconds, skip_bytes);
+    if (ffmpeg_pipe == NULL)
+    {
+        return ERROR_ABORTED;
+    }
+
+    int16_t sample_buffer[2 * 4096];
+    size_t samples = sizeof(sample_buffer) / sizeof(uint16_t);
+    size_t blocks_read = 0;
     error_t error = NO_ERROR;
-    size_t cs;
-    if (current_source == NULL)
+
+    *length = 0;
+    while (error == NO_ERROR)
     {
-        current_source = &cs;
+        if (!(*active))
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+        error = ffmpeg_decode_audio(ffmpeg_pipe, sample_buffer, samples, &blocks_read);
+        if (error != NO_ERROR)
+        {
+            break;
+        }
+        size_t count = blocks_read / OPUS_CHANNELS;
+        if (tail)
+        {
+            ffmpeg_keep_tail(tail, sample_buffer, count);
+        }
+        *length += count;
+        if (taf)
+        {
+            error = toniefile_encode(taf, sample_buffer, count);
+        }
     }
-    *current_source = 0;
+
+    if (error == ERROR_END_OF_STREAM)
+    {
+        return ffmpeg_decode_audio_end(ffmpeg_pipe, NO_ERROR);
+    }
+    ffmpeg_decode_audio_end(ffmpeg_pipe, error);
+    return error;
+}
+
+static void ffmpeg_measure_chapter(void *ctx, size_t index)
+{
+    ffmpeg_chapters_t *chapters = (ffmpeg_chapters_t *)ctx;
+
+    chapters->errors[index] = ffmpeg_encode_source(chapters->source[index], chapters->skip_seconds, NULL, chapters->tails[index], &chapters->lengths[index], chapters->active);
+}
+
+static void ffmpeg_encode_chapter(void *ctx, size_t index)
+{
+    ffmpeg_chapters_t *chapters = (ffmpeg_chapters_t *)ctx;
+
+    size_t preroll = (index > 0) ? FFMPEG_PREROLL_FRAMES : 0;
+    toniefile_t *segment = toniefile_create_segment(chapters->segments[index], chapters->audio_id, chapters->offsets[index], preroll);
+    if (segment == NULL)
+    {
+        chapters->errors[index] = ERROR_FILE_OPENING_FAILED;
+    }
+    else
+    {
+        error_t error = NO_ERROR;
+        if (index > 0)
+        {
+            /* the frame grid of the TAF, this segment takes over the partial last frame of the previous source */
+            size_t partial = chapters->starts[index] % OPUS_FRAME_SIZE;
+            size_t count = FFMPEG_PREROLL_FRAMES * OPUS_FRAME_SIZE + partial;
+            error = toniefile_encode(segment, &chapters->tails[index - 1][(FFMPEG_TAIL_SAMPLES - count) * OPUS_CHANNELS], count);
+        }
+
+        size_t length = 0;
+        if (error == NO_ERROR)
+        {
+            error = ffmpeg_encode_source(chapters->source[index], chapters->skip_seconds, segment, NULL, &length, chapters->active);
+        }
+        if (error == NO_ERROR && length != chapters->lengths[index])
+        {
+            TRACE_ERROR("Source %s decoded to %zu samples instead of %zu\r\n", chapters->source[index], length, chapters->lengths[index]);
+            error = ERROR_INVALID_LENGTH;
+        }
+
+        /* the partial last frame stays unencoded, the next segment or nobody takes it over */
+        error_t close_error = toniefile_close(segment);
+        chapters->errors[index] = (error != NO_ERROR) ? error : close_error;
+    }
+    __atomic_add_fetch(chapters->current_source, 1, __ATOMIC_RELEASE);
+}
+
+/* every source is decoded twice by its own ffmpeg. the first pass measures the sources, so the second one can encode each of them
+ * with its own Opus encoder on the frame grid of a serial encode. the packets of the segments are appended to the TAF afterwards.
+ * returns ERROR_UNSUPPORTED_FEATURE without writing anything for sources that have to be encoded serially. */
+static error_t ffmpeg_stream_parallel(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, uint32_t workers)
+{
+    for (size_t index = 0; index < source_len; index++)
+    {
+        /* a stream would not deliver the same samples twice */
+        if (!fsFileExists(source[index]))
+        {
+            TRACE_INFO("Source %s is no local file, encoding serially\r\n", source[index]);
+            return ERROR_UNSUPPORTED_FEATURE;
+        }
+    }
+
+    ffmpeg_chapters_t chapters = {
+        .source = source,
+        .skip_seconds = skip_seconds,
+        .active = active,
+        .audio_id = time(NULL) - TEDDY_BENCH_AUDIO_ID_DEDUCT,
+        .current_source = current_source,
+    };
+
+    chapters.segments = osAllocMem(sizeof(char *) * source_len);
+    chapters.lengths = osAllocMem(sizeof(size_t) * source_len);
+    chapters.starts = osAllocMem(sizeof(size_t) * source_len);
+    chapters.offsets = osAllocMem(sizeof(size_t) * source_len);
+    chapters.tails = osAllocMem(sizeof(int16_t *) * source_len);
+    chapters.errors = osAllocMem(sizeof(error_t) * source_len);
+    for (size_t index = 0; index < source_len; index++)
+    {
+        chapters.segments[index] = custom_asprintf("%s.%zu.part", target_taf, index);
+        chapters.lengths[index] = 0;
+        chapters.starts[index] = 0;
+        chapters.offsets[index] = 0;
+        chapters.tails[index] = osAllocMem(FFMPEG_TAIL_SAMPLES * OPUS_CHANNELS * sizeof(int16_t));
+        osMemset(chapters.tails[index], 0x00, FFMPEG_TAIL_SAMPLES * OPUS_CHANNELS * sizeof(int16_t));
+        chapters.errors[index] = NO_ERROR;
+    }
+
+    TRACE_INFO("Measure sources with %" PRIu32 " workers\r\n", workers);
+    *active = true;
+    worker_pool_run(&ffmpeg_measure_chapter, &chapters, source_len, workers);
+
+    error_t error = NO_ERROR;
+    size_t start = 0;
+    for (size_t index = 0; index < source_len; index++)
+    {
+        error = chapters.errors[index];
+        if (error != NO_ERROR)
+        {
+            *current_source = index;
+            TRACE_ERROR("Could not decode %s error=%s\r\n", source[index], error2text(error));
+            break;
+        }
+        /* the pre-roll of the next segment has to come from this source alone */
+        if (index + 1 < source_len && chapters.lengths[index] < FFMPEG_TAIL_SAMPLES)
+        {
+            TRACE_INFO("Source %s is too short, encoding serially\r\n", source[index]);
+            error = ERROR_UNSUPPORTED_FEATURE;
+            break;
+        }
+        chapters.starts[index] = start;
+        start += chapters.lengths[index];
+    }
+
+    toniefile_t *taf = NULL;
+    if (error == NO_ERROR)
+    {
+        taf = toniefile_create(target_taf, chapters.audio_id, false, 0);
+        if (!taf)
+        {
+            TRACE_ERROR("toniefile_create() failed, aborting\r\n");
+            error = ERROR_ABORTED;
+        }
+        else
+        {
+            /* the first segment continues the block of the stream headers */
+            chapters.offsets[0] = taf->file_pos;
+        }
+    }
+
+    if (error == NO_ERROR)
+    {
+        TRACE_INFO("Encode sources with %" PRIu32 " workers\r\n", workers);
+        worker_pool_run(&ffmpeg_encode_chapter, &chapters, source_len, workers);
+
+        for (size_t index = 0; index < source_len; index++)
+        {
+            error = chapters.errors[index];
+            if (error == NO_ERROR && index > 0)
+            {
+                error = toniefile_new_chapter(taf);
+            }
+            if (error == NO_ERROR)
+            {
+                error = toniefile_append_segment(taf, chapters.segments[index]);
+            }
+            if (error != NO_ERROR)
+            {
+                /* like the sequential encode, the failed source is the current one */
+                *current_source = index;
+                TRACE_ERROR("Could not encode %s error=%s\r\n", source[index], error2text(error));
+                break;
+            }
+        }
+        if (error == NO_ERROR)
+        {
+            TRACE_INFO("Encoded all sources\r\n");
+        }
+    }
+
+    for (size_t index = 0; index < source_len; index++)
+    {
+        if (fsFileExists(chapters.segments[index]))
+        {
+            fsDeleteFile(chapters.segments[index]);
+        }
+        osFreeMem(chapters.segments[index]);
+        osFreeMem(chapters.tails[index]);
+    }
+    osFreeMem(chapters.segments);
+    osFreeMem(chapters.lengths);
+    osFreeMem(chapters.starts);
+    osFreeMem(chapters.offsets);
+    osFreeMem(chapters.tails);
+    osFreeMem(chapters.errors);
+
+    if (error == ERROR_UNSUPPORTED_FEATURE)
+    {
+        return error;
+    }
+
+    if (!(*active))
+    {
+        TRACE_INFO("Encoding aborted, active flag set to false\r\n");
+    }
+    else
+    {
+        *active = false;
+    }
+    if (taf)
+    {
+        error_t close_error = toniefile_close(taf);
+        if (error == NO_ERROR)
+        {
+            error = close_error;
+        }
+    }
+
+    if (error == NO_ERROR)
+    {
+        TRACE_INFO("TAF encoding successful\r\n");
+    }
+    else
+    {
+        TRACE_ERROR("TAF encoding failed, deleting TAF\r\n");
+        fsDeleteFile(target_taf);
+    }
+
+    return error;
+}
+
+static error_t ffmpeg_stream_serial(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, bool_t isStream, stream_buffer_t *stream_buffer)
+{
+    FILE *ffmpeg_pipe = NULL;
+    error_t error = NO_ERROR;
 
     size_t skip_bytes = 0;
     if (toniefile_is_valid(source[*current_source]))
@@ -713,7 +1356,7 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
     {
         size = get_settings()->encode.stream_max_size - TONIE_HEADER_LENGTH;
     }
-    toniefile_t *taf = toniefile_create(target_taf, time(NULL) - TEDDY_BENCH_AUDIO_ID_DEDUCT, append, size);
+    toniefile_t *taf = toniefile_create_stream(target_taf, time(NULL) - TEDDY_BENCH_AUDIO_ID_DEDUCT, append, size, stream_buffer);
     if (!taf)
     {
         TRACE_ERROR("toniefile_create() failed, aborting\r\n");
@@ -768,6 +1411,10 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
             }
             break;
         }
+        if (stream_buffer)
+        {
+            stream_buffer_report_input(stream_buffer, blocks_read / OPUS_CHANNELS, OPUS_SAMPLING_RATE);
+        }
         if (*sweep == false)
         {
             error = toniefile_encode(taf, sample_buffer, blocks_read / OPUS_CHANNELS);
@@ -804,7 +1451,11 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
     {
         ffmpeg_decode_audio_end(ffmpeg_pipe, error);
     }
-    toniefile_close(taf);
+    error_t close_error = toniefile_close(taf);
+    if (error == NO_ERROR)
+    {
+        error = close_error;
+    }
 
     if (error == NO_ERROR)
     {
@@ -823,6 +1474,306 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
     return error;
 }
 
+error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, bool_t isStream, stream_buffer_t *stream_buffer)
+{
+    TRACE_INFO("Encode %zu sources: \r\n", source_len);
+    for (size_t i = 0; i < source_len; i++)
+    {
+        TRACE_INFO(" %s\r\n", source[i]);
+    }
+    TRACE_INFO("as TAF to %s\r\n", target_taf);
+    if (skip_seconds > 0)
+    {
+        TRACE_INFO(" and skip %zu seconds\r\n", skip_seconds);
+    }
+
+    size_t cs;
+    if (current_source == NULL)
+    {
+        current_source = &cs;
+    }
+    *current_source = 0;
+
+    uint32_t workers = get_settings()->encode.workers;
+    if (source_len > 1 && workers > 1 && !append && !isStream && stream_buffer == NULL)
+    {
+        error_t error = ffmpeg_stream_parallel(source, source_len, current_source, target_taf, skip_seconds, active, workers);
+        if (error != ERROR_UNSUPPORTED_FEATURE)
+        {
+            return error;
+        }
+    }
+
+    return ffmpeg_stream_serial(source, source_len, current_source, target_taf, skip_seconds, active, sweep, append, isStream, stream_buffer);
+}
+
+static TonieboxAudioFileHeader *toniefile_read_header(FsFile *file)
+{
+    uint8_t buffer[TONIEFILE_FRAME_SIZE];
+    size_t read_length = 0;
+
+    fsSeekFile(file, 0, SEEK_SET);
+    if (fsReadFile(file, buffer, sizeof(buffer), &read_length) != NO_ERROR || read_length != sizeof(buffer))
+    {
+        return NULL;
+    }
+    uint32_t proto_size = ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+    if (proto_size > sizeof(buffer) - 4)
+    {
+        return NULL;
+    }
+    return toniebox_audio_file_header__unpack(NULL, proto_size, &buffer[4]);
+}
+
+/* granule position of the first sample in a block and the number of audio packets in it */
+static error_t toniefile_block_start(FsFile *file, size_t block, uint64_t *granule, size_t *packets)
+{
+    uint8_t data[TONIEFILE_FRAME_SIZE];
+    size_t length = 0;
+
+    fsSeekFile(file, TONIEFILE_FRAME_SIZE * (block + 1), SEEK_SET);
+    error_t error = fsReadFile(file, data, sizeof(data), &length);
+    if (error != NO_ERROR)
+    {
+        return ERROR_INVALID_FILE;
+    }
+
+    uint64_t end = 0;
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos + OGG_HEADER_LENGTH <= length && pos + OGG_HEADER_LENGTH + data[pos + 26] <= length)
+    {
+        if (osMemcmp(&data[pos], "OggS", 4) != 0)
+        {
+            return ERROR_INVALID_FILE;
+        }
+        size_t body_len = 0;
+        for (size_t index = 0; index < data[pos + 26]; index++)
+        {
+            uint8_t lacing = data[pos + OGG_HEADER_LENGTH + index];
+            body_len += lacing;
+            if (lacing < 255)
+            {
+                count++;
+            }
+        }
+        end = toniefile_load_le(&data[pos + 6], 8);
+        pos += OGG_HEADER_LENGTH + data[pos + 26] + body_len;
+    }
+    /* the first block starts with the two stream header packets */
+    if (block == 0)
+    {
+        count = (count > 2) ? count - 2 : 0;
+    }
+    *packets = count;
+    *granule = end - count * OPUS_FRAME_SIZE;
+
+    return NO_ERROR;
+}
+
+/* decodes both TAFs with ffmpeg and compares their durations. the signal to noise ratio of the two encodes is only reported,
+ * the worst one of all 85 ms windows shows a click or gap at a chapter boundary */
+static error_t toniefile_compare_audio(const char *expectedPath, const char *actualPath)
+{
+    FILE *ffmpeg_pipes[2];
+    ffmpeg_pipes[0] = ffmpeg_decode_audio_start_skip(expectedPath, 0, TONIEFILE_FRAME_SIZE);
+    ffmpeg_pipes[1] = ffmpeg_decode_audio_start_skip(actualPath, 0, TONIEFILE_FRAME_SIZE);
+
+    int16_t sample_buffers[2][2 * 4096];
+    size_t samples = sizeof(sample_buffers[0]) / sizeof(uint16_t);
+    size_t lengths[2] = {0, 0};
+    bool_t ended[2] = {false, false};
+    double signal = 0;
+    double noise = 0;
+    double worst_snr = INFINITY;
+    size_t worst_pos = 0;
+    error_t error = NO_ERROR;
+
+    if (ffmpeg_pipes[0] == NULL || ffmpeg_pipes[1] == NULL)
+    {
+        error = ERROR_ABORTED;
+    }
+    while (error == NO_ERROR && !(ended[0] && ended[1]))
+    {
+        size_t blocks_read[2] = {0, 0};
+        for (size_t file = 0; file < 2 && error == NO_ERROR; file++)
+        {
+            if (ended[file])
+            {
+                continue;
+            }
+            error = ffmpeg_decode_audio(ffmpeg_pipes[file], sample_buffers[file], samples, &blocks_read[file]);
+            if (error == ERROR_END_OF_STREAM)
+            {
+                ended[file] = true;
+                blocks_read[file] = 0;
+                error = NO_ERROR;
+            }
+        }
+
+        /* both decoders deliver full buffers until their end, so the buffers hold the same samples */
+        size_t common = MIN(blocks_read[0], blocks_read[1]);
+        double window_signal = 0;
+        double window_noise = 0;
+        for (size_t pos = 0; pos < common; pos++)
+        {
+            double expected = sample_buffers[0][pos];
+            double difference = expected - sample_buffers[1][pos];
+            window_signal += expected * expected;
+            window_noise += difference * difference;
+        }
+        /* windows close to silence say nothing about the encode */
+        if (common > 0 && window_signal > common * 100.0 * 100.0)
+        {
+            double snr = 10 * log10(window_signal / MAX(window_noise, 1.0));
+            if (snr < worst_snr)
+            {
+                worst_snr = snr;
+                worst_pos = lengths[0] / OPUS_CHANNELS;
+            }
+        }
+        signal += window_signal;
+        noise += window_noise;
+        lengths[0] += blocks_read[0];
+        lengths[1] += blocks_read[1];
+    }
+    for (size_t file = 0; file < 2; file++)
+    {
+        if (ffmpeg_pipes[file] != NULL)
+        {
+            ffmpeg_decode_audio_end(ffmpeg_pipes[file], error);
+        }
+    }
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not decode the TAFs error=%s\r\n", error2text(error));
+        return error;
+    }
+
+    TRACE_WARNING("Duration: %zu samples serial, %zu samples parallel\r\n", lengths[0] / OPUS_CHANNELS, lengths[1] / OPUS_CHANNELS);
+    TRACE_WARNING("Signal to noise ratio: %.1f dB, worst %.1f dB at %zu ms\r\n", 10 * log10(signal / MAX(noise, 1.0)), worst_snr, worst_pos * 1000 / OPUS_SAMPLING_RATE);
+    if (lengths[0] != lengths[1])
+    {
+        TRACE_ERROR("Durations differ\r\n");
+        return ERROR_FAILURE;
+    }
+    return NO_ERROR;
+}
+
+/* compares the TAF of a parallel encode with the one of a serial encode of the same sources */
+static error_t toniefile_compare(const char *expectedPath, const char *actualPath)
+{
+    const char *paths[2] = {expectedPath, actualPath};
+    FsFile *files[2] = {NULL, NULL};
+    TonieboxAudioFileHeader *headers[2] = {NULL, NULL};
+    error_t error = NO_ERROR;
+
+    for (size_t file = 0; file < 2; file++)
+    {
+        files[file] = fsOpenFile(paths[file], FS_FILE_MODE_READ);
+        if (files[file] != NULL)
+        {
+            headers[file] = toniefile_read_header(files[file]);
+        }
+        if (headers[file] == NULL)
+        {
+            TRACE_ERROR("Cannot read TAF header of %s\r\n", paths[file]);
+            error = ERROR_INVALID_FILE;
+        }
+    }
+
+    if (error == NO_ERROR)
+    {
+        TRACE_WARNING("Granule position: %" PRIu64 " serial, %" PRIu64 " parallel\r\n", headers[0]->ogg_granule_position, headers[1]->ogg_granule_position);
+        TRACE_WARNING("Chapters: %zu serial, %zu parallel\r\n", headers[0]->n_track_page_nums, headers[1]->n_track_page_nums);
+        if (headers[0]->ogg_granule_position != headers[1]->ogg_granule_position)
+        {
+            TRACE_ERROR("Granule positions differ\r\n");
+            error = ERROR_FAILURE;
+        }
+        if (headers[0]->n_track_page_nums != headers[1]->n_track_page_nums)
+        {
+            TRACE_ERROR("Chapter counts differ\r\n");
+            error = ERROR_FAILURE;
+        }
+    }
+
+    for (size_t chapter = 0; error == NO_ERROR && chapter < headers[0]->n_track_page_nums; chapter++)
+    {
+        uint64_t starts[2];
+        size_t packets[2];
+        for (size_t file = 0; file < 2 && error == NO_ERROR; file++)
+        {
+            error = toniefile_block_start(files[file], headers[file]->track_page_nums[chapter], &starts[file], &packets[file]);
+        }
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Cannot read the block of chapter %zu\r\n", chapter + 1);
+            break;
+        }
+        TRACE_INFO("Chapter %zu starts at %" PRIu64 " serial, %" PRIu64 " parallel\r\n", chapter + 1, starts[0], starts[1]);
+
+        /* both blocks hold the first packet of the chapter, so their starts are less than the packets of one block apart */
+        uint64_t distance = (starts[0] > starts[1]) ? starts[0] - starts[1] : starts[1] - starts[0];
+        if (distance > 0 && distance >= MAX(packets[0], packets[1]) * OPUS_FRAME_SIZE)
+        {
+            TRACE_ERROR("Chapter %zu starts %" PRIu64 " samples apart\r\n", chapter + 1, distance);
+            error = ERROR_FAILURE;
+        }
+    }
+
+    for (size_t file = 0; file < 2; file++)
+    {
+        if (headers[file] != NULL)
+        {
+            toniebox_audio_file_header__free_unpacked(headers[file], NULL);
+        }
+        if (files[file] != NULL)
+        {
+            fsCloseFile(files[file]);
+        }
+    }
+
+    if (error == NO_ERROR)
+    {
+        error = toniefile_compare_audio(expectedPath, actualPath);
+    }
+    return error;
+}
+
+error_t ffmpeg_convert_check(char source[99][PATH_LEN], size_t source_len, const char *target_taf, size_t skip_seconds)
+{
+    char *serial_taf = custom_asprintf("%s.serial", target_taf);
+    bool_t active = true;
+    bool_t sweep = false;
+    size_t current_source = 0;
+
+    TRACE_WARNING("Encode serially to %s\r\n", serial_taf);
+    error_t error = ffmpeg_stream_serial(source, source_len, &current_source, serial_taf, skip_seconds, &active, &sweep, false, false, NULL);
+    if (error == NO_ERROR)
+    {
+        uint32_t workers = MAX(get_settings()->encode.workers, 2);
+        TRACE_WARNING("Encode in parallel to %s\r\n", target_taf);
+        current_source = 0;
+        error = ffmpeg_stream_parallel(source, source_len, &current_source, target_taf, skip_seconds, &active, workers);
+        if (error == ERROR_UNSUPPORTED_FEATURE)
+        {
+            TRACE_ERROR("The sources cannot be encoded in parallel\r\n");
+        }
+    }
+    if (error == NO_ERROR)
+    {
+        error = toniefile_compare(serial_taf, target_taf);
+    }
+    if (error == NO_ERROR)
+    {
+        TRACE_WARNING("Parallel encode matches the serial one\r\n");
+    }
+    osFreeMem(serial_taf);
+
+    return error;
+}
+
 void ffmpeg_stream_task(void *param)
 {
     stream_ctx_t *stream_ctx = (stream_ctx_t *)param;
@@ -830,7 +1781,11 @@ void ffmpeg_stream_task(void *param)
 
     char source[99][PATH_LEN]; // waste memory, but warning otherwise
     strncpy(source[0], ffmpeg_ctx->source, PATH_LEN - 1);
-    stream_ctx->error = ffmpeg_stream(source, 1, &stream_ctx->current_source, ffmpeg_ctx->targetFile, ffmpeg_ctx->skip_seconds, &stream_ctx->active, &ffmpeg_ctx->sweep, ffmpeg_ctx->append, true);
+    stream_ctx->error = ffmpeg_stream(source, 1, &stream_ctx->current_source, ffmpeg_ctx->targetFile, ffmpeg_ctx->skip_seconds, &stream_ctx->active, &ffmpeg_ctx->sweep, ffmpeg_ctx->append, true, ffmpeg_ctx->stream_buffer);
+    if (ffmpeg_ctx->stream_buffer)
+    {
+        stream_buffer_close(ffmpeg_ctx->stream_buffer, stream_ctx->error);
+    }
     stream_ctx->quit = true;
     osDeleteTask(OS_SELF_TASK_ID);
 }
\ No newline at end of file
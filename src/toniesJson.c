@@ -4,73 +4,687 @@
 #include "settings.h"
 #include "cache.h"
 #include "debug.h"
-#include "cJSON.h"
 #include "handler.h"
 #include "cloud_request.h"
 #include "server_helpers.h"
 #include "mutex_manager.h"
+#include "stats.h"
+#include "tonies_search.h"
+#include "json_reader.h"
+#include "tonies_snapshot.h"
+#include "file_watch.h"
+#include "date_time.h"
 
 #define TONIES_JSON_CACHED 1
 #if TONIES_JSON_CACHED == 1
+/* tonies.custom.json, tonies.json, toniesV2.custom.json and toniesV2.json */
+#define TONIES_DB_SOURCES 4
+
+/* state of a source file when it was read, to tell own writes from changes on disk */
+typedef struct
+{
+    bool exists;
+    FsFileStat stat;
+} tonies_source_stat_t;
+
+/* open addressing hash index over both caches, slots hold the item ordinal + 1 (0 = empty),
+ * custom items come first, so the first match on a probe sequence is the one that overrides */
+typedef struct
+{
+    uint32_t bits;
+    uint32_t *keys;
+    uint32_t *items;
+} tonies_index_t;
+
+/* one row per audio id of toniesV2.json, stored column by column and found through an audio id index */
+typedef struct
+{
+    size_t rows;
+    uint32_t *audioIds;
+    uint8_t *hashes;    /* 20 bytes per row */
+    uint32_t *items;    /* ordinal of the item, custom items first */
+    tonies_index_t byAudioId; /* slots hold the row + 1 */
+} toniesV2_index_t;
+
+/* one immutable version of the parsed tonies.json files, a reload publishes a new one */
+struct tonies_db_s
+{
+    uint32_t version;
+    size_t customCount;
+    toniesJson_item_t *customItems;
+    mem_arena_t *customArena;
+    const char **customPictureSources; /* per item the original URL of a cached picture, owned by the cache */
+    size_t count;
+    toniesJson_item_t *items;
+    mem_arena_t *arena;
+    const char **pictureSources;
+    tonies_index_t audioIdIndex;
+    tonies_index_t hashIndex;
+    tonies_index_t modelIndex;
+    tonies_search_t *search;
+
+    size_t v2CustomCount;
+    toniesV2Json_item_t *v2CustomItems;
+    mem_arena_t *v2CustomArena;
+    size_t v2Count;
+    toniesV2Json_item_t *v2Items;
+    mem_arena_t *v2Arena;
+    toniesV2_index_t v2Index;
+    tonies_source_stat_t sources[TONIES_DB_SOURCES];
+
+    uint32_t readers;    /* callers holding this version through tonies_dbAcquire() */
+    systime_t retiredAt; /* when it got replaced by a newer version */
+    tonies_db_t *nextRetired;
+};
+
+/* the items of one file in the current version, a newly read file is diffed against */
+typedef struct
+{
+    const tonies_db_t *db;
+    const toniesJson_item_t *items;
+    size_t count;
+    const char **pictureSources;
+} tonies_json_previous_t;
+
+/* HTTP validators of a downloaded file, stored next to it to make the next update conditional */
+typedef struct
+{
+    char etag[128];
+    char lastModified[64];
+} tonies_validators_t;
+
+typedef struct
+{
+    const char *name;
+    char *tmpPath;
+    tonies_validators_t request;
+    tonies_validators_t response;
+    uint32_t status;
+} tonies_download_t;
+
+/* readers only load toniesDb atomically, MUTEX_TONIES_JSON_CACHE serializes the writers */
 static bool toniesJsonInitialized = false;
-static size_t toniesJsonCount = 0;
-static toniesJson_item_t *toniesJsonCache = NULL;
-static size_t toniesCustomJsonCount = 0;
-static toniesJson_item_t *toniesCustomJsonCache = NULL;
+static tonies_db_t *toniesDb = NULL;
+static tonies_db_t *toniesRetired = NULL;
+static uint32_t toniesDbVersion = 0;
+/* a reload requested while another one runs is done as one more pass of the running one */
+static bool toniesReloading = false;
+static bool toniesReloadPending = false;
 static char *tonies_json_path = NULL;
 static char *tonies_custom_json_path = NULL;
 static char *tonies_json_tmp_path = NULL;
-
-static bool toniesV2JsonInitialized = false;
-static size_t toniesV2JsonCount = 0;
-static toniesV2Json_item_t *toniesV2JsonCache = NULL;
-static size_t toniesV2CustomJsonCount = 0;
-static toniesV2Json_item_t *toniesV2CustomJsonCache = NULL;
 static char *toniesV2_json_path = NULL;
 static char *toniesV2_custom_json_path = NULL;
-static char *toniesV2_json_tmp_path = NULL;
 #endif
 
+void tonies_deinit_base(mem_arena_t *toniesArena, size_t *toniesCount);
+static void tonies_readJsonDiff(char *source, const tonies_json_previous_t *previous, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena, const char ***retPictureSources);
+static void toniesV2_buildIndex(tonies_db_t *db);
+static void toniesV2_freeIndex(toniesV2_index_t *index);
+
+#if TONIES_JSON_CACHED == 1
+static uint32_t tonies_hashModel(const char *model)
+{
+    /* FNV-1a over the case folded model */
+    uint32_t hash = 2166136261u;
+    for (const char *c = model; *c; c++)
+    {
+        hash ^= (uint8_t)tolower((unsigned char)*c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t tonies_hashFromSha1(const uint8_t *sha1)
+{
+    /* sha1 is evenly distributed already */
+    return ((uint32_t)sha1[0] << 24) | ((uint32_t)sha1[1] << 16) | ((uint32_t)sha1[2] << 8) | sha1[3];
+}
+
+static size_t tonies_indexSlot(const tonies_index_t *index, uint32_t key)
+{
+    return (size_t)((key * 2654435761u) >> (32 - index->bits));
+}
+
+static toniesJson_item_t *tonies_indexItem(const tonies_db_t *db, uint32_t ordinal)
+{
+    if (ordinal < db->customCount)
+    {
+        return &db->customItems[ordinal];
+    }
+    return &db->items[ordinal - db->customCount];
+}
+
+static void tonies_indexFree(tonies_index_t *index)
+{
+    osFreeMem(index->keys);
+    osFreeMem(index->items);
+    osMemset(index, 0, sizeof(tonies_index_t));
+}
+
+static bool tonies_indexAlloc(tonies_index_t *index, size_t entries)
+{
+    /* keep the load factor below 50% */
+    index->bits = 4;
+    while (((size_t)1 << index->bits) < entries * 2 && index->bits < 31)
+    {
+        index->bits++;
+    }
+    size_t capacity = (size_t)1 << index->bits;
+    index->keys = osAllocMem(capacity * sizeof(uint32_t));
+    index->items = osAllocMem(capacity * sizeof(uint32_t));
+    if (index->keys == NULL || index->items == NULL)
+    {
+        tonies_indexFree(index);
+        return false;
+    }
+    osMemset(index->items, 0, capacity * sizeof(uint32_t));
+    return true;
+}
+
+static void tonies_indexInsert(tonies_index_t *index, uint32_t key, uint32_t ordinal)
+{
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    size_t slot = tonies_indexSlot(index, key);
+    while (index->items[slot] != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    index->keys[slot] = key;
+    index->items[slot] = ordinal + 1;
+}
+
+static void tonies_buildIndices(tonies_db_t *db)
+{
+    size_t itemCount = db->customCount + db->count;
+    size_t audioIdCount = 0;
+    size_t hashCount = 0;
+    for (uint32_t ordinal = 0; ordinal < itemCount; ordinal++)
+    {
+        toniesJson_item_t *item = tonies_indexItem(db, ordinal);
+        audioIdCount += item->audio_ids_count;
+        hashCount += item->hashes_count;
+    }
+
+    if (!tonies_indexAlloc(&db->audioIdIndex, audioIdCount) || !tonies_indexAlloc(&db->hashIndex, hashCount) || !tonies_indexAlloc(&db->modelIndex, itemCount))
+    {
+        TRACE_ERROR("Could not allocate tonies.json indices\r\n");
+        tonies_indexFree(&db->audioIdIndex);
+        tonies_indexFree(&db->hashIndex);
+        tonies_indexFree(&db->modelIndex);
+        return;
+    }
+
+    for (uint32_t ordinal = 0; ordinal < itemCount; ordinal++)
+    {
+        toniesJson_item_t *item = tonies_indexItem(db, ordinal);
+        for (size_t i = 0; i < item->audio_ids_count; i++)
+        {
+            tonies_indexInsert(&db->audioIdIndex, item->audio_ids[i], ordinal);
+        }
+        for (size_t i = 0; i < item->hashes_count; i++)
+        {
+            tonies_indexInsert(&db->hashIndex, tonies_hashFromSha1(&item->hashes[i * 20]), ordinal);
+        }
+        if (item->model != NULL && item->model[0] != '\0')
+        {
+            tonies_indexInsert(&db->modelIndex, tonies_hashModel(item->model), ordinal);
+        }
+    }
+    TRACE_INFO("Indexed %zu tonies with %zu audio ids and %zu hashes\r\n", itemCount, audioIdCount, hashCount);
+}
+
+static bool tonies_hasAudioId(const toniesJson_item_t *item, uint32_t audio_id)
+{
+    for (size_t j = 0; j < item->audio_ids_count; j++)
+    {
+        if (item->audio_ids[j] == audio_id || (audio_id < TEDDY_BENCH_AUDIO_ID_DEDUCT && item->audio_ids[j] == audio_id + TEDDY_BENCH_AUDIO_ID_DEDUCT))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool tonies_hasHash(const toniesJson_item_t *item, const uint8_t *hash)
+{
+    for (size_t k = 0; k < item->hashes_count; k++)
+    {
+        if (hash == NULL || osMemcmp(item->hashes + (k * 20), hash, 20) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* returns the lowest ordinal + 1 with the given key that passes the check, 0 if none */
+static uint32_t tonies_indexFind(const tonies_db_t *db, const tonies_index_t *index, uint32_t key, bool (*check)(const toniesJson_item_t *item, const void *param), const void *param)
+{
+    if (index->items == NULL)
+    {
+        return 0;
+    }
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    for (size_t slot = tonies_indexSlot(index, key); index->items[slot] != 0; slot = (slot + 1) & mask)
+    {
+        /* entries with the same key are on the probe sequence in insertion order */
+        if (index->keys[slot] == key && check(tonies_indexItem(db, index->items[slot] - 1), param))
+        {
+            return index->items[slot];
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    uint32_t audio_id;
+    const uint8_t *hash;
+    const char *model;
+    const toniesJson_item_t *first; /* restricts tonies_checkModelIn to the items of one file */
+    size_t count;
+} tonies_query_t;
+
+static bool tonies_checkAudioIdHash(const toniesJson_item_t *item, const void *param)
+{
+    const tonies_query_t *query = (const tonies_query_t *)param;
+    return tonies_hasAudioId(item, query->audio_id) && tonies_hasHash(item, query->hash);
+}
+
+static bool tonies_checkModel(const toniesJson_item_t *item, const void *param)
+{
+    const tonies_query_t *query = (const tonies_query_t *)param;
+    return osStrcasecmp(item->model, query->model) == 0;
+}
+
+static bool tonies_checkModelIn(const toniesJson_item_t *item, const void *param)
+{
+    const tonies_query_t *query = (const tonies_query_t *)param;
+    return item >= query->first && item < query->first + query->count && osStrcmp(item->model, query->model) == 0;
+}
+
+/* finds the item with exactly the same model in the previous version of a file */
+static const toniesJson_item_t *tonies_previousItem(const tonies_json_previous_t *previous, const char *model, const char **pictureSource)
+{
+    *pictureSource = NULL;
+    if (previous == NULL || previous->count == 0 || model[0] == '\0')
+    {
+        return NULL;
+    }
+    tonies_query_t query = {.model = model, .first = previous->items, .count = previous->count};
+    uint32_t found = tonies_indexFind(previous->db, &previous->db->modelIndex, tonies_hashModel(model), &tonies_checkModelIn, &query);
+    if (found == 0)
+    {
+        return NULL;
+    }
+    const toniesJson_item_t *item = tonies_indexItem(previous->db, found - 1);
+    if (previous->pictureSources)
+    {
+        *pictureSource = previous->pictureSources[item - previous->items];
+    }
+    return item;
+}
+
+static bool tonies_sameText(const char *a, const char *b)
+{
+    return osStrcmp(a, b) == 0;
+}
+
+static bool tonies_sameItem(const toniesJson_item_t *a, const toniesJson_item_t *b)
+{
+    if (a->no != b->no || a->release != b->release || a->audio_ids_count != b->audio_ids_count || a->hashes_count != b->hashes_count || a->tracks_count != b->tracks_count)
+    {
+        return false;
+    }
+    if (!tonies_sameText(a->model, b->model) || !tonies_sameText(a->title, b->title) || !tonies_sameText(a->series, b->series) || !tonies_sameText(a->episodes, b->episodes) ||
+        !tonies_sameText(a->language, b->language) || !tonies_sameText(a->category, b->category) || !tonies_sameText(a->picture, b->picture))
+    {
+        return false;
+    }
+    if ((a->audio_ids_count > 0 && osMemcmp(a->audio_ids, b->audio_ids, a->audio_ids_count * sizeof(uint32_t))) || (a->hashes_count > 0 && osMemcmp(a->hashes, b->hashes, a->hashes_count * 20)))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->tracks_count; i++)
+    {
+        if (!tonies_sameText(a->tracks[i], b->tracks[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+static void tonies_statSources(tonies_source_stat_t sources[TONIES_DB_SOURCES])
+{
+    const char *paths[TONIES_DB_SOURCES] = {tonies_custom_json_path, tonies_json_path, toniesV2_custom_json_path, toniesV2_json_path};
+    for (size_t i = 0; i < TONIES_DB_SOURCES; i++)
+    {
+        osMemset(&sources[i], 0, sizeof(tonies_source_stat_t));
+        sources[i].exists = (paths[i] != NULL && fsGetFileStat(paths[i], &sources[i].stat) == NO_ERROR);
+    }
+}
+
+static tonies_db_t *tonies_dbLoad(const tonies_db_t *previous)
+{
+    tonies_db_t *db = osAllocMem(sizeof(tonies_db_t));
+    if (db == NULL)
+    {
+        return NULL;
+    }
+    osMemset(db, 0, sizeof(tonies_db_t));
+
+    systime_t start = osGetSystemTime();
+    /* taken before reading, so a change while reading triggers another reload */
+    tonies_statSources(db->sources);
+    tonies_json_previous_t previousCustom = {0};
+    tonies_json_previous_t previousOfficial = {0};
+    if (previous)
+    {
+        previousCustom = (tonies_json_previous_t){.db = previous, .items = previous->customItems, .count = previous->customCount, .pictureSources = previous->customPictureSources};
+        previousOfficial = (tonies_json_previous_t){.db = previous, .items = previous->items, .count = previous->count, .pictureSources = previous->pictureSources};
+    }
+    tonies_readJsonDiff(tonies_custom_json_path, previous ? &previousCustom : NULL, &db->customItems, &db->customCount, &db->customArena, &db->customPictureSources);
+    tonies_readJsonDiff(tonies_json_path, previous ? &previousOfficial : NULL, &db->items, &db->count, &db->arena, &db->pictureSources);
+    tonies_buildIndices(db);
+    db->search = tonies_search_build(db->customItems, db->customCount, db->items, db->count);
+    toniesV2_readJson(toniesV2_custom_json_path, &db->v2CustomItems, &db->v2CustomCount, &db->v2CustomArena);
+    toniesV2_readJson(toniesV2_json_path, &db->v2Items, &db->v2Count, &db->v2Arena);
+    toniesV2_buildIndex(db);
+    TRACE_INFO("Loaded and indexed tonies.json in %" PRIu32 " ms\r\n", (uint32_t)(osGetSystemTime() - start));
+
+    return db;
+}
+
+static void tonies_dbFree(tonies_db_t *db)
+{
+    tonies_search_free(db->search);
+    tonies_indexFree(&db->audioIdIndex);
+    tonies_indexFree(&db->hashIndex);
+    tonies_indexFree(&db->modelIndex);
+    tonies_deinit_base(db->customArena, &db->customCount);
+    tonies_deinit_base(db->arena, &db->count);
+    osFreeMem(db->customPictureSources);
+    osFreeMem(db->pictureSources);
+    toniesV2_freeIndex(&db->v2Index);
+    mem_arena_free(db->v2CustomArena);
+    mem_arena_free(db->v2Arena);
+    osFreeMem(db);
+}
+
+/* has to be called with MUTEX_TONIES_JSON_CACHE held, the replaced version is freed by tonies_loop() */
+static void tonies_dbPublish(tonies_db_t *db)
+{
+    db->version = ++toniesDbVersion;
+    tonies_db_t *old = __atomic_exchange_n(&toniesDb, db, __ATOMIC_ACQ_REL);
+    if (old)
+    {
+        old->retiredAt = osGetSystemTime();
+        old->nextRetired = toniesRetired;
+        toniesRetired = old;
+    }
+    TRACE_INFO("Published tonies.json version %" PRIu32 " with %zu custom and %zu official tonies\r\n", db->version, db->customCount, db->count);
+}
+
+tonies_db_t *tonies_dbAcquire()
+{
+    while (true)
+    {
+        tonies_db_t *db = __atomic_load_n(&toniesDb, __ATOMIC_ACQUIRE);
+        if (db == NULL)
+        {
+            return NULL;
+        }
+        __atomic_add_fetch(&db->readers, 1, __ATOMIC_ACQ_REL);
+        /* if the version got replaced in between, hold the new one instead */
+        if (__atomic_load_n(&toniesDb, __ATOMIC_ACQUIRE) == db)
+        {
+            return db;
+        }
+        __atomic_sub_fetch(&db->readers, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void tonies_dbRelease(tonies_db_t *db)
+{
+    if (db)
+    {
+        __atomic_sub_fetch(&db->readers, 1, __ATOMIC_RELEASE);
+    }
+}
+
 void tonies_init()
 {
     /* lock tonies cache and update caches */
     mutex_lock(MUTEX_TONIES_JSON_CACHE);
     if (!toniesJsonInitialized)
     {
-        toniesCustomJsonCount = 0;
         tonies_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_FILE);
         tonies_custom_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_CUSTOM_JSON_FILE);
         tonies_json_tmp_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_TMP_FILE);
+        toniesV2_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIESV2_JSON_FILE);
+        toniesV2_custom_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIESV2_CUSTOM_JSON_FILE);
 
-        tonies_readJson(tonies_custom_json_path, &toniesCustomJsonCache, &toniesCustomJsonCount);
-        tonies_readJson(tonies_json_path, &toniesJsonCache, &toniesJsonCount);
+        tonies_db_t *db = tonies_dbLoad(NULL);
+        if (db)
+        {
+            tonies_dbPublish(db);
+        }
         toniesJsonInitialized = true;
     }
+    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
+}
 
-    if (!toniesV2JsonInitialized)
+void tonies_reload()
+{
+    if (!toniesJsonInitialized)
     {
-        toniesV2CustomJsonCount = 0;
-        toniesV2_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIESV2_JSON_FILE);
-        toniesV2_custom_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIESV2_CUSTOM_JSON_FILE);
-        toniesV2_json_tmp_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_TMP_FILE);
+        tonies_init();
+        return;
+    }
+
+    mutex_lock(MUTEX_TONIES_JSON_CACHE);
+    toniesReloadPending = true;
+    if (toniesReloading)
+    {
+        mutex_unlock(MUTEX_TONIES_JSON_CACHE);
+        return;
+    }
+    toniesReloading = true;
+
+    while (toniesReloadPending)
+    {
+        toniesReloadPending = false;
+        mutex_unlock(MUTEX_TONIES_JSON_CACHE);
+
+        /* lookups keep using the current version while the new one is loaded, then it is swapped in one step,
+         * the current version stays pinned meanwhile, so unchanged items can take over its cached pictures */
+        tonies_db_t *previous = tonies_dbAcquire();
+        tonies_db_t *db = tonies_dbLoad(previous);
+        tonies_dbRelease(previous);
+
+        mutex_lock(MUTEX_TONIES_JSON_CACHE);
+        if (db == NULL)
+        {
+            TRACE_ERROR("Could not reload tonies.json\r\n");
+            continue;
+        }
+        tonies_dbPublish(db);
+    }
+    toniesReloading = false;
+    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
+}
+
+/* reloads if one of the files differs from the loaded version, tonies_update() reloads after its own downloads already */
+static void tonies_fileChanged(const char *path, void *ctx)
+{
+    const char *paths[TONIES_DB_SOURCES] = {tonies_custom_json_path, tonies_json_path, toniesV2_custom_json_path, toniesV2_json_path};
+    bool isSource = (path == NULL);
+    for (size_t i = 0; i < TONIES_DB_SOURCES && !isSource; i++)
+    {
+        isSource = (paths[i] != NULL && !osStrcmp(path, paths[i]));
+    }
+    if (!isSource)
+    {
+        return;
+    }
+
+    tonies_source_stat_t current[TONIES_DB_SOURCES];
+    tonies_statSources(current);
+    tonies_db_t *db = tonies_dbAcquire();
+    bool changed = (db == NULL);
+    for (size_t i = 0; i < TONIES_DB_SOURCES && !changed; i++)
+    {
+        const tonies_source_stat_t *loaded = &db->sources[i];
+        changed = current[i].exists != loaded->exists ||
+                  current[i].stat.size != loaded->stat.size ||
+                  compareDateTime(&current[i].stat.modified, &loaded->stat.modified);
+    }
+    tonies_dbRelease(db);
+
+    if (changed)
+    {
+        TRACE_INFO("tonies.json changed on disk. Reloading.\r\n");
+        tonies_reload();
+    }
+}
 
-        toniesV2_readJson(toniesV2_custom_json_path, &toniesV2CustomJsonCache, &toniesV2CustomJsonCount);
-        toniesV2_readJson(toniesV2_json_path, &toniesV2JsonCache, &toniesV2JsonCount);
-        toniesV2JsonInitialized = true;
+void tonies_watch()
+{
+    file_watch_subscribe("tonies.json", settings_get_string("internal.configdirfull"), NULL, false, TONIES_JSON_WATCH_DEBOUNCE_MS, &tonies_fileChanged, NULL);
+}
+
+void tonies_loop()
+{
+    systime_t now = osGetSystemTime();
+
+    mutex_lock(MUTEX_TONIES_JSON_CACHE);
+    tonies_db_t **pos = &toniesRetired;
+    while (*pos)
+    {
+        tonies_db_t *db = *pos;
+        /* the grace period covers a reader that loaded the pointer right before the swap but is not counted yet */
+        if (now - db->retiredAt >= TONIES_JSON_GRACE_PERIOD_MS && __atomic_load_n(&db->readers, __ATOMIC_ACQUIRE) == 0)
+        {
+            *pos = db->nextRetired;
+            TRACE_INFO("Freeing tonies.json version %" PRIu32 "\r\n", db->version);
+            tonies_dbFree(db);
+            continue;
+        }
+        pos = &db->nextRetired;
     }
     mutex_unlock(MUTEX_TONIES_JSON_CACHE);
 }
 
+uint32_t tonies_version()
+{
+    tonies_db_t *db = tonies_dbAcquire();
+    uint32_t version = db ? db->version : 0;
+    tonies_dbRelease(db);
+    return version;
+}
+
+static void tonies_readValidators(const char *path, tonies_validators_t *validators)
+{
+    osMemset(validators, 0, sizeof(tonies_validators_t));
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return;
+    }
+    char buffer[sizeof(validators->etag) + sizeof(validators->lastModified) + 2];
+    size_t length = 0;
+    fsReadFile(file, buffer, sizeof(buffer) - 1, &length);
+    fsCloseFile(file);
+    buffer[length] = '\0';
+
+    /* the ETag on the first line, Last-Modified on the second */
+    char *lastModified = osStrchr(buffer, '\n');
+    if (lastModified == NULL)
+    {
+        return;
+    }
+    *lastModified++ = '\0';
+    char *end = osStrchr(lastModified, '\n');
+    if (end)
+    {
+        *end = '\0';
+    }
+    osStrncpy(validators->etag, buffer, sizeof(validators->etag) - 1);
+    osStrncpy(validators->lastModified, lastModified, sizeof(validators->lastModified) - 1);
+}
+
+static void tonies_writeValidators(const char *path, const tonies_validators_t *validators)
+{
+    if (validators->etag[0] == '\0' && validators->lastModified[0] == '\0')
+    {
+        fsDeleteFile(path);
+        return;
+    }
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        TRACE_WARNING("Could not write %s\r\n", path);
+        return;
+    }
+    char *content = custom_asprintf("%s\n%s\n", validators->etag, validators->lastModified);
+    fsWriteFile(file, content, osStrlen(content));
+    fsCloseFile(file);
+    osFreeMem(content);
+}
+
+static void tonies_downloadRequest(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    tonies_download_t *download = (tonies_download_t *)((cbr_ctx_t *)src_ctx)->customData;
+
+    if (download->request.etag[0] != '\0')
+    {
+        httpClientAddHeaderField(cloud_ctx, "If-None-Match", download->request.etag);
+    }
+    if (download->request.lastModified[0] != '\0')
+    {
+        httpClientAddHeaderField(cloud_ctx, "If-Modified-Since", download->request.lastModified);
+    }
+}
+
+static void tonies_downloadResponse(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    tonies_download_t *download = (tonies_download_t *)((cbr_ctx_t *)src_ctx)->customData;
+    download->status = cloud_ctx->statusCode;
+}
+
+static void tonies_downloadHeader(void *src_ctx, HttpClientContext *cloud_ctx, const char *header, const char *value)
+{
+    tonies_download_t *download = (tonies_download_t *)((cbr_ctx_t *)src_ctx)->customData;
+
+    if (header == NULL || value == NULL || cloud_ctx->statusCode != 200)
+    {
+        return;
+    }
+    if (!osStrcasecmp(header, "ETag"))
+    {
+        osStrncpy(download->response.etag, value, sizeof(download->response.etag) - 1);
+    }
+    else if (!osStrcasecmp(header, "Last-Modified"))
+    {
+        osStrncpy(download->response.lastModified, value, sizeof(download->response.lastModified) - 1);
+    }
+}
+
 void tonies_downloadBody(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
 {
     cbr_ctx_t *ctx = (cbr_ctx_t *)src_ctx;
     HttpClientContext *httpClientContext = (HttpClientContext *)cloud_ctx;
+    tonies_download_t *download = (tonies_download_t *)ctx->customData;
 
     if (httpClientContext->statusCode == 200)
     {
         if (ctx->file == NULL)
         {
-            ctx->file = fsOpenFile(tonies_json_tmp_path, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+            ctx->file = fsOpenFile(download->tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
         }
         error_t errorWrite = NO_ERROR;
         if (length > 0)
@@ -85,409 +699,1045 @@ void tonies_downloadBody(void *src_ctx, HttpClientContext *cloud_ctx, const char
         else if (error != NO_ERROR)
         {
             fsCloseFile(ctx->file);
-            TRACE_ERROR("tonies.json download body error=%s\r\n", error2text(error));
+            TRACE_ERROR("%s download body error=%s\r\n", download->name, error2text(error));
         }
         if (errorWrite != NO_ERROR)
         {
             fsCloseFile(ctx->file);
-            TRACE_ERROR("tonies.json (%s) write error=%s\r\n", tonies_json_tmp_path, error2text(error));
+            TRACE_ERROR("%s (%s) write error=%s\r\n", download->name, download->tmpPath, error2text(error));
         }
     }
 }
 
-error_t tonies_update()
+/* downloads the file unless the stored validators show it is unchanged, *updated tells whether the target was replaced */
+static error_t tonies_download(const char *name, const char *uri_path, const char *target, bool *updated)
 {
-    TRACE_INFO("Updating tonies.json from api.revvox.de...\r\n");
+    TRACE_INFO("Updating %s from api.revvox.de...\r\n", name);
     cbr_ctx_t ctx;
     client_ctx_t client_ctx = {
         .settings = get_settings(),
     };
+    tonies_download_t download;
+    osMemset(&download, 0, sizeof(download));
+    download.name = name;
+    download.tmpPath = custom_asprintf("%s.tmp", target);
+    char *validatorsPath = custom_asprintf("%s%s", target, TONIES_VALIDATORS_EXT);
+
+    /* without the file there is nothing the server could confirm */
+    if (fsFileExists(target))
+    {
+        tonies_readValidators(validatorsPath, &download.request);
+    }
 
     const char *uri_base = "api.revvox.de";
-    const char *uri_path = "/tonies.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA;
     const char *queryString = NULL;
     fillBaseCtx(NULL, uri_path, queryString, V1_LOG, &ctx, &client_ctx);
+    ctx.customData = &download;
     req_cbr_t cbr = {
         .ctx = &ctx,
+        .response = &tonies_downloadResponse,
+        .header = &tonies_downloadHeader,
         .body = &tonies_downloadBody,
+        .request = &tonies_downloadRequest,
     };
 
     ctx.file = NULL;
-    fsDeleteFile(tonies_json_tmp_path);
+    fsDeleteFile(download.tmpPath);
+    *updated = false;
     // TODO: Be sure HTTPS CA is checked!
     error_t error = web_request(uri_base, 443, true, uri_path, queryString, "GET", NULL, 0, NULL, &cbr, false, false, NULL);
 
-    if (error == NO_ERROR && fsFileExists(tonies_json_tmp_path))
+    if (error == NO_ERROR && download.status == 304)
     {
-        fsDeleteFile(tonies_json_path);
-        fsRenameFile(tonies_json_tmp_path, tonies_json_path);
-        TRACE_INFO("... success updating tonies.json from api.revvox.de, reloading\r\n");
-        tonies_deinit();
-        tonies_init();
+        TRACE_INFO("... %s is unchanged on api.revvox.de\r\n", name);
+        stats_update("tonies_json_not_modified", 1);
     }
-    else
+    else if (error == NO_ERROR && download.status == 200 && fsFileExists(download.tmpPath))
     {
-        TRACE_ERROR("... failed updating tonies.json error=%s\r\n", error2text(error));
+        fsDeleteFile(target);
+        fsRenameFile(download.tmpPath, target);
+        tonies_writeValidators(validatorsPath, &download.response);
+        *updated = true;
+        TRACE_INFO("... success updating %s from api.revvox.de, reloading\r\n", name);
+    }
+    else
+    {
+        if (error == NO_ERROR)
+        {
+            error = ERROR_INVALID_RESPONSE;
+        }
+        TRACE_ERROR("... failed updating %s error=%s\r\n", name, error2text(error));
+    }
+    osFreeMem(download.tmpPath);
+    osFreeMem(validatorsPath);
+    return error;
+}
+
+error_t tonies_update()
+{
+    bool updated = false;
+    error_t error = tonies_download(TONIES_JSON_FILE, "/tonies.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA, tonies_json_path, &updated);
+    if (updated)
+    {
+        tonies_reload();
     }
     return error;
 }
 
 error_t toniesV2_update()
 {
-    TRACE_INFO("Updating tonies.json from api.revvox.de...\r\n");
-    cbr_ctx_t ctx;
-    client_ctx_t client_ctx = {
-        .settings = get_settings(),
-    };
+    bool updated = false;
+    error_t error = tonies_download(TONIESV2_JSON_FILE, "/toniesV2.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA, toniesV2_json_path, &updated);
+    if (updated)
+    {
+        tonies_reload();
+    }
+    return error;
+}
 
-    const char *uri_base = "api.revvox.de";
-    const char *uri_path = "/toniesV2.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA;
-    const char *queryString = NULL;
-    fillBaseCtx(NULL, uri_path, queryString, V1_LOG, &ctx, &client_ctx);
-    req_cbr_t cbr = {
-        .ctx = &ctx,
-        .body = &tonies_downloadBody,
-    };
+error_t tonieboxes_update()
+{
+    bool updated = false;
+    char *target = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIEBOX_JSON_FILE);
+    error_t error = tonies_download(TONIEBOX_JSON_FILE, "/tonieboxes.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA, target, &updated);
+    if (updated)
+    {
+        tonies_reload();
+    }
+    osFreeMem(target);
+    return error;
+}
 
-    ctx.file = NULL;
-    fsDeleteFile(tonies_json_tmp_path);
-    // TODO: Be sure HTTPS CA is checked!
-    error_t error = web_request(uri_base, 443, true, uri_path, queryString, "GET", NULL, 0, NULL, &cbr, false, false, NULL);
+/* temporary storage for the arrays of the item being read, copied to the arena once complete */
+typedef struct
+{
+    uint32_t audio_ids[UINT8_MAX];
+    uint8_t hashes[UINT8_MAX * 20];
+    char *tracks[UINT8_MAX];
+    bool cacheImages;
+    bool cachePreload;
+    const char *pictureSource; /* original URL of a cached picture, owned by the cache */
+    bool cacheFailed;
+    size_t picturesReused;
+} tonies_json_scratch_t;
+
+static char *tonies_jsonReadText(json_reader_t *reader, mem_arena_t *arena, bool intern)
+{
+    if (!json_reader_scalar(reader))
+    {
+        return NULL;
+    }
+    return intern ? mem_arena_intern(arena, reader->text) : mem_arena_strdup(arena, reader->text);
+}
 
-    if (error == NO_ERROR && fsFileExists(tonies_json_tmp_path))
+static bool tonies_jsonReadItem(json_reader_t *reader, mem_arena_t *arena, tonies_json_scratch_t *scratch, toniesJson_item_t *item)
+{
+    char *empty = mem_arena_intern(arena, "");
+    char *pic_link = empty;
+
+    osMemset(item, 0, sizeof(toniesJson_item_t));
+    item->model = empty;
+    item->title = empty;
+    item->episodes = empty;
+    item->series = empty;
+    item->language = empty;
+    item->category = empty;
+
+    if (!json_reader_enter(reader, '{'))
     {
-        fsDeleteFile(tonies_json_path);
-        fsRenameFile(tonies_json_tmp_path, tonies_json_path);
-        TRACE_INFO("... success updating tonies.json from api.revvox.de, reloading\r\n");
-        tonies_deinit();
-        tonies_init();
+        return false;
     }
-    else
+    while (json_reader_more(reader, '}'))
     {
-        TRACE_ERROR("... failed updating tonies.json error=%s\r\n", error2text(error));
+        if (!json_reader_key(reader))
+        {
+            return false;
+        }
+
+        char key[16];
+        osStrncpy(key, reader->text, sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
+
+        if (!osStrcmp(key, "no") || !osStrcmp(key, "release"))
+        {
+            if (!json_reader_scalar(reader))
+            {
+                return false;
+            }
+            if (key[0] == 'n')
+            {
+                item->no = atoi(reader->text);
+            }
+            else
+            {
+                item->release = atoi(reader->text);
+            }
+        }
+        else if (!osStrcmp(key, "model"))
+        {
+            item->model = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (!osStrcmp(key, "title"))
+        {
+            item->title = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (!osStrcmp(key, "episodes"))
+        {
+            item->episodes = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (!osStrcmp(key, "series"))
+        {
+            item->series = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (!osStrcmp(key, "language"))
+        {
+            item->language = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (!osStrcmp(key, "category"))
+        {
+            item->category = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (!osStrcmp(key, "pic"))
+        {
+            /* cached by tonies_jsonCachePicture() once the model is known */
+            pic_link = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (!osStrcmp(key, "audio_id") || !osStrcmp(key, "hash") || !osStrcmp(key, "tracks"))
+        {
+            size_t count = 0;
+            if (json_reader_peek(reader) != '[')
+            {
+                /* not an array, treated as empty like before */
+                if (!json_reader_skip(reader))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                json_reader_enter(reader, '[');
+                while (json_reader_more(reader, ']'))
+                {
+                    if (!json_reader_scalar(reader))
+                    {
+                        return false;
+                    }
+                    if (count >= UINT8_MAX)
+                    {
+                        continue;
+                    }
+                    if (key[0] == 'a')
+                    {
+                        scratch->audio_ids[count++] = (uint32_t)strtoul(reader->text, NULL, 10);
+                    }
+                    else if (key[0] == 'h')
+                    {
+                        if (reader->textLength != 40)
+                        {
+                            continue;
+                        }
+                        for (size_t j = 0; j < 20; j++)
+                        {
+                            sscanf(&reader->text[j * 2], "%2hhx", &scratch->hashes[(count * 20) + j]);
+                        }
+                        count++;
+                    }
+                    else
+                    {
+                        scratch->tracks[count++] = mem_arena_strdup(arena, reader->text);
+                    }
+                }
+                if (reader->failed)
+                {
+                    return false;
+                }
+            }
+
+            if (key[0] == 'a')
+            {
+                item->audio_ids_count = (uint8_t)count;
+                item->audio_ids = mem_arena_alloc(arena, count * sizeof(uint32_t));
+                if (item->audio_ids)
+                {
+                    osMemcpy(item->audio_ids, scratch->audio_ids, count * sizeof(uint32_t));
+                }
+            }
+            else if (key[0] == 'h')
+            {
+                item->hashes_count = (uint8_t)count;
+                item->hashes = mem_arena_alloc(arena, count * 20);
+                if (item->hashes)
+                {
+                    osMemcpy(item->hashes, scratch->hashes, count * 20);
+                }
+            }
+            else if (count > 0)
+            {
+                item->tracks_count = (uint8_t)count;
+                item->tracks = mem_arena_alloc(arena, count * sizeof(char *));
+                if (item->tracks)
+                {
+                    osMemcpy(item->tracks, scratch->tracks, count * sizeof(char *));
+                }
+            }
+        }
+        else if (!json_reader_skip(reader))
+        {
+            return false;
+        }
+
+        if (reader->failed)
+        {
+            return false;
+        }
     }
-    return error;
+    item->picture = pic_link;
+
+    /* a NULL member means the arena ran out of memory */
+    return !reader->failed && item->model && item->title && item->episodes && item->series && item->language && item->category && item->picture &&
+           (item->audio_ids || item->audio_ids_count == 0) && (item->hashes || item->hashes_count == 0) && (item->tracks || item->tracks_count == 0);
 }
 
-void tonieboxes_downloadBody(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
+/* replaces the picture by its cached URL, an unchanged picture takes over the cache entry of the previous version */
+static void tonies_jsonCachePicture(mem_arena_t *arena, tonies_json_scratch_t *scratch, toniesJson_item_t *item, const toniesJson_item_t *previous, const char *previousSource)
 {
-    cbr_ctx_t *ctx = (cbr_ctx_t *)src_ctx;
-    HttpClientContext *httpClientContext = (HttpClientContext *)cloud_ctx;
+    scratch->pictureSource = NULL;
+    if (!scratch->cacheImages || item->picture[0] == '\0')
+    {
+        return;
+    }
 
-    if (httpClientContext->statusCode == 200)
+    if (previousSource != NULL && !osStrcmp(previousSource, item->picture))
     {
-        if (ctx->file == NULL)
+        char *pic_link = mem_arena_strdup(arena, previous->picture);
+        if (pic_link)
         {
-            char *target = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIEBOX_JSON_FILE);
-            char *target_tmp = custom_asprintf("%s.tmp", target);
-            ctx->file = fsOpenFile(target_tmp, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
-            osFreeMem(target);
-            osFreeMem(target_tmp);
+            item->picture = pic_link;
+            scratch->pictureSource = previousSource;
+            scratch->picturesReused++;
+            return;
         }
-        error_t errorWrite = NO_ERROR;
-        if (length > 0)
+    }
+
+    cache_entry_t *cache = cache_add(item->picture);
+    if (cache == NULL)
+    {
+        scratch->cacheFailed = true;
+        return;
+    }
+    char *pic_link = mem_arena_strdup(arena, cache->cached_url);
+    if (pic_link == NULL)
+    {
+        return;
+    }
+    item->picture = pic_link;
+    scratch->pictureSource = cache->original_url;
+
+    TRACE_DEBUG("Cache URL would be: '%s'\r\n", cache->cached_url);
+
+    if (scratch->cachePreload)
+    {
+        /* download and cache the file in the background */
+        cache_prefetch(cache);
+    }
+}
+
+void tonies_readJson(char *source, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena)
+{
+    const char **pictureSources = NULL;
+    tonies_readJsonDiff(source, NULL, retCache, retCount, retArena, &pictureSources);
+    osFreeMem(pictureSources);
+}
+
+static void tonies_readJsonDiff(char *source, const tonies_json_previous_t *previous, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena, const char ***retPictureSources)
+{
+#if TONIES_JSON_CACHED == 1
+    *retCache = NULL;
+    *retCount = 0;
+    *retArena = NULL;
+    *retPictureSources = NULL;
+
+    size_t fileSize = 0;
+    fsGetFileSize(source, (uint32_t *)(&fileSize));
+    TRACE_INFO("Trying to read %s with size %zu\r\n", source, fileSize);
+
+    systime_t start = osGetSystemTime();
+    uint32_t snapshotFlags = settings_get_bool("tonie_json.cache_images") ? TONIES_SNAPSHOT_FLAG_CACHE_IMAGES : 0;
+    tonies_snapshot_source_t snapshotSource;
+    bool hasSnapshotSource = fsFileExists(source) && tonies_snapshot_source(source, &snapshotSource);
+    if (hasSnapshotSource && tonies_snapshot_load(source, &snapshotSource, snapshotFlags, retCache, retCount, retArena, retPictureSources))
+    {
+        TRACE_INFO("Loaded %zu tonies from snapshot of %s in %" PRIu32 " ms\r\n", *retCount, source, (uint32_t)(osGetSystemTime() - start));
+        return;
+    }
+
+    FsFile *fsFile = fsOpenFile(source, FS_FILE_MODE_READ);
+    if (fsFile == NULL)
+    {
+        TRACE_INFO("Create empty json file\r\n");
+        fsFile = fsOpenFile(source, FS_FILE_MODE_WRITE);
+        if (fsFile != NULL)
+        {
+            fsWriteFile(fsFile, "[]", 2);
+            fsCloseFile(fsFile);
+        }
+        else
+        {
+            TRACE_ERROR("...could not create file\r\n");
+        }
+        return;
+    }
+
+    /* the file is parsed block by block right into the arena, only the item array is grown aside */
+    mem_arena_t *arena = mem_arena_create();
+    json_reader_t *reader = osAllocMem(sizeof(json_reader_t));
+    tonies_json_scratch_t *scratch = osAllocMem(sizeof(tonies_json_scratch_t));
+    toniesJson_item_t *items = NULL;
+    const char **pictureSources = NULL;
+    size_t capacity = 0;
+    size_t count = 0;
+    bool success = false;
+    bool cacheFailed = false;
+    size_t picturesReused = 0;
+    size_t added = 0;
+    size_t changed = 0;
+
+    if (arena != NULL && reader != NULL && scratch != NULL)
+    {
+        scratch->cacheImages = (snapshotFlags & TONIES_SNAPSHOT_FLAG_CACHE_IMAGES) != 0;
+        scratch->cachePreload = settings_get_bool("tonie_json.cache_preload");
+        scratch->cacheFailed = false;
+        scratch->picturesReused = 0;
+        json_reader_init(reader, fsFile);
+        success = json_reader_enter(reader, '[');
+        while (success && json_reader_more(reader, ']'))
+        {
+            if (count == capacity)
+            {
+                size_t newCapacity = capacity ? capacity * 2 : 256;
+                toniesJson_item_t *newItems = osAllocMem(newCapacity * sizeof(toniesJson_item_t));
+                const char **newSources = osAllocMem(newCapacity * sizeof(const char *));
+                if (newItems == NULL || newSources == NULL)
+                {
+                    osFreeMem(newItems);
+                    osFreeMem(newSources);
+                    success = false;
+                    break;
+                }
+                if (items)
+                {
+                    osMemcpy(newItems, items, count * sizeof(toniesJson_item_t));
+                    osMemcpy(newSources, pictureSources, count * sizeof(const char *));
+                    osFreeMem(items);
+                    osFreeMem(pictureSources);
+                }
+                items = newItems;
+                pictureSources = newSources;
+                capacity = newCapacity;
+            }
+            success = tonies_jsonReadItem(reader, arena, scratch, &items[count]);
+            if (success)
+            {
+                const char *previousSource = NULL;
+                const toniesJson_item_t *previousItem = tonies_previousItem(previous, items[count].model, &previousSource);
+                tonies_jsonCachePicture(arena, scratch, &items[count], previousItem, previousSource);
+                if (previousItem == NULL)
+                {
+                    added++;
+                }
+                else if (!tonies_sameItem(previousItem, &items[count]))
+                {
+                    changed++;
+                }
+                pictureSources[count] = scratch->pictureSource;
+                count++;
+            }
+        }
+        success = success && !reader->failed;
+        json_reader_deinit(reader);
+        cacheFailed = scratch->cacheFailed;
+        picturesReused = scratch->picturesReused;
+    }
+    fsCloseFile(fsFile);
+    osFreeMem(reader);
+    osFreeMem(scratch);
+
+    toniesJson_item_t *toniesCache = NULL;
+    if (success && count > 0)
+    {
+        toniesCache = mem_arena_alloc(arena, count * sizeof(toniesJson_item_t));
+        success = (toniesCache != NULL);
+        if (success)
+        {
+            osMemcpy(toniesCache, items, count * sizeof(toniesJson_item_t));
+        }
+    }
+    osFreeMem(items);
+
+    if (!success)
+    {
+        if (fileSize > 0)
+        {
+            TRACE_ERROR("Json parse error\r\n");
+        }
+        osFreeMem(pictureSources);
+        mem_arena_free(arena);
+        return;
+    }
+    TRACE_INFO("Read %zu tonies from %s into %zu KB in %" PRIu32 " ms\r\n", count, source, mem_arena_size(arena) / 1024, (uint32_t)(osGetSystemTime() - start));
+    if (previous)
+    {
+        size_t kept = count - added;
+        size_t removed = previous->count > kept ? previous->count - kept : 0;
+        TRACE_INFO("Changes in %s: %zu added, %zu changed, %zu removed, %zu pictures already cached\r\n", source, added, changed, removed, picturesReused);
+    }
+
+    /* skipped if a picture could not be cached, the snapshot would keep it uncached */
+    if (hasSnapshotSource && count > 0 && !cacheFailed)
+    {
+        tonies_snapshot_save(source, &snapshotSource, snapshotFlags, toniesCache, count, pictureSources);
+    }
+
+    *retCache = toniesCache;
+    *retCount = count;
+    *retArena = arena;
+    *retPictureSources = pictureSources;
+#endif
+}
+
+/* temporary storage for the arrays of the toniesV2 item being read */
+typedef struct
+{
+    toniesV2Json_data_t data[UINT8_MAX];
+    toniesV2Json_ids_t ids[UINT8_MAX];
+    char *trackDesc[UINT8_MAX];
+} toniesV2_json_scratch_t;
+
+/* toniesV2.json spells its keys with dashes, accept underscores as well */
+static bool toniesV2_jsonKey(const char *key, const char *name)
+{
+    for (; *key && *name; key++, name++)
+    {
+        if (*key != *name && !(*key == '_' && *name == '-'))
+        {
+            return false;
+        }
+    }
+    return *key == *name;
+}
+
+static bool toniesV2_jsonReadIds(json_reader_t *reader, mem_arena_t *arena, toniesV2_json_scratch_t *scratch, size_t *idsCount)
+{
+    if (!json_reader_enter(reader, '['))
+    {
+        return false;
+    }
+    while (json_reader_more(reader, ']'))
+    {
+        toniesV2Json_ids_t ids;
+        osMemset(&ids, 0, sizeof(ids));
+        ids.hash = mem_arena_intern(arena, "");
+
+        if (!json_reader_enter(reader, '{'))
+        {
+            return false;
+        }
+        while (json_reader_more(reader, '}'))
+        {
+            if (!json_reader_key(reader))
+            {
+                return false;
+            }
+            char key[16];
+            osStrncpy(key, reader->text, sizeof(key) - 1);
+            key[sizeof(key) - 1] = '\0';
+
+            if (!json_reader_scalar(reader))
+            {
+                return false;
+            }
+            if (toniesV2_jsonKey(key, "audio-id"))
+            {
+                ids.audio_id = (uint32_t)strtoul(reader->text, NULL, 10);
+            }
+            else if (toniesV2_jsonKey(key, "hash"))
+            {
+                ids.hash = mem_arena_strdup(arena, reader->text);
+            }
+            else if (toniesV2_jsonKey(key, "size"))
+            {
+                ids.size = (uint32_t)strtoul(reader->text, NULL, 10);
+            }
+            else if (toniesV2_jsonKey(key, "tracks"))
+            {
+                ids.tracks = (uint8_t)atoi(reader->text);
+            }
+            else if (toniesV2_jsonKey(key, "confidence"))
+            {
+                ids.confidence = (uint8_t)atoi(reader->text);
+            }
+        }
+        if (reader->failed || ids.hash == NULL)
+        {
+            return false;
+        }
+        if (*idsCount < UINT8_MAX)
+        {
+            scratch->ids[(*idsCount)++] = ids;
+        }
+    }
+    return !reader->failed;
+}
+
+static bool toniesV2_jsonReadData(json_reader_t *reader, mem_arena_t *arena, toniesV2_json_scratch_t *scratch, toniesV2Json_data_t *data, size_t *idsCount)
+{
+    char *empty = mem_arena_intern(arena, "");
+    osMemset(data, 0, sizeof(toniesV2Json_data_t));
+    data->series = empty;
+    data->episode = empty;
+    data->language = empty;
+    data->category = empty;
+    data->image = empty;
+    data->sample = empty;
+    data->web = empty;
+    data->shop_id = empty;
+
+    if (!json_reader_enter(reader, '{'))
+    {
+        return false;
+    }
+    while (json_reader_more(reader, '}'))
+    {
+        if (!json_reader_key(reader))
+        {
+            return false;
+        }
+        char key[16];
+        osStrncpy(key, reader->text, sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
+
+        if (toniesV2_jsonKey(key, "ids") && json_reader_peek(reader) == '[')
+        {
+            if (!toniesV2_jsonReadIds(reader, arena, scratch, idsCount))
+            {
+                return false;
+            }
+        }
+        else if (toniesV2_jsonKey(key, "track-desc") && json_reader_peek(reader) == '[')
+        {
+            size_t count = 0;
+            json_reader_enter(reader, '[');
+            while (json_reader_more(reader, ']'))
+            {
+                if (!json_reader_scalar(reader))
+                {
+                    return false;
+                }
+                if (count < UINT8_MAX)
+                {
+                    scratch->trackDesc[count++] = mem_arena_strdup(arena, reader->text);
+                }
+            }
+            if (count > 0)
+            {
+                data->track_desc_count = (uint8_t)count;
+                data->track_desc = mem_arena_alloc(arena, count * sizeof(char *));
+                if (data->track_desc == NULL)
+                {
+                    return false;
+                }
+                osMemcpy(data->track_desc, scratch->trackDesc, count * sizeof(char *));
+            }
+        }
+        else if (toniesV2_jsonKey(key, "release"))
+        {
+            if (!json_reader_scalar(reader))
+            {
+                return false;
+            }
+            data->release = (uint32_t)strtoul(reader->text, NULL, 10);
+        }
+        else if (toniesV2_jsonKey(key, "series"))
+        {
+            data->series = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (toniesV2_jsonKey(key, "episode") || toniesV2_jsonKey(key, "episodes"))
+        {
+            data->episode = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (toniesV2_jsonKey(key, "language"))
+        {
+            data->language = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (toniesV2_jsonKey(key, "category"))
+        {
+            data->category = tonies_jsonReadText(reader, arena, true);
+        }
+        else if (toniesV2_jsonKey(key, "image"))
+        {
+            data->image = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (toniesV2_jsonKey(key, "sample"))
+        {
+            data->sample = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (toniesV2_jsonKey(key, "web"))
         {
-            errorWrite = fsWriteFile(ctx->file, (void *)payload, length);
+            data->web = tonies_jsonReadText(reader, arena, false);
         }
-
-        if (error == ERROR_END_OF_STREAM)
+        else if (toniesV2_jsonKey(key, "shop-id"))
         {
-            fsCloseFile(ctx->file);
+            data->shop_id = tonies_jsonReadText(reader, arena, false);
         }
-        else if (error != NO_ERROR)
+        else if (!json_reader_skip(reader))
         {
-            fsCloseFile(ctx->file);
-            TRACE_ERROR("tonieboxes.json download body error=%s\r\n", error2text(error));
+            return false;
         }
-        if (errorWrite != NO_ERROR)
+
+        if (reader->failed)
         {
-            fsCloseFile(ctx->file);
-            TRACE_ERROR("tonieboxes.json (%s) write error=%s\r\n", tonies_json_tmp_path, error2text(error));
+            return false;
         }
     }
-}
-error_t tonieboxes_update()
-{
-    TRACE_INFO("Updating tonies.json from api.revvox.de...\r\n");
-    cbr_ctx_t ctx;
-    client_ctx_t client_ctx = {
-        .settings = get_settings(),
-    };
 
-    char *target = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIEBOX_JSON_FILE);
-    char *target_tmp = custom_asprintf("%s.tmp", target);
+    /* a NULL member means the arena ran out of memory */
+    return !reader->failed && data->series && data->episode && data->language && data->category && data->image && data->sample && data->web && data->shop_id;
+}
 
-    const char *uri_base = "api.revvox.de";
-    const char *uri_path = "/tonieboxes.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA;
-    const char *queryString = NULL;
-    fillBaseCtx(NULL, uri_path, queryString, V1_LOG, &ctx, &client_ctx);
-    req_cbr_t cbr = {
-        .ctx = &ctx,
-        .body = &tonieboxes_downloadBody,
-    };
+static bool toniesV2_jsonReadItem(json_reader_t *reader, mem_arena_t *arena, toniesV2_json_scratch_t *scratch, toniesV2Json_item_t *item)
+{
+    size_t dataCount = 0;
+    size_t idsCount = 0;
 
-    ctx.file = NULL;
-    fsDeleteFile(target_tmp);
-    // TODO: Be sure HTTPS CA is checked!
-    error_t error = web_request(uri_base, 443, true, uri_path, queryString, "GET", NULL, 0, NULL, &cbr, false, false, NULL);
+    osMemset(item, 0, sizeof(toniesV2Json_item_t));
+    item->article = mem_arena_intern(arena, "");
 
-    if (error == NO_ERROR && fsFileExists(target_tmp))
+    if (!json_reader_enter(reader, '{'))
     {
-        fsDeleteFile(target);
-        fsRenameFile(target_tmp, target);
-        TRACE_INFO("... success updating tonieboxes.json from api.revvox.de, reloading\r\n");
-        tonies_deinit();
-        tonies_init();
+        return false;
     }
-    else
+    while (json_reader_more(reader, '}'))
     {
-        TRACE_ERROR("... failed updating tonieboxes.json error=%s\r\n", error2text(error));
-    }
-    osFreeMem(target);
-    osFreeMem(target_tmp);
-    return error;
-}
+        if (!json_reader_key(reader))
+        {
+            return false;
+        }
+        char key[16];
+        osStrncpy(key, reader->text, sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
 
-char *tonies_jsonGetString(cJSON *jsonElement, char *name)
-{
+        if (toniesV2_jsonKey(key, "article"))
+        {
+            item->article = tonies_jsonReadText(reader, arena, false);
+        }
+        else if (toniesV2_jsonKey(key, "data") && json_reader_peek(reader) == '[')
+        {
+            /* the ids are usually part of the data entries, they are collected for the whole item */
+            json_reader_enter(reader, '[');
+            while (json_reader_more(reader, ']'))
+            {
+                toniesV2Json_data_t data;
+                if (!toniesV2_jsonReadData(reader, arena, scratch, &data, &idsCount))
+                {
+                    return false;
+                }
+                if (dataCount < UINT8_MAX)
+                {
+                    scratch->data[dataCount++] = data;
+                }
+            }
+        }
+        else if (toniesV2_jsonKey(key, "ids") && json_reader_peek(reader) == '[')
+        {
+            if (!toniesV2_jsonReadIds(reader, arena, scratch, &idsCount))
+            {
+                return false;
+            }
+        }
+        else if (!json_reader_skip(reader))
+        {
+            return false;
+        }
 
-    cJSON *attr = cJSON_GetObjectItemCaseSensitive(jsonElement, name);
-    if (cJSON_IsString(attr))
-    {
-        return strdup(attr->valuestring);
+        if (reader->failed)
+        {
+            return false;
+        }
     }
-    return strdup("");
-}
 
-uint32_t tonies_jsonGetUInt32(cJSON *jsonElement, char *name)
-{
-    cJSON *attr = cJSON_GetObjectItemCaseSensitive(jsonElement, name);
-    if (cJSON_IsNumber(attr))
+    item->data_count = (uint8_t)dataCount;
+    item->data = mem_arena_alloc(arena, dataCount * sizeof(toniesV2Json_data_t));
+    if (item->data)
     {
-        return attr->valuedouble;
+        osMemcpy(item->data, scratch->data, dataCount * sizeof(toniesV2Json_data_t));
     }
-    return 0;
+    item->ids_count = (uint8_t)idsCount;
+    item->ids = mem_arena_alloc(arena, idsCount * sizeof(toniesV2Json_ids_t));
+    if (item->ids)
+    {
+        osMemcpy(item->ids, scratch->ids, idsCount * sizeof(toniesV2Json_ids_t));
+    }
+
+    return !reader->failed && item->article && (item->data || dataCount == 0) && (item->ids || idsCount == 0);
 }
 
-void tonies_readJson(char *source, toniesJson_item_t **retCache, size_t *retCount)
+void toniesV2_readJson(char *source, toniesV2Json_item_t **retCache, size_t *retCount, mem_arena_t **retArena)
 {
 #if TONIES_JSON_CACHED == 1
-    size_t toniesCount = 0;
-    toniesJson_item_t *toniesCache = NULL;
-
-    size_t fileSize = 0;
-    fsGetFileSize(source, (uint32_t *)(&fileSize));
-    TRACE_INFO("Trying to read %s with size %zu\r\n", source, fileSize);
+    *retCache = NULL;
+    *retCount = 0;
+    *retArena = NULL;
 
+    systime_t start = osGetSystemTime();
     FsFile *fsFile = fsOpenFile(source, FS_FILE_MODE_READ);
-    if (fsFile != NULL)
+    if (fsFile == NULL)
     {
-        size_t sizeRead;
-        char *data = osAllocMem(fileSize);
-        size_t pos = 0;
-
-        while (pos < fileSize)
+        TRACE_INFO("Create empty json file %s\r\n", source);
+        fsFile = fsOpenFile(source, FS_FILE_MODE_WRITE);
+        if (fsFile != NULL)
         {
-            fsReadFile(fsFile, &data[pos], fileSize - pos, &sizeRead);
-            pos += sizeRead;
+            fsWriteFile(fsFile, "[]", 2);
+            fsCloseFile(fsFile);
         }
-        fsCloseFile(fsFile);
-
-        cJSON *toniesJson = cJSON_ParseWithLengthOpts(data, fileSize, 0, 0);
-        cJSON *tonieJson;
-        osFreeMem(data);
-        if (toniesJson == NULL)
+        else
         {
-            if (fileSize > 0)
-            {
-                const char *error_ptr = cJSON_GetErrorPtr();
-                TRACE_ERROR("Json parse error\r\n");
-                if (error_ptr != NULL)
-                {
-                    // TRACE_ERROR(" before: %s\r\n", error_ptr); //TODO is crashing
-                }
-            }
-            cJSON_Delete(toniesJson);
+            TRACE_ERROR("...could not create file\r\n");
         }
-        else
+        return;
+    }
+
+    mem_arena_t *arena = mem_arena_create();
+    json_reader_t *reader = osAllocMem(sizeof(json_reader_t));
+    toniesV2_json_scratch_t *scratch = osAllocMem(sizeof(toniesV2_json_scratch_t));
+    toniesV2Json_item_t *items = NULL;
+    size_t capacity = 0;
+    size_t count = 0;
+    bool success = false;
+
+    if (arena != NULL && reader != NULL && scratch != NULL)
+    {
+        json_reader_init(reader, fsFile);
+        success = json_reader_enter(reader, '[');
+        while (success && json_reader_more(reader, ']'))
         {
-            size_t line = 0;
-            toniesCount = cJSON_GetArraySize(toniesJson);
-            toniesCache = osAllocMem(toniesCount * sizeof(toniesJson_item_t));
-            cJSON_ArrayForEach(tonieJson, toniesJson)
+            if (count == capacity)
             {
-                cJSON *arrayJson;
-                toniesJson_item_t *item = &toniesCache[line++];
-                char *no_str = tonies_jsonGetString(tonieJson, "no");
-                item->no = atoi(no_str);
-                free(no_str);
-                item->model = tonies_jsonGetString(tonieJson, "model");
-
-                arrayJson = cJSON_GetObjectItem(tonieJson, "audio_id");
-                item->audio_ids_count = (uint8_t)cJSON_GetArraySize(arrayJson);
-                item->audio_ids = osAllocMem(item->audio_ids_count * sizeof(uint32_t));
-                for (size_t i = 0; i < item->audio_ids_count; i++)
-                {
-                    cJSON *arrayItemJson = cJSON_GetArrayItem(arrayJson, i);
-                    item->audio_ids[i] = atoi(arrayItemJson->valuestring);
-                }
-                arrayJson = cJSON_GetObjectItem(tonieJson, "hash");
-                item->hashes_count = (uint8_t)cJSON_GetArraySize(arrayJson);
-                item->hashes = osAllocMem(item->hashes_count * sizeof(uint8_t) * 20);
-                for (size_t i = 0; i < item->hashes_count; i++)
+                size_t newCapacity = capacity ? capacity * 2 : 256;
+                toniesV2Json_item_t *newItems = osAllocMem(newCapacity * sizeof(toniesV2Json_item_t));
+                if (newItems == NULL)
                 {
-                    cJSON *arrayItemJson = cJSON_GetArrayItem(arrayJson, i);
-                    if (arrayItemJson->valuestring == NULL || osStrlen(arrayItemJson->valuestring) != 40)
-                    {
-                        break;
-                    }
-                    for (size_t j = 0; j < 20; j++)
-                    {
-                        sscanf(&arrayItemJson->valuestring[j * 2], "%2hhx", &item->hashes[(i * 20) + j]);
-                    }
+                    success = false;
+                    break;
                 }
-                item->title = tonies_jsonGetString(tonieJson, "title");
-                item->episodes = tonies_jsonGetString(tonieJson, "episodes");
-                item->series = tonies_jsonGetString(tonieJson, "series");
-
-                const cJSON *tracks = cJSON_GetObjectItemCaseSensitive(tonieJson, "tracks");
-                item->tracks_count = cJSON_GetArraySize(tracks);
-                if (item->tracks_count > 0)
+                if (items)
                 {
-                    item->tracks = osAllocMem(item->tracks_count * sizeof(char *));
-                    uint8_t i = 0;
-                    const cJSON *track;
-                    cJSON_ArrayForEach(track, tracks)
-                    {
-                        item->tracks[i++] = strdup(track->valuestring);
-                    }
+                    osMemcpy(newItems, items, count * sizeof(toniesV2Json_item_t));
+                    osFreeMem(items);
                 }
+                items = newItems;
+                capacity = newCapacity;
+            }
+            success = toniesV2_jsonReadItem(reader, arena, scratch, &items[count]);
+            if (success)
+            {
+                count++;
+            }
+        }
+        success = success && !reader->failed;
+        json_reader_deinit(reader);
+    }
+    fsCloseFile(fsFile);
+    osFreeMem(reader);
+    osFreeMem(scratch);
 
-                char *releaseString = tonies_jsonGetString(tonieJson, "release");
-                item->release = atoi(releaseString);
-                osFreeMem(releaseString);
-                item->language = tonies_jsonGetString(tonieJson, "language");
-                item->category = tonies_jsonGetString(tonieJson, "category");
+    toniesV2Json_item_t *toniesCache = NULL;
+    if (success && count > 0)
+    {
+        toniesCache = mem_arena_alloc(arena, count * sizeof(toniesV2Json_item_t));
+        success = (toniesCache != NULL);
+        if (success)
+        {
+            osMemcpy(toniesCache, items, count * sizeof(toniesV2Json_item_t));
+        }
+    }
+    osFreeMem(items);
 
-                char *pic_link = tonies_jsonGetString(tonieJson, "pic");
+    if (!success)
+    {
+        TRACE_ERROR("Json parse error in %s\r\n", source);
+        mem_arena_free(arena);
+        return;
+    }
+    TRACE_INFO("Read %zu tonies from %s into %zu KB in %" PRIu32 " ms\r\n", count, source, mem_arena_size(arena) / 1024, (uint32_t)(osGetSystemTime() - start));
 
-                if (osStrlen(pic_link) > 0 && settings_get_bool("tonie_json.cache_images"))
-                {
-                    cache_entry_t *cache = cache_add(pic_link);
+    *retCache = toniesCache;
+    *retCount = count;
+    *retArena = arena;
+#endif
+}
 
-                    if (cache)
-                    {
-                        osFreeMem(pic_link);
-                        pic_link = strdup(cache->cached_url);
+static toniesV2Json_item_t *toniesV2_indexItem(const tonies_db_t *db, uint32_t ordinal)
+{
+    if (ordinal < db->v2CustomCount)
+    {
+        return &db->v2CustomItems[ordinal];
+    }
+    return &db->v2Items[ordinal - db->v2CustomCount];
+}
 
-                        TRACE_DEBUG("Cache URL would be: '%s'\r\n", cache->cached_url);
+static void toniesV2_freeIndex(toniesV2_index_t *index)
+{
+    osFreeMem(index->audioIds);
+    osFreeMem(index->hashes);
+    osFreeMem(index->items);
+    tonies_indexFree(&index->byAudioId);
+    osMemset(index, 0, sizeof(toniesV2_index_t));
+}
 
-                        if (settings_get_bool("tonie_json.cache_preload"))
-                        {
-                            /* try to download and cache the file */
-                            cache_fetch_entry(cache);
-                        }
-                    }
-                }
-                item->picture = pic_link;
-            }
-            cJSON_Delete(toniesJson);
-        }
+static bool toniesV2_parseHash(const char *text, uint8_t *hash)
+{
+    if (osStrlen(text) != 40)
+    {
+        return false;
     }
-    else
+    for (size_t j = 0; j < 20; j++)
     {
-        TRACE_INFO("Create empty json file\r\n");
-        fsFile = fsOpenFile(source, FS_FILE_MODE_WRITE);
-        if (fsFile != NULL)
-        {
-            fsWriteFile(fsFile, "[]", 2);
-            fsCloseFile(fsFile);
-        }
-        else
+        if (sscanf(&text[j * 2], "%2hhx", &hash[j]) != 1)
         {
-            TRACE_ERROR("...could not create file\r\n");
+            return false;
         }
     }
+    return true;
+}
 
-    /* first save old pointer, then update return values */
-    void *oldPtr = *retCache;
+static void toniesV2_buildIndex(tonies_db_t *db)
+{
+    toniesV2_index_t *index = &db->v2Index;
+    size_t itemCount = db->v2CustomCount + db->v2Count;
+    size_t rows = 0;
+    for (uint32_t ordinal = 0; ordinal < itemCount; ordinal++)
+    {
+        rows += toniesV2_indexItem(db, ordinal)->ids_count;
+    }
 
-    *retCache = toniesCache;
-    *retCount = toniesCount;
+    index->audioIds = osAllocMem(rows * sizeof(uint32_t) + 1);
+    index->hashes = osAllocMem(rows * 20 + 1);
+    index->items = osAllocMem(rows * sizeof(uint32_t) + 1);
+    if (index->audioIds == NULL || index->hashes == NULL || index->items == NULL || !tonies_indexAlloc(&index->byAudioId, rows))
+    {
+        TRACE_ERROR("Could not allocate toniesV2.json index\r\n");
+        toniesV2_freeIndex(index);
+        return;
+    }
 
-    if (oldPtr)
+    /* rows keep the file order with custom items first, so the first match on a probe sequence overrides */
+    for (uint32_t ordinal = 0; ordinal < itemCount; ordinal++)
     {
-        osFreeMem(oldPtr);
+        toniesV2Json_item_t *item = toniesV2_indexItem(db, ordinal);
+        for (size_t i = 0; i < item->ids_count; i++)
+        {
+            size_t row = index->rows;
+            index->audioIds[row] = item->ids[i].audio_id;
+            if (!toniesV2_parseHash(item->ids[i].hash, &index->hashes[row * 20]))
+            {
+                osMemset(&index->hashes[row * 20], 0, 20);
+            }
+            index->items[row] = ordinal;
+            tonies_indexInsert(&index->byAudioId, item->ids[i].audio_id, row);
+            index->rows++;
+        }
     }
-#endif
+    TRACE_INFO("Indexed %zu toniesV2 with %zu audio ids\r\n", itemCount, index->rows);
 }
 
-void toniesV2_readJson(char *source, toniesV2Json_item_t **toniesCache, size_t *toniesCount)
+/* returns the first row + 1 with the audio id and, if given, the hash, 0 if none */
+static uint32_t toniesV2_indexFind(const toniesV2_index_t *index, uint32_t audio_id, const uint8_t *hash)
 {
-#if TONIES_JSON_CACHED == 1
+    if (index->byAudioId.items == NULL)
+    {
+        return 0;
+    }
+    size_t mask = ((size_t)1 << index->byAudioId.bits) - 1;
+    for (size_t slot = tonies_indexSlot(&index->byAudioId, audio_id); index->byAudioId.items[slot] != 0; slot = (slot + 1) & mask)
+    {
+        uint32_t row = index->byAudioId.items[slot] - 1;
+        if (index->audioIds[row] == audio_id && (hash == NULL || osMemcmp(&index->hashes[row * 20], hash, 20) == 0))
+        {
+            return row + 1;
+        }
+    }
+    return 0;
+}
 
-#endif
+static toniesV2Json_item_t *toniesV2_byAudioIdHash_base(const tonies_db_t *db, uint32_t audio_id, const uint8_t *hash)
+{
+    uint32_t found = toniesV2_indexFind(&db->v2Index, audio_id, hash);
+    if (audio_id < TEDDY_BENCH_AUDIO_ID_DEDUCT)
+    {
+        uint32_t deducted = toniesV2_indexFind(&db->v2Index, audio_id + TEDDY_BENCH_AUDIO_ID_DEDUCT, hash);
+        if (deducted != 0 && (found == 0 || deducted < found))
+        {
+            found = deducted;
+        }
+    }
+    if (found == 0)
+    {
+        return NULL;
+    }
+    return toniesV2_indexItem(db, db->v2Index.items[found - 1]);
 }
 
-toniesJson_item_t *tonies_byAudioIdHash_base(uint32_t audio_id, uint8_t *hash, toniesJson_item_t *toniesCache, size_t toniesCount)
+static toniesJson_item_t *tonies_byAudioIdHash_base(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash)
 {
 #if TONIES_JSON_CACHED == 1
-    for (size_t i = 0; i < toniesCount; i++)
+    tonies_query_t query = {.audio_id = audio_id, .hash = hash};
+    uint32_t found = 0;
+    if (hash != NULL)
+    {
+        found = tonies_indexFind(db, &db->hashIndex, tonies_hashFromSha1(hash), &tonies_checkAudioIdHash, &query);
+    }
+    else
     {
-        for (size_t j = 0; j < toniesCache[i].audio_ids_count; j++)
+        found = tonies_indexFind(db, &db->audioIdIndex, audio_id, &tonies_checkAudioIdHash, &query);
+        if (audio_id < TEDDY_BENCH_AUDIO_ID_DEDUCT)
         {
-            if (toniesCache[i].audio_ids[j] == audio_id || (audio_id < TEDDY_BENCH_AUDIO_ID_DEDUCT && toniesCache[i].audio_ids[j] == audio_id + TEDDY_BENCH_AUDIO_ID_DEDUCT))
+            uint32_t deducted = tonies_indexFind(db, &db->audioIdIndex, audio_id + TEDDY_BENCH_AUDIO_ID_DEDUCT, &tonies_checkAudioIdHash, &query);
+            if (deducted != 0 && (found == 0 || deducted < found))
             {
-                for (size_t k = 0; k < toniesCache[i].hashes_count; k++)
-                {
-                    if (hash == NULL || osMemcmp(toniesCache[i].hashes + (k * 20), hash, 20) == 0)
-                        return &toniesCache[i];
-                }
+                found = deducted;
             }
         }
     }
+    if (found != 0)
+    {
+        return tonies_indexItem(db, found - 1);
+    }
 #else
     // cJSON_ParseWithLengthOpts
 #endif
     return NULL;
 }
 
-toniesJson_item_t *tonies_byAudioId(uint32_t audio_id)
+toniesJson_item_t *tonies_byAudioId(const tonies_db_t *db, uint32_t audio_id)
 {
-    mutex_lock(MUTEX_TONIES_JSON_CACHE);
-    toniesJson_item_t *item = tonies_byAudioIdHash_base(audio_id, NULL, toniesCustomJsonCache, toniesCustomJsonCount);
-
-    if (!item)
-    {
-        item = tonies_byAudioIdHash_base(audio_id, NULL, toniesJsonCache, toniesJsonCount);
-    }
-
-    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
-    return item;
+    return db ? tonies_byAudioIdHash_base(db, audio_id, NULL) : NULL;
 }
 
-toniesJson_item_t *tonies_byAudioIdHash(uint32_t audio_id, uint8_t *hash)
+toniesJson_item_t *tonies_byAudioIdHash(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash)
 {
-    mutex_lock(MUTEX_TONIES_JSON_CACHE);
-    toniesJson_item_t *item = tonies_byAudioIdHash_base(audio_id, hash, toniesCustomJsonCache, toniesCustomJsonCount);
-    if (!item)
-    {
-        item = tonies_byAudioIdHash_base(audio_id, hash, toniesJsonCache, toniesJsonCount);
-    }
-
-    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
-    return item;
+    return db ? tonies_byAudioIdHash_base(db, audio_id, hash) : NULL;
 }
 
-toniesJson_item_t *tonies_byModel_base(char *model, toniesJson_item_t *toniesCache, size_t toniesCount)
+static toniesJson_item_t *tonies_byModel_base(const tonies_db_t *db, char *model)
 {
     if (model == NULL || osStrcmp(model, "") == 0)
         return NULL;
 #if TONIES_JSON_CACHED == 1
-    for (size_t i = 0; i < toniesCount; i++)
+    tonies_query_t query = {.model = model};
+    uint32_t found = tonies_indexFind(db, &db->modelIndex, tonies_hashModel(model), &tonies_checkModel, &query);
+    if (found != 0)
     {
-        if (osStrcasecmp(toniesCache[i].model, model) == 0)
-            return &toniesCache[i];
+        return tonies_indexItem(db, found - 1);
     }
 #else
         // cJSON_ParseWithLengthOpts
@@ -495,210 +1745,151 @@ toniesJson_item_t *tonies_byModel_base(char *model, toniesJson_item_t *toniesCac
     return NULL;
 }
 
-toniesJson_item_t *tonies_byModel(char *model)
+toniesJson_item_t *tonies_byModel(const tonies_db_t *db, char *model)
 {
-    mutex_lock(MUTEX_TONIES_JSON_CACHE);
+    return db ? tonies_byModel_base(db, model) : NULL;
+}
 
-    toniesJson_item_t *item = tonies_byModel_base(model, toniesCustomJsonCache, toniesCustomJsonCount);
-    if (!item)
+toniesJson_item_t *tonies_byAudioIdHashModel(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash, char *model)
+{
+    toniesJson_item_t *item = NULL;
+    if (db)
     {
-        item = tonies_byModel_base(model, toniesJsonCache, toniesJsonCount);
+        item = tonies_byAudioIdHash_base(db, audio_id, hash);
+        if (!item)
+        {
+            item = tonies_byModel_base(db, model);
+        }
     }
 
-    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
     return item;
 }
 
-toniesJson_item_t *tonies_byAudioIdHashModel(uint32_t audio_id, uint8_t *hash, char *model)
+toniesV2Json_item_t *toniesV2_byAudioIdHash(const tonies_db_t *db, uint32_t audio_id, uint8_t *hash)
 {
-    toniesJson_item_t *item = tonies_byAudioIdHash(audio_id, hash);
-    if (!item)
-    {
-        item = tonies_byModel(model);
-    }
-
-    return item;
+    return db ? toniesV2_byAudioIdHash_base(db, audio_id, hash) : NULL;
 }
 
-const char *tonies_strcasestr(const char *haystack, const char *needle)
+/* logs the throughput of both lookup paths with the audio ids of toniesV2.json as workload */
+void tonies_benchmark(uint32_t duration_ms)
 {
-    while (*haystack)
+    tonies_db_t *db = tonies_dbAcquire();
+    if (db == NULL || db->v2Index.rows == 0)
     {
-        const char *h = haystack;
-        const char *n = needle;
+        TRACE_ERROR("No toniesV2.json ids loaded, nothing to resolve\r\n");
+        tonies_dbRelease(db);
+        return;
+    }
+    const toniesV2_index_t *index = &db->v2Index;
 
-        // Compare strings case-insensitively
-        while (*h && *n && (tolower(*h) == tolower(*n)))
+    size_t lookupsV1 = 0;
+    size_t foundV1 = 0;
+    systime_t start = osGetSystemTime();
+    systime_t elapsedV1;
+    do
+    {
+        for (size_t row = 0; row < index->rows; row++)
         {
-            h++;
-            n++;
+            foundV1 += tonies_byAudioIdHash_base(db, index->audioIds[row], &index->hashes[row * 20]) != NULL;
         }
-
-        // If the end of needle is reached, match found
-        if (!*n)
+        lookupsV1 += index->rows;
+        elapsedV1 = osGetSystemTime() - start;
+    } while (elapsedV1 < duration_ms);
+
+    size_t lookupsV2 = 0;
+    size_t foundV2 = 0;
+    start = osGetSystemTime();
+    systime_t elapsedV2;
+    do
+    {
+        for (size_t row = 0; row < index->rows; row++)
         {
-            return haystack;
+            foundV2 += toniesV2_byAudioIdHash_base(db, index->audioIds[row], &index->hashes[row * 20]) != NULL;
         }
-
-        haystack++;
-    }
-
-    return NULL;
+        lookupsV2 += index->rows;
+        elapsedV2 = osGetSystemTime() - start;
+    } while (elapsedV2 < duration_ms);
+
+    TRACE_WARNING("Resolved %zu ids of toniesV2.json against %zu custom and %zu official tonies.json entries\r\n", index->rows, db->customCount, db->count);
+    TRACE_WARNING("  tonies.json:   %zu lookups/ms (%zu%% found)\r\n", lookupsV1 / MAX(elapsedV1, 1), foundV1 * 100 / lookupsV1);
+    TRACE_WARNING("  toniesV2.json: %zu lookups/ms (%zu%% found)\r\n", lookupsV2 / MAX(elapsedV2, 1), foundV2 * 100 / lookupsV2);
+    tonies_dbRelease(db);
 }
 
-bool tonies_byModelSeriesEpisode_base(char *model, char *series, char *episode, toniesJson_item_t *result[18], size_t *result_size, size_t max_slots, toniesJson_item_t *toniesCache, size_t toniesCount)
+char *tonies_modelByAudioIdHash(uint32_t audio_id, uint8_t *hash)
 {
-#if TONIES_JSON_CACHED == 1
-    size_t count = *result_size;
-
-    if (model != NULL && osStrlen(model) > 0)
-    {
-        size_t count_model = 0;
-        for (size_t i = 0; i < toniesCount; i++)
-        {
-            if (count >= max_slots || count_model >= (max_slots - count) / 3)
-            {
-                break;
-            }
-            if (tonies_strcasestr(toniesCache[i].model, model) != NULL)
-            {
-                bool duplicate = false;
-                for (size_t j = 0; j < count; j++)
-                {
-                    if (osStrcasecmp(result[j]->model, toniesCache[i].model) == 0)
-                    {
-                        duplicate = true;
-                        break;
-                    }
-                }
-                if (!duplicate)
-                {
-                    result[count++] = &toniesCache[i];
-                    count_model++;
-                }
-            }
-        }
-    }
-    if (series != NULL && osStrlen(series) > 0)
+    tonies_db_t *db = tonies_dbAcquire();
+    const char *model = NULL;
+    if (db)
     {
-        size_t count_series = 0;
-        for (size_t i = 0; i < toniesCount; i++)
+        /* tonies.json decides like before, toniesV2.json only knows audio ids that are missing there */
+        toniesJson_item_t *item = tonies_byAudioIdHash_base(db, audio_id, hash);
+        if (item != NULL)
         {
-            if (count >= max_slots || count_series >= (max_slots - count) / 2)
-            {
-                break;
-            }
-            if (tonies_strcasestr(toniesCache[i].series, series) != NULL)
-            {
-                bool duplicate = false;
-                for (size_t j = 0; j < count; j++)
-                {
-                    if (osStrcasecmp(result[j]->model, toniesCache[i].model) == 0)
-                    {
-                        duplicate = true;
-                        break;
-                    }
-                }
-                if (!duplicate)
-                {
-                    result[count++] = &toniesCache[i];
-                    count_series++;
-                }
-            }
+            model = item->model;
         }
-    }
-    if (episode != NULL && osStrlen(episode) > 0)
-    {
-        size_t count_episode = 0;
-        for (size_t i = 0; i < toniesCount; i++)
+        else
         {
-            if (count >= max_slots || count_episode >= (max_slots - count) / 1)
+            toniesV2Json_item_t *itemV2 = toniesV2_byAudioIdHash_base(db, audio_id, hash);
+            if (itemV2 != NULL && itemV2->article[0] != '\0')
             {
-                break;
-            }
-            if (tonies_strcasestr(toniesCache[i].episodes, episode) != NULL)
-            {
-                bool duplicate = false;
-                for (size_t j = 0; j < count; j++)
-                {
-                    if (osStrcasecmp(result[j]->model, toniesCache[i].model) == 0)
-                    {
-                        duplicate = true;
-                        break;
-                    }
-                }
-                if (!duplicate)
-                {
-                    result[count++] = &toniesCache[i];
-                    count_episode++;
-                }
+                model = itemV2->article;
             }
         }
     }
-    *result_size = count;
-    return *result_size > 0;
-#else
-    return false;
-#endif
+    /* the copy is taken before the version may be freed */
+    char *copy = model ? strdup(model) : NULL;
+    tonies_dbRelease(db);
+    return copy;
 }
 
-bool tonies_byModelSeriesEpisode(char *model, char *series, char *episode, toniesJson_item_t *result[18], size_t *result_size)
+size_t tonies_search(const tonies_db_t *db, const tonies_search_term_t *terms, size_t termCount, size_t offset, size_t limit, toniesJson_item_t **results, size_t *total)
 {
     size_t count = 0;
-    mutex_lock(MUTEX_TONIES_JSON_CACHE);
-    tonies_byModelSeriesEpisode_base(model, series, episode, result, &count, 9, toniesCustomJsonCache, toniesCustomJsonCount);
-    tonies_byModelSeriesEpisode_base(model, series, episode, result, &count, 18, toniesJsonCache, toniesJsonCount);
-    mutex_unlock(MUTEX_TONIES_JSON_CACHE);
-    *result_size = count;
-    return *result_size > 0;
+    *total = 0;
+    if (db)
+    {
+        count = tonies_search_query(db->search, terms, termCount, offset, limit, results, total);
+    }
+    return count;
 }
 
-void tonies_deinit_base(toniesJson_item_t *toniesCache, size_t *toniesCount)
+void tonies_deinit_base(mem_arena_t *toniesArena, size_t *toniesCount)
 {
 #if TONIES_JSON_CACHED == 1
-    size_t count = *toniesCount;
+    /* items and all their members live in the arena */
     *toniesCount = 0;
-    for (size_t i = 0; i < count; i++)
-    {
-        toniesJson_item_t *item = &toniesCache[i];
-        osFreeMem(item->model);
-        osFreeMem(item->audio_ids);
-        osFreeMem(item->hashes);
-        osFreeMem(item->title);
-        osFreeMem(item->episodes);
-        osFreeMem(item->series);
-        osFreeMem(item->language);
-        osFreeMem(item->category);
-        osFreeMem(item->picture);
-        if (item->tracks_count > 0)
-        {
-            for (size_t track = 0; track < item->tracks_count; track++)
-            {
-                osFreeMem(item->tracks[track]);
-            }
-            osFreeMem(item->tracks);
-        }
-    }
-    osFreeMem(toniesCache);
+    mem_arena_free(toniesArena);
 #endif
 }
 
 void tonies_deinit()
 {
     mutex_lock(MUTEX_TONIES_JSON_CACHE);
-    tonies_deinit_base(toniesJsonCache, &toniesJsonCount);
-    tonies_deinit_base(toniesCustomJsonCache, &toniesCustomJsonCount);
-
-    toniesJsonCache = NULL;
-    toniesCustomJsonCache = NULL;
+    /* only called on shutdown, when no lookups run anymore */
+    tonies_db_t *db = __atomic_exchange_n(&toniesDb, NULL, __ATOMIC_ACQ_REL);
+    if (db)
+    {
+        tonies_dbFree(db);
+    }
+    while (toniesRetired)
+    {
+        db = toniesRetired;
+        toniesRetired = db->nextRetired;
+        tonies_dbFree(db);
+    }
 
     osFreeMem(tonies_json_path);
     osFreeMem(tonies_custom_json_path);
     osFreeMem(tonies_json_tmp_path);
+    osFreeMem(toniesV2_json_path);
+    osFreeMem(toniesV2_custom_json_path);
 
     tonies_json_path = NULL;
     tonies_custom_json_path = NULL;
     tonies_json_tmp_path = NULL;
+    toniesV2_json_path = NULL;
+    toniesV2_custom_json_path = NULL;
 
     toniesJsonInitialized = false;
     mutex_unlock(MUTEX_TONIES_JSON_CACHE);
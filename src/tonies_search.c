@@ -0,0 +1,522 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tonies_search.h"
+#include "debug.h"
+#include "os_port.h"
+
+/* share of the query trigrams (permille) an entry has to contain to be a fuzzy match */
+#define TONIES_SEARCH_FUZZY_MIN 500
+
+#define TONIES_SEARCH_TIER_FUZZY 1
+#define TONIES_SEARCH_TIER_SUBSTRING 2
+#define TONIES_SEARCH_TIER_PREFIX 3
+
+struct tonies_search_s
+{
+    size_t docCount;
+    toniesJson_item_t **items; /* document -> tonies.json item */
+    uint32_t *fields;          /* TONIES_SEARCH_FIELDS offsets into text per document */
+    char *text;                /* normalized fields, each zero terminated */
+    size_t trigramCount;
+    uint32_t *trigrams;     /* sorted */
+    uint32_t *postingStart; /* trigramCount + 1 offsets into postings */
+    uint32_t *postings;     /* document * TONIES_SEARCH_FIELDS + field per trigram, ascending */
+};
+
+typedef struct
+{
+    uint32_t doc;
+    uint32_t score;
+} tonies_search_hit_t;
+
+/* base letters of U+00C0 to U+017F */
+static const char *const tonies_search_fold[] = {
+    "a", "a", "a", "a", "a", "a", "ae", "c",  /* U+00C0 */
+    "e", "e", "e", "e", "i", "i", "i", "i",   /* U+00C8 */
+    "d", "n", "o", "o", "o", "o", "o", " ",   /* U+00D0 */
+    "o", "u", "u", "u", "u", "y", "th", "ss", /* U+00D8 */
+    "a", "a", "a", "a", "a", "a", "ae", "c",  /* U+00E0 */
+    "e", "e", "e", "e", "i", "i", "i", "i",   /* U+00E8 */
+    "d", "n", "o", "o", "o", "o", "o", " ",   /* U+00F0 */
+    "o", "u", "u", "u", "u", "y", "th", "y",  /* U+00F8 */
+    "a", "a", "a", "a", "a", "a", "c", "c",   /* U+0100 */
+    "c", "c", "c", "c", "c", "c", "d", "d",   /* U+0108 */
+    "d", "d", "e", "e", "e", "e", "e", "e",   /* U+0110 */
+    "e", "e", "e", "e", "g", "g", "g", "g",   /* U+0118 */
+    "g", "g", "g", "g", "h", "h", "h", "h",   /* U+0120 */
+    "i", "i", "i", "i", "i", "i", "i", "i",   /* U+0128 */
+    "i", "i", "ij", "ij", "j", "j", "k", "k", /* U+0130 */
+    "k", "l", "l", "l", "l", "l", "l", "l",   /* U+0138 */
+    "l", "l", "l", "n", "n", "n", "n", "n",   /* U+0140 */
+    "n", "n", "n", "n", "o", "o", "o", "o",   /* U+0148 */
+    "o", "o", "oe", "oe", "r", "r", "r", "r", /* U+0150 */
+    "r", "r", "s", "s", "s", "s", "s", "s",   /* U+0158 */
+    "s", "s", "t", "t", "t", "t", "t", "t",   /* U+0160 */
+    "u", "u", "u", "u", "u", "u", "u", "u",   /* U+0168 */
+    "u", "u", "u", "u", "w", "w", "y", "y",   /* U+0170 */
+    "y", "z", "z", "z", "z", "z", "z", "s",   /* U+0178 */
+};
+
+/* ranking weight of model, series, episodes and title matches */
+static const uint32_t tonies_search_fieldWeight[TONIES_SEARCH_FIELDS] = {4, 2, 1, 3};
+
+size_t tonies_search_normalize(const char *text, char *out, size_t size)
+{
+    size_t len = 0;
+    bool space = true; /* suppresses leading and repeated spaces */
+    const uint8_t *p = (const uint8_t *)text;
+
+    while (*p && len + 3 < size)
+    {
+        const char *mapped = NULL;
+        char ascii[2] = {0, 0};
+        uint32_t cp = *p++;
+
+        if (cp < 0x80)
+        {
+            if (isalnum(cp))
+            {
+                ascii[0] = (char)tolower(cp);
+                mapped = ascii;
+            }
+        }
+        else if ((cp & 0xE0) == 0xC0 && (*p & 0xC0) == 0x80)
+        {
+            cp = ((cp & 0x1F) << 6) | (*p++ & 0x3F);
+            if (cp >= 0xC0 && cp < 0x180)
+            {
+                mapped = tonies_search_fold[cp - 0xC0];
+            }
+        }
+        else
+        {
+            /* other code points only separate words */
+            while ((*p & 0xC0) == 0x80)
+            {
+                p++;
+            }
+        }
+
+        if (mapped == NULL || *mapped == ' ')
+        {
+            if (!space)
+            {
+                out[len++] = ' ';
+                space = true;
+            }
+            continue;
+        }
+        for (; *mapped; mapped++)
+        {
+            out[len++] = *mapped;
+        }
+        space = false;
+    }
+    if (len > 0 && out[len - 1] == ' ')
+    {
+        len--;
+    }
+    out[len] = '\0';
+
+    return len;
+}
+
+static const char *tonies_search_itemField(const toniesJson_item_t *item, size_t field)
+{
+    const char *value = NULL;
+    switch (field)
+    {
+    case 0:
+        value = item->model;
+        break;
+    case 1:
+        value = item->series;
+        break;
+    case 2:
+        value = item->episodes;
+        break;
+    default:
+        value = item->title;
+        break;
+    }
+    return value ? value : "";
+}
+
+static uint32_t tonies_search_trigram(const char *text)
+{
+    return ((uint32_t)(uint8_t)text[0] << 16) | ((uint32_t)(uint8_t)text[1] << 8) | (uint8_t)text[2];
+}
+
+static uint32_t tonies_search_hashString(const char *text)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = text; *c; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int tonies_search_comparePairs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int tonies_search_compareTrigrams(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int tonies_search_compareHits(const void *a, const void *b)
+{
+    const tonies_search_hit_t *x = (const tonies_search_hit_t *)a;
+    const tonies_search_hit_t *y = (const tonies_search_hit_t *)b;
+    if (x->score != y->score)
+    {
+        return (x->score < y->score) ? 1 : -1;
+    }
+    return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+void tonies_search_free(tonies_search_t *search)
+{
+    if (search == NULL)
+    {
+        return;
+    }
+    osFreeMem(search->items);
+    osFreeMem(search->fields);
+    osFreeMem(search->text);
+    osFreeMem(search->trigrams);
+    osFreeMem(search->postingStart);
+    osFreeMem(search->postings);
+    osFreeMem(search);
+}
+
+tonies_search_t *tonies_search_build(toniesJson_item_t *custom, size_t customCount, toniesJson_item_t *official, size_t officialCount)
+{
+    size_t itemCount = customCount + officialCount;
+    size_t textSize = 4;
+    for (size_t i = 0; i < itemCount; i++)
+    {
+        toniesJson_item_t *item = (i < customCount) ? &custom[i] : &official[i - customCount];
+        for (size_t field = 0; field < TONIES_SEARCH_FIELDS; field++)
+        {
+            /* normalizing never makes a text longer */
+            textSize += osStrlen(tonies_search_itemField(item, field)) + 1;
+        }
+    }
+
+    tonies_search_t *search = osAllocMem(sizeof(tonies_search_t));
+    if (search == NULL)
+    {
+        return NULL;
+    }
+    osMemset(search, 0, sizeof(tonies_search_t));
+
+    size_t seenBits = 4;
+    while (((size_t)1 << seenBits) < itemCount * 2)
+    {
+        seenBits++;
+    }
+    size_t seenMask = ((size_t)1 << seenBits) - 1;
+    uint32_t *seen = osAllocMem((seenMask + 1) * sizeof(uint32_t));
+
+    search->items = osAllocMem((itemCount + 1) * sizeof(toniesJson_item_t *));
+    search->fields = osAllocMem((itemCount + 1) * TONIES_SEARCH_FIELDS * sizeof(uint32_t));
+    search->text = osAllocMem(textSize);
+    if (seen == NULL || search->items == NULL || search->fields == NULL || search->text == NULL)
+    {
+        osFreeMem(seen);
+        tonies_search_free(search);
+        return NULL;
+    }
+    osMemset(seen, 0, (seenMask + 1) * sizeof(uint32_t));
+
+    /* normalize all fields, official entries with a model also found in the custom file are skipped */
+    size_t textLen = 0;
+    size_t pairCount = 0;
+    for (size_t i = 0; i < itemCount; i++)
+    {
+        toniesJson_item_t *item = (i < customCount) ? &custom[i] : &official[i - customCount];
+        uint32_t doc = (uint32_t)search->docCount;
+        uint32_t *fields = &search->fields[doc * TONIES_SEARCH_FIELDS];
+        size_t docStart = textLen;
+        size_t docPairs = 0;
+
+        for (size_t field = 0; field < TONIES_SEARCH_FIELDS; field++)
+        {
+            fields[field] = (uint32_t)textLen;
+            size_t len = tonies_search_normalize(tonies_search_itemField(item, field), &search->text[textLen], textSize - textLen);
+            textLen += len + 1;
+            if (len >= 3)
+            {
+                docPairs += len - 2;
+            }
+        }
+
+        const char *model = &search->text[fields[0]];
+        if (*model)
+        {
+            size_t slot = tonies_search_hashString(model) & seenMask;
+            bool shadowed = false;
+            for (; seen[slot] != 0; slot = (slot + 1) & seenMask)
+            {
+                if (!osStrcmp(&search->text[search->fields[(seen[slot] - 1) * TONIES_SEARCH_FIELDS]], model))
+                {
+                    shadowed = true;
+                    break;
+                }
+            }
+            if (shadowed)
+            {
+                textLen = docStart;
+                continue;
+            }
+            seen[slot] = doc + 1;
+        }
+        search->items[doc] = item;
+        search->docCount++;
+        pairCount += docPairs;
+    }
+    osFreeMem(seen);
+
+    /* collect (trigram, document and field) pairs, sorting them groups the posting lists */
+    uint64_t *pairs = osAllocMem((pairCount + 1) * sizeof(uint64_t));
+    if (pairs == NULL)
+    {
+        tonies_search_free(search);
+        return NULL;
+    }
+    size_t pos = 0;
+    for (uint32_t doc = 0; doc < search->docCount; doc++)
+    {
+        for (size_t field = 0; field < TONIES_SEARCH_FIELDS; field++)
+        {
+            const char *text = &search->text[search->fields[doc * TONIES_SEARCH_FIELDS + field]];
+            size_t len = osStrlen(text);
+            for (size_t i = 0; i + 3 <= len; i++)
+            {
+                pairs[pos++] = ((uint64_t)tonies_search_trigram(&text[i]) << 32) | (doc * TONIES_SEARCH_FIELDS + field);
+            }
+        }
+    }
+    qsort(pairs, pos, sizeof(uint64_t), tonies_search_comparePairs);
+
+    size_t unique = 0;
+    size_t trigramCount = 0;
+    for (size_t i = 0; i < pos; i++)
+    {
+        if (unique > 0 && pairs[unique - 1] == pairs[i])
+        {
+            continue;
+        }
+        if (unique == 0 || (pairs[unique - 1] >> 32) != (pairs[i] >> 32))
+        {
+            trigramCount++;
+        }
+        pairs[unique++] = pairs[i];
+    }
+
+    search->trigrams = osAllocMem((trigramCount + 1) * sizeof(uint32_t));
+    search->postingStart = osAllocMem((trigramCount + 1) * sizeof(uint32_t));
+    search->postings = osAllocMem((unique + 1) * sizeof(uint32_t));
+    if (search->trigrams == NULL || search->postingStart == NULL || search->postings == NULL)
+    {
+        osFreeMem(pairs);
+        tonies_search_free(search);
+        return NULL;
+    }
+    for (size_t i = 0; i < unique; i++)
+    {
+        uint32_t trigram = (uint32_t)(pairs[i] >> 32);
+        if (search->trigramCount == 0 || search->trigrams[search->trigramCount - 1] != trigram)
+        {
+            search->trigrams[search->trigramCount] = trigram;
+            search->postingStart[search->trigramCount] = (uint32_t)i;
+            search->trigramCount++;
+        }
+        search->postings[i] = (uint32_t)pairs[i];
+    }
+    search->postingStart[search->trigramCount] = (uint32_t)unique;
+    osFreeMem(pairs);
+
+    TRACE_INFO("Search index with %zu tonies, %zu trigrams and %zu postings built\r\n", search->docCount, search->trigramCount, unique);
+
+    return search;
+}
+
+static uint32_t tonies_search_matchTier(const char *field, const char *query)
+{
+    const char *pos = strstr(field, query);
+    if (pos == NULL)
+    {
+        return 0;
+    }
+    for (; pos != NULL; pos = strstr(pos + 1, query))
+    {
+        if (pos == field || pos[-1] == ' ')
+        {
+            return TONIES_SEARCH_TIER_PREFIX;
+        }
+    }
+    return TONIES_SEARCH_TIER_SUBSTRING;
+}
+
+/* tier first, then the weight of the matching field, fuzzy matches by their share of trigrams */
+static uint32_t tonies_search_score(const tonies_search_t *search, uint32_t doc, const char *query, uint32_t fields, uint32_t fuzzy)
+{
+    uint32_t best = 0;
+    for (size_t field = 0; field < TONIES_SEARCH_FIELDS; field++)
+    {
+        if (!(fields & (1 << field)))
+        {
+            continue;
+        }
+        uint32_t tier = tonies_search_matchTier(&search->text[search->fields[doc * TONIES_SEARCH_FIELDS + field]], query);
+        if (tier != 0)
+        {
+            best = MAX(best, tier * 100000 + tonies_search_fieldWeight[field] * 10000);
+        }
+    }
+    if (best == 0 && fuzzy > 0)
+    {
+        best = TONIES_SEARCH_TIER_FUZZY * 100000 + fuzzy;
+    }
+    return best;
+}
+
+size_t tonies_search_query(const tonies_search_t *search, const tonies_search_term_t *terms, size_t termCount, size_t offset, size_t limit, toniesJson_item_t **results, size_t *total)
+{
+    *total = 0;
+    if (search == NULL || search->docCount == 0)
+    {
+        return 0;
+    }
+
+    size_t docCount = search->docCount;
+    uint32_t *scores = osAllocMem(docCount * sizeof(uint32_t));
+    uint16_t *counts = osAllocMem(docCount * sizeof(uint16_t));
+    uint32_t *candidates = osAllocMem(docCount * sizeof(uint32_t));
+    if (scores == NULL || counts == NULL || candidates == NULL)
+    {
+        osFreeMem(scores);
+        osFreeMem(counts);
+        osFreeMem(candidates);
+        return 0;
+    }
+    osMemset(scores, 0, docCount * sizeof(uint32_t));
+
+    char query[TONIES_SEARCH_QUERY_LEN];
+    uint32_t queryTrigrams[TONIES_SEARCH_QUERY_LEN];
+    for (size_t term = 0; term < termCount; term++)
+    {
+        if (terms[term].text == NULL)
+        {
+            continue;
+        }
+        size_t len = tonies_search_normalize(terms[term].text, query, sizeof(query));
+        if (len == 0)
+        {
+            continue;
+        }
+        if (len < 3)
+        {
+            /* too short for trigrams, but the normalized fields are quickly scanned */
+            for (uint32_t doc = 0; doc < docCount; doc++)
+            {
+                scores[doc] = MAX(scores[doc], tonies_search_score(search, doc, query, terms[term].fields, 0));
+            }
+            continue;
+        }
+
+        size_t queryTrigramCount = 0;
+        for (size_t i = 0; i + 3 <= len; i++)
+        {
+            queryTrigrams[queryTrigramCount++] = tonies_search_trigram(&query[i]);
+        }
+        qsort(queryTrigrams, queryTrigramCount, sizeof(uint32_t), tonies_search_compareTrigrams);
+        size_t unique = 0;
+        for (size_t i = 0; i < queryTrigramCount; i++)
+        {
+            if (unique == 0 || queryTrigrams[unique - 1] != queryTrigrams[i])
+            {
+                queryTrigrams[unique++] = queryTrigrams[i];
+            }
+        }
+        queryTrigramCount = unique;
+
+        /* count the matching trigrams per document within the fields of the term, collecting each once it reaches the fuzzy threshold */
+        uint16_t needed = (uint16_t)MAX(1, (queryTrigramCount * TONIES_SEARCH_FUZZY_MIN + 999) / 1000);
+        size_t candidateCount = 0;
+        osMemset(counts, 0, docCount * sizeof(uint16_t));
+        for (size_t i = 0; i < queryTrigramCount; i++)
+        {
+            uint32_t *found = bsearch(&queryTrigrams[i], search->trigrams, search->trigramCount, sizeof(uint32_t), tonies_search_compareTrigrams);
+            if (found == NULL)
+            {
+                continue;
+            }
+            size_t index = found - search->trigrams;
+            uint32_t lastDoc = UINT32_MAX;
+            for (uint32_t p = search->postingStart[index]; p < search->postingStart[index + 1]; p++)
+            {
+                uint32_t doc = search->postings[p] / TONIES_SEARCH_FIELDS;
+                uint32_t field = search->postings[p] % TONIES_SEARCH_FIELDS;
+                /* a trigram found in several fields of the document counts once */
+                if (!(terms[term].fields & (1 << field)) || doc == lastDoc)
+                {
+                    continue;
+                }
+                lastDoc = doc;
+                if (++counts[doc] == needed)
+                {
+                    candidates[candidateCount++] = doc;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < candidateCount; i++)
+        {
+            uint32_t doc = candidates[i];
+            uint32_t fuzzy = counts[doc] * 1000 / queryTrigramCount;
+            scores[doc] = MAX(scores[doc], tonies_search_score(search, doc, query, terms[term].fields, fuzzy));
+        }
+    }
+    osFreeMem(counts);
+
+    tonies_search_hit_t *hits = osAllocMem(docCount * sizeof(tonies_search_hit_t));
+    size_t hitCount = 0;
+    if (hits != NULL)
+    {
+        for (uint32_t doc = 0; doc < docCount; doc++)
+        {
+            if (scores[doc] > 0)
+            {
+                hits[hitCount].doc = doc;
+                hits[hitCount].score = scores[doc];
+                hitCount++;
+            }
+        }
+        qsort(hits, hitCount, sizeof(tonies_search_hit_t), tonies_search_compareHits);
+    }
+    osFreeMem(candidates);
+    osFreeMem(scores);
+
+    size_t count = 0;
+    for (size_t i = offset; i < hitCount && count < limit; i++)
+    {
+        results[count++] = search->items[hits[i].doc];
+    }
+    *total = hitCount;
+    osFreeMem(hits);
+
+    return count;
+}
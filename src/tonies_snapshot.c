@@ -0,0 +1,396 @@
+#include <string.h>
+
+#include "tonies_snapshot.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "debug.h"
+#include "settings.h"
+#include "cache.h"
+#include "server_helpers.h"
+#include "date_time.h"
+#include "hash/sha256.h"
+
+#define TONIES_SNAPSHOT_HASH_BLOCK (16 * 1024)
+
+/* followed by dataSize bytes: the items, the picture source offsets and then all arrays and strings,
+ * pointers are stored as offset into the data + 1, so 0 stays NULL */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t itemSize; /* changes with the item layout and the pointer size */
+    uint32_t flags;
+    uint32_t sourceSize;
+    uint32_t count;
+    int64_t sourceMtime;
+    uint8_t sourceSha256[32];
+    uint32_t dataSize;
+    uint32_t reserved;
+} tonies_snapshot_header_t;
+
+/* writes into data, or only measures if data is NULL */
+typedef struct
+{
+    uint8_t *data;
+    size_t pos;
+} tonies_snapshot_writer_t;
+
+static size_t tonies_snapshot_align(size_t pos)
+{
+    return (pos + MEM_ARENA_ALIGNMENT - 1) & ~(size_t)(MEM_ARENA_ALIGNMENT - 1);
+}
+
+static char *tonies_snapshot_path(const char *source)
+{
+    return custom_asprintf("%s%s", source, TONIES_SNAPSHOT_EXT);
+}
+
+bool tonies_snapshot_source(const char *source, tonies_snapshot_source_t *info)
+{
+    FsFileStat stat;
+    if (fsGetFileStat(source, &stat) != NO_ERROR)
+    {
+        return false;
+    }
+    osMemset(info, 0, sizeof(tonies_snapshot_source_t));
+    info->size = stat.size;
+    info->mtime = (int64_t)convertDateToUnixTime(&stat.modified);
+
+    FsFile *file = fsOpenFile(source, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return false;
+    }
+    uint8_t *buffer = osAllocMem(TONIES_SNAPSHOT_HASH_BLOCK);
+    if (buffer == NULL)
+    {
+        fsCloseFile(file);
+        return false;
+    }
+
+    Sha256Context ctx;
+    sha256Init(&ctx);
+    size_t total = 0;
+    while (true)
+    {
+        size_t read = 0;
+        error_t error = fsReadFile(file, buffer, TONIES_SNAPSHOT_HASH_BLOCK, &read);
+        if (error != NO_ERROR || read == 0)
+        {
+            break;
+        }
+        sha256Update(&ctx, buffer, read);
+        total += read;
+    }
+    sha256Final(&ctx, info->sha256);
+    fsCloseFile(file);
+    osFreeMem(buffer);
+
+    /* a short read would hash only a part */
+    return total == info->size;
+}
+
+static uintptr_t tonies_snapshot_put(tonies_snapshot_writer_t *writer, const void *src, size_t len, bool align)
+{
+    if (align)
+    {
+        writer->pos = tonies_snapshot_align(writer->pos);
+    }
+    uintptr_t offset = writer->pos + 1;
+    if (writer->data != NULL && src != NULL && len > 0)
+    {
+        osMemcpy(&writer->data[writer->pos], src, len);
+    }
+    writer->pos += len;
+    return offset;
+}
+
+static uintptr_t tonies_snapshot_putString(tonies_snapshot_writer_t *writer, const char *str)
+{
+    return tonies_snapshot_put(writer, str, osStrlen(str) + 1, false);
+}
+
+static void tonies_snapshot_write(tonies_snapshot_writer_t *writer, const toniesJson_item_t *items, size_t count, const char *const *pictureSources)
+{
+    size_t sourcesPos = tonies_snapshot_align(count * sizeof(toniesJson_item_t));
+    writer->pos = sourcesPos + count * sizeof(uint32_t);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const toniesJson_item_t *item = &items[i];
+        toniesJson_item_t copy = *item;
+
+        copy.model = (char *)tonies_snapshot_putString(writer, item->model);
+        copy.title = (char *)tonies_snapshot_putString(writer, item->title);
+        copy.series = (char *)tonies_snapshot_putString(writer, item->series);
+        copy.episodes = (char *)tonies_snapshot_putString(writer, item->episodes);
+        copy.language = (char *)tonies_snapshot_putString(writer, item->language);
+        copy.category = (char *)tonies_snapshot_putString(writer, item->category);
+        copy.picture = (char *)tonies_snapshot_putString(writer, item->picture);
+        copy.audio_ids = (uint32_t *)tonies_snapshot_put(writer, item->audio_ids, item->audio_ids_count * sizeof(uint32_t), true);
+        copy.hashes = (uint8_t *)tonies_snapshot_put(writer, item->hashes, item->hashes_count * 20, false);
+        copy.tracks = NULL;
+        if (item->tracks_count > 0)
+        {
+            uintptr_t tracks = tonies_snapshot_put(writer, NULL, item->tracks_count * sizeof(char *), true);
+            for (size_t j = 0; j < item->tracks_count; j++)
+            {
+                uintptr_t track = tonies_snapshot_putString(writer, item->tracks[j]);
+                if (writer->data)
+                {
+                    osMemcpy(&writer->data[tracks - 1 + j * sizeof(char *)], &track, sizeof(track));
+                }
+            }
+            copy.tracks = (char **)tracks;
+        }
+
+        uint32_t pictureSource = 0;
+        if (pictureSources != NULL && pictureSources[i] != NULL)
+        {
+            pictureSource = (uint32_t)tonies_snapshot_putString(writer, pictureSources[i]);
+        }
+
+        if (writer->data)
+        {
+            osMemcpy(&writer->data[i * sizeof(toniesJson_item_t)], &copy, sizeof(copy));
+            osMemcpy(&writer->data[sourcesPos + i * sizeof(uint32_t)], &pictureSource, sizeof(pictureSource));
+        }
+    }
+}
+
+error_t tonies_snapshot_save(const char *source, const tonies_snapshot_source_t *info, uint32_t flags, const toniesJson_item_t *items, size_t count, const char *const *pictureSources)
+{
+    /* measure first, then write into a buffer of exactly that size */
+    tonies_snapshot_writer_t writer = {.data = NULL, .pos = 0};
+    tonies_snapshot_write(&writer, items, count, pictureSources);
+    if (writer.pos > UINT32_MAX)
+    {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    tonies_snapshot_header_t header;
+    osMemset(&header, 0, sizeof(header));
+    header.magic = TONIES_SNAPSHOT_MAGIC;
+    header.version = TONIES_SNAPSHOT_VERSION;
+    header.itemSize = sizeof(toniesJson_item_t);
+    header.flags = flags;
+    header.sourceSize = info->size;
+    header.count = (uint32_t)count;
+    header.sourceMtime = info->mtime;
+    osMemcpy(header.sourceSha256, info->sha256, sizeof(header.sourceSha256));
+    header.dataSize = (uint32_t)writer.pos;
+
+    writer.data = osAllocMem(header.dataSize);
+    if (writer.data == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    osMemset(writer.data, 0, header.dataSize);
+    tonies_snapshot_write(&writer, items, count, pictureSources);
+
+    char *path = tonies_snapshot_path(source);
+    char *tmpPath = custom_asprintf("%s.tmp", path);
+    error_t error = ERROR_FILE_OPENING_FAILED;
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+    if (file != NULL)
+    {
+        error = fsWriteFile(file, &header, sizeof(header));
+        if (error == NO_ERROR)
+        {
+            error = fsWriteFile(file, writer.data, header.dataSize);
+        }
+        fsCloseFile(file);
+    }
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(tmpPath, path, true);
+    }
+
+    if (error == NO_ERROR)
+    {
+        TRACE_INFO("Saved snapshot %s with %zu tonies\r\n", path, count);
+    }
+    else
+    {
+        TRACE_WARNING("Could not save snapshot %s, error=%s\r\n", path, error2text(error));
+        fsDeleteFile(tmpPath);
+    }
+    osFreeMem(writer.data);
+    osFreeMem(path);
+    osFreeMem(tmpPath);
+
+    return error;
+}
+
+/* turns a stored offset back into a pointer, flags the snapshot invalid if it points outside the data */
+static void *tonies_snapshot_resolve(uint8_t *data, size_t size, const void *stored, size_t len, bool *valid)
+{
+    uintptr_t offset = (uintptr_t)stored;
+    if (offset == 0)
+    {
+        return NULL;
+    }
+    offset--;
+    if (offset > size || len > size - offset)
+    {
+        *valid = false;
+        return NULL;
+    }
+    return &data[offset];
+}
+
+static char *tonies_snapshot_resolveString(uint8_t *data, size_t size, const void *stored, bool *valid)
+{
+    char *str = tonies_snapshot_resolve(data, size, stored, 1, valid);
+    if (str == NULL || memchr(str, '\0', &data[size] - (uint8_t *)str) == NULL)
+    {
+        *valid = false;
+        return NULL;
+    }
+    return str;
+}
+
+static bool tonies_snapshot_relocate(uint8_t *data, size_t size, toniesJson_item_t *item)
+{
+    bool valid = true;
+
+    item->model = tonies_snapshot_resolveString(data, size, item->model, &valid);
+    item->title = tonies_snapshot_resolveString(data, size, item->title, &valid);
+    item->series = tonies_snapshot_resolveString(data, size, item->series, &valid);
+    item->episodes = tonies_snapshot_resolveString(data, size, item->episodes, &valid);
+    item->language = tonies_snapshot_resolveString(data, size, item->language, &valid);
+    item->category = tonies_snapshot_resolveString(data, size, item->category, &valid);
+    item->picture = tonies_snapshot_resolveString(data, size, item->picture, &valid);
+    item->audio_ids = tonies_snapshot_resolve(data, size, item->audio_ids, item->audio_ids_count * sizeof(uint32_t), &valid);
+    item->hashes = tonies_snapshot_resolve(data, size, item->hashes, item->hashes_count * 20, &valid);
+    item->tracks = tonies_snapshot_resolve(data, size, item->tracks, item->tracks_count * sizeof(char *), &valid);
+    if (item->tracks_count > 0 && item->tracks == NULL)
+    {
+        valid = false;
+    }
+    for (size_t j = 0; valid && j < item->tracks_count; j++)
+    {
+        item->tracks[j] = tonies_snapshot_resolveString(data, size, item->tracks[j], &valid);
+    }
+
+    return valid;
+}
+
+bool tonies_snapshot_load(const char *source, const tonies_snapshot_source_t *info, uint32_t flags, toniesJson_item_t **retCache, size_t *retCount, mem_arena_t **retArena, const char ***retPictureSources)
+{
+    char *path = tonies_snapshot_path(source);
+    uint32_t fileSize = 0;
+    if (!fsFileExists(path) || fsGetFileSize(path, &fileSize) != NO_ERROR || fileSize < sizeof(tonies_snapshot_header_t))
+    {
+        osFreeMem(path);
+        return false;
+    }
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    mem_arena_t *arena = mem_arena_create();
+    uint8_t *buffer = arena ? mem_arena_alloc(arena, fileSize) : NULL;
+    size_t read = 0;
+    if (file != NULL)
+    {
+        if (buffer != NULL)
+        {
+            fsReadFile(file, buffer, fileSize, &read);
+        }
+        fsCloseFile(file);
+    }
+
+    tonies_snapshot_header_t *header = (tonies_snapshot_header_t *)buffer;
+    const char *reason = NULL;
+    if (buffer == NULL || read != fileSize)
+    {
+        reason = "could not be read";
+    }
+    else if (header->magic != TONIES_SNAPSHOT_MAGIC || header->version != TONIES_SNAPSHOT_VERSION || header->itemSize != sizeof(toniesJson_item_t))
+    {
+        reason = "has an unknown format";
+    }
+    else if (header->flags != flags)
+    {
+        reason = "was built with other settings";
+    }
+    else if (header->sourceSize != info->size || header->sourceMtime != info->mtime || osMemcmp(header->sourceSha256, info->sha256, sizeof(header->sourceSha256)))
+    {
+        reason = "is outdated";
+    }
+    else if (header->dataSize != fileSize - sizeof(tonies_snapshot_header_t) ||
+             tonies_snapshot_align((size_t)header->count * sizeof(toniesJson_item_t)) + (size_t)header->count * sizeof(uint32_t) > header->dataSize)
+    {
+        reason = "is truncated";
+    }
+
+    size_t count = 0;
+    uint8_t *data = NULL;
+    toniesJson_item_t *items = NULL;
+    uint32_t *pictureSources = NULL;
+    if (reason == NULL)
+    {
+        count = header->count;
+        data = &buffer[sizeof(tonies_snapshot_header_t)];
+        items = (toniesJson_item_t *)data;
+        pictureSources = (uint32_t *)&data[tonies_snapshot_align(count * sizeof(toniesJson_item_t))];
+    }
+    for (size_t i = 0; i < count && reason == NULL; i++)
+    {
+        if (!tonies_snapshot_relocate(data, header->dataSize, &items[i]))
+        {
+            reason = "is corrupted";
+        }
+    }
+
+    const char **sources = NULL;
+    if (count > 0 && reason == NULL)
+    {
+        sources = osAllocMem(count * sizeof(const char *));
+        if (sources == NULL)
+        {
+            reason = "could not be loaded";
+        }
+    }
+
+    /* the pictures' cache entries are only registered once the whole snapshot turned out valid */
+    bool preload = settings_get_bool("tonie_json.cache_preload");
+    for (size_t i = 0; i < count && reason == NULL; i++)
+    {
+        sources[i] = NULL;
+        if (pictureSources[i] == 0)
+        {
+            continue;
+        }
+        bool valid = true;
+        const char *url = tonies_snapshot_resolveString(data, header->dataSize, (const void *)(uintptr_t)pictureSources[i], &valid);
+        cache_entry_t *cache = valid ? cache_add_cached(url, items[i].picture) : NULL;
+        if (cache == NULL)
+        {
+            reason = "has invalid cached pictures";
+            break;
+        }
+        sources[i] = url;
+        if (preload)
+        {
+            /* download and cache the file in the background */
+            cache_prefetch(cache);
+        }
+    }
+
+    if (reason != NULL)
+    {
+        TRACE_INFO("Snapshot %s %s, parsing %s\r\n", path, reason, source);
+        osFreeMem(sources);
+        mem_arena_free(arena);
+        osFreeMem(path);
+        return false;
+    }
+
+    *retCache = count ? items : NULL;
+    *retCount = count;
+    *retArena = arena;
+    *retPictureSources = sources;
+    osFreeMem(path);
+
+    return true;
+}
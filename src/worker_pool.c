@@ -0,0 +1,169 @@
+#include "worker_pool.h"
+#include "os_port.h"
+#include "debug.h"
+#include "mutex_manager.h"
+#include "settings.h"
+
+typedef struct worker_pool_job
+{
+    worker_pool_fn_t fn;
+    void *ctx;
+    size_t count;
+    size_t next;    /* next index to hand out */
+    size_t done;    /* number of finished elements */
+    size_t active;  /* pool tasks currently working on this job */
+    size_t helpers; /* maximum of pool tasks, the caller is not counted */
+    OsEvent finished;
+    struct worker_pool_job *next_job;
+} worker_pool_job_t;
+
+static worker_pool_job_t *worker_pool_jobs = NULL;
+static size_t worker_pool_tasks = 0;
+static OsEvent worker_pool_event;
+
+/* with MUTEX_WORKER_POOL held */
+static worker_pool_job_t *worker_pool_take(size_t *index)
+{
+    for (worker_pool_job_t *job = worker_pool_jobs; job != NULL; job = job->next_job)
+    {
+        if (job->next < job->count && job->active < job->helpers)
+        {
+            *index = job->next++;
+            job->active++;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/* with MUTEX_WORKER_POOL held */
+static bool worker_pool_pending()
+{
+    for (worker_pool_job_t *job = worker_pool_jobs; job != NULL; job = job->next_job)
+    {
+        if (job->next < job->count && job->active < job->helpers)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void worker_pool_task(void *param)
+{
+    while (!settings_get_bool("internal.exit"))
+    {
+        size_t index = 0;
+        mutex_lock(MUTEX_WORKER_POOL);
+        worker_pool_job_t *job = worker_pool_take(&index);
+        bool pending = worker_pool_pending();
+        mutex_unlock(MUTEX_WORKER_POOL);
+
+        if (pending)
+        {
+            /* the event wakes a single task, pass it on while there is work left */
+            osSetEvent(&worker_pool_event);
+        }
+        if (job == NULL)
+        {
+            osWaitForEvent(&worker_pool_event, 1000);
+            continue;
+        }
+
+        job->fn(job->ctx, index);
+
+        mutex_lock(MUTEX_WORKER_POOL);
+        job->active--;
+        job->done++;
+        if (job->done == job->count)
+        {
+            /* signal while locked, the caller may release the job as soon as it sees it finished */
+            osSetEvent(&job->finished);
+        }
+        mutex_unlock(MUTEX_WORKER_POOL);
+    }
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void worker_pool_run(worker_pool_fn_t fn, void *ctx, size_t count, size_t workers)
+{
+    workers = MIN(workers, WORKER_POOL_MAX_WORKERS);
+    if (workers <= 1 || count <= 1)
+    {
+        for (size_t index = 0; index < count; index++)
+        {
+            fn(ctx, index);
+        }
+        return;
+    }
+
+    worker_pool_job_t job = {
+        .fn = fn,
+        .ctx = ctx,
+        .count = count,
+        .helpers = workers - 1,
+    };
+    osCreateEvent(&job.finished);
+
+    mutex_lock(MUTEX_WORKER_POOL);
+    if (worker_pool_tasks == 0)
+    {
+        osCreateEvent(&worker_pool_event);
+    }
+    while (worker_pool_tasks < job.helpers)
+    {
+        if (osCreateTask("WorkerPool", &worker_pool_task, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            TRACE_ERROR("Failed to start worker pool task\r\n");
+            break;
+        }
+        worker_pool_tasks++;
+    }
+    job.next_job = worker_pool_jobs;
+    worker_pool_jobs = &job;
+    mutex_unlock(MUTEX_WORKER_POOL);
+    osSetEvent(&worker_pool_event);
+
+    /* work on the job until every element is handed out */
+    while (true)
+    {
+        mutex_lock(MUTEX_WORKER_POOL);
+        if (job.next >= job.count)
+        {
+            mutex_unlock(MUTEX_WORKER_POOL);
+            break;
+        }
+        size_t index = job.next++;
+        mutex_unlock(MUTEX_WORKER_POOL);
+
+        fn(ctx, index);
+
+        mutex_lock(MUTEX_WORKER_POOL);
+        job.done++;
+        mutex_unlock(MUTEX_WORKER_POOL);
+    }
+
+    /* wait for the elements still processed by the pool */
+    while (true)
+    {
+        mutex_lock(MUTEX_WORKER_POOL);
+        bool finished = (job.done == job.count);
+        if (finished)
+        {
+            worker_pool_job_t **link = &worker_pool_jobs;
+            while (*link != &job)
+            {
+                link = &(*link)->next_job;
+            }
+            *link = job.next_job;
+        }
+        mutex_unlock(MUTEX_WORKER_POOL);
+
+        if (finished)
+        {
+            break;
+        }
+        osWaitForEvent(&job.finished, 100);
+    }
+    osDeleteEvent(&job.finished);
+}